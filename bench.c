@@ -0,0 +1,471 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "toml.h"
+
+// A growing buffer the generators write documents into.
+struct buffer {
+  int size;
+  int capacity;
+  char *content;
+};
+
+void buffer_printf( struct buffer *self, char *format, ... ) {
+  va_list args;
+  for ( ;; ) {
+    va_start( args, format );
+    int available = self->capacity - self->size;
+    int size =
+      vsnprintf( self->content + self->size, available, format, args );
+    va_end( args );
+
+    if ( size < available ) {
+      self->size += size;
+      return;
+    }
+
+    self->capacity = self->capacity ? self->capacity * 2 : 65536;
+    while ( self->capacity - self->size <= size ) {
+      self->capacity *= 2;
+    }
+    self->content = realloc( self->content, self->capacity );
+  }
+}
+
+// Each generator writes documents of one shape until the buffer holds at
+// least the given number of bytes.
+
+void generate_wide( struct buffer *out, int bytes ) {
+  buffer_printf( out, "[wide]\n" );
+  for ( int i = 0; out->size < bytes; ++i ) {
+    buffer_printf( out, "key%08d = %d\n", i, i * 7 );
+  }
+}
+
+void generate_deep( struct buffer *out, int bytes ) {
+  for ( int i = 0; out->size < bytes; ++i ) {
+    buffer_printf( out, "[" );
+    for ( int depth = 0; depth < 12; ++depth ) {
+      buffer_printf( out, "level%02d.", depth );
+    }
+    buffer_printf(
+      out, "table%08d]\nname = \"table %d\"\nvalue = %d\n\n", i, i, i
+    );
+  }
+}
+
+void generate_arrays( struct buffer *out, int bytes ) {
+  for ( int i = 0; out->size < bytes; ++i ) {
+    buffer_printf( out, "array%08d = [ ", i );
+    for ( int j = 0; j < 256; ++j ) {
+      buffer_printf( out, j ? ", %d" : "%d", i + j );
+    }
+    buffer_printf( out, " ]\n" );
+  }
+}
+
+void generate_array_tables( struct buffer *out, int bytes ) {
+  for ( int i = 0; out->size < bytes; ++i ) {
+    buffer_printf(
+      out,
+      "[[product]]\nid = %d\nname = \"product %d\"\nprice = %d.%02d\n\n",
+      i,
+      i,
+      i % 1000,
+      i % 100
+    );
+  }
+}
+
+void generate_escapes( struct buffer *out, int bytes ) {
+  buffer_printf( out, "[escapes]\n" );
+  for ( int i = 0; out->size < bytes; ++i ) {
+    buffer_printf(
+      out,
+      "line%08d = \"say \\\"hi\\\"\\tto C:\\\\path\\\\%d\\n"
+        " caf\\u00e9 \\u2603\"\n",
+      i,
+      i
+    );
+  }
+}
+
+void generate_numbers( struct buffer *out, int bytes ) {
+  buffer_printf( out, "[numbers]\n" );
+  for ( int i = 0; out->size < bytes; ++i ) {
+    buffer_printf(
+      out,
+      "int%08d = %d\ndouble%08d = %d.%06d\n"
+        "date%08d = %04d-%02d-%02dT%02d:%02d:%02dZ\n",
+      i,
+      i * 131 - 65536,
+      i,
+      i % 100000,
+      i * 37 % 1000000,
+      i,
+      1970 + i % 60,
+      1 + i % 12,
+      1 + i % 28,
+      i % 24,
+      i % 60,
+      i * 7 % 60
+    );
+  }
+}
+
+struct shape {
+  char *name;
+  void (*generate)( struct buffer *, int bytes );
+};
+
+struct shape shapes[] = {
+  { "wide", generate_wide },
+  { "deep", generate_deep },
+  { "arrays", generate_arrays },
+  { "array_tables", generate_array_tables },
+  { "escapes", generate_escapes },
+  { "numbers", generate_numbers },
+  { NULL, NULL }
+};
+
+// Paths to every value below a table, used to time TOML_find. Each path is a
+// list of keys ending with NULL.
+struct paths {
+  int size;
+  int capacity;
+  char ***content;
+};
+
+void collect_paths(
+  struct paths *paths, TOMLRef ref, char **prefix, int depth
+) {
+  TOMLBasic *basic = ref;
+  int size = 0;
+  if ( basic->type == TOML_TABLE ) {
+    size = ((TOMLTable *) basic)->keys->size;
+  } else if (
+    basic->type == TOML_ARRAY &&
+      ((TOMLArray *) basic)->memberType == TOML_TABLE
+  ) {
+    size = ((TOMLArray *) basic)->size;
+  } else {
+    if ( paths->size == paths->capacity ) {
+      paths->capacity = paths->capacity ? paths->capacity * 2 : 1024;
+      paths->content =
+        realloc( paths->content, paths->capacity * sizeof(char **) );
+    }
+    char **path = malloc( ( depth + 1 ) * sizeof(char *) );
+    for ( int i = 0; i < depth; ++i ) {
+      path[ i ] = strcpy( malloc( strlen( prefix[ i ] ) + 1 ), prefix[ i ] );
+    }
+    path[ depth ] = NULL;
+    paths->content[ paths->size++ ] = path;
+    return;
+  }
+
+  for ( int i = 0; i < size; ++i ) {
+    char index[ 16 ];
+    TOMLRef child;
+    if ( basic->type == TOML_TABLE ) {
+      TOMLString *key = ((TOMLTable *) basic)->keys->members[ i ];
+      prefix[ depth ] = key->content;
+      child = ((TOMLTable *) basic)->values->members[ i ];
+    } else {
+      snprintf( index, sizeof(index), "%d", i );
+      prefix[ depth ] = index;
+      child = ((TOMLArray *) basic)->members[ i ];
+    }
+    collect_paths( paths, child, prefix, depth + 1 );
+  }
+}
+
+void free_paths( struct paths *paths ) {
+  for ( int i = 0; i < paths->size; ++i ) {
+    for ( char **key = paths->content[ i ]; *key; ++key ) {
+      free( *key );
+    }
+    free( paths->content[ i ] );
+  }
+  free( paths->content );
+}
+
+TOMLRef find_path( TOMLRef ref, char **path ) {
+  while ( ref && *path ) {
+    ref = TOML_find( ref, *path++, NULL );
+  }
+  return ref;
+}
+
+double now() {
+  struct timespec time;
+  clock_gettime( CLOCK_MONOTONIC, &time );
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// Every allocation tomlc makes goes through the counter, so each operation
+// can report how many it made.
+TOMLCountingAllocator counter;
+
+long long allocation_count() {
+  return counter.stats.mallocs + counter.stats.reallocs;
+}
+
+struct result {
+  char *name;
+  int iterations;
+  double seconds;
+  // Bytes handled per iteration, or 0 where throughput does not apply.
+  double bytes;
+  // Operations per iteration.
+  double operations;
+  double allocations;
+};
+
+// Times one operation and counts its allocations.
+struct measure {
+  double start;
+  long long allocations;
+};
+
+void measure_start( struct measure *measure ) {
+  measure->allocations = allocation_count();
+  measure->start = now();
+}
+
+void measure_stop( struct measure *measure, struct result *result ) {
+  result->seconds += now() - measure->start;
+  result->allocations += allocation_count() - measure->allocations;
+}
+
+void print_result( struct result *result, int json, int last ) {
+  double perIteration = result->seconds / result->iterations;
+  double nsPerOp = perIteration * 1e9 / result->operations;
+  double mbPerS = result->bytes / perIteration / ( 1024 * 1024 );
+  double allocationsPerOp =
+    result->allocations / result->iterations / result->operations;
+
+  if ( !json ) {
+    printf( "  %-10s ", result->name );
+    if ( result->bytes > 0 ) {
+      printf( "%10.2f MB/s", mbPerS );
+    } else {
+      printf( "%10s     ", "" );
+    }
+    printf( " %14.1f ns/op %12.1f allocs/op\n", nsPerOp, allocationsPerOp );
+    return;
+  }
+
+  printf(
+    "        { \"name\": \"%s\", \"iterations\": %d, \"mb_per_s\": ",
+    result->name,
+    result->iterations
+  );
+  if ( result->bytes > 0 ) {
+    printf( "%.3f", mbPerS );
+  } else {
+    printf( "null" );
+  }
+  printf(
+    ", \"ns_per_op\": %.1f, \"allocations\": %.1f }%s\n",
+    nsPerOp,
+    allocationsPerOp,
+    last ? "" : ","
+  );
+}
+
+int run_shape(
+  struct shape *shape, int bytes, int iterations, int json, int last
+) {
+  struct buffer source = { 0, 0, NULL };
+  shape->generate( &source, bytes );
+
+  char filename[] = "/tmp/toml-bench-XXXXXX";
+  int fd = mkstemp( filename );
+  if ( fd == -1 || write( fd, source.content, source.size ) != source.size ) {
+    fprintf( stderr, "could not write %s\n", filename );
+    return 1;
+  }
+  close( fd );
+
+  struct result results[ 6 ];
+  for ( int i = 0; i < 6; ++i ) {
+    results[ i ].iterations = iterations;
+    results[ i ].seconds = 0;
+    results[ i ].bytes = 0;
+    results[ i ].operations = 1;
+    results[ i ].allocations = 0;
+  }
+  results[ 0 ].name = "parse";
+  results[ 0 ].bytes = source.size;
+  // Parsing again with stats kept shows what keeping them costs.
+  results[ 1 ].name = "stats";
+  results[ 1 ].bytes = source.size;
+  results[ 2 ].name = "load";
+  results[ 2 ].bytes = source.size;
+  results[ 3 ].name = "stringify";
+  results[ 4 ].name = "find";
+  results[ 5 ].name = "free";
+
+  struct paths paths = { 0, 0, NULL };
+  struct measure measure;
+  int errorCode = 0;
+
+  for ( int i = 0; i < iterations && errorCode == 0; ++i ) {
+    TOMLTable *table = NULL;
+    measure_start( &measure );
+    errorCode = TOML_parse( source.content, &table, NULL );
+    measure_stop( &measure, &results[ 0 ] );
+    if ( errorCode ) {
+      break;
+    }
+    TOML_free( table );
+
+    TOMLParseStats stats;
+    table = NULL;
+    measure_start( &measure );
+    errorCode = TOML_parseWithStats( source.content, &table, &stats, NULL );
+    measure_stop( &measure, &results[ 1 ] );
+    if ( errorCode ) {
+      break;
+    }
+    TOML_free( table );
+
+    table = NULL;
+    measure_start( &measure );
+    errorCode = TOML_load( filename, &table, NULL );
+    measure_stop( &measure, &results[ 2 ] );
+    if ( errorCode ) {
+      break;
+    }
+
+    char *output;
+    measure_start( &measure );
+    TOML_stringify( &output, table, NULL );
+    measure_stop( &measure, &results[ 3 ] );
+    results[ 3 ].bytes = strlen( output );
+    counter.allocator.free( counter.allocator.context, output );
+
+    if ( paths.size == 0 ) {
+      char *prefix[ 64 ];
+      collect_paths( &paths, table, prefix, 0 );
+    }
+    measure_start( &measure );
+    for ( int j = 0; j < paths.size; ++j ) {
+      if ( find_path( table, paths.content[ j ] ) == NULL ) {
+        errorCode = TOML_ERROR_NO_VALUE;
+      }
+    }
+    measure_stop( &measure, &results[ 4 ] );
+    results[ 4 ].operations = paths.size ? paths.size : 1;
+
+    measure_start( &measure );
+    TOML_free( table );
+    measure_stop( &measure, &results[ 5 ] );
+  }
+
+  remove( filename );
+  free( source.content );
+
+  if ( errorCode ) {
+    fprintf( stderr, "%s failed with error %d\n", shape->name, errorCode );
+    free_paths( &paths );
+    return errorCode;
+  }
+
+  if ( json ) {
+    printf(
+      "    {\n      \"shape\": \"%s\",\n      \"bytes\": %d,\n"
+        "      \"values\": %d,\n      \"operations\": [\n",
+      shape->name,
+      source.size,
+      paths.size
+    );
+  } else {
+    printf( "%s: %d bytes, %d values\n", shape->name, source.size, paths.size );
+  }
+
+  for ( int i = 0; i < 6; ++i ) {
+    print_result( &results[ i ], json, i == 5 );
+  }
+
+  if ( json ) {
+    printf( "      ]\n    }%s\n", last ? "" : "," );
+  }
+
+  free_paths( &paths );
+  return 0;
+}
+
+int main( int argc, char **argv ) {
+  int bytes = 1 << 20;
+  int iterations = 5;
+  int json = 0;
+  char *only = NULL;
+
+  for ( int i = 1; i < argc; ++i ) {
+    if ( strcmp( argv[ i ], "--json" ) == 0 ) {
+      json = 1;
+    } else if ( strcmp( argv[ i ], "--bytes" ) == 0 && i + 1 < argc ) {
+      bytes = atoi( argv[ ++i ] );
+    } else if ( strcmp( argv[ i ], "--iterations" ) == 0 && i + 1 < argc ) {
+      iterations = atoi( argv[ ++i ] );
+    } else if ( strcmp( argv[ i ], "--shape" ) == 0 && i + 1 < argc ) {
+      only = argv[ ++i ];
+    } else {
+      printf(
+        "toml-bench [--json] [--bytes size] [--iterations count] "
+          "[--shape name]\n\tshapes:"
+      );
+      for ( struct shape *shape = shapes; shape->name; ++shape ) {
+        printf( " %s", shape->name );
+      }
+      printf( "\n" );
+      return strcmp( argv[ i ], "--help" ) == 0 ? 0 : 1;
+    }
+  }
+
+  if ( iterations < 1 ) {
+    iterations = 1;
+  }
+
+  TOMLCountingAllocator_init( &counter, NULL );
+  TOML_setAllocator( &counter.allocator );
+
+  int count = 0;
+  for ( struct shape *shape = shapes; shape->name; ++shape ) {
+    count += only == NULL || strcmp( only, shape->name ) == 0;
+  }
+  if ( count == 0 ) {
+    fprintf( stderr, "unknown shape %s\n", only );
+    return 1;
+  }
+
+  if ( json ) {
+    printf(
+      "{\n  \"bytes\": %d,\n  \"iterations\": %d,\n  \"shapes\": [\n",
+      bytes,
+      iterations
+    );
+  }
+
+  int errorCode = 0;
+  for (
+    struct shape *shape = shapes; shape->name && errorCode == 0; ++shape
+  ) {
+    if ( only == NULL || strcmp( only, shape->name ) == 0 ) {
+      errorCode = run_shape( shape, bytes, iterations, json, --count == 0 );
+    }
+  }
+
+  if ( json ) {
+    printf( "  ]\n}\n" );
+  }
+
+  return errorCode;
+}
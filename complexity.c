@@ -0,0 +1,347 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tap.h"
+#include "toml.h"
+
+// Runs each operation at growing sizes, fits the exponent k in time ~ n^k and
+// fails any operation that grows faster than O(n log n). Between 1k and 1M
+// elements n log n fits to about 1.1, so the limit leaves room for noise and
+// cache effects while a quadratic path still fits to about 2.
+#define EXPONENT_LIMIT 1.35
+
+// A growing buffer the generators write documents into.
+struct buffer {
+  int size;
+  int capacity;
+  char *content;
+};
+
+void buffer_printf( struct buffer *self, char *format, ... ) {
+  va_list args;
+  for ( ;; ) {
+    va_start( args, format );
+    int available = self->capacity - self->size;
+    int size =
+      vsnprintf( self->content + self->size, available, format, args );
+    va_end( args );
+
+    if ( size < available ) {
+      self->size += size;
+      return;
+    }
+
+    self->capacity = self->capacity ? self->capacity * 2 : 65536;
+    while ( self->capacity - self->size <= size ) {
+      self->capacity *= 2;
+    }
+    self->content = realloc( self->content, self->capacity );
+  }
+}
+
+double now() {
+  struct timespec time;
+  clock_gettime( CLOCK_MONOTONIC, &time );
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// Generators write a document with n elements of one shape.
+
+// n keys in one table.
+void generate_keys( struct buffer *out, int n ) {
+  for ( int i = 0; i < n; ++i ) {
+    buffer_printf( out, "key%d = %d\n", i, i );
+  }
+}
+
+// One array of n numbers on a single line.
+void generate_array( struct buffer *out, int n ) {
+  buffer_printf( out, "array = [ " );
+  for ( int i = 0; i < n; ++i ) {
+    buffer_printf( out, i ? ", %d" : "%d", i );
+  }
+  buffer_printf( out, " ]\n" );
+}
+
+// One string with n escapes.
+void generate_escapes( struct buffer *out, int n ) {
+  buffer_printf( out, "string = \"" );
+  for ( int i = 0; i < n; ++i ) {
+    buffer_printf( out, i % 2 ? "\\n" : "\\u00e9" );
+  }
+  buffer_printf( out, "\"\n" );
+}
+
+// One string spanning n lines.
+void generate_lines( struct buffer *out, int n ) {
+  buffer_printf( out, "string = \"" );
+  for ( int i = 0; i < n; ++i ) {
+    buffer_printf( out, "line\n" );
+  }
+  buffer_printf( out, "\"\n" );
+}
+
+// One table header n keys deep. Past TOML_MAX_DEPTH keys the parser rejects
+// it, which must take no more than linear time either.
+void generate_header( struct buffer *out, int n ) {
+  buffer_printf( out, "[a" );
+  for ( int i = 1; i < n; ++i ) {
+    buffer_printf( out, ".a" );
+  }
+  buffer_printf( out, "]\nkey = 1\n" );
+}
+
+// Headers TOML_MAX_DEPTH keys deep, with n keys across all of them.
+void generate_deep_headers( struct buffer *out, int n ) {
+  for ( int i = 0; i < n; i += TOML_MAX_DEPTH ) {
+    buffer_printf( out, "[h%d", i );
+    for ( int j = 1; j < TOML_MAX_DEPTH; ++j ) {
+      buffer_printf( out, ".a" );
+    }
+    buffer_printf( out, "]\nkey = 1\n" );
+  }
+}
+
+// n tables, each defined by its own header.
+void generate_tables( struct buffer *out, int n ) {
+  for ( int i = 0; i < n; ++i ) {
+    buffer_printf( out, "[table%d]\nkey = %d\n", i, i );
+  }
+}
+
+// Each case returns the seconds one run of its operation took at size n.
+
+double parse_document( void (*generate)( struct buffer *, int ), int n ) {
+  struct buffer document = { 0, 0, NULL };
+  generate( &document, n );
+
+  TOMLTable *table = NULL;
+  double start = now();
+  TOML_parse( document.content, &table, NULL );
+  double seconds = now() - start;
+
+  TOML_free( table );
+  free( document.content );
+  return seconds;
+}
+
+double load_document( void (*generate)( struct buffer *, int ), int n ) {
+  struct buffer document = { 0, 0, NULL };
+  generate( &document, n );
+  FILE *file = fopen( "complexity.toml", "w" );
+  fwrite( document.content, 1, document.size, file );
+  fclose( file );
+
+  TOMLTable *table = NULL;
+  double start = now();
+  TOML_load( "complexity.toml", &table, NULL );
+  double seconds = now() - start;
+
+  remove( "complexity.toml" );
+  TOML_free( table );
+  free( document.content );
+  return seconds;
+}
+
+double stringify_document( void (*generate)( struct buffer *, int ), int n ) {
+  struct buffer document = { 0, 0, NULL };
+  generate( &document, n );
+  TOMLTable *table = NULL;
+  TOML_parse( document.content, &table, NULL );
+
+  char *output = NULL;
+  double start = now();
+  TOML_stringify( &output, table, NULL );
+  double seconds = now() - start;
+
+  free( output );
+  TOML_free( table );
+  free( document.content );
+  return seconds;
+}
+
+double run_array_append( int n ) {
+  TOMLArray *array = TOML_allocArray( TOML_INT, NULL );
+  double start = now();
+  for ( int i = 0; i < n; ++i ) {
+    TOMLArray_append( array, TOML_allocInt( i ) );
+  }
+  double seconds = now() - start;
+  TOML_free( array );
+  return seconds;
+}
+
+double run_table_keys( int n ) {
+  char **keys = malloc( n * sizeof(char *) );
+  for ( int i = 0; i < n; ++i ) {
+    keys[ i ] = malloc( 16 );
+    snprintf( keys[ i ], 16, "key%d", i );
+  }
+
+  TOMLTable *table = TOML_allocTable( NULL, NULL );
+  double start = now();
+  for ( int i = 0; i < n; ++i ) {
+    TOMLTable_setKey( table, keys[ i ], TOML_allocInt( i ) );
+  }
+  for ( int i = 0; i < n; ++i ) {
+    TOMLTable_getKey( table, keys[ i ] );
+  }
+  double seconds = now() - start;
+
+  TOML_free( table );
+  for ( int i = 0; i < n; ++i ) {
+    free( keys[ i ] );
+  }
+  free( keys );
+  return seconds;
+}
+
+double run_parse_keys( int n ) {
+  return parse_document( generate_keys, n );
+}
+
+double run_parse_array( int n ) {
+  return parse_document( generate_array, n );
+}
+
+double run_parse_escapes( int n ) {
+  return parse_document( generate_escapes, n );
+}
+
+double run_parse_lines( int n ) {
+  return parse_document( generate_lines, n );
+}
+
+double run_parse_header( int n ) {
+  return parse_document( generate_header, n );
+}
+
+double run_parse_tables( int n ) {
+  return parse_document( generate_tables, n );
+}
+
+double run_load_keys( int n ) {
+  return load_document( generate_keys, n );
+}
+
+double run_load_array( int n ) {
+  return load_document( generate_array, n );
+}
+
+double run_load_escapes( int n ) {
+  return load_document( generate_escapes, n );
+}
+
+double run_stringify_keys( int n ) {
+  return stringify_document( generate_keys, n );
+}
+
+double run_stringify_array( int n ) {
+  return stringify_document( generate_array, n );
+}
+
+double run_stringify_header( int n ) {
+  return stringify_document( generate_deep_headers, n );
+}
+
+struct scaling {
+  char *name;
+  // Largest n the case runs at.
+  int maxSize;
+  double (*run)( int n );
+};
+
+struct scaling scalings[] = {
+  { "array_append", 1000000, run_array_append },
+  { "table_keys", 1000000, run_table_keys },
+  { "parse_keys", 1000000, run_parse_keys },
+  { "parse_array", 1000000, run_parse_array },
+  { "parse_escapes", 1000000, run_parse_escapes },
+  { "parse_lines", 1000000, run_parse_lines },
+  { "parse_header", 1000000, run_parse_header },
+  { "parse_tables", 1000000, run_parse_tables },
+  { "load_keys", 1000000, run_load_keys },
+  { "load_array", 1000000, run_load_array },
+  { "load_escapes", 1000000, run_load_escapes },
+  { "stringify_keys", 1000000, run_stringify_keys },
+  { "stringify_array", 1000000, run_stringify_array },
+  { "stringify_header", 1000000, run_stringify_header },
+  { NULL, 0, NULL }
+};
+
+// The best of several runs, with more runs at small sizes where timer and
+// cache noise matter most.
+double best_time( struct scaling *scaling, int n ) {
+  int runs = n <= 10000 ? 15 : n <= 100000 ? 5 : 3;
+  double best = scaling->run( n );
+  for ( int i = 1; i < runs; ++i ) {
+    double seconds = scaling->run( n );
+    if ( seconds < best ) {
+      best = seconds;
+    }
+  }
+  return best;
+}
+
+// Least squares slope of log time over log size.
+double fit_exponent( double *sizes, double *times, int count ) {
+  double sumX = 0, sumY = 0, sumXX = 0, sumXY = 0;
+  for ( int i = 0; i < count; ++i ) {
+    double x = log( sizes[ i ] );
+    double y = log( times[ i ] > 1e-9 ? times[ i ] : 1e-9 );
+    sumX += x;
+    sumY += y;
+    sumXX += x * x;
+    sumXY += x * y;
+  }
+  return ( count * sumXY - sumX * sumY ) / ( count * sumXX - sumX * sumX );
+}
+
+int main( int argc, char **argv ) {
+  // An optional largest size keeps quick runs quick, and an optional name
+  // runs one case.
+  int maxSize = argc > 1 ? atoi( argv[ 1 ] ) : 1000000;
+  char *only = argc > 2 ? argv[ 2 ] : NULL;
+
+  int count = 0;
+  for ( struct scaling *scaling = scalings; scaling->name; ++scaling ) {
+    count += !only || strcmp( scaling->name, only ) == 0;
+  }
+  plan( count );
+
+  for ( struct scaling *scaling = scalings; scaling->name; ++scaling ) {
+    if ( only && strcmp( scaling->name, only ) != 0 ) {
+      continue;
+    }
+
+    double sizes[ 4 ];
+    double times[ 4 ];
+    int points = 0;
+    for (
+      int n = 1000;
+      n <= scaling->maxSize && n <= maxSize && points < 4;
+      n *= 10
+    ) {
+      sizes[ points ] = n;
+      times[ points ] = best_time( scaling, n );
+      note(
+        "%s n=%d %.3fms", scaling->name, n, times[ points ] * 1e3
+      );
+      points++;
+    }
+
+    double exponent = points > 1 ? fit_exponent( sizes, times, points ) : 0;
+    ok(
+      exponent < EXPONENT_LIMIT,
+      "%s grows as n^%.2f", scaling->name, exponent
+    );
+  }
+
+  done_testing();
+}
@@ -1,6 +1,18 @@
+#define _XOPEN_SOURCE 700
+
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
 #include "toml.h"
 
 struct option {
@@ -31,8 +43,8 @@ int available_option( struct option *head, int i ) {
   struct option *ptr = head;
   while ( ptr ) {
     if (
-      ptr->argumentIndex >= i &&
-        ptr->argumentIndex < i + ptr->argumentCount
+      i >= ptr->argumentIndex &&
+        i < ptr->argumentIndex + ptr->argumentCount
     ) {
       return 0;
     }
@@ -97,15 +109,795 @@ int available_option( struct option *head, int i ) {
   } \
 }
 
+// Find the value a member path like "en.text[0].characterImage" names.
+TOMLRef lookup( TOMLRef ref, char *members ) {
+  int tokenSize = 0;
+  char *token = NULL;
+  char *tokenStart = members;
+  char *tokenEnd = tokenStart;
+
+  while ( tokenEnd ) {
+    tokenEnd = strpbrk( tokenStart, ".[]" );
+
+    if ( tokenEnd ) {
+      if ( tokenEnd - tokenStart > tokenSize ) {
+        tokenSize = tokenEnd - tokenStart;
+        free( token );
+        token = malloc( tokenSize + 1 );
+      }
+
+      strncpy( token, tokenStart, tokenEnd - tokenStart );
+      token[ tokenEnd - tokenStart ] = 0;
+
+      ref = TOML_find( ref, token, NULL );
+
+      tokenEnd++;
+      if ( *tokenEnd == '.' || *tokenEnd == '[' ) {
+        tokenEnd++;
+      }
+      tokenStart = tokenEnd;
+      if ( *tokenEnd == 0 ) {
+        tokenEnd = NULL;
+      }
+    } else {
+      ref = TOML_find( ref, tokenStart, NULL );
+    }
+  }
+
+  free( token );
+  return ref;
+}
+
+// How a value is printed.
+enum style {
+  STYLE_TOML,
+  STYLE_JSON,
+  // Compact JSON that fits on one line.
+  STYLE_JSONL
+};
+
+char *styleNames[] = { "toml", "json", "jsonl", NULL };
+
+// A growing buffer answers are written into before they are printed or sent.
+struct buffer {
+  int size;
+  int capacity;
+  char *content;
+};
+
+int buffer_write( void *context, char *bytes, int size ) {
+  struct buffer *self = context;
+  if ( self->size + size > self->capacity ) {
+    while ( self->size + size > self->capacity ) {
+      self->capacity = self->capacity ? self->capacity * 2 : 4096;
+    }
+    self->content = realloc( self->content, self->capacity );
+  }
+  memcpy( self->content + self->size, bytes, size );
+  self->size += size;
+  return 0;
+}
+
+// Write the value a member path names, or the whole table without one.
+int render(
+  TOMLTable *table, char *members, enum style style, struct buffer *out,
+  TOMLError *error
+) {
+  TOMLRef ref = members && *members ? lookup( table, members ) : table;
+
+  TOMLWriter writer;
+  TOMLWriter_initCallback( &writer, buffer_write, out );
+
+  if ( style == STYLE_TOML ) {
+    return TOML_write( &writer, ref, error );
+  }
+  return TOML_toJSON( &writer, ref, style == STYLE_JSON, error );
+}
+
+// Print one answer followed by end.
+int answer( TOMLTable *table, char *members, enum style style, char end ) {
+  struct buffer out = { 0, 0, NULL };
+  TOMLError *error = TOML_allocError( TOML_SUCCESS );
+
+  int errorCode = render( table, members, style, &out, error );
+  if ( errorCode != TOML_SUCCESS ) {
+    printf( "%s\n", error->fullDescription );
+  } else {
+    fwrite( out.content, 1, out.size, stdout );
+    fputc( end, stdout );
+  }
+
+  TOML_free( error );
+  free( out.content );
+
+  return errorCode;
+}
+
+// Read a line without its newline into a buffer that grows as needed. A
+// positive limit caps the size of the line. Returns the size of the line, -1
+// at the end of the file, or -2 once the line passes the limit, leaving the
+// rest of it unread.
+int read_line( FILE *file, char **buffer, int *capacity, int limit ) {
+  if ( *capacity == 0 ) {
+    *capacity = 256;
+    *buffer = malloc( *capacity );
+  }
+
+  int size = 0;
+  int ch;
+  while ( ( ch = getc( file ) ) != EOF && ch != '\n' ) {
+    if ( limit > 0 && size == limit ) {
+      ( *buffer )[ size ] = 0;
+      return -2;
+    }
+    if ( size + 1 >= *capacity ) {
+      *capacity *= 2;
+      *buffer = realloc( *buffer, *capacity );
+    }
+    ( *buffer )[ size++ ] = ch;
+  }
+
+  if ( ch == EOF && size == 0 ) {
+    return -1;
+  }
+
+  if ( size > 0 && ( *buffer )[ size - 1 ] == '\r' ) {
+    size--;
+  }
+  ( *buffer )[ size ] = 0;
+  return size;
+}
+
+// Requests to a server are lines of "style\tfile\tmembers", naming the file
+// by its real path. Each is answered with "ok size\n" and size bytes, or with
+// "error message\n". The style "check" answers "ok 0" for served files.
+//
+// Fields and error messages escape backslashes, tabs and line breaks as \\,
+// \t, \n and \r, so they never split a request or a reply. Requests longer
+// than SERVE_LINE_LIMIT are answered with an error and the connection closed.
+#define SERVE_LINE_LIMIT 65536
+
+// Seconds between checks for changed files.
+#define SERVE_RELOAD_INTERVAL 1
+
+void write_field( FILE *out, char *field ) {
+  for ( ; *field; ++field ) {
+    switch ( *field ) {
+      case '\\': fputs( "\\\\", out ); break;
+      case '\t': fputs( "\\t", out ); break;
+      case '\n': fputs( "\\n", out ); break;
+      case '\r': fputs( "\\r", out ); break;
+      default: fputc( *field, out ); break;
+    }
+  }
+}
+
+// Undo write_field in place.
+void read_field( char *field ) {
+  char *cursor = field;
+  for ( ; *field; ++field ) {
+    if ( *field != '\\' || field[ 1 ] == 0 ) {
+      *cursor++ = *field;
+      continue;
+    }
+    switch ( *++field ) {
+      case 't': *cursor++ = '\t'; break;
+      case 'n': *cursor++ = '\n'; break;
+      case 'r': *cursor++ = '\r'; break;
+      default: *cursor++ = *field; break;
+    }
+  }
+  *cursor = 0;
+}
+
+// Connect to a server's socket, or bind and listen on it.
+int open_socket( char *path, int listening ) {
+  struct sockaddr_un address;
+  if ( strlen( path ) >= sizeof(address.sun_path) ) {
+    return -1;
+  }
+  memset( &address, 0, sizeof(address) );
+  address.sun_family = AF_UNIX;
+  strcpy( address.sun_path, path );
+
+  int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+  if ( fd < 0 ) {
+    return -1;
+  }
+
+  int failed;
+  if ( listening ) {
+    unlink( path );
+    failed =
+      bind( fd, (struct sockaddr *) &address, sizeof(address) ) != 0 ||
+        listen( fd, 64 ) != 0;
+  } else {
+    failed = connect( fd, (struct sockaddr *) &address, sizeof(address) ) != 0;
+  }
+
+  if ( failed ) {
+    close( fd );
+    return -1;
+  }
+  return fd;
+}
+
+// Files a server keeps parsed, matched by their real paths.
+struct server {
+  int size;
+  char **paths;
+  TOMLConfigHandle **configs;
+};
+
+struct connection {
+  struct server *server;
+  int fd;
+};
+
+TOMLConfigHandle * server_find( struct server *self, char *path ) {
+  for ( int i = 0; i < self->size; ++i ) {
+    if ( self->paths[ i ] && strcmp( self->paths[ i ], path ) == 0 ) {
+      return self->configs[ i ];
+    }
+  }
+  return NULL;
+}
+
+void serve_request( struct server *server, char *request, FILE *out ) {
+  char *file = strchr( request, '\t' );
+  char *members = file ? strchr( file + 1, '\t' ) : NULL;
+  if ( members == NULL ) {
+    fprintf( out, "error malformed request\n" );
+    return;
+  }
+  *file++ = 0;
+  *members++ = 0;
+  read_field( request );
+  read_field( file );
+  read_field( members );
+
+  int style = 0;
+  while ( styleNames[ style ] && strcmp( styleNames[ style ], request ) ) {
+    style++;
+  }
+
+  TOMLConfigHandle *config = server_find( server, file );
+  if ( config == NULL ) {
+    fputs( "error ", out );
+    write_field( out, file );
+    fputs( " is not served\n", out );
+    return;
+  } else if ( strcmp( request, "check" ) == 0 ) {
+    fprintf( out, "ok 0\n" );
+    return;
+  } else if ( styleNames[ style ] == NULL ) {
+    fputs( "error unknown style ", out );
+    write_field( out, request );
+    fputs( "\n", out );
+    return;
+  }
+
+  struct buffer answer = { 0, 0, NULL };
+  TOMLError *error = TOML_allocError( TOML_SUCCESS );
+
+  TOMLTable *table = TOMLConfig_acquire( config );
+  int errorCode = render( table, members, style, &answer, error );
+  TOMLConfig_release( config );
+
+  if ( errorCode != TOML_SUCCESS ) {
+    fputs( "error ", out );
+    write_field( out, error->fullDescription );
+    fputs( "\n", out );
+  } else {
+    fprintf( out, "ok %d\n", answer.size );
+    fwrite( answer.content, 1, answer.size, out );
+  }
+
+  TOML_free( error );
+  free( answer.content );
+}
+
+void * serve_connection( void *context ) {
+  struct connection *connection = context;
+  FILE *in = fdopen( connection->fd, "r" );
+  FILE *out = fdopen( dup( connection->fd ), "w" );
+
+  char *line = NULL;
+  int capacity = 0;
+  for ( ;; ) {
+    int size = read_line( in, &line, &capacity, SERVE_LINE_LIMIT );
+    if ( size == -2 ) {
+      // The rest of the line is unread, so the connection cannot go on.
+      fprintf( out, "error request is over %d bytes\n", SERVE_LINE_LIMIT );
+      break;
+    } else if ( size < 0 ) {
+      break;
+    }
+    serve_request( connection->server, line, out );
+    fflush( out );
+  }
+
+  free( line );
+  fclose( in );
+  fclose( out );
+  free( connection );
+  return NULL;
+}
+
+// Reloads changed files for every connection from one thread, so requests
+// only read the current parse. A reload that fails keeps the last good parse.
+void * serve_reload( void *context ) {
+  struct server *server = context;
+  for ( ;; ) {
+    sleep( SERVE_RELOAD_INTERVAL );
+    for ( int i = 0; i < server->size; ++i ) {
+      TOMLConfig_reloadIfChanged( server->configs[ i ], NULL );
+      TOMLConfig_collect( server->configs[ i ] );
+    }
+  }
+  return NULL;
+}
+
+// Load the files once and answer requests for them until killed, one thread
+// per connection. Only returns if the files, the socket or the reload thread
+// fail.
+int serve_files( char *socketPath, char **files, int count ) {
+  struct server server = {
+    count,
+    malloc( count * sizeof(char *) ),
+    malloc( count * sizeof(TOMLConfigHandle *) )
+  };
+
+  for ( int i = 0; i < count; ++i ) {
+    TOMLError *error = TOML_allocError( TOML_SUCCESS );
+    server.configs[ i ] = TOML_allocConfig( files[ i ], error );
+    if ( server.configs[ i ] == NULL ) {
+      printf( "%s\n", error->fullDescription );
+      return error->code;
+    }
+    TOML_free( error );
+    server.paths[ i ] = realpath( files[ i ], NULL );
+  }
+
+  int existing = open_socket( socketPath, 0 );
+  if ( existing >= 0 ) {
+    close( existing );
+    printf( "%s is already being served\n", socketPath );
+    return 1;
+  }
+
+  int fd = open_socket( socketPath, 1 );
+  if ( fd < 0 ) {
+    perror( socketPath );
+    return 1;
+  }
+
+  // Clients that hang up early must not stop the server.
+  signal( SIGPIPE, SIG_IGN );
+
+  pthread_t reloader;
+  if ( pthread_create( &reloader, NULL, serve_reload, &server ) ) {
+    perror( "pthread_create" );
+    close( fd );
+    return 1;
+  }
+
+  for ( ;; ) {
+    int client = accept( fd, NULL, NULL );
+    if ( client < 0 ) {
+      continue;
+    }
+
+    struct connection *connection = malloc( sizeof(struct connection) );
+    connection->server = &server;
+    connection->fd = client;
+
+    pthread_t thread;
+    if ( pthread_create( &thread, NULL, serve_connection, connection ) ) {
+      close( client );
+      free( connection );
+      continue;
+    }
+    pthread_detach( thread );
+  }
+}
+
+// Answers members either from a loaded table or from a server.
+struct session {
+  TOMLTable *table;
+  FILE *in;
+  FILE *out;
+  // The real path of the file, as the server knows it.
+  char *path;
+  enum style style;
+  char end;
+};
+
+// Send a request and read the status line of its answer. Returns the size of
+// the answer that follows, or -1 with the status line left in line.
+long session_request(
+  struct session *self, char *style, char *members, char **line,
+  int *capacity
+) {
+  write_field( self->out, style );
+  fputc( '\t', self->out );
+  write_field( self->out, self->path );
+  fputc( '\t', self->out );
+  write_field( self->out, members );
+  fputc( '\n', self->out );
+  fflush( self->out );
+
+  if ( read_line( self->in, line, capacity, 0 ) < 0 ) {
+    ( *line )[ 0 ] = 0;
+    return -1;
+  }
+  if ( strncmp( *line, "ok ", 3 ) != 0 ) {
+    return -1;
+  }
+  return atol( *line + 3 );
+}
+
+// Start answering from the server on the socket. Returns 0 if the server
+// serves the file.
+int session_connect( struct session *self, char *socketPath, char *filepath ) {
+  self->path = realpath( filepath, NULL );
+  int fd = self->path ? open_socket( socketPath, 0 ) : -1;
+  if ( fd < 0 ) {
+    return -1;
+  }
+
+  self->in = fdopen( fd, "r" );
+  self->out = fdopen( dup( fd ), "w" );
+
+  char *line = NULL;
+  int capacity = 0;
+  long size = session_request( self, "check", "", &line, &capacity );
+  free( line );
+  if ( size != 0 ) {
+    fclose( self->in );
+    fclose( self->out );
+    self->in = self->out = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+int session_answer( struct session *self, char *members ) {
+  if ( self->in == NULL ) {
+    return answer( self->table, members, self->style, self->end );
+  }
+
+  char *line = NULL;
+  int capacity = 0;
+  long size = session_request(
+    self, styleNames[ self->style ], members ? members : "", &line, &capacity
+  );
+  if ( size < 0 ) {
+    // Errors print like they would without a server.
+    char *message = strncmp( line, "error ", 6 ) == 0 ? line + 6 : line;
+    read_field( message );
+    printf( "%s\n", message );
+    free( line );
+    return 1;
+  }
+  free( line );
+
+  char chunk[ 4096 ];
+  while ( size > 0 ) {
+    int read = fread(
+      chunk, 1, size < (long) sizeof(chunk) ? size : sizeof(chunk), self->in
+    );
+    if ( read <= 0 ) {
+      return 1;
+    }
+    fwrite( chunk, 1, read, stdout );
+    size -= read;
+  }
+  fputc( self->end, stdout );
+  return 0;
+}
+
+// Checking many files parses each into an arena owned by the checking thread.
+// Blocks are never freed one at a time. The arena is rewound after each file,
+// so a thread reuses the same memory for every file it checks.
+struct arena {
+  TOMLAllocator allocator;
+  char *chunk;
+  size_t used;
+  size_t capacity;
+  // Chunks filled before the current one, freed when the arena is rewound.
+  char **full;
+  int fullCount;
+  int fullCapacity;
+};
+
+// Each block keeps its size in front of it so realloc knows what to copy.
+#define ARENA_HEADER_SIZE 16
+
+void * arena_malloc( void *context, size_t size ) {
+  struct arena *self = context;
+  size_t needed = ARENA_HEADER_SIZE + ( ( size + 15 ) & ~(size_t) 15 );
+
+  if ( self->used + needed > self->capacity ) {
+    size_t capacity = self->capacity ? self->capacity * 2 : 65536;
+    while ( capacity < needed ) {
+      capacity *= 2;
+    }
+    char *chunk = malloc( capacity );
+    if ( chunk == NULL ) {
+      return NULL;
+    }
+
+    if ( self->chunk ) {
+      if ( self->fullCount == self->fullCapacity ) {
+        self->fullCapacity = self->fullCapacity ? self->fullCapacity * 2 : 8;
+        self->full =
+          realloc( self->full, self->fullCapacity * sizeof(char *) );
+      }
+      self->full[ self->fullCount++ ] = self->chunk;
+    }
+    self->chunk = chunk;
+    self->capacity = capacity;
+    self->used = 0;
+  }
+
+  char *block = self->chunk + self->used;
+  self->used += needed;
+  *(size_t *) block = size;
+  return block + ARENA_HEADER_SIZE;
+}
+
+void * arena_realloc( void *context, void *ptr, size_t size ) {
+  if ( ptr == NULL ) {
+    return arena_malloc( context, size );
+  }
+
+  size_t oldSize = *(size_t *) ( (char *) ptr - ARENA_HEADER_SIZE );
+  if ( size <= oldSize ) {
+    return ptr;
+  }
+
+  void *moved = arena_malloc( context, size );
+  if ( moved ) {
+    memcpy( moved, ptr, oldSize );
+  }
+  return moved;
+}
+
+void arena_free( void *context, void *ptr ) {
+}
+
+// Free everything allocated since the last rewind, keeping the largest chunk.
+void arena_rewind( struct arena *self ) {
+  for ( int i = 0; i < self->fullCount; ++i ) {
+    free( self->full[ i ] );
+  }
+  self->fullCount = 0;
+  self->used = 0;
+}
+
+void arena_destroy( struct arena *self ) {
+  arena_rewind( self );
+  free( self->full );
+  free( self->chunk );
+}
+
+int compare_names( const void *a, const void *b ) {
+  return strcmp( *(char **) a, *(char **) b );
+}
+
+// Add path to files, or every .toml file under it when it is a directory.
+// Directories are read in name order so results print in a stable order.
+// Named files are always added, found ones only if they end in .toml.
+void gather_files(
+  char *path, int named, char ***files, int *count, int *capacity
+) {
+  struct stat info;
+  if ( lstat( path, &info ) == 0 && S_ISDIR( info.st_mode ) ) {
+    DIR *dir = opendir( path );
+    if ( dir == NULL ) {
+      return;
+    }
+
+    char **names = NULL;
+    int nameCount = 0;
+    int nameCapacity = 0;
+    struct dirent *entry;
+    while ( ( entry = readdir( dir ) ) ) {
+      // Skips ., .. and hidden entries like .git.
+      if ( entry->d_name[ 0 ] == '.' ) {
+        continue;
+      }
+      if ( nameCount == nameCapacity ) {
+        nameCapacity = nameCapacity ? nameCapacity * 2 : 16;
+        names = realloc( names, nameCapacity * sizeof(char *) );
+      }
+      names[ nameCount++ ] = strdup( entry->d_name );
+    }
+    closedir( dir );
+
+    qsort( names, nameCount, sizeof(char *), compare_names );
+    for ( int i = 0; i < nameCount; ++i ) {
+      char *child = malloc( strlen( path ) + strlen( names[ i ] ) + 2 );
+      sprintf( child, "%s/%s", path, names[ i ] );
+      gather_files( child, 0, files, count, capacity );
+      free( child );
+      free( names[ i ] );
+    }
+    free( names );
+    return;
+  }
+
+  int length = strlen( path );
+  if (
+    !named && ( length < 5 || strcmp( path + length - 5, ".toml" ) != 0 )
+  ) {
+    return;
+  }
+
+  if ( *count == *capacity ) {
+    *capacity = *capacity ? *capacity * 2 : 64;
+    *files = realloc( *files, *capacity * sizeof(char *) );
+  }
+  ( *files )[ ( *count )++ ] = strdup( path );
+}
+
+// What checking one file found. The message is copied out of the arena.
+struct check_result {
+  int code;
+  int lineNo;
+  char *message;
+};
+
+// Files are claimed one at a time from nextFile, so a thread that drew small
+// files keeps taking more while another works through a large one.
+struct check_job {
+  char **files;
+  int count;
+  int nextFile;
+  struct check_result *results;
+};
+
+void * check_worker( void *context ) {
+  struct check_job *job = context;
+
+  struct arena arena;
+  memset( &arena, 0, sizeof(arena) );
+  arena.allocator.malloc = arena_malloc;
+  arena.allocator.realloc = arena_realloc;
+  arena.allocator.free = arena_free;
+  arena.allocator.context = &arena;
+  TOMLAllocator *previous = TOML_useAllocator( &arena.allocator );
+
+  for ( ;; ) {
+    int i = __atomic_fetch_add( &job->nextFile, 1, __ATOMIC_RELAXED );
+    if ( i >= job->count ) {
+      break;
+    }
+
+    struct check_result *result = job->results + i;
+    TOMLTable *table = NULL;
+    TOMLError *error = TOML_allocError( TOML_SUCCESS );
+    result->code = TOML_load( job->files[ i ], &table, error );
+    if ( result->code != TOML_SUCCESS ) {
+      result->lineNo = error->lineNo;
+      result->message = strdup( error->message ? error->message : "" );
+    }
+
+    // Drops the table and the error with everything else the load made.
+    arena_rewind( &arena );
+  }
+
+  TOML_useAllocator( previous );
+  arena_destroy( &arena );
+  return NULL;
+}
+
+// Print one check result as a line of text or as a compact JSON object.
+void print_result(
+  char *file, struct check_result *result, enum style style, char end
+) {
+  if ( style == STYLE_TOML ) {
+    if ( result->code == TOML_SUCCESS ) {
+      printf( "%s: ok%c", file, end );
+    } else {
+      printf(
+        "%s:%d: %s %s%c", file, result->lineNo,
+        TOMLErrorStrings[ result->code ], result->message, end
+      );
+    }
+    return;
+  }
+
+  TOMLTable *table = TOML_allocTable(
+    TOML_allocString( "file" ), TOML_allocString( file ),
+    TOML_allocString( "ok" ), TOML_allocBoolean( result->code == TOML_SUCCESS ),
+    NULL, NULL
+  );
+  if ( result->code != TOML_SUCCESS ) {
+    TOMLTable_setKey( table, "line", TOML_allocInt( result->lineNo ) );
+    TOMLTable_setKey(
+      table, "code", TOML_allocString( TOMLErrorStrings[ result->code ] )
+    );
+    TOMLTable_setKey( table, "message", TOML_allocString( result->message ) );
+  }
+  answer( table, NULL, STYLE_JSONL, end );
+  TOML_free( table );
+}
+
+// Check every file on threadCount threads, or one per core when threadCount
+// is 0 or less, and print the results in the order the files were given.
+// Returns the error code of the first file that failed, or 0.
+int check_files(
+  char **files, int count, int threadCount, enum style style, char end
+) {
+  struct check_job job = {
+    files, count, 0, calloc( count, sizeof(struct check_result) )
+  };
+
+  if ( threadCount <= 0 ) {
+    threadCount = sysconf( _SC_NPROCESSORS_ONLN );
+  }
+  if ( threadCount > count ) {
+    threadCount = count;
+  }
+
+  // The calling thread checks files too.
+  pthread_t *threads = malloc( threadCount * sizeof(pthread_t) );
+  int started = 0;
+  for ( int i = 1; i < threadCount; ++i ) {
+    if ( pthread_create( &threads[ started ], NULL, check_worker, &job ) ) {
+      break;
+    }
+    started++;
+  }
+  check_worker( &job );
+  for ( int i = 0; i < started; ++i ) {
+    pthread_join( threads[ i ], NULL );
+  }
+  free( threads );
+
+  int status = 0;
+  for ( int i = 0; i < count; ++i ) {
+    print_result( files[ i ], &job.results[ i ], style, end );
+    if ( status == 0 ) {
+      status = job.results[ i ].code;
+    }
+    free( job.results[ i ].message );
+  }
+  free( job.results );
+
+  return status;
+}
+
 int main( int argc, char **argv ) {
   struct option *optionhead = NULL;
 
-  USAGE( "toml [options] filepath [members]" );
+  USAGE( "toml [options] filepath [members...]" );
   FLAG( "-h", "--help", help, "print help and exit" );
   FLAG( "-c", "--check", check, "check that given source is valid toml" );
   FLAG( "-v", "--version", version, "print version and exit" );
+  FLAG( "-j", "--json", json, "print the result as json" );
+  FLAG(
+    "-s", "--stdin", readStdin, "also read members from stdin, one per line"
+  );
+  STROPTION(
+    "-f", "--format", format, "separate results by lines, nul or jsonl"
+  );
+  STROPTION(
+    "-S", "--serve", servePath,
+    "keep the files loaded and answer lookups on a unix socket"
+  );
+  STROPTION(
+    "-C", "--connect", connectPath,
+    "ask the server on a unix socket when it has the file"
+  );
+  STROPTION(
+    "-t", "--threads", threads,
+    "check files on this many threads, one per core by default"
+  );
   STROPTION( NULL, NULL, filepath, "path to toml file" );
-  STROPTION( NULL, NULL, members, "key names to lookup" );
+  STROPTION( NULL, NULL, members, "key names to lookup, may be repeated" );
 
   if ( help || filepath == NULL ) {
     printf( "%s\n", usageHelpText );
@@ -128,72 +920,119 @@ int main( int argc, char **argv ) {
     return 0;
   }
 
-  TOMLTable *table = NULL;
-  TOMLError *error = TOML_allocError( TOML_SUCCESS );
-
-  // Load and exit if there is an error.
-  if ( TOML_load( filepath, &table, error ) != TOML_SUCCESS ) {
-    printf( "%s\n", error->fullDescription );
-    return error->code;
+  struct session session = {
+    NULL, NULL, NULL, NULL, json ? STYLE_JSON : STYLE_TOML, '\n'
+  };
+  if ( format == NULL || strcmp( format, "lines" ) == 0 ) {
+  } else if ( strcmp( format, "nul" ) == 0 ) {
+    session.end = 0;
+  } else if ( strcmp( format, "jsonl" ) == 0 ) {
+    session.style = STYLE_JSONL;
+  } else {
+    printf( "unknown format %s\n", format );
+    return 1;
   }
 
-  TOML_free( error );
-
-  if ( check ) {
-    printf( "ok\n" );
-    return 0;
+  // Serving and checking take every remaining argument as a file.
+  char **files = malloc( argc * sizeof(char *) );
+  int count = 0;
+  for ( int i = filepathOption.argumentIndex; i < argc; ++i ) {
+    if (
+      i == filepathOption.argumentIndex ||
+        i == membersOption.argumentIndex ||
+        available_option( optionhead, i )
+    ) {
+      files[ count++ ] = argv[ i ];
+    }
   }
 
-  // Parse path argument.
-  TOMLRef ref = table;
-  TOMLBasic *basic = ref;
-  {
-    int tokenSize = 0;
-    char *token = NULL;
-    char *tokenStart = members;
-    char *tokenEnd = tokenStart;
+  if ( servePath ) {
+    return serve_files( servePath, files, count );
+  }
 
-    while ( tokenEnd ) {
-      tokenEnd = strpbrk( tokenStart, ".[]" );
+  // Many files or a directory are checked together, one result per file.
+  struct stat info;
+  if (
+    check && (
+      count > 1 || ( stat( filepath, &info ) == 0 && S_ISDIR( info.st_mode ) )
+    )
+  ) {
+    char **found = NULL;
+    int foundCount = 0;
+    int foundCapacity = 0;
+    for ( int i = 0; i < count; ++i ) {
+      gather_files( files[ i ], 1, &found, &foundCount, &foundCapacity );
+    }
 
-      if ( tokenEnd ) {
-        if ( tokenEnd - tokenStart > tokenSize ) {
-          tokenSize = tokenEnd - tokenStart;
-          free( token );
-          token = malloc( tokenSize + 1 );
-        }
+    int status = check_files(
+      found, foundCount, threads ? atoi( threads ) : 0,
+      format && strcmp( format, "jsonl" ) == 0 ? STYLE_JSONL : STYLE_TOML,
+      session.end
+    );
 
-        strncpy( token, tokenStart, tokenEnd - tokenStart );
-        token[ tokenEnd - tokenStart ] = 0;
+    for ( int i = 0; i < foundCount; ++i ) {
+      free( found[ i ] );
+    }
+    free( found );
+    free( files );
+    return status;
+  }
+  free( files );
 
-        basic = ref = TOML_find( ref, token, NULL );
+  // Without a server for the file, answer from a load like any other run.
+  if (
+    !connectPath || check || session_connect( &session, connectPath, filepath )
+  ) {
+    TOMLError *error = TOML_allocError( TOML_SUCCESS );
 
-        tokenEnd++;
-        if ( *tokenEnd == '.' || *tokenEnd == '[' ) {
-          tokenEnd++;
-        }
-        tokenStart = tokenEnd;
-        if ( *tokenEnd == 0 ) {
-          tokenEnd = NULL;
-        }
-      } else {
-        basic = ref = TOML_find( ref, tokenStart, NULL );
-      }
+    // Load and exit if there is an error.
+    if ( TOML_load( filepath, &session.table, error ) != TOML_SUCCESS ) {
+      printf( "%s\n", error->fullDescription );
+      return error->code;
     }
+
+    TOML_free( error );
   }
 
-  error = TOML_allocError( TOML_SUCCESS );
+  if ( check ) {
+    printf( "ok\n" );
+    return 0;
+  }
 
-  char *output;
-  if ( TOML_stringify( &output, ref, error ) != TOML_SUCCESS ) {
-    printf( "%s\n", error->fullDescription );
-    return error->code;
+  // Answer every member from the one load or connection, first from the
+  // arguments after filepath and then from stdin.
+  int status = 0;
+  if ( members == NULL && !readStdin ) {
+    status = session_answer( &session, NULL );
   }
 
-  TOML_free( error );
+  for ( int i = membersOption.argumentIndex; members && i < argc; ++i ) {
+    if (
+      i == membersOption.argumentIndex || available_option( optionhead, i )
+    ) {
+      int errorCode = session_answer( &session, argv[ i ] );
+      status = errorCode ? errorCode : status;
+    }
+  }
+
+  if ( readStdin ) {
+    char *line = NULL;
+    int capacity = 0;
+    while ( read_line( stdin, &line, &capacity, 0 ) >= 0 ) {
+      if ( line[ 0 ] ) {
+        int errorCode = session_answer( &session, line );
+        status = errorCode ? errorCode : status;
+      }
+    }
+    free( line );
+  }
 
-  printf( "%s\n", output );
-  free( output );
+  if ( session.in ) {
+    fclose( session.in );
+    fclose( session.out );
+  }
+  free( session.path );
+  TOML_free( session.table );
 
-  return 0;
+  return status;
 }
@@ -1,12 +1,140 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <float.h>
 #include <math.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "tap.h"
 #include "toml.h"
 
+int diff_collect(
+  void *context, TOMLDiffType type, char *path, TOMLRef a, TOMLRef b
+) {
+  char *buffer = context;
+  strcat( buffer, type == TOML_DIFF_ADDED ? "+" :
+    type == TOML_DIFF_REMOVED ? "-" : "~" );
+  strcat( buffer, path );
+  strcat( buffer, " " );
+  return 0;
+}
+
+int write_count( void *context, char *bytes, int size ) {
+  *(int *) context += size;
+  return 0;
+}
+
+int write_string( void *context, char *bytes, int size ) {
+  char **end = context;
+  memcpy( *end, bytes, size );
+  *end += size;
+  **end = 0;
+  return 0;
+}
+
+struct iov_collect {
+  char *end;
+  char *watch;
+  int pointedAt;
+};
+
+int iov_collect( void *context, struct iovec *iov, int count ) {
+  struct iov_collect *collect = context;
+  for ( int i = 0; i < count; ++i ) {
+    if ( iov[ i ].iov_base == collect->watch ) {
+      collect->pointedAt = 1;
+    }
+    memcpy( collect->end, iov[ i ].iov_base, iov[ i ].iov_len );
+    collect->end += iov[ i ].iov_len;
+  }
+  *collect->end = 0;
+  return 0;
+}
+
+int event_table( void *context, char *path ) {
+  sprintf( strchr( context, 0 ), "[%s] ", path );
+  return 0;
+}
+
+int event_array_table( void *context, char *path ) {
+  sprintf( strchr( context, 0 ), "[[%s]] ", path );
+  return 0;
+}
+
+int event_key( void *context, char *name ) {
+  sprintf( strchr( context, 0 ), "%s=", name );
+  return strcmp( name, "stop" ) == 0 ? 7 : 0;
+}
+
+int event_value( void *context, TOMLRef value ) {
+  char *end = strchr( context, 0 );
+  TOML_stringifyTo( end, 64, value );
+  strcat( end, " " );
+  return 0;
+}
+
+int event_begin_array( void *context ) {
+  strcat( context, "< " );
+  return 0;
+}
+
+int event_end_array( void *context ) {
+  strcat( context, "> " );
+  return 0;
+}
+
+// Writes a reader's event the way the event callbacks above do.
+void read_event( char *events, TOMLReadEvent *event ) {
+  switch ( event->type ) {
+    case TOML_READ_TABLE: event_table( events, event->name ); break;
+    case TOML_READ_ARRAY_TABLE: event_array_table( events, event->name ); break;
+    case TOML_READ_KEY: event_key( events, event->name ); break;
+    case TOML_READ_VALUE: event_value( events, event->value ); break;
+    case TOML_READ_BEGIN_ARRAY: event_begin_array( events ); break;
+    case TOML_READ_END_ARRAY: event_end_array( events ); break;
+  }
+}
+
+// Holds a config snapshot on another thread until the hold mutex is unlocked.
+struct config_reader {
+  TOMLConfigHandle *config;
+  pthread_mutex_t hold;
+  TOMLTable *table;
+};
+
+void * config_read( void *context ) {
+  struct config_reader *reader = context;
+  __atomic_store_n(
+    &reader->table, TOMLConfig_acquire( reader->config ), __ATOMIC_SEQ_CST
+  );
+  pthread_mutex_lock( &reader->hold );
+  TOMLConfig_release( reader->config );
+  pthread_mutex_unlock( &reader->hold );
+  return NULL;
+}
+
+void * tally_malloc( void *context, size_t size ) {
+  ++*(int *) context;
+  return malloc( size );
+}
+
+void * tally_realloc( void *context, void *ptr, size_t size ) {
+  ++*(int *) context;
+  return realloc( ptr, size );
+}
+
+void tally_free( void *context, void *ptr ) {
+  free( ptr );
+}
+
 int main() {
   ansicolor( getenv( "ANSICOLOR" ) != NULL );
-  plan( 75 );
+  plan( 326 );
 
   note( "\n** memory management **" );
 
@@ -67,6 +195,93 @@ int main() {
     TOML_free( table );
   }
 
+  { /** table_keys **/
+    note( "table_keys" );
+    TOMLTable *table = TOML_allocTable( NULL, NULL );
+    TOMLTable_setKey( table, "arr", TOML_allocInt( 1 ) );
+    TOMLTable_setKey( table, "a", TOML_allocInt( 2 ) );
+    ok( table->keys->size == 2, "a key is not replaced by a longer key" );
+    ok( TOML_toInt( TOMLTable_getKey( table, "arr" ) ) == 1 );
+    ok( TOML_toInt( TOMLTable_getKey( table, "a" ) ) == 2 );
+    ok( TOMLTable_getKey( table, "ar" ) == NULL );
+
+    // Big enough to be indexed.
+    char key[ 16 ];
+    for ( int i = 0; i < 100; ++i ) {
+      sprintf( key, "key%d", i );
+      TOMLTable_setKey( table, key, TOML_allocInt( i ) );
+    }
+    TOMLTable_setKey( table, "key42", TOML_allocInt( -42 ) );
+    ok( table->keys->size == 102 );
+    ok( TOML_toInt( TOMLTable_getKey( table, "key42" ) ) == -42 );
+    ok( TOML_toInt( TOMLTable_getKey( table, "key99" ) ) == 99 );
+    ok( TOML_toInt( TOMLTable_getKey( table, "a" ) ) == 2 );
+    ok( TOMLTable_getKey( table, "key100" ) == NULL );
+    TOML_free( table );
+  }
+
+  { /** allocator **/
+    note( "allocator" );
+    int calls = 0;
+    TOMLAllocator tally = { tally_malloc, tally_realloc, tally_free, &calls };
+    TOML_setAllocator( &tally );
+    TOMLNumber *number = TOML_allocInt( 1 );
+    TOML_free( number );
+    TOML_setAllocator( NULL );
+    ok( calls == 1, "global allocator is used" );
+
+    TOMLCountingAllocator counter;
+    TOMLCountingAllocator_init( &counter, &tally );
+    TOMLTable *table = NULL;
+    ok( TOML_parseWith(
+      "[server]\nports = [ 80, 81 ]\nname = \"web\"",
+      &table,
+      &counter.allocator,
+      NULL
+    ) == TOML_SUCCESS );
+    ok( counter.stats.mallocs > 0 && calls > 1, "parse allocates through it" );
+    ok( counter.stats.peakBytes >= counter.stats.liveBytes );
+
+    TOMLCountingAllocator_reset( &counter );
+    TOMLAllocator *previous = TOML_useAllocator( &counter.allocator );
+    char *buffer;
+    TOML_stringify( &buffer, table, NULL );
+    counter.allocator.free( counter.allocator.context, buffer );
+    TOML_useAllocator( previous );
+    ok( counter.stats.mallocs > 0 && counter.stats.frees > 0 );
+
+    TOML_freeWith( table, &counter.allocator );
+    ok( counter.stats.liveBytes == 0, "everything is freed" );
+
+    // Tables keep their allocator for what they allocate after the parse.
+    TOMLCountingAllocator_reset( &counter );
+    table = NULL;
+    TOML_parseWith(
+      "[server]\nports = [ 80, 81 ]\nname = \"web\"",
+      &table,
+      &counter.allocator,
+      NULL
+    );
+    char text[ 256 ];
+    char *end = text;
+    TOMLWriter writer;
+    TOMLWriter_initCallback( &writer, write_string, &end );
+    ok( TOML_writeCached( &writer, table, NULL ) == TOML_SUCCESS );
+    TOMLTable *server = TOML_find( table, "server", NULL );
+    TOMLArray *ports = TOML_find( server, "ports", NULL );
+    for ( int i = 0; i < 10; ++i ) {
+      char key[ 16 ];
+      sprintf( key, "key%d", i );
+      TOMLTable_setKey( server, key, TOML_copy( ports->members[ 0 ] ) );
+      TOMLArray_append( ports, TOML_copy( ports->members[ 0 ] ) );
+    }
+    TOMLRef variant = TOML_copy( table );
+    TOML_findMutable( &variant, "server", "ports", NULL );
+    TOML_free( variant );
+    TOML_free( table );
+    ok( counter.stats.liveBytes == 0, "tables free with their allocator" );
+  }
+
   note( "\n** parse **" );
 
   { /** parse_entry_string **/
@@ -96,6 +311,15 @@ int main() {
       "member contained escaped characters"
     );
     TOML_free( table );
+
+    table = NULL;
+    TOML_parse( "mixed = \"a\\tb\\u00e9c\\u2603d\\\\\"", &table, NULL );
+    is(
+      ((TOMLString *) TOML_find( table, "mixed", NULL ))->content,
+      "a\tb\xc3\xa9" "c\xe2\x98\x83" "d\\",
+      "text between escapes is kept"
+    );
+    TOML_free( table );
   }
 
   { /** parse_entry_int **/
@@ -219,8 +443,382 @@ int main() {
     TOML_free( table );
   }
 
+  { /** reparse_section **/
+    note( "reparse_section" );
+    char *before =
+      "x = 0\nnote = \"an entry the edits below leave alone\"\n"
+        "[a]\nx = 1\n\n"
+        "[b]\ny = \"two\"\nz = [ 1, 2 ]\n";
+    char *after =
+      "x = 0\nnote = \"an entry the edits below leave alone\"\n"
+        "[a]\nx = 1\n\n"
+        "[b]\ny = \"three\"\nz = [ 1, 2 ]\n";
+    TOMLTable *table = NULL;
+    TOML_parse( before, &table, NULL );
+    TOMLRef a = TOML_find( table, "a", NULL );
+    TOMLRef z = TOML_find( table, "b", "z", NULL );
+    ok( TOML_reparse( table, before, after, NULL ) == TOML_SUCCESS );
+    ok( TOML_find( table, "a", NULL ) == a, "untouched table kept" );
+    ok( TOML_find( table, "b", "z", NULL ) == z, "unchanged entry kept" );
+    is( ((TOMLString *) TOML_find( table, "b", "y", NULL ))->content, "three" );
+
+    char *removed =
+      "x = 0\nnote = \"an entry the edits below leave alone\"\n"
+        "[a]\nx = 1\n";
+    ok( TOML_reparse( table, after, removed, NULL ) == TOML_SUCCESS );
+    ok( TOML_find( table, "b", NULL ) == NULL, "removed section dropped" );
+    ok( TOML_find( table, "a", NULL ) == a );
+
+    TOMLError *error = TOML_allocError( TOML_SUCCESS );
+    ok(
+      TOML_reparse(
+        table, removed,
+        "x = 0\nnote = \"an entry the edits below leave alone\"\n"
+          "[a]\nx = 1\nx = 2\n",
+        error
+      )
+    );
+    ok( error->code == TOML_ERROR_ENTRY_DEFINED );
+    ok(
+      TOML_find( table, "a", "x", NULL ) != NULL, "failed reparse kept table"
+    );
+    TOML_free( error );
+    TOML_free( table );
+  }
+
+  { /** reparse_order **/
+    note( "reparse_order" );
+    char *sources[] = {
+      "[a.b]\nl = 0\n[b.a]\nm = 2\n\n[a.c]\nm = 0\n[c]\nn = 1\n",
+      "[a.b]\nl = 0\n[b.a]\nm = 2\n[a.c]\nm = 0\n[c]\nn = 1\n",
+      "[a.b]\nl = 0\n[b.a]\nm = 2\n[a.c]\nm = 0\n[c]\nn = 1\nq = 1\n",
+      "[a.b]\nl = 0\n[b.a]\nm = 2\n[a.c]\nk = 1\nm = 0\n[c]\nn = 1\nq = 1\n",
+      "[a.b]\nl = 0\n[b.a]\nm = 2\n[new]\n[a.c]\nk = 1\nm = 0\n[c]\nn = 1\n"
+    };
+    int count = sizeof(sources) / sizeof(sources[ 0 ]);
+    TOMLTable *table = NULL;
+    TOML_parse( sources[ 0 ], &table, NULL );
+    for ( int i = 1; i < count; ++i ) {
+      TOMLTable *parsed = NULL;
+      TOML_parse( sources[ i ], &parsed, NULL );
+      TOML_reparse( table, sources[ i - 1 ], sources[ i ], NULL );
+      char *reparsed;
+      char *expected;
+      TOML_stringify( &reparsed, table, NULL );
+      TOML_stringify( &expected, parsed, NULL );
+      is( reparsed, expected, "reparse %d writes what a full parse does", i );
+      free( reparsed );
+      free( expected );
+      TOML_free( parsed );
+    }
+    TOML_free( table );
+  }
+
+  { /** reparse_strings **/
+    note( "reparse_strings" );
+    // Brackets in strings and arrays starting a line are not headers.
+    char *sources[][ 2 ] = {
+      {
+        "s = \"multi\n  [a]\n[b]\n[c]\"\nx = 1\n[d.e.f]\n  [a]\n",
+        "s = \"multi\n  [q]\n[b]\n[c]\"\nx = 1\n[d.e.f]\n  [a]\n"
+      },
+      {
+        "s = \"multi\n  [a]\n[b]\n[c]\"\nx = 1\n[d.e.f]\n  [a]\n",
+        "s = \"multi\n  [a]\n[b]\n[c]\"\nx = 2\n[d.e.f]\n  [a]\n"
+      },
+      {
+        "s = \"multi\n  [a]\n[b]\n[c]\"\n[c]\n",
+        "s = \"multi\n  [a]\n[b]\n[c]\"\n[b.t]\n"
+      },
+      {
+        "[a]\nx = 1\n[b]\ny = [\n  [ 1 ],\n  [ 2 ]\n]\n"
+          "[c]\nz = \"a long value\"\n",
+        "[a]\nx = 1\n[b]\ny = [\n  [ 1 ],\n  [ 3 ]\n]\n"
+          "[c]\nz = \"a long value\"\n"
+      }
+    };
+    int count = sizeof(sources) / sizeof(sources[ 0 ]);
+    for ( int i = 0; i < count; ++i ) {
+      TOMLTable *table = NULL;
+      TOMLTable *parsed = NULL;
+      TOML_parse( sources[ i ][ 0 ], &table, NULL );
+      ok(
+        TOML_reparse( table, sources[ i ][ 0 ], sources[ i ][ 1 ], NULL ) ==
+          TOML_SUCCESS
+      );
+      TOML_parse( sources[ i ][ 1 ], &parsed, NULL );
+      ok( TOML_equal( table, parsed ), "reparse %d matches a full parse", i );
+      TOML_free( table );
+      TOML_free( parsed );
+    }
+
+    // What a full parse rejects is rejected too, though a section alone
+    // would parse.
+    char *before = "[a.b]\nx = 1\n[[r]]\n[[r]]\n[c]\nlong = \"enough\"\n";
+    char *after = "[a.b]\nx = 1\ny[[r]]\n[[r]]\n[c]\nlong = \"enough\"\n";
+    TOMLTable *table = NULL;
+    TOMLTable *parsed = NULL;
+    TOML_parse( before, &table, NULL );
+    ok( TOML_parse( after, &parsed, NULL ) != TOML_SUCCESS );
+    ok( TOML_reparse( table, before, after, NULL ) != TOML_SUCCESS );
+    TOML_free( table );
+    TOML_free( parsed );
+  }
+
+  { /** parse_stats **/
+    note( "parse_stats" );
+    TOMLParseStats stats;
+    TOMLTable *table = NULL;
+    char *source =
+      "# ports\n[server]\nports = [ 80, 81 ]\n"
+      "since = 1979-05-27T07:32:00Z\nname = \"web\"\n";
+    ok( TOML_parseWithStats( source, &table, &stats, NULL ) == 0 );
+    ok( stats.bytes == strlen( source ) );
+    ok( stats.comments == 1 && stats.keys == 4 && stats.numbers == 2 );
+    ok( stats.dates == 1 && stats.strings == 1 && stats.brackets == 4 );
+    ok( stats.nodes[ TOML_TABLE ] == 2 && stats.nodes[ TOML_INT ] == 2 );
+    ok( stats.maxDepth == 4, "root, server, ports and its numbers" );
+    ok( stats.allocations > 0 && stats.parseNanoseconds > 0 );
+    TOML_free( table );
+
+    FILE *file = fopen( "test-stats.toml", "w" );
+    fputs( source, file );
+    fclose( file );
+    table = NULL;
+    ok( TOML_loadWithStats( "test-stats.toml", &table, &stats, NULL ) == 0 );
+    ok( stats.bytes == strlen( source ) && stats.tokens > 0 );
+    remove( "test-stats.toml" );
+    TOML_free( table );
+  }
+
+  { /** parse_events **/
+    note( "parse_events" );
+    char events[ 512 ] = "";
+    TOMLEvents callbacks = {
+      event_table, event_array_table, event_key, event_value,
+      event_begin_array, event_end_array, TOML_CHECK_ALL
+    };
+    char *source =
+      "title = \"a\\tb\"\n[server.web]\nports = [ [ 80, 81 ], [] ]\n"
+      "[[host]]\nup = true # on\nsince = 1979-05-27T07:32:00Z\n";
+    ok( TOML_parseEvents( source, &callbacks, events, NULL ) == 0 );
+    is(
+      events,
+      "title=a\tb [server.web] ports=< < 80 81 > < > > "
+      "[[host]] up=true since=1979-05-27T07:32:00Z "
+    );
+
+    FILE *file = fopen( "test-events.toml", "w" );
+    fputs( source, file );
+    fclose( file );
+    char loaded[ 512 ] = "";
+    ok( TOML_loadEvents( "test-events.toml", &callbacks, loaded, NULL ) == 0 );
+    is( loaded, events );
+    remove( "test-events.toml" );
+
+    TOMLError *error = TOML_allocError( 0 );
+    events[ 0 ] = 0;
+    ok(
+      TOML_parseEvents( "a = 1\nb 2\n", &callbacks, events, error ) ==
+        TOML_ERROR_NO_EQ
+    );
+    ok( error->lineNo == 1 );
+    is( events, "a=1 " );
+    TOML_free( error );
+
+    events[ 0 ] = 0;
+    ok(
+      TOML_parseEvents( "a = 1\nstop = 2\nb = 3\n", &callbacks, events, NULL )
+        == 7
+    );
+    is( events, "a=1 stop=", "nothing after the callback that stopped" );
+
+    char *repeated = "a = 1\na = [ 1, \"b\" ]\n[[t]]\nc = 1\n[[t]]\nc = 2\n";
+    callbacks.checks = 0;
+    ok( TOML_parseEvents( repeated, &callbacks, events, NULL ) == 0 );
+    callbacks.checks = TOML_CHECK_ARRAY_TYPES;
+    ok(
+      TOML_parseEvents( repeated, &callbacks, events, NULL ) ==
+        TOML_ERROR_ARRAY_MEMBER_MISMATCH
+    );
+    callbacks.checks = TOML_CHECK_DUPLICATES;
+    ok(
+      TOML_parseEvents( repeated, &callbacks, events, NULL ) ==
+        TOML_ERROR_ENTRY_DEFINED
+    );
+    ok(
+      TOML_parseEvents( "[a.b]\n[a]\n", &callbacks, events, NULL ) ==
+        TOML_ERROR_TABLE_DEFINED
+    );
+  }
+
+  { /** read_events **/
+    note( "read_events" );
+    char *source =
+      "[server]\nports = [ [ 80 ], [ 81 ] ]\nname = \"web\"\n"
+      "[[db]]\nname = \"main\"\n";
+    TOMLReader reader;
+    TOMLReadEvent event;
+    char events[ 512 ] = "";
+    TOMLReader_initBuffer( &reader, source, TOML_CHECK_ALL, NULL );
+    while ( TOMLReader_next( &reader, &event ) ) {
+      read_event( events, &event );
+    }
+    ok( TOMLReader_finish( &reader ) == 0 );
+    is( events, "[server] ports=< < 80 > < 81 > > name=web [[db]] name=main " );
+    ok( event.line == 4 );
+
+    events[ 0 ] = 0;
+    TOMLReader_initBuffer( &reader, source, TOML_CHECK_ALL, NULL );
+    while ( TOMLReader_next( &reader, &event ) ) {
+      read_event( events, &event );
+      if ( event.type == TOML_READ_KEY && strcmp( event.name, "ports" ) == 0 ) {
+        TOMLReader_skipValue( &reader );
+      }
+    }
+    ok( TOMLReader_finish( &reader ) == 0 );
+    is( events, "[server] ports=name=web [[db]] name=main " );
+
+    events[ 0 ] = 0;
+    int arrays = 0;
+    TOMLReader_initBuffer( &reader, source, TOML_CHECK_ALL, NULL );
+    while ( TOMLReader_next( &reader, &event ) ) {
+      read_event( events, &event );
+      if ( event.type == TOML_READ_BEGIN_ARRAY && ++arrays == 2 ) {
+        TOMLReader_skipValue( &reader );
+      }
+    }
+    ok( TOMLReader_finish( &reader ) == 0 );
+    is(
+      events, "[server] ports=< < < 81 > > name=web [[db]] name=main ",
+      "skipping inside an array skips the rest of it"
+    );
+
+    events[ 0 ] = 0;
+    TOMLReader_initBuffer( &reader, source, TOML_CHECK_ALL, NULL );
+    while ( TOMLReader_next( &reader, &event ) ) {
+      read_event( events, &event );
+      if ( event.type == TOML_READ_TABLE ) {
+        TOMLReader_skipTable( &reader );
+      }
+    }
+    ok( TOMLReader_finish( &reader ) == 0 );
+    is( events, "[server] [[db]] name=main " );
+
+    int fds[ 2 ];
+    pipe( fds );
+    write( fds[ 1 ], source, strlen( source ) );
+    close( fds[ 1 ] );
+    events[ 0 ] = 0;
+    TOMLReader_initFd( &reader, fds[ 0 ], 0, NULL );
+    while (
+      TOMLReader_next( &reader, &event ) && event.type != TOML_READ_VALUE
+    ) {
+      read_event( events, &event );
+    }
+    ok( TOMLReader_finish( &reader ) == 0, "stopping early is not an error" );
+    is( events, "[server] ports=< < " );
+    close( fds[ 0 ] );
+
+    TOMLError *error = TOML_allocError( 0 );
+    TOMLReader_initBuffer( &reader, "a = 1\nb 2\nc = 3\n", 0, error );
+    while ( TOMLReader_next( &reader, &event ) ) {}
+    ok( TOMLReader_finish( &reader ) == TOML_ERROR_NO_EQ );
+    ok( error->lineNo == 1 );
+    TOML_free( error );
+
+    TOMLReader_initBuffer( &reader, "a = [ 1, [ 2 ]\n", 0, NULL );
+    TOMLReader_next( &reader, &event );
+    TOMLReader_skipValue( &reader );
+    ok( TOMLReader_next( &reader, &event ) == 0 );
+    ok( TOMLReader_finish( &reader ) == TOML_ERROR_NO_VALUE );
+  }
+
+  { /** bind **/
+    note( "bind" );
+    struct server {
+      int port;
+      double load;
+      int up;
+      char name[ 8 ];
+      time_t since;
+    } server = { 0, 0, 0, "", 0 };
+    TOMLBinding bindings[] = {
+      { "server.port", TOML_BIND_INT, offsetof( struct server, port ),
+        TOML_BIND_REQUIRED },
+      { "server.load", TOML_BIND_DOUBLE, offsetof( struct server, load ) },
+      { "up", TOML_BIND_BOOLEAN, offsetof( struct server, up ) },
+      { "server.name", TOML_BIND_STRING, offsetof( struct server, name ), 0,
+        sizeof(server.name) },
+      { "server.since", TOML_BIND_DATE, offsetof( struct server, since ) },
+      { NULL }
+    };
+    TOMLBindSpec *spec = TOML_allocBindSpec( bindings );
+    ok( spec->count == 5 );
+
+    char *source =
+      "up = true\n[[host]]\nport = \"a\"\n[server]\nports = [ [ 1 ], [ 2 ] ]\n"
+      "port = 8080\nload = 2\nname = \"frontend\"\n"
+      "since = 1979-05-27T07:32:00Z\n";
+    ok( TOML_bind( source, spec, &server, NULL ) == 0 );
+    ok( server.port == 8080 );
+    ok( server.load == 2.0, "integers bind to doubles" );
+    ok( server.up == 1 );
+    is( server.name, "fronten", "strings are cut short to fit" );
+    TOMLDate *date = TOML_allocDate( 1979, 5, 27, 7, 32, 0 );
+    ok( server.since == date->sinceEpoch );
+    TOML_free( date );
+
+    TOMLError *error = TOML_allocError( 0 );
+    ok(
+      TOML_bind( "[server]\nport = 1.5\n", spec, &server, error ) ==
+        TOML_ERROR_BIND_TYPE
+    );
+    ok( error->lineNo == 1 );
+    ok( server.port == 8080, "a mismatched value is not stored" );
+    TOML_free( error );
+
+    error = TOML_allocError( 0 );
+    ok(
+      TOML_bind( "[server]\nload = 1\n", spec, &server, error ) ==
+        TOML_ERROR_BIND_MISSING
+    );
+    is( error->fullDescription, "Missing required value.: server.port" );
+    TOML_free( error );
+
+    ok(
+      TOML_bind( "[server]\nport = [ 1 ]\n", spec, &server, NULL ) ==
+        TOML_ERROR_BIND_TYPE
+    );
+    ok(
+      TOML_bind( "[server]\nport 1\n", spec, &server, NULL ) ==
+        TOML_ERROR_NO_EQ
+    );
+    TOML_freeBindSpec( spec );
+  }
+
   note( "\n** errors **" );
 
+  { /** load_long_line **/
+    note( "load_long_line" );
+    FILE *file = fopen( "test-long.toml", "w" );
+    fputs( "array = [ 0", file );
+    for ( int i = 1; i < 5000; ++i ) {
+      fprintf( file, ", %d", i );
+    }
+    fputs( " ]\nafter = \"end\"\n", file );
+    fclose( file );
+
+    TOMLTable *table = NULL;
+    ok( TOML_load( "test-long.toml", &table, NULL ) == 0 );
+    TOMLArray *array = TOML_find( table, "array", NULL );
+    ok( array && array->size == 5000 );
+    ok( TOML_toInt( TOML_find( table, "array", "4999", NULL ) ) == 4999 );
+    is( ((TOMLString *) TOML_find( table, "after", NULL ))->content, "end" );
+    remove( "test-long.toml" );
+    TOML_free( table );
+  }
+
   { /** parse_incomplete_string **/
     note( "parse_incomplete_string" );
     TOMLTable *table = NULL;
@@ -265,6 +863,33 @@ int main() {
     TOML_free( error );
   }
 
+  { /** parse_deep_header **/
+    note( "parse_deep_header" );
+    char *buffer = malloc( ( TOML_MAX_DEPTH + 1 ) * 2 + 16 );
+    char *end = buffer + sprintf( buffer, "[[a" );
+    for ( int i = 1; i < TOML_MAX_DEPTH; ++i ) {
+      end += sprintf( end, ".a" );
+    }
+    strcpy( end, "]]" );
+    TOMLTable *table = NULL;
+    ok( TOML_parse( buffer, &table, NULL ) == 0, "header at the limit parses" );
+    TOML_free( table );
+    table = NULL;
+
+    TOMLError *error = TOML_allocError( TOML_SUCCESS );
+    strcpy( end, ".a]]" );
+    ok( TOML_parse( buffer, &table, error ) == TOML_ERROR_TOO_DEEP );
+    ok( table == NULL );
+    TOML_free( error );
+
+    error = TOML_allocError( TOML_SUCCESS );
+    strcpy( end, ".a]" );
+    ok( TOML_parse( buffer + 1, &table, error ) == TOML_ERROR_TOO_DEEP );
+    ok( error->code == TOML_ERROR_TOO_DEEP );
+    TOML_free( error );
+    free( buffer );
+  }
+
   note( "\n** stringify **" );
 
   { /** stringify_string **/
@@ -311,6 +936,114 @@ int main() {
     TOML_free( table );
   }
 
+  { /** stringify_numbers **/
+    note( "stringify_numbers" );
+    TOMLTable *table = NULL;
+    TOML_parse(
+      "a = [ -2147483648, 0, 2147483647 ]\n"
+      "b = [ 0.1, -2.5, 100.0, 0.000001234, 123456789012345680000.0 ]",
+      &table, NULL
+    );
+    char *buffer;
+    TOML_stringify( &buffer, table, NULL );
+    is(
+      buffer,
+      "a = [ -2147483648, 0, 2147483647 ]\n"
+      "b = [ 0.1, -2.5, 100.0, 0.000001234, 123456789012345680000.0 ]\n"
+    );
+    free( buffer );
+    TOML_free( table );
+
+    int roundTrips = 1;
+    for ( int i = 1; i < 2000; ++i ) {
+      double value = i / 7.0 * ( i % 2 ? 1e-9 : 1e9 );
+      TOMLTable *numbers = TOML_allocTable(
+        TOML_allocString( "x" ), TOML_allocDouble( value ), NULL
+      );
+      TOMLTable *parsed = NULL;
+      TOML_stringify( &buffer, numbers, NULL );
+      TOML_parse( buffer, &parsed, NULL );
+      TOMLNumber *number = TOML_find( parsed, "x", NULL );
+      roundTrips = roundTrips && number->doubleValue == value;
+      free( buffer );
+      TOML_free( parsed );
+      TOML_free( numbers );
+    }
+    ok( roundTrips, "doubles round trip" );
+  }
+
+  { /** stringify_not_finite **/
+    note( "stringify_not_finite" );
+    double values[] = { NAN, INFINITY, -INFINITY };
+    for ( int i = 0; i < 3; ++i ) {
+      TOMLTable *table = TOML_allocTable(
+        TOML_allocString( "x" ), TOML_allocDouble( values[ i ] ), NULL
+      );
+      TOMLError *error = TOML_allocError( TOML_SUCCESS );
+      char *buffer = "";
+      ok(
+        TOML_stringify( &buffer, table, error ) == TOML_ERROR_NOT_FINITE &&
+          buffer == NULL && error->code == TOML_ERROR_NOT_FINITE,
+        "stringify fails for %f", values[ i ]
+      );
+      ok( TOML_stringifySize( table ) == -1 );
+      TOML_free( error );
+      TOML_free( table );
+    }
+
+    TOMLTable *parsed = NULL;
+    ok( TOML_parse( "x = nan", &parsed, NULL ) != TOML_SUCCESS );
+    ok( TOML_parse( "x = inf", &parsed, NULL ) != TOML_SUCCESS );
+
+    // The largest finite doubles still write and read back.
+    TOMLTable *largest = TOML_allocTable(
+      TOML_allocString( "x" ), TOML_allocDouble( -DBL_MAX ), NULL
+    );
+    char *buffer;
+    ok( TOML_stringify( &buffer, largest, NULL ) == TOML_SUCCESS );
+    ok(
+      TOML_parse( buffer, &parsed, NULL ) == TOML_SUCCESS &&
+        TOML_equal( parsed, largest ),
+      "-DBL_MAX round trips"
+    );
+    free( buffer );
+    TOML_free( parsed );
+    TOML_free( largest );
+
+    int count = 0;
+    TOMLWriter writer;
+    TOMLWriter_initCallback( &writer, write_count, &count );
+    TOMLEmitter emitter;
+    TOMLEmitter_init( &emitter, &writer );
+    TOMLEmitter_key( &emitter, "x" );
+    TOMLEmitter_double( &emitter, NAN );
+    ok(
+      TOMLEmitter_finish( &emitter ) == TOML_ERROR_NOT_FINITE,
+      "emitter refuses nan"
+    );
+
+    TOMLTable *table = TOML_allocTable( NULL, NULL );
+    for ( int i = 0; i < 1000; ++i ) {
+      char name[ 16 ];
+      sprintf( name, "t%d", i );
+      TOMLTable_setKey( table, name, TOML_allocTable(
+        TOML_allocString( "x" ), TOML_allocDouble( i == 700 ? INFINITY : i ),
+        NULL
+      ) );
+    }
+    count = 0;
+    TOMLWriter_initCallback( &writer, write_count, &count );
+    ok(
+      TOML_writeParallel( &writer, table, 4, NULL ) == TOML_ERROR_NOT_FINITE &&
+        count == 0,
+      "parallel writes fail before any output"
+    );
+    TOMLWriter_initCallback( &writer, write_count, &count );
+    ok( TOML_writeCached( &writer, table, NULL ) == TOML_ERROR_NOT_FINITE );
+    ok( TOML_writeCached( &writer, table, NULL ) == TOML_ERROR_NOT_FINITE );
+    TOML_free( table );
+  }
+
   { /** stringify_table_simple **/
     note( "stringify_table_simple" );
     TOMLTable *table = NULL;
@@ -370,6 +1103,360 @@ int main() {
     TOML_free( table );
   }
 
+  { /** write_callback **/
+    note( "write_callback" );
+    TOMLTable *table = TOML_allocTable( NULL, NULL );
+    for ( int i = 0; i < 2000; ++i ) {
+      char key[16];
+      sprintf( key, "key%d", i );
+      TOMLTable_setKey( table, key, TOML_allocInt( i ) );
+    }
+    char *buffer;
+    TOML_stringify( &buffer, table, NULL );
+    int written = 0;
+    TOMLWriter writer;
+    TOMLWriter_initCallback( &writer, write_count, &written );
+    ok( TOML_write( &writer, table, NULL ) == TOML_SUCCESS );
+    ok( written == strlen( buffer ), "writer saw every byte" );
+    free( buffer );
+    TOML_free( table );
+  }
+
+  { /** write_parallel **/
+    note( "write_parallel" );
+    TOMLTable *table = TOML_allocTable( NULL, NULL );
+    for ( int i = 0; i < 300; ++i ) {
+      char key[ 16 ];
+      sprintf( key, "empty%d", i );
+      TOMLTable_setKey( table, key, TOML_allocTable( NULL, NULL ) );
+    }
+    TOMLArray *services = TOML_allocArray( TOML_TABLE, NULL );
+    for ( int i = 0; i < 3000; ++i ) {
+      TOMLTable *service = TOML_allocTable(
+        TOML_allocString( "port" ), TOML_allocInt( i ),
+        TOML_allocString( "limits" ), TOML_allocTable(
+          TOML_allocString( "cpu" ), TOML_allocDouble( i / 8.0 ),
+          NULL
+        ),
+        NULL
+      );
+      TOMLArray_append( services, service );
+    }
+    TOMLTable_setKey( table, "service", services );
+
+    char *expected;
+    TOML_stringify( &expected, table, NULL );
+    char *buffer = malloc( strlen( expected ) + 1 );
+    char *end = buffer;
+    TOMLWriter writer;
+    TOMLWriter_initCallback( &writer, write_string, &end );
+    ok( TOML_writeParallel( &writer, table, 4, NULL ) == TOML_SUCCESS );
+    is( buffer, expected, "parallel output matches" );
+    free( buffer );
+    free( expected );
+    TOML_free( table );
+  }
+
+  { /** stringify_iov **/
+    note( "stringify_iov" );
+    TOMLTable *table = NULL;
+    TOML_parse(
+      "[[entry]]\ntext = \"a string long enough to point at\"\nn = 1.5\n"
+        "[[entry]]\ntext = \"escaped \\\"quotes\\\" are copied\"\n",
+      &table, NULL
+    );
+    TOMLString *text = TOML_find( table, "entry", "0", "text", NULL );
+    char *expected;
+    TOML_stringify( &expected, table, NULL );
+    char *buffer = malloc( strlen( expected ) + 1 );
+    struct iov_collect collect = { buffer, text->content, 0 };
+    ok( TOML_stringifyIov( table, iov_collect, &collect, NULL ) == 0 );
+    is( buffer, expected, "iov output matches" );
+    ok( collect.pointedAt, "string content is not copied" );
+    free( buffer );
+    free( expected );
+    TOML_free( table );
+  }
+
+  { /** to_json **/
+    note( "to_json" );
+    TOMLTable *table = NULL;
+    TOML_parse(
+      "when = 2013-12-20T14:30:00Z\n"
+        "[server]\nname = \"a \\\"b\\\"\\u0001\"\nports = [ 80, 443 ]\n"
+        "[[user]]\nratio = 0.5\nadmin = true\n[[user]]",
+      &table, NULL
+    );
+    char buffer[ 256 ];
+    char *end = buffer;
+    TOMLWriter writer;
+    TOMLWriter_initCallback( &writer, write_string, &end );
+    ok( TOML_toJSON( &writer, table, 0, NULL ) == TOML_SUCCESS );
+    is(
+      buffer,
+      "{\"when\":\"2013-12-20T14:30:00Z\","
+        "\"server\":{\"name\":\"a \\\"b\\\"\\u0001\",\"ports\":[80,443]},"
+        "\"user\":[{\"ratio\":0.5,\"admin\":true},{}]}"
+    );
+
+    TOMLArray *ports = TOML_find( table, "server", "ports", NULL );
+    end = buffer;
+    TOMLWriter_initCallback( &writer, write_string, &end );
+    TOML_toJSON( &writer, ports, 1, NULL );
+    is( buffer, "[\n  80,\n  443\n]" );
+    TOML_free( table );
+  }
+
+  { /** write_cached **/
+    note( "write_cached" );
+    TOMLTable *table = NULL;
+    TOML_parse(
+      "title = \"cached\"\n[server]\nport = 80\nhosts = [ \"a\", \"b\" ]\n"
+        "[client]\nname = \"x\"\n[[user]]\nid = 1\n[[user]]\nid = 2",
+      &table, NULL
+    );
+    char buffer[ 512 ];
+    char *end = buffer;
+    TOMLWriter writer;
+    TOMLWriter_initCallback( &writer, write_string, &end );
+    TOML_writeCached( &writer, table, NULL );
+    char *expected;
+    TOML_stringify( &expected, table, NULL );
+    is( buffer, expected );
+    free( expected );
+
+    TOMLTable *client = TOML_find( table, "client", NULL );
+    struct _TOMLTableText *clientText = client->text;
+    TOMLTable_setKey(
+      TOML_find( table, "server", NULL ), "port", TOML_allocInt( 8080 )
+    );
+
+    end = buffer;
+    TOMLWriter_initCallback( &writer, write_string, &end );
+    TOML_writeCached( &writer, table, NULL );
+    TOML_stringify( &expected, table, NULL );
+    is( buffer, expected, "changed table is written again" );
+    ok(
+      clientText != NULL && client->text == clientText,
+      "unchanged text is kept"
+    );
+    free( expected );
+
+    // The changes below are not touched, the setters clear what they affect.
+    TOMLArray *hosts = TOML_find( table, "server", "hosts", NULL );
+    TOMLArray_setIndex( hosts, 0, TOML_allocString( "c" ) );
+    TOMLArray_append( hosts, TOML_allocString( "d" ) );
+    end = buffer;
+    TOMLWriter_initCallback( &writer, write_string, &end );
+    TOML_writeCached( &writer, table, NULL );
+    TOML_stringify( &expected, table, NULL );
+    is( buffer, expected, "inline array changes are written" );
+    ok( strstr( buffer, "\"c\", \"b\", \"d\"" ) != NULL );
+    ok( client->text == clientText );
+    free( expected );
+    TOML_free( table );
+  }
+
+  { /** emitter **/
+    note( "emitter" );
+    char buffer[ 512 ];
+    char *end = buffer;
+    TOMLWriter writer;
+    TOMLWriter_initCallback( &writer, write_string, &end );
+    TOMLEmitter emitter;
+    TOMLEmitter_init( &emitter, &writer );
+    TOMLEmitter_key( &emitter, "title" );
+    TOMLEmitter_string( &emitter, "hosts \"all\"" );
+    for ( int i = 0; i < 2; ++i ) {
+      TOMLEmitter_beginArrayTable( &emitter, "host" );
+      TOMLEmitter_key( &emitter, "id" );
+      TOMLEmitter_int( &emitter, i );
+      TOMLEmitter_key( &emitter, "load" );
+      TOMLEmitter_beginArray( &emitter );
+      TOMLEmitter_double( &emitter, 0.5 );
+      TOMLEmitter_double( &emitter, i );
+      TOMLEmitter_endArray( &emitter );
+    }
+    TOMLEmitter_beginTable( &emitter, "owner" );
+    TOMLEmitter_key( &emitter, "active" );
+    TOMLEmitter_boolean( &emitter, 1 );
+    ok( TOMLEmitter_finish( &emitter ) == TOML_SUCCESS );
+
+    TOMLTable *table = NULL;
+    TOML_parse( buffer, &table, NULL );
+    char *expected;
+    TOML_stringify( &expected, table, NULL );
+    is( buffer, expected, "emitted like stringify" );
+    free( expected );
+    TOML_free( table );
+
+    end = buffer;
+    TOMLWriter_initCallback( &writer, write_string, &end );
+    TOMLEmitter_init( &emitter, &writer );
+    TOMLEmitter_key( &emitter, "mixed" );
+    TOMLEmitter_beginArray( &emitter );
+    TOMLEmitter_int( &emitter, 1 );
+    TOMLEmitter_string( &emitter, "two" );
+    TOMLEmitter_endArray( &emitter );
+    ok(
+      TOMLEmitter_finish( &emitter ) == TOML_ERROR_ARRAY_MEMBER_MISMATCH,
+      "mixed arrays fail"
+    );
+
+    end = buffer;
+    TOMLWriter_initCallback( &writer, write_string, &end );
+    TOMLEmitter_init( &emitter, &writer );
+    TOMLEmitter_key( &emitter, "dangling" );
+    ok(
+      TOMLEmitter_finish( &emitter ) == TOML_ERROR_NO_VALUE,
+      "keys need values"
+    );
+
+    char *keys[] = { "a b", "1st", "x = 1\ny", "true", "", "a.b", NULL };
+    for ( int i = 0; keys[ i ]; ++i ) {
+      end = buffer;
+      *end = 0;
+      TOMLWriter_initCallback( &writer, write_string, &end );
+      TOMLEmitter_init( &emitter, &writer );
+      TOMLEmitter_key( &emitter, keys[ i ] );
+      TOMLEmitter_int( &emitter, 1 );
+      ok(
+        TOMLEmitter_finish( &emitter ) == TOML_ERROR_INVALID_KEY &&
+          buffer[ 0 ] == 0,
+        "key \"%s\" is rejected unwritten", keys[ i ]
+      );
+    }
+
+    char *paths[] = { "a..b", "a.", "a]\nb = 1\n[c", "a.false", NULL };
+    for ( int i = 0; paths[ i ]; ++i ) {
+      end = buffer;
+      *end = 0;
+      TOMLWriter_initCallback( &writer, write_string, &end );
+      TOMLEmitter_init( &emitter, &writer );
+      TOMLEmitter_beginArrayTable( &emitter, paths[ i ] );
+      ok(
+        TOMLEmitter_finish( &emitter ) == TOML_ERROR_INVALID_KEY &&
+          buffer[ 0 ] == 0,
+        "header \"%s\" is rejected unwritten", paths[ i ]
+      );
+    }
+
+    end = buffer;
+    TOMLWriter_initCallback( &writer, write_string, &end );
+    TOMLEmitter_init( &emitter, &writer );
+    TOMLEmitter_beginTable( &emitter, "_a.B_2" );
+    TOMLEmitter_key( &emitter, "trueish" );
+    TOMLEmitter_int( &emitter, 1 );
+    ok( TOMLEmitter_finish( &emitter ) == TOML_SUCCESS );
+    is( buffer, "[_a.B_2]\ntrueish = 1\n" );
+  }
+
+  { /** stringify_to **/
+    note( "stringify_to" );
+    TOMLTable *table = NULL;
+    TOML_parse( "a = 1\n[table]\nchairs = 4", &table, NULL );
+    char *expected;
+    TOML_stringify( &expected, table, NULL );
+    int size = TOML_stringifySize( table );
+    ok( size == strlen( expected ), "size matches stringify" );
+
+    char small[ 8 ];
+    ok( TOML_stringifyTo( small, 8, table ) == size, "returns full size" );
+    ok( strncmp( small, expected, 7 ) == 0 && small[ 7 ] == 0 );
+
+    char *exact = malloc( size + 1 );
+    ok( TOML_stringifyTo( exact, size + 1, table ) == size );
+    is( exact, expected );
+    free( exact );
+    free( expected );
+    TOML_free( table );
+
+    // Large enough to grow the string a few times.
+    char *content = malloc( 20001 );
+    memset( content, 'x', 20000 );
+    content[ 20000 ] = 0;
+    TOMLString *big = TOML_allocString( content );
+    TOMLError *error = TOML_allocError( TOML_SUCCESS );
+    ok( TOML_stringify( &expected, big, error ) == TOML_SUCCESS );
+    ok( error->code == TOML_SUCCESS );
+    is( expected, content, "grows the string in one pass" );
+    free( expected );
+    free( content );
+    TOML_free( error );
+    TOML_free( big );
+  }
+
+  { /** dump **/
+    note( "dump" );
+    TOMLTable *table = NULL;
+    TOML_parse( "[table]\nchairs = 4", &table, NULL );
+    ok( TOML_dump( "test-dump.toml", table, NULL ) == TOML_SUCCESS );
+    TOMLTable *loaded = NULL;
+    ok( TOML_load( "test-dump.toml", &loaded, NULL ) == TOML_SUCCESS );
+    ok( TOML_equal( table, loaded ), "dump loads back" );
+    remove( "test-dump.toml" );
+
+    // A date cut by the end of TOML_load's first read.
+    FILE *file = fopen( "test-dump.toml", "w" );
+    fprintf( file, "# %01007d\nd = 2008-03-15T14:38:26Z\n", 0 );
+    fclose( file );
+    TOML_free( loaded );
+    loaded = NULL;
+    ok( TOML_load( "test-dump.toml", &loaded, NULL ) == TOML_SUCCESS );
+    remove( "test-dump.toml" );
+
+    TOMLError *error = TOML_allocError( TOML_SUCCESS );
+    ok( TOML_dump( "missing/test-dump.toml", table, error ) != 0 );
+    ok( error->code == TOML_ERROR_FILEIO );
+    TOML_free( error );
+    TOML_free( loaded );
+    TOML_free( table );
+  }
+
+  { /** edit_set **/
+    note( "edit_set" );
+    TOMLDocument *doc = NULL;
+    ok( TOML_parseDocument(
+      "# settings\ntitle = \"old\" # keep\n\n"
+      "[server]\nports = [ 80,\n  81 ] # web\n\n"
+      "[[host]]\nname = \"a\"\n[[host]]\nname = \"b\"",
+      &doc,
+      NULL
+    ) == TOML_SUCCESS );
+    TOMLArray *ports = TOML_allocArray( TOML_INT, TOML_allocInt( 8080 ), NULL );
+    ok( TOML_editSet( doc, "title", TOML_allocString( "new" ), NULL ) == 0 );
+    ok( TOML_editSet( doc, "server.ports", ports, NULL ) == 0 );
+    ok(
+      TOML_editSet( doc, "server.debug", TOML_allocBoolean( 1 ), NULL ) == 0
+    );
+    ok(
+      TOML_editSet( doc, "host.1.name", TOML_allocString( "c" ), NULL ) == 0
+    );
+    ok( TOML_editSet( doc, "owner.name", TOML_allocString( "d" ), NULL ) == 0 );
+    is(
+      doc->source,
+      "# settings\ntitle = \"new\" # keep\n\n"
+      "[server]\nports = [ 8080 ] # web\ndebug = true\n\n"
+      "[[host]]\nname = \"a\"\n[[host]]\nname = \"c\"\n"
+      "\n[owner]\nname = \"d\"\n"
+    );
+    TOMLSpan *span = TOML_findSpan( doc, "server.debug" );
+    is( doc->source + span->start, "true\n\n[[host]]\nname = \"a\"\n"
+      "[[host]]\nname = \"c\"\n\n[owner]\nname = \"d\"\n" );
+
+    TOMLTable *table = NULL;
+    TOML_parse( doc->source, &table, NULL );
+    ok( TOML_equal( doc->table, table ), "edited table matches its source" );
+    TOML_free( table );
+
+    TOMLError *error = TOML_allocError( TOML_SUCCESS );
+    ok( TOML_editSet( doc, "server", TOML_allocInt( 1 ), error ) != 0 );
+    ok( error->code == TOML_ERROR_TABLE_DEFINED );
+    ok( TOML_editSet( doc, "host.5.name", TOML_allocInt( 1 ), NULL ) != 0 );
+    TOML_free( error );
+    TOML_freeDocument( doc );
+  }
+
   note( "** unicode **" );
 
   { /** parse_utf8 **/
@@ -394,5 +1481,384 @@ int main() {
     TOML_free( table );
   }
 
+  { /** stringify_utf8_long **/
+    note( "stringify_utf8_long" );
+    TOMLTable *table = TOML_allocTable(
+      TOML_allocString( "text" ),
+      TOML_allocString(
+        "a long run of plain text before \xf0\x9f\x98\x80 and a \"quote\" "
+          "then \xc3\xa9 after more plain text\n"
+      ),
+      NULL
+    );
+    char *buffer;
+    TOML_stringify( &buffer, table, NULL );
+    is(
+      buffer,
+      "text = \"a long run of plain text before \xf0\x9f\x98\x80 and a "
+        "\\\"quote\\\" then \\u00e9 after more plain text\\n\"\n"
+    );
+    TOMLTable *parsed = NULL;
+    TOML_parse( buffer, &parsed, NULL );
+    ok( TOML_equal( table, parsed ), "four byte sequences round trip" );
+    free( buffer );
+    TOML_free( parsed );
+    TOML_free( table );
+  }
+
+  { /** stringify_utf8_invalid **/
+    note( "stringify_utf8_invalid" );
+    char *invalid[] = {
+      "\xf0\"\nadmin = true\n#",
+      "a\xc3" "bcd",
+      "\xe2\x98",
+      "\xed\xa0\x80",
+      "\xc0\xaf\\",
+      "\xf4\x90\x80\x80\x01",
+      "\xe2\x98\"\xf0\x9f\x98"
+    };
+    int count = sizeof(invalid) / sizeof(invalid[ 0 ]);
+    for ( int i = 0; i < count; ++i ) {
+      TOMLTable *table = TOML_allocTable(
+        TOML_allocString( "s" ), TOML_allocString( invalid[ i ] ), NULL
+      );
+      char *buffer;
+      TOML_stringify( &buffer, table, NULL );
+      TOMLTable *parsed = NULL;
+      TOML_parse( buffer, &parsed, NULL );
+      ok(
+        parsed && TOML_equal( table, parsed ) && parsed->keys->size == 1,
+        "invalid sequence %d round trips", i
+      );
+      free( buffer );
+      TOML_free( parsed );
+      TOML_free( table );
+    }
+
+    TOMLTable *table = TOML_allocTable(
+      TOML_allocString( "s" ), TOML_allocString( "a\xc3" "bcd\xe9" ), NULL
+    );
+    char *buffer;
+    TOML_stringify( &buffer, table, NULL );
+    is( buffer, "s = \"a\xc3" "bcd\xe9\"\n", "invalid bytes are copied alone" );
+    free( buffer );
+    char json[ 64 ];
+    char *end = json;
+    TOMLWriter writer;
+    TOMLWriter_initCallback( &writer, write_string, &end );
+    TOML_toJSON( &writer, table, 0, NULL );
+    is(
+      json, "{\"s\":\"a\\ufffdbcd\\ufffd\"}",
+      "JSON gets replacement characters"
+    );
+    TOML_free( table );
+  }
+
+  { /** copy_on_write **/
+    note( "copy_on_write" );
+    TOMLTable *base = NULL;
+    TOML_parse( "[server]\nport = 80\n[client]\nname = \"x\"", &base, NULL );
+    TOMLTable *variant = TOML_copy( base );
+    ok( variant == base, "copy shares the tree" );
+    TOMLTable_setKey(
+      TOML_findMutable( (TOMLRef *) &variant, "server", NULL ),
+      "port",
+      TOML_allocInt( 8080 )
+    );
+    ok( variant != base, "change copied the root" );
+    ok( TOML_toInt( TOML_find( base, "server", "port", NULL ) ) == 80 );
+    ok( TOML_toInt( TOML_find( variant, "server", "port", NULL ) ) == 8080 );
+    ok(
+      TOML_find( variant, "client", NULL ) == TOML_find( base, "client", NULL ),
+      "untouched table still shared"
+    );
+    TOML_free( base );
+    is(
+      ((TOMLString *) TOML_find( variant, "client", "name", NULL ))->content,
+      "x"
+    );
+    TOML_free( variant );
+  }
+
+  { /** copy_then_mutate **/
+    note( "copy_then_mutate" );
+    TOMLTable *base = NULL;
+    TOML_parse( "port = 80\nhosts = [ \"a\" ]", &base, NULL );
+    TOMLTable *variant = TOML_copy( base );
+    ok(
+      TOMLTable_setKey( variant, "port", TOML_allocInt( 8080 ) ) ==
+        TOML_ERROR_SHARED,
+      "setKey refuses a shared table"
+    );
+
+    TOMLArray *hosts = TOML_copy( TOML_find( base, "hosts", NULL ) );
+    ok(
+      TOMLArray_append( hosts, TOML_allocString( "b" ) ) == TOML_ERROR_SHARED
+    );
+    ok(
+      TOMLArray_setIndex( hosts, 0, TOML_allocString( "b" ) ) ==
+        TOML_ERROR_SHARED
+    );
+    TOML_free( hosts );
+
+    TOMLError *error = TOML_allocError( TOML_SUCCESS );
+    ok(
+      TOML_reparse( variant, "port = 80", "port = 81", error ) ==
+        TOML_ERROR_SHARED,
+      "reparse refuses a shared table"
+    );
+    ok( error->code == TOML_ERROR_SHARED );
+    TOML_free( error );
+    ok( TOML_toInt( TOML_find( base, "port", NULL ) ) == 80, "base unchanged" );
+    ok( ((TOMLArray *) TOML_find( base, "hosts", NULL ))->size == 1 );
+
+    ok(
+      TOMLTable_setKey(
+        TOML_findMutable( (TOMLRef *) &variant, NULL ),
+        "port",
+        TOML_allocInt( 8080 )
+      ) == TOML_SUCCESS,
+      "setKey after findMutable"
+    );
+    ok( TOML_toInt( TOML_find( base, "port", NULL ) ) == 80, "base unchanged" );
+    ok( TOML_toInt( TOML_find( variant, "port", NULL ) ) == 8080 );
+    TOML_free( base );
+    TOML_free( variant );
+  }
+
+  { /** copy_then_mutate_nested **/
+    note( "copy_then_mutate_nested" );
+    TOMLTable *base = NULL;
+    TOML_parse(
+      "[server]\nport = 80\nhosts = [ [ \"a\" ] ]\n[client]\nname = \"x\"",
+      &base, NULL
+    );
+    TOMLTable *variant = TOML_copy( base );
+    ok(
+      TOMLTable_setKey(
+        TOML_find( variant, "server", NULL ), "port", TOML_allocInt( 8080 )
+      ) == TOML_ERROR_SHARED,
+      "tables inside a shared root are shared"
+    );
+    ok(
+      TOMLArray_append(
+        TOML_find( variant, "server", "hosts", "0", NULL ),
+        TOML_allocString( "b" )
+      ) == TOML_ERROR_SHARED,
+      "arrays inside a shared root are shared"
+    );
+
+    ok(
+      TOMLTable_setKey(
+        TOML_findMutable( (TOMLRef *) &variant, "server", NULL ),
+        "port",
+        TOML_allocInt( 8080 )
+      ) == TOML_SUCCESS
+    );
+    ok(
+      TOMLArray_append(
+        TOML_findMutable( (TOMLRef *) &variant, "server", "hosts", "0", NULL ),
+        TOML_allocString( "b" )
+      ) == TOML_SUCCESS
+    );
+    TOMLArray *hosts = TOML_find( base, "server", "hosts", "0", NULL );
+    ok( TOML_toInt( TOML_find( base, "server", "port", NULL ) ) == 80 );
+    ok( hosts->size == 1, "base unchanged" );
+    hosts = TOML_find( variant, "server", "hosts", "0", NULL );
+    ok( TOML_toInt( TOML_find( variant, "server", "port", NULL ) ) == 8080 );
+    ok( hosts->size == 2 );
+
+    // The base still owns its tables alone and can change them in place.
+    ok(
+      TOMLTable_setKey(
+        TOML_find( base, "server", NULL ), "port", TOML_allocInt( 81 )
+      ) == TOML_SUCCESS
+    );
+    ok( TOML_toInt( TOML_find( variant, "server", "port", NULL ) ) == 8080 );
+
+    // The client table was shared with the freed base, and is found again.
+    TOML_free( base );
+    ok(
+      TOMLTable_setKey(
+        TOML_find( variant, "client", NULL ), "name", TOML_allocString( "y" )
+      ) == TOML_ERROR_SHARED
+    );
+    ok(
+      TOMLTable_setKey(
+        TOML_findMutable( (TOMLRef *) &variant, "client", NULL ),
+        "name",
+        TOML_allocString( "y" )
+      ) == TOML_SUCCESS
+    );
+    ok(
+      TOMLTable_setKey(
+        TOML_find( variant, "client", NULL ), "id", TOML_allocInt( 1 )
+      ) == TOML_SUCCESS,
+      "found tables change in place"
+    );
+    TOML_free( variant );
+  }
+
+  note( "\n** hash **" );
+
+  { /** hash_equal **/
+    note( "hash_equal" );
+    TOMLTable *a = NULL;
+    TOMLTable *b = NULL;
+    TOML_parse( "a = 1\nb = [ \"x\", \"y\" ]\n[t]\nc = 1.5", &a, NULL );
+    TOML_parse( "b = [ \"x\", \"y\" ]\na = 1\n[t]\nc = 1.5", &b, NULL );
+    ok( TOML_hash( a ) == TOML_hash( b ), "key order does not change hash" );
+    ok( TOML_equal( a, b ) );
+    ok( TOML_hash( TOML_find( a, "b", NULL ) ) != TOML_hash( a ) );
+
+    TOMLTable_setKey( TOML_find( b, "t", NULL ), "c", TOML_allocDouble( 2.5 ) );
+    TOML_touch( b, "t", NULL );
+    ok( TOML_hash( a ) != TOML_hash( b ), "touch clears ancestor hash" );
+    ok( !TOML_equal( a, b ) );
+
+    // Changes through the setters clear the hashes above them untouched.
+    TOMLTable_setKey( TOML_find( b, "t", NULL ), "c", TOML_allocDouble( 1.5 ) );
+    ok( TOML_equal( a, b ), "setKey clears ancestor hashes" );
+    TOMLArray_setIndex( TOML_find( b, "b", NULL ), 1, TOML_allocString( "z" ) );
+    ok( !TOML_equal( a, b ), "setIndex clears ancestor hashes" );
+    TOMLArray_append( TOML_find( a, "b", NULL ), TOML_allocString( "z" ) );
+    TOMLArray_setIndex( TOML_find( a, "b", NULL ), 1, TOML_allocString( "z" ) );
+    TOMLArray_append( TOML_find( b, "b", NULL ), TOML_allocString( "z" ) );
+    ok( TOML_hash( a ) == TOML_hash( b ), "append clears ancestor hashes" );
+    ok( TOML_equal( a, b ) );
+    TOML_free( a );
+    TOML_free( b );
+  }
+
+  note( "\n** diff **" );
+
+  { /** diff_tables **/
+    note( "diff_tables" );
+    TOMLTable *before = NULL;
+    TOMLTable *after = NULL;
+    TOML_parse(
+      "a = 1\nb = \"x\"\n[t]\nc = [ 1 ]\n[[s]]\nn = 1\n[[s]]\nn = 2",
+      &before,
+      NULL
+    );
+    TOML_parse(
+      "a = 2\nd = 1\n[t]\nc = [ 1 ]\n[[s]]\nn = 1\n[[s]]\nn = 3\n[[s]]\nn = 4",
+      &after,
+      NULL
+    );
+    char buffer[256] = "";
+    ok( TOML_diff( before, after, diff_collect, buffer ) == 5 );
+    is( buffer, "~a -b ~s[1].n +s[2] +d " );
+    buffer[0] = 0;
+    ok( TOML_diff( before, before, diff_collect, buffer ) == 0 );
+    TOML_free( before );
+    TOML_free( after );
+  }
+
+  { /** diff_nested_set **/
+    note( "diff_nested_set" );
+    char *source = "[t]\nc = [ [ 1 ], [ 2 ] ]\n[t.u]\nd = 1";
+    TOMLTable *before = NULL;
+    TOMLTable *after = NULL;
+    TOML_parse( source, &before, NULL );
+    TOML_parse( source, &after, NULL );
+    // Cache every hash, then change nested values without touching the path.
+    ok( TOML_hash( before ) == TOML_hash( after ) );
+    TOMLTable_setKey(
+      TOML_find( after, "t", "u", NULL ), "d", TOML_allocInt( 2 )
+    );
+    TOMLArray_setIndex(
+      TOML_find( after, "t", "c", "1", NULL ), 0, TOML_allocInt( 3 )
+    );
+    char buffer[256] = "";
+    ok( TOML_diff( before, after, diff_collect, buffer ) == 2 );
+    is( buffer, "~t.c ~t.u.d " );
+    TOML_free( before );
+    TOML_free( after );
+  }
+
+  note( "\n** config **" );
+
+  { /** config_reload **/
+    note( "config_reload" );
+    TOMLConfigHandle *config = TOML_allocConfig( "test.toml", NULL );
+    ok( config != NULL );
+    TOMLTable *first = TOMLConfig_acquire( config );
+    ok( TOML_toInt( TOML_find( first, "player", "size", NULL ) ) == 10 );
+    ok( TOMLConfig_reload( config, NULL ) == TOML_SUCCESS );
+    TOMLTable *second = TOMLConfig_acquire( config );
+    ok( first != second, "reload published a new table" );
+    ok( TOMLConfig_collect( config ) == 1, "old table kept while read" );
+    TOMLConfig_release( config );
+    TOMLConfig_release( config );
+    ok( TOMLConfig_collect( config ) == 0, "old table freed" );
+    ok( TOMLConfig_reloadIfChanged( config, NULL ) == TOML_SUCCESS );
+    ok( TOMLConfig_acquire( config ) == second, "unchanged file not reparsed" );
+    TOMLConfig_release( config );
+    TOML_freeConfig( config );
+
+    // A failed reload leaves the file marked as changed, so it is tried again.
+    FILE *file = fopen( "test-config.toml", "w" );
+    fputs( "size = 1\n", file );
+    fclose( file );
+    config = TOML_allocConfig( "test-config.toml", NULL );
+    file = fopen( "test-config.toml", "w" );
+    fputs( "[a]\n[a]\n", file );
+    fclose( file );
+    ok( TOMLConfig_reloadIfChanged( config, NULL ) != TOML_SUCCESS );
+    ok(
+      TOMLConfig_reloadIfChanged( config, NULL ) != TOML_SUCCESS,
+      "failed reload is retried"
+    );
+    file = fopen( "test-config.toml", "w" );
+    fputs( "size = 2\n", file );
+    fclose( file );
+    ok( TOMLConfig_reloadIfChanged( config, NULL ) == TOML_SUCCESS );
+    ok(
+      TOML_toInt( TOML_find( TOMLConfig_acquire( config ), "size", NULL ) ) ==
+        2
+    );
+    TOMLConfig_release( config );
+    TOML_freeConfig( config );
+    remove( "test-config.toml" );
+
+    TOMLError *error = TOML_allocError( TOML_SUCCESS );
+    ok( TOML_allocConfig( "missing.toml", error ) == NULL );
+    ok( error->code == TOML_ERROR_FILEIO );
+    TOML_free( error );
+  }
+
+  { /** config_overlapping_readers **/
+    note( "config_overlapping_readers" );
+    TOMLConfigHandle *config = TOML_allocConfig( "test.toml", NULL );
+    TOMLTable *first = TOMLConfig_acquire( config );
+    TOMLConfig_reload( config, NULL );
+    ok( TOMLConfig_collect( config ) == 1, "old table kept while read" );
+
+    // Another thread reads the second table while this one lets go of the
+    // first.
+    struct config_reader reader = { config, PTHREAD_MUTEX_INITIALIZER, NULL };
+    pthread_t thread;
+    pthread_mutex_lock( &reader.hold );
+    pthread_create( &thread, NULL, config_read, &reader );
+    while ( !__atomic_load_n( &reader.table, __ATOMIC_SEQ_CST ) ) {
+      nanosleep( &(struct timespec) { 0, 100000 }, NULL );
+    }
+    ok( reader.table != first );
+    TOMLConfig_release( config );
+    ok(
+      TOMLConfig_collect( config ) == 0,
+      "old table freed while a newer one is read"
+    );
+
+    TOMLConfig_reload( config, NULL );
+    ok( TOMLConfig_collect( config ) == 1, "table read elsewhere kept" );
+    pthread_mutex_unlock( &reader.hold );
+    pthread_join( thread, NULL );
+    ok( TOMLConfig_collect( config ) == 0, "freed once the reader is done" );
+    ok( config->generation == 3 );
+    TOML_freeConfig( config );
+  }
+
   done_testing();
 }
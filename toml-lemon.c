@@ -24,7 +24,7 @@ char * _TOML_newstr( TOMLToken *token ) {
   }
 
   int size = token->end - token->start;
-  char *buffer = malloc( size + 1 );
+  char *buffer = _TOML_malloc( size + 1 );
   strncpy( buffer, token->start, size );
   buffer[ size ] = 0;
   return buffer;
@@ -37,7 +37,7 @@ char * _TOML_getline( TOMLToken *token ) {
   }
 
   int size = endOfLine - token->lineStart;
-  char *buffer = malloc( size + 1 );
+  char *buffer = _TOML_malloc( size + 1 );
   strncpy( buffer, token->lineStart, size );
   buffer[ size ] = 0;
 
@@ -56,11 +56,11 @@ void _TOML_fillError(
     error->line = _TOML_getline( state->token );
 
     int messageSize = strlen( TOMLErrorDescription[ errorCode ] );
-    error->message = malloc( messageSize + 1 );
+    error->message = _TOML_malloc( messageSize + 1 );
     strncpy( error->message, TOMLErrorDescription[ errorCode ], messageSize );
     error->message[ messageSize ] = 0;
 
-    char *longMessage = malloc(
+    char *longMessage = _TOML_malloc(
       strlen( error->line ) +
       strlen( error->message ) +
       (int) ( error->lineNo / 10 ) +
@@ -78,10 +78,31 @@ void _TOML_fillError(
 }
 
 void TOML_freeToken( TOMLToken *token ) {
-  free( token->tokenStr );
-  free( token );
+  _TOML_dealloc( token->tokenStr );
+  _TOML_dealloc( token );
 }
-#line 85 "toml-lemon.c"
+
+// Reject a header with more than TOML_MAX_DEPTH keys, freeing its nodes.
+// Returns non-zero if the header was rejected.
+int _TOML_rejectDeepHeader( table_id_node *first, TOMLParserState *state ) {
+  int depth = 0;
+  for ( table_id_node *node = first; node; node = node->next ) {
+    depth++;
+  }
+  if ( depth <= TOML_MAX_DEPTH ) {
+    return 0;
+  }
+
+  _TOML_fillError( state->token, state, TOML_ERROR_TOO_DEEP );
+  while ( first ) {
+    table_id_node *next = first->next;
+    _TOML_dealloc( first->name );
+    _TOML_dealloc( first );
+    first = next;
+  }
+  return 1;
+}
+#line 106 "toml-lemon.c"
 /* Next is all token values, in a form suitable for use by makeheaders.
 ** This section will be null unless lemon is run with the -m switch.
 */
@@ -502,7 +523,7 @@ static void yy_destructor(
 {
 #line 1 "toml-lemon.lemon"
  TOML_freeToken((yypminor->yy0)); 
-#line 506 "toml-lemon.c"
+#line 527 "toml-lemon.c"
 }
       break;
     default:  break;   /* If no destructor action specified: do nothing */
@@ -821,35 +842,39 @@ static void yy_reduce(
   **     break;
   */
       case 0: /* file ::= line EOF */
-#line 85 "toml-lemon.lemon"
+#line 106 "toml-lemon.lemon"
 {
   yy_destructor(yypParser,1,&yymsp[0].minor);
 }
-#line 829 "toml-lemon.c"
+#line 850 "toml-lemon.c"
         break;
       case 4: /* line_and_comment ::= COMMENT */
-#line 89 "toml-lemon.lemon"
+#line 110 "toml-lemon.lemon"
 {
   yy_destructor(yypParser,2,&yymsp[0].minor);
 }
-#line 836 "toml-lemon.c"
+#line 857 "toml-lemon.c"
         break;
       case 7: /* table_header ::= LEFT_SQUARE table_header_2 RIGHT_SQUARE */
-#line 93 "toml-lemon.lemon"
+#line 114 "toml-lemon.lemon"
 {
   yy_destructor(yypParser,3,&yymsp[-2].minor);
   yy_destructor(yypParser,4,&yymsp[0].minor);
 }
-#line 844 "toml-lemon.c"
+#line 865 "toml-lemon.c"
         break;
       case 8: /* table_header_2 ::= LEFT_SQUARE table_id RIGHT_SQUARE */
-#line 95 "toml-lemon.lemon"
+#line 116 "toml-lemon.lemon"
 {
   table_id_node *first = yymsp[-1].minor.yy62->first;
   table_id_node *node = first;
   table_id_node *next = node->next;
   TOMLTable *table = state->rootTable;
 
+  if ( _TOML_rejectDeepHeader( first, state ) ) {
+    node = NULL;
+  }
+
   for ( ; node; node = next ) {
     TOMLTable *tmpTable = TOMLTable_getKey( table, node->name );
     TOMLBasic *tmpBasic = (TOMLBasic *) tmpTable;
@@ -871,28 +896,34 @@ static void yy_reduce(
     }
     table = tmpTable;
     next = node->next;
-    free( node->name );
-    free( node );
+    _TOML_dealloc( node->name );
+    _TOML_dealloc( node );
   }
 
-  TOMLArray *array = (TOMLArray *) table;
-  table = TOML_allocTable( NULL, NULL );
-  TOMLArray_append( array, table );
+  if ( state->errorCode == TOML_SUCCESS ) {
+    TOMLArray *array = (TOMLArray *) table;
+    table = TOML_allocTable( NULL, NULL );
+    TOMLArray_append( array, table );
+  }
 
   state->currentTable = table;
   yy_destructor(yypParser,3,&yymsp[-2].minor);
   yy_destructor(yypParser,4,&yymsp[0].minor);
 }
-#line 887 "toml-lemon.c"
+#line 914 "toml-lemon.c"
         break;
       case 9: /* table_header_2 ::= table_id */
-#line 132 "toml-lemon.lemon"
+#line 159 "toml-lemon.lemon"
 {
   table_id_node *first = yymsp[0].minor.yy62->first;
   table_id_node *node = first;
   table_id_node *next = node->next;
   TOMLTable *table = state->rootTable;
 
+  if ( _TOML_rejectDeepHeader( first, state ) ) {
+    node = NULL;
+  }
+
   for ( ; node; node = next ) {
     TOMLTable *tmpTable = TOMLTable_getKey( table, node->name );
     TOMLBasic *tmpBasic = (TOMLBasic *) tmpTable;
@@ -910,18 +941,18 @@ static void yy_reduce(
     }
     table = tmpTable;
     next = node->next;
-    free( node->name );
-    free( node );
+    _TOML_dealloc( node->name );
+    _TOML_dealloc( node );
   }
 
   state->currentTable = table;
 }
-#line 920 "toml-lemon.c"
+#line 951 "toml-lemon.c"
         break;
       case 10: /* table_id ::= table_id ID_DOT id */
-#line 163 "toml-lemon.lemon"
+#line 194 "toml-lemon.lemon"
 {
-  table_id_node *node = malloc( sizeof(table_id_node) );
+  table_id_node *node = _TOML_malloc( sizeof(table_id_node) );
   node->name = yymsp[0].minor.yy0;
   node->first = yymsp[-2].minor.yy62->first;
   node->next = NULL;
@@ -929,21 +960,21 @@ static void yy_reduce(
   yygotominor.yy62 = node;
   yy_destructor(yypParser,5,&yymsp[-1].minor);
 }
-#line 933 "toml-lemon.c"
+#line 964 "toml-lemon.c"
         break;
       case 11: /* table_id ::= id */
-#line 171 "toml-lemon.lemon"
+#line 202 "toml-lemon.lemon"
 {
-  table_id_node *node = malloc( sizeof(table_id_node) );
+  table_id_node *node = _TOML_malloc( sizeof(table_id_node) );
   node->name = yymsp[0].minor.yy0;
   node->first = node;
   node->next = NULL;
   yygotominor.yy62 = node;
 }
-#line 944 "toml-lemon.c"
+#line 975 "toml-lemon.c"
         break;
       case 12: /* entry ::= id EQ value */
-#line 179 "toml-lemon.lemon"
+#line 210 "toml-lemon.lemon"
 {
   if ( yymsp[-2].minor.yy0 != NULL || yymsp[0].minor.yy13 != NULL ) {
     TOMLRef oldValue = TOMLTable_getKey( state->currentTable, yymsp[-2].minor.yy0 );
@@ -953,60 +984,61 @@ static void yy_reduce(
       TOMLTable_setKey( state->currentTable, yymsp[-2].minor.yy0, yymsp[0].minor.yy13 );
     }
   }
-  free( yymsp[-2].minor.yy0 );
+  _TOML_dealloc( yymsp[-2].minor.yy0 );
   yy_destructor(yypParser,6,&yymsp[-1].minor);
 }
-#line 960 "toml-lemon.c"
+#line 991 "toml-lemon.c"
         break;
       case 13: /* id ::= ID */
-#line 191 "toml-lemon.lemon"
+#line 222 "toml-lemon.lemon"
 {
   yygotominor.yy0 = _TOML_newstr( yymsp[0].minor.yy0 );
+  TOML_freeToken( yymsp[0].minor.yy0 );
 }
-#line 967 "toml-lemon.c"
+#line 999 "toml-lemon.c"
         break;
       case 14: /* value ::= array */
       case 15: /* value ::= string */ yytestcase(yyruleno==15);
-#line 196 "toml-lemon.lemon"
+#line 228 "toml-lemon.lemon"
 { yygotominor.yy13 = (TOMLBasic *) yymsp[0].minor.yy0; }
-#line 973 "toml-lemon.c"
+#line 1005 "toml-lemon.c"
         break;
       case 16: /* value ::= number */
-#line 198 "toml-lemon.lemon"
+#line 230 "toml-lemon.lemon"
 { yygotominor.yy13 = (TOMLBasic *) yymsp[0].minor.yy8; }
-#line 978 "toml-lemon.c"
+#line 1010 "toml-lemon.c"
         break;
       case 17: /* value ::= boolean */
-#line 199 "toml-lemon.lemon"
+#line 231 "toml-lemon.lemon"
 { yygotominor.yy13 = (TOMLBasic *) yymsp[0].minor.yy3; }
-#line 983 "toml-lemon.c"
+#line 1015 "toml-lemon.c"
         break;
       case 18: /* value ::= date */
-#line 200 "toml-lemon.lemon"
+#line 232 "toml-lemon.lemon"
 { yygotominor.yy13 = (TOMLBasic *) yymsp[0].minor.yy4; }
-#line 988 "toml-lemon.c"
+#line 1020 "toml-lemon.c"
         break;
       case 19: /* array ::= LEFT_SQUARE members RIGHT_SQUARE */
-#line 202 "toml-lemon.lemon"
+#line 234 "toml-lemon.lemon"
 {
   yygotominor.yy0 = yymsp[-1].minor.yy0;
   yy_destructor(yypParser,3,&yymsp[-2].minor);
   yy_destructor(yypParser,4,&yymsp[0].minor);
 }
-#line 997 "toml-lemon.c"
+#line 1029 "toml-lemon.c"
         break;
       case 20: /* members ::= value_members */
-#line 205 "toml-lemon.lemon"
+#line 237 "toml-lemon.lemon"
 { yygotominor.yy0 = yymsp[0].minor.yy50; }
-#line 1002 "toml-lemon.c"
+#line 1034 "toml-lemon.c"
         break;
       case 21: /* members ::= */
-#line 206 "toml-lemon.lemon"
+#line 238 "toml-lemon.lemon"
 { yygotominor.yy0 = TOML_allocArray( TOML_NOTYPE, NULL ); }
-#line 1007 "toml-lemon.c"
+#line 1039 "toml-lemon.c"
         break;
       case 22: /* value_members ::= value_members comma value */
-#line 209 "toml-lemon.lemon"
+#line 241 "toml-lemon.lemon"
 {
   if ( yymsp[-2].minor.yy50->memberType != yymsp[0].minor.yy13->type ) {
     _TOML_fillError( state->token, state, TOML_ERROR_ARRAY_MEMBER_MISMATCH );
@@ -1014,190 +1046,112 @@ static void yy_reduce(
   yygotominor.yy50 = yymsp[-2].minor.yy50;
   TOMLArray_append( yygotominor.yy50, yymsp[0].minor.yy13 );
 }
-#line 1018 "toml-lemon.c"
+#line 1050 "toml-lemon.c"
         break;
       case 23: /* value_members ::= value_members comma */
-#line 216 "toml-lemon.lemon"
+#line 248 "toml-lemon.lemon"
 {
   yygotominor.yy50 = yymsp[-1].minor.yy50;
 }
-#line 1025 "toml-lemon.c"
+#line 1057 "toml-lemon.c"
         break;
       case 24: /* value_members ::= value */
-#line 219 "toml-lemon.lemon"
+#line 251 "toml-lemon.lemon"
 {
   yygotominor.yy50 = TOML_allocArray( yymsp[0].minor.yy13->type, yymsp[0].minor.yy13, NULL );
 }
-#line 1032 "toml-lemon.c"
+#line 1064 "toml-lemon.c"
         break;
       case 25: /* comma ::= COMMA */
-#line 223 "toml-lemon.lemon"
+#line 255 "toml-lemon.lemon"
 {
   yy_destructor(yypParser,8,&yymsp[0].minor);
 }
-#line 1039 "toml-lemon.c"
+#line 1071 "toml-lemon.c"
         break;
       case 26: /* string ::= STRING */
-#line 225 "toml-lemon.lemon"
+#line 257 "toml-lemon.lemon"
 {
   TOMLToken *token = yymsp[0].minor.yy0;
-  int size = token->end - token->start;
+  // The text between the quotes.
+  int size = token->end - token->start - 2;
 
   char *tmp = _TOML_newstr( token );
+  TOML_freeToken( token );
 
-  char *dest = malloc( size + 1 );
-  strncpy( dest, tmp, size );
-  dest[ size ] = 0;
-
-  char *tmpCursor = tmp;
-  char *destCursor = dest;
-
-  // replace \\b with \b (U+0008)
-  // replace \\t with \t (U+0009)
-  // replace \\n with \n (U+000A)
-  // replace \\f with \f (U+000C)
-  // replace \\r with \r (U+000D)
-  // replace \\\" with " (U+0022)
-  // replace \/ with / (U+002F)
-  // replace \\ with \ (U+005C)
-  // replace \\uxxxx with encoded character
-  while ( tmpCursor != NULL ) {
-    char *next = strchr( tmpCursor, '\\' );
-    if ( next && next[1] ) {
-      char *nextDest = destCursor + ( (int) next - (int) tmpCursor );
-      #define REPLACE( match, value ) \
-      if ( next[1] == match ) { \
-        *nextDest = value; \
-      }
-      REPLACE( 'b', '\b' )
-      else REPLACE( 't', '\t' )
-      else REPLACE( 'f', '\f' )
-      else REPLACE( 'n', '\n' )
-      else REPLACE( 'r', '\r' )
-      else REPLACE( '"', '"' )
-      else REPLACE( '/', '/' )
-      else REPLACE( '\\', '\\' )
-      #undef REPLACE
-      else if ( next[1] == 'u' ) {
-        int num = 0;
-        sscanf( next + 2, "%04x", &num );
-        int chsize = 0;
-
-        // Number is in normal ascii range.
-        if ( num < 0x80 ) {
-          nextDest[0] = num; // Up to 0x7f
-          chsize = 1;
-        // Split the value into 2 or 3 chars as utf8.
-        } else if ( num < 0x800 ) {
-          nextDest[0] = 0xc0 | ( ( num >> 6 ) & 0x1f );
-          nextDest[1] = 0x80 | ( num & 0x3f );
-          chsize = 2;
-        } else {
-          nextDest[0] = 0xe0 | ( ( num >> 12 ) & 0x0f );
-          nextDest[1] = 0x80 | ( ( num >> 6 ) & 0x3f );
-          nextDest[2] = 0x80 | ( num & 0x3f );
-          chsize = 3;
-        }
+  char *dest = _TOML_malloc( size + 1 );
+  yygotominor.yy0 = TOML_allocStringN( dest, _TOML_unescape( dest, tmp + 1, size ) );
 
-        next += 4;
-        nextDest += chsize - 1;
-        size -= 5 - chsize;
-      }
-
-      size--;
-      strcpy( nextDest + 1, next + 2 );
-      tmpCursor = next + 2;
-      destCursor = nextDest + 1;
-    } else {
-      tmpCursor = next;
-    }
-  }
-
-  yygotominor.yy0 = TOML_allocStringN( dest + 1, size - 2 );
-
-  free( dest );
-  free( tmp );
+  _TOML_dealloc( dest );
+  _TOML_dealloc( tmp );
 }
-#line 1122 "toml-lemon.c"
+#line 1089 "toml-lemon.c"
         break;
       case 27: /* number ::= NUMBER */
-#line 306 "toml-lemon.lemon"
+#line 273 "toml-lemon.lemon"
 {
   char *tmp = _TOML_newstr( yymsp[0].minor.yy0 );
+  TOML_freeToken( yymsp[0].minor.yy0 );
 
-  if ( strchr( tmp, '.' ) != NULL ) {
-    yygotominor.yy8 = TOML_allocDouble( atof( tmp ) );
-  } else {
-    yygotominor.yy8 = TOML_allocInt( atoi( tmp ) );
-  }
-
-  free( tmp );
+  yygotominor.yy8 = _TOML_convertNumber( tmp );
+  _TOML_dealloc( tmp );
 }
-#line 1137 "toml-lemon.c"
+#line 1100 "toml-lemon.c"
         break;
       case 28: /* boolean ::= TRUE */
-#line 319 "toml-lemon.lemon"
+#line 282 "toml-lemon.lemon"
 {
   yygotominor.yy3 = TOML_allocBoolean( 1 );
   yy_destructor(yypParser,11,&yymsp[0].minor);
 }
-#line 1145 "toml-lemon.c"
+#line 1108 "toml-lemon.c"
         break;
       case 29: /* boolean ::= FALSE */
-#line 323 "toml-lemon.lemon"
+#line 286 "toml-lemon.lemon"
 {
   yygotominor.yy3 = TOML_allocBoolean( 0 );
   yy_destructor(yypParser,12,&yymsp[0].minor);
 }
-#line 1153 "toml-lemon.c"
+#line 1116 "toml-lemon.c"
         break;
       case 30: /* date ::= DATE */
-#line 328 "toml-lemon.lemon"
+#line 291 "toml-lemon.lemon"
 {
-  int year;
-  int month;
-  int day;
-  int hour;
-  int minute;
-  int second;
-  sscanf(
-    ((TOMLToken *) yymsp[0].minor.yy0)->tokenStr,
-    "%d-%d-%dT%d:%d:%dZ",
-    &year, &month, &day, &hour, &minute, &second
-  );
-  yygotominor.yy4 = TOML_allocDate( year, month, day, hour, minute, second );
+  yygotominor.yy4 = _TOML_convertDate( ((TOMLToken *) yymsp[0].minor.yy0)->tokenStr );
+  TOML_freeToken( yymsp[0].minor.yy0 );
 }
-#line 1171 "toml-lemon.c"
+#line 1124 "toml-lemon.c"
         break;
       case 31: /* error ::= EOF error */
-#line 347 "toml-lemon.lemon"
+#line 300 "toml-lemon.lemon"
 { yygotominor.yy67 = yymsp[0].minor.yy67;   yy_destructor(yypParser,1,&yymsp[-1].minor);
 }
-#line 1177 "toml-lemon.c"
+#line 1130 "toml-lemon.c"
         break;
       case 32: /* table_header ::= LEFT_SQUARE error */
-#line 349 "toml-lemon.lemon"
+#line 302 "toml-lemon.lemon"
 {
   _TOML_fillError( yymsp[-1].minor.yy0, state, TOML_ERROR_INVALID_HEADER );
+  TOML_freeToken( yymsp[-1].minor.yy0 );
 }
-#line 1184 "toml-lemon.c"
+#line 1138 "toml-lemon.c"
         break;
       case 33: /* entry ::= id EQ error */
-#line 353 "toml-lemon.lemon"
+#line 307 "toml-lemon.lemon"
 {
   _TOML_fillError( state->token, state, TOML_ERROR_NO_VALUE );
-  free( yymsp[-2].minor.yy0 );
+  _TOML_dealloc( yymsp[-2].minor.yy0 );
   yy_destructor(yypParser,6,&yymsp[-1].minor);
 }
-#line 1193 "toml-lemon.c"
+#line 1147 "toml-lemon.c"
         break;
       case 34: /* entry ::= id error */
-#line 358 "toml-lemon.lemon"
+#line 312 "toml-lemon.lemon"
 {
   _TOML_fillError( state->token, state, TOML_ERROR_NO_EQ );
-  free( yymsp[-1].minor.yy0 );
+  _TOML_dealloc( yymsp[-1].minor.yy0 );
 }
-#line 1201 "toml-lemon.c"
+#line 1155 "toml-lemon.c"
         break;
       default:
       /* (1) line ::= line_and_comment */ yytestcase(yyruleno==1);
@@ -1252,7 +1206,7 @@ static void yy_parse_failed(
   ** parser fails */
 #line 3 "toml-lemon.lemon"
  _TOML_fillError( state->token, state, TOML_ERROR_FATAL ); 
-#line 1256 "toml-lemon.c"
+#line 1210 "toml-lemon.c"
   TOMLParserARG_STORE; /* Suppress warning about unused %extra_argument variable */
 }
 #endif /* YYNOERRORRECOVERY */
@@ -35,6 +35,23 @@ void TOMLParser( void *, int hTokenId, void *, TOMLParserState * );
 
 int TOMLScan(char *p, int* token, TOMLToken * );
 
+// Allocate and free through the allocator set with TOML_setAllocator or
+// TOML_useAllocator.
+void * _TOML_malloc( size_t );
+void * _TOML_realloc( void *, size_t );
+void _TOML_dealloc( void * );
+
+// Convert the text of number and date tokens.
+TOMLNumber * _TOML_convertNumber( char * );
+TOMLDate * _TOML_convertDate( char * );
+
+// Unescape the text of a string token between its quotes into dest, which
+// needs room for size bytes. Returns the unescaped size.
+int _TOML_unescape( char *dest, char *source, int size );
+
+// Fill the parser's error object for the token, defined with the grammar.
+void _TOML_fillError( TOMLToken *, TOMLParserState *, int errorCode );
+
 #ifdef __cplusplus
 };
 #endif
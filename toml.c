@@ -1,3 +1,5 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <assert.h>
 #include <math.h>
 #include <stdarg.h>
@@ -6,26 +8,291 @@
 #include <string.h>
 #include <time.h>
 
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 // #include <antlr3.h>
 
 #include "toml.h"
 #include "toml-parser.h"
+
+// stdio's EOF is not used here and would hide the parser's token.
+#undef EOF
+#include "toml-lemon.h"
 // #include "tomlParser.h"
 // #include "tomlLexer.h"
 
+// Plain decimal doubles need up to 17 significant digits and as many as 323
+// zeros around them.
+#define TOML_DOUBLE_BUFFER_SIZE 352
+
+struct _TOMLStringBuffer {
+  int size;
+  int capacity;
+  char *content;
+};
+
+// Entry lines of a table kept by TOML_writeCached. Runs of entries are
+// separated by the table's subtables and arrays of tables.
+struct _TOMLTableText {
+  int size;
+  char *content;
+  int runEnds[];
+};
+
 struct _TOMLStringifyData {
   TOMLError *error;
 
-  int bufferSize;
-  int bufferIndex;
-  char *buffer;
+  TOMLWriter *writer;
   int tableNameDepth;
   int tableNameStackSize;
   TOMLString **tableNameStack;
+  // Most documents nest shallowly enough to never need the heap.
+  TOMLString *inlineNameStack[ 16 ];
+  // Headers start with a blank line once anything has been written. Set
+  // when the writer is one part of a larger output.
+  int hasOutput;
+  // Set by TOML_toJSON. JSON strings also escape control characters.
+  int json;
+  int pretty;
+  // Set by TOML_writeCached to keep and reuse the entry lines of tables.
+  int cached;
+  // Output goes here instead of the writer while set.
+  struct _TOMLStringBuffer *capture;
+  // Set when the text may change before the writer is flushed.
+  int transient;
+  // The first error, like TOML_ERROR_NOT_FINITE for a double TOML cannot
+  // write. Output after it is abandoned.
+  int errorCode;
 };
 
 int _TOML_stringify( struct _TOMLStringifyData *self, TOMLRef src );
 
+int _TOMLWriter_writeString( void *context, char *bytes, int size ) {
+  struct _TOMLStringBuffer *self = context;
+  if ( self->size + size > self->capacity ) {
+    while ( self->size + size > self->capacity ) {
+      self->capacity = self->capacity ? self->capacity * 2 : 4096;
+    }
+    self->content = _TOML_realloc( self->content, self->capacity );
+  }
+  memcpy( self->content + self->size, bytes, size );
+  self->size += size;
+  return 0;
+}
+
+
+void * _TOML_systemMalloc( void *context, size_t size ) {
+  return malloc( size );
+}
+
+void * _TOML_systemRealloc( void *context, void *ptr, size_t size ) {
+  return realloc( ptr, size );
+}
+
+void _TOML_systemFree( void *context, void *ptr ) {
+  free( ptr );
+}
+
+static TOMLAllocator _TOML_systemAllocator = {
+  _TOML_systemMalloc, _TOML_systemRealloc, _TOML_systemFree, NULL
+};
+
+static TOMLAllocator *_TOML_globalAllocator = &_TOML_systemAllocator;
+
+// Set by TOML_useAllocator for the calling thread.
+static __thread TOMLAllocator *_TOML_threadAllocator = NULL;
+
+// Set while TOML_parseWithStats or TOML_loadWithStats runs on this thread.
+static __thread TOMLParseStats *_TOML_parseStats = NULL;
+
+// Parse stats time one token in _TOML_STATS_SAMPLE, since reading the clock
+// costs about as much as scanning and parsing a token. The sampled times split
+// the time of the whole parse between the lexer, the parser and conversions.
+#define _TOML_STATS_SAMPLE 64
+
+// Sampled times of the parse in progress on this thread.
+struct _TOMLStatsSample {
+  // Non-zero from scanning a sampled token until it has been parsed.
+  int timing;
+  long long lex;
+  long long parse;
+  long long convert;
+};
+
+static __thread struct _TOMLStatsSample _TOML_statsSample;
+
+TOMLAllocator * _TOML_currentAllocator() {
+  return _TOML_threadAllocator ? _TOML_threadAllocator : _TOML_globalAllocator;
+}
+
+void * _TOML_mallocWith( TOMLAllocator *allocator, size_t size ) {
+  if ( _TOML_parseStats ) {
+    _TOML_parseStats->allocations++;
+    _TOML_parseStats->allocatedBytes += size;
+  }
+
+  return allocator->malloc( allocator->context, size );
+}
+
+void * _TOML_reallocWith(
+  TOMLAllocator *allocator, void *ptr, size_t size
+) {
+  if ( _TOML_parseStats ) {
+    _TOML_parseStats->allocations++;
+    _TOML_parseStats->allocatedBytes += size;
+  }
+
+  return allocator->realloc( allocator->context, ptr, size );
+}
+
+void _TOML_deallocWith( TOMLAllocator *allocator, void *ptr ) {
+  allocator->free( allocator->context, ptr );
+}
+
+void * _TOML_malloc( size_t size ) {
+  return _TOML_mallocWith( _TOML_currentAllocator(), size );
+}
+
+void * _TOML_realloc( void *ptr, size_t size ) {
+  return _TOML_reallocWith( _TOML_currentAllocator(), ptr, size );
+}
+
+void _TOML_dealloc( void *ptr ) {
+  _TOML_deallocWith( _TOML_currentAllocator(), ptr );
+}
+
+void TOML_setAllocator( TOMLAllocator *allocator ) {
+  _TOML_globalAllocator = allocator ? allocator : &_TOML_systemAllocator;
+}
+
+TOMLAllocator * TOML_useAllocator( TOMLAllocator *allocator ) {
+  TOMLAllocator *previous = _TOML_threadAllocator;
+  _TOML_threadAllocator = allocator;
+  return previous;
+}
+
+int TOML_parseWith(
+  char *buffer, TOMLTable **dest, TOMLAllocator *allocator, TOMLError *error
+) {
+  TOMLAllocator *previous = TOML_useAllocator( allocator );
+  int errorCode = TOML_parse( buffer, dest, error );
+  TOML_useAllocator( previous );
+  return errorCode;
+}
+
+int TOML_loadWith(
+  char *filename, TOMLTable **dest, TOMLAllocator *allocator, TOMLError *error
+) {
+  TOMLAllocator *previous = TOML_useAllocator( allocator );
+  int errorCode = TOML_load( filename, dest, error );
+  TOML_useAllocator( previous );
+  return errorCode;
+}
+
+void TOML_freeWith( TOMLRef self, TOMLAllocator *allocator ) {
+  TOMLAllocator *previous = TOML_useAllocator( allocator );
+  TOML_free( self );
+  TOML_useAllocator( previous );
+}
+
+// The counting allocator keeps the size of each block in front of it so
+// frees can update the live byte count. The header keeps blocks aligned.
+#define TOML_COUNTING_HEADER_SIZE 16
+
+void _TOMLCountingAllocator_grow(
+  TOMLCountingAllocator *self, long long size
+) {
+  long long live =
+    __atomic_add_fetch( &self->stats.liveBytes, size, __ATOMIC_RELAXED );
+  long long peak = __atomic_load_n( &self->stats.peakBytes, __ATOMIC_RELAXED );
+  while (
+    live > peak &&
+      !__atomic_compare_exchange_n(
+        &self->stats.peakBytes, &peak, live, 1,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED
+      )
+  ) {}
+}
+
+void * _TOMLCountingAllocator_malloc( void *context, size_t size ) {
+  TOMLCountingAllocator *self = context;
+  char *block = self->parent->malloc(
+    self->parent->context, size + TOML_COUNTING_HEADER_SIZE
+  );
+  if ( block == NULL ) {
+    return NULL;
+  }
+
+  *(size_t *) block = size;
+  __atomic_add_fetch( &self->stats.mallocs, 1, __ATOMIC_RELAXED );
+  __atomic_add_fetch( &self->stats.bytes, size, __ATOMIC_RELAXED );
+  _TOMLCountingAllocator_grow( self, size );
+  return block + TOML_COUNTING_HEADER_SIZE;
+}
+
+void * _TOMLCountingAllocator_realloc( void *context, void *ptr, size_t size ) {
+  TOMLCountingAllocator *self = context;
+  if ( ptr == NULL ) {
+    return _TOMLCountingAllocator_malloc( context, size );
+  }
+
+  char *block = (char *) ptr - TOML_COUNTING_HEADER_SIZE;
+  size_t oldSize = *(size_t *) block;
+  block = self->parent->realloc(
+    self->parent->context, block, size + TOML_COUNTING_HEADER_SIZE
+  );
+  if ( block == NULL ) {
+    return NULL;
+  }
+
+  *(size_t *) block = size;
+  __atomic_add_fetch( &self->stats.reallocs, 1, __ATOMIC_RELAXED );
+  if ( size > oldSize ) {
+    __atomic_add_fetch( &self->stats.bytes, size - oldSize, __ATOMIC_RELAXED );
+  }
+  _TOMLCountingAllocator_grow( self, (long long) size - (long long) oldSize );
+  return block + TOML_COUNTING_HEADER_SIZE;
+}
+
+void _TOMLCountingAllocator_free( void *context, void *ptr ) {
+  TOMLCountingAllocator *self = context;
+  if ( ptr == NULL ) {
+    return;
+  }
+
+  char *block = (char *) ptr - TOML_COUNTING_HEADER_SIZE;
+  __atomic_add_fetch( &self->stats.frees, 1, __ATOMIC_RELAXED );
+  __atomic_sub_fetch(
+    &self->stats.liveBytes, *(size_t *) block, __ATOMIC_RELAXED
+  );
+  self->parent->free( self->parent->context, block );
+}
+
+void TOMLCountingAllocator_init(
+  TOMLCountingAllocator *self, TOMLAllocator *parent
+) {
+  self->allocator.malloc = _TOMLCountingAllocator_malloc;
+  self->allocator.realloc = _TOMLCountingAllocator_realloc;
+  self->allocator.free = _TOMLCountingAllocator_free;
+  self->allocator.context = self;
+  self->parent = parent ? parent : &_TOML_systemAllocator;
+  memset( &self->stats, 0, sizeof(self->stats) );
+}
+
+void TOMLCountingAllocator_reset( TOMLCountingAllocator *self ) {
+  self->stats.mallocs = 0;
+  self->stats.reallocs = 0;
+  self->stats.frees = 0;
+  self->stats.bytes = 0;
+  self->stats.peakBytes = self->stats.liveBytes;
+}
+
 TOMLRef TOML_alloc( TOMLType type ) {
   switch ( type ) {
     case TOML_TABLE:
@@ -48,10 +315,17 @@ TOMLRef TOML_alloc( TOMLType type ) {
 }
 
 TOMLTable * TOML_allocTable( TOMLString *key, TOMLRef value, ... ) {
-  TOMLTable *self = malloc( sizeof(TOMLTable) );
+  TOMLTable *self = _TOML_malloc( sizeof(TOMLTable) );
+  self->allocator = _TOML_currentAllocator();
+  self->text = NULL;
+  self->index = NULL;
   self->type = TOML_TABLE;
+  self->refCount = 1;
   self->keys = TOML_allocArray( TOML_STRING, NULL );
   self->values = TOML_allocArray( TOML_NOTYPE, NULL );
+  self->keys->parent = self->values->parent = self;
+  self->hash = 0;
+  self->parent = NULL;
 
   if ( key != NULL ) {
     TOMLArray_append( self->keys, key );
@@ -77,11 +351,16 @@ TOMLTable * TOML_allocTable( TOMLString *key, TOMLRef value, ... ) {
 }
 
 TOMLArray * TOML_allocArray( TOMLType memberType, ... ) {
-  TOMLArray *self = malloc( sizeof(TOMLArray) );
+  TOMLArray *self = _TOML_malloc( sizeof(TOMLArray) );
+  self->allocator = _TOML_currentAllocator();
   self->type = TOML_ARRAY;
+  self->refCount = 1;
   self->memberType = memberType;
   self->size = 0;
+  self->capacity = 0;
   self->members = NULL;
+  self->hash = 0;
+  self->parent = NULL;
 
   va_list args;
   va_start( args, memberType );
@@ -99,9 +378,11 @@ TOMLArray * TOML_allocArray( TOMLType memberType, ... ) {
 
 TOMLString * TOML_allocString( char *content ) {
   int size = strlen( content );
-  TOMLString *self = malloc( sizeof(TOMLString) + size + 1 );
+  TOMLString *self = _TOML_malloc( sizeof(TOMLString) + size + 1 );
   self->type = TOML_STRING;
+  self->refCount = 1;
   self->size = size;
+  self->hash = 0;
   self->content[ self->size ] = 0;
   strncpy( self->content, content, size );
 
@@ -109,9 +390,11 @@ TOMLString * TOML_allocString( char *content ) {
 }
 
 TOMLString * TOML_allocStringN( char *content, int n ) {
-  TOMLString *self = malloc( sizeof(TOMLString) + n + 1 );
+  TOMLString *self = _TOML_malloc( sizeof(TOMLString) + n + 1 );
   self->type = TOML_STRING;
+  self->refCount = 1;
   self->size = n;
+  self->hash = 0;
   self->content[ n ] = 0;
   strncpy( self->content, content, n );
 
@@ -119,8 +402,9 @@ TOMLString * TOML_allocStringN( char *content, int n ) {
 }
 
 TOMLNumber * TOML_allocInt( int value ) {
-  TOMLNumber *self = malloc( sizeof(TOMLNumber) );
+  TOMLNumber *self = _TOML_malloc( sizeof(TOMLNumber) );
   self->type = TOML_INT;
+  self->refCount = 1;
   // self->numberType = TOML_INT;
   self->intValue = value;
 
@@ -128,8 +412,9 @@ TOMLNumber * TOML_allocInt( int value ) {
 }
 
 TOMLNumber * TOML_allocDouble( double value ) {
-  TOMLNumber *self = malloc( sizeof(TOMLNumber) );
+  TOMLNumber *self = _TOML_malloc( sizeof(TOMLNumber) );
   self->type = TOML_DOUBLE;
+  self->refCount = 1;
   // self->numberType = TOML_DOUBLE;
   self->doubleValue = value;
 
@@ -137,8 +422,9 @@ TOMLNumber * TOML_allocDouble( double value ) {
 }
 
 TOMLBoolean * TOML_allocBoolean( int truth ) {
-  TOMLBoolean *self = malloc( sizeof(TOMLBoolean) );
+  TOMLBoolean *self = _TOML_malloc( sizeof(TOMLBoolean) );
   self->type = TOML_BOOLEAN;
+  self->refCount = 1;
   self->isTrue = truth;
   return self;
 }
@@ -155,11 +441,13 @@ int _TOML_isLeapYear( int year ) {
   }
 }
 
-TOMLDate * TOML_allocDate(
-  int year, int month, int day, int hour, int minute, int second
+// Fill a date with the given values and the GMT timestamp they name.
+void _TOMLDate_set(
+  TOMLDate *self, int year, int month, int day, int hour, int minute,
+  int second
 ) {
-  TOMLDate *self = malloc( sizeof(TOMLDate) );
   self->type = TOML_DATE;
+  self->refCount = 1;
 
   self->year = year;
   self->month = month;
@@ -188,13 +476,20 @@ TOMLDate * TOML_allocDate(
 
   // Adjust the localEpock made by mktime to a gmt epoch.
   self->sinceEpoch = localEpoch + diff;
+}
 
+TOMLDate * TOML_allocDate(
+  int year, int month, int day, int hour, int minute, int second
+) {
+  TOMLDate *self = _TOML_malloc( sizeof(TOMLDate) );
+  _TOMLDate_set( self, year, month, day, hour, minute, second );
   return self;
 }
 
 TOMLDate * TOML_allocEpochDate( time_t stamp ) {
-  TOMLDate *self = malloc( sizeof(TOMLDate) );
+  TOMLDate *self = _TOML_malloc( sizeof(TOMLDate) );
   self->type = TOML_DATE;
+  self->refCount = 1;
   self->sinceEpoch = stamp;
 
   struct tm _time = *gmtime( &stamp );
@@ -210,8 +505,9 @@ TOMLDate * TOML_allocEpochDate( time_t stamp ) {
 }
 
 TOMLError * TOML_allocError( int code ) {
-  TOMLError *self = malloc( sizeof(TOMLError) );
+  TOMLError *self = _TOML_malloc( sizeof(TOMLError) );
   self->type = TOML_ERROR;
+  self->refCount = 1;
   self->code = code;
   self->lineNo = 0;
   self->line = NULL;
@@ -227,7 +523,7 @@ char * _TOML_cstringCopy( char *str ) {
   }
 
   int size = strlen( str );
-  char *newstr = malloc( size + 1 );
+  char *newstr = _TOML_malloc( size + 1 );
   newstr[ size ] = 0;
   strncpy( newstr, str, size );
 
@@ -236,56 +532,127 @@ char * _TOML_cstringCopy( char *str ) {
 
 TOMLRef TOML_copy( TOMLRef self ) {
   TOMLBasic *basic = (TOMLBasic *) self;
+  __atomic_fetch_add( &basic->refCount, 1, __ATOMIC_RELAXED );
+  return self;
+}
+
+// Parent of a table or array whose holder let go of it while other owners
+// kept it. Which of them holds it is unknown, so it counts as shared.
+static TOMLBasic _TOML_lostParent = { TOML_NOTYPE, 1 };
+#define TOML_LOST_PARENT ( (TOMLRef) &_TOML_lostParent )
+
+// The parent field of a table or array, or NULL for other objects.
+TOMLRef * _TOML_parentOf( TOMLBasic *basic ) {
+  if ( basic->type == TOML_TABLE ) {
+    return &((TOMLTable *) basic)->parent;
+  } else if ( basic->type == TOML_ARRAY ) {
+    return &((TOMLArray *) basic)->parent;
+  }
+  return NULL;
+}
+
+TOMLRef _TOML_loadParent( TOMLBasic *basic ) {
+  TOMLRef *parent = _TOML_parentOf( basic );
+  return parent ? __atomic_load_n( parent, __ATOMIC_ACQUIRE ) : NULL;
+}
+
+// Record the array now holding the value.
+void _TOML_adopt( TOMLArray *owner, TOMLRef value ) {
+  TOMLRef *parent = value ? _TOML_parentOf( value ) : NULL;
+  if ( parent ) {
+    __atomic_store_n( parent, owner, __ATOMIC_RELEASE );
+  }
+}
+
+void _TOML_freeIn( TOMLRef, TOMLAllocator * );
+
+// Free the owner's reference to a member. Other owners may keep the member,
+// and since they are unknown a member that named this owner as its parent
+// loses it. A NULL owner is the caller holding a root.
+void _TOML_release( TOMLRef owner, TOMLRef value ) {
+  TOMLRef *parent = owner && value ? _TOML_parentOf( value ) : NULL;
+  if ( parent ) {
+    TOMLRef expected = owner;
+    __atomic_compare_exchange_n(
+      parent, &expected, TOML_LOST_PARENT, 0, __ATOMIC_ACQ_REL,
+      __ATOMIC_RELAXED
+    );
+  }
+  _TOML_freeIn(
+    value, owner ? ((TOMLArray *) owner)->allocator : _TOML_currentAllocator()
+  );
+}
+
+// A private copy of an object whose members, if any, are shared with it.
+// Tables and arrays are copied with their own allocator, other values with
+// the current one.
+TOMLRef _TOML_copyShallow( TOMLRef self ) {
+  TOMLBasic *basic = (TOMLBasic *) self;
 
   if ( basic->type == TOML_TABLE ) {
     TOMLTable *table = (TOMLTable *) self;
-    TOMLTable *newTable = malloc( sizeof(TOMLTable) );
+    TOMLTable *newTable =
+      _TOML_mallocWith( table->allocator, sizeof(TOMLTable) );
+    newTable->allocator = table->allocator;
     newTable->type = TOML_TABLE;
-    newTable->keys = TOML_copy( table->keys );
-    newTable->values = TOML_copy( table->values );
+    newTable->refCount = 1;
+    newTable->keys = _TOML_copyShallow( table->keys );
+    newTable->values = _TOML_copyShallow( table->values );
+    newTable->keys->parent = newTable->values->parent = newTable;
+    newTable->hash = table->hash;
+    newTable->text = NULL;
+    newTable->index = NULL;
+    newTable->parent = NULL;
     return newTable;
   } else if ( basic->type == TOML_ARRAY ) {
     TOMLArray *array = (TOMLArray *) self;
-    TOMLArray *newArray = malloc( sizeof(TOMLArray) );
+    TOMLArray *newArray =
+      _TOML_mallocWith( array->allocator, sizeof(TOMLArray) );
+    newArray->allocator = array->allocator;
     newArray->type = TOML_ARRAY;
+    newArray->refCount = 1;
     newArray->memberType = array->memberType;
-    int i;
-    for ( i = 0; i < array->size; ++i ) {
-      TOMLArray_append(
-        newArray,
-        TOML_copy( TOMLArray_getIndex( array, i ) )
-      );
+    newArray->size = array->size;
+    newArray->capacity = array->size;
+    newArray->members = NULL;
+    newArray->hash = array->hash;
+    // Members keep the original as their parent, since it still holds them.
+    newArray->parent = NULL;
+    if ( array->size > 0 ) {
+      newArray->members =
+        _TOML_mallocWith( array->allocator, array->size * sizeof(TOMLRef) );
+      for ( int i = 0; i < array->size; ++i ) {
+        newArray->members[ i ] = TOML_copy( array->members[ i ] );
+      }
     }
     return newArray;
   } else if ( basic->type == TOML_STRING ) {
     TOMLString *string = (TOMLString *) self;
-    TOMLString *newString = malloc( sizeof(TOMLString) + string->size + 1 );
-    newString->type = TOML_STRING;
-    newString->size = string->size;
-    strncpy( newString->content, string->content, string->size + 1 );
+    TOMLString *newString =
+      _TOML_malloc( sizeof(TOMLString) + string->size + 1 );
+    memcpy( newString, string, sizeof(TOMLString) + string->size + 1 );
+    newString->refCount = 1;
     return newString;
   } else if ( basic->type == TOML_INT || basic->type == TOML_DOUBLE ) {
-    TOMLNumber *number = (TOMLNumber *) self;
-    TOMLNumber *newNumber = malloc( sizeof(TOMLNumber) );
-    newNumber->type = number->type;
-    // newNumber->numberType = number->numberType;
-    memcpy( newNumber->bytes, number->bytes, 8 );
+    TOMLNumber *newNumber = _TOML_malloc( sizeof(TOMLNumber) );
+    *newNumber = *(TOMLNumber *) self;
+    newNumber->refCount = 1;
     return newNumber;
   } else if ( basic->type == TOML_BOOLEAN ) {
-    TOMLBoolean *boolean = (TOMLBoolean *) self;
-    TOMLBoolean *newBoolean = malloc( sizeof(TOMLBoolean) );
-    newBoolean->type = boolean->type;
-    newBoolean->isTrue = boolean->isTrue;
+    TOMLBoolean *newBoolean = _TOML_malloc( sizeof(TOMLBoolean) );
+    *newBoolean = *(TOMLBoolean *) self;
+    newBoolean->refCount = 1;
     return newBoolean;
   } else if ( basic->type == TOML_DATE ) {
-    TOMLDate *date = (TOMLDate *) self;
-    TOMLDate *newDate = malloc( sizeof(TOMLDate) );
-    *newDate = *date;
+    TOMLDate *newDate = _TOML_malloc( sizeof(TOMLDate) );
+    *newDate = *(TOMLDate *) self;
+    newDate->refCount = 1;
     return newDate;
   } else if ( basic->type == TOML_ERROR ) {
     TOMLError *error = (TOMLError *) self;
-    TOMLError *newError = malloc( sizeof(TOMLError) );
+    TOMLError *newError = _TOML_malloc( sizeof(TOMLError) );
     newError->type = TOML_ERROR;
+    newError->refCount = 1;
     newError->code = error->code;
     newError->lineNo = error->lineNo;
     newError->line = _TOML_cstringCopy( error->line );
@@ -297,28 +664,155 @@ TOMLRef TOML_copy( TOMLRef self ) {
   }
 }
 
-void TOML_free( TOMLRef self ) {
+// FNV-1a over the given bytes.
+unsigned long long _TOML_hashBytes( char *bytes, int size ) {
+  unsigned long long hash = 0xcbf29ce484222325ULL;
+  for ( int i = 0; i < size; ++i ) {
+    hash ^= (unsigned char) bytes[ i ];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+// Open addressed index from a table's keys to their positions.
+struct _TOMLKeyIndex {
+  int mask;
+  int *slots;
+  // How many keys from the front of the table are indexed.
+  int count;
+};
+
+void _TOMLKeyIndex_add( struct _TOMLKeyIndex *self, TOMLTable *table ) {
+  TOMLString *key = table->keys->members[ self->count ];
+  int slot = _TOML_hashBytes( key->content, key->size ) & self->mask;
+  while ( self->slots[ slot ] != -1 ) {
+    slot = ( slot + 1 ) & self->mask;
+  }
+  self->slots[ slot ] = self->count;
+  self->count++;
+}
+
+void _TOMLKeyIndex_init( struct _TOMLKeyIndex *self, TOMLTable *table ) {
+  int capacity = 16;
+  while ( capacity < table->keys->size * 2 ) {
+    capacity *= 2;
+  }
+  self->mask = capacity - 1;
+  self->slots = _TOML_mallocWith( table->allocator, capacity * sizeof(int) );
+  memset( self->slots, 0xff, capacity * sizeof(int) );
+  self->count = 0;
+
+  while ( self->count < table->keys->size ) {
+    _TOMLKeyIndex_add( self, table );
+  }
+}
+
+// Index keys appended since the last update, rebuilding at twice the size
+// once the slots are half full.
+void _TOMLKeyIndex_update( struct _TOMLKeyIndex *self, TOMLTable *table ) {
+  if ( table->keys->size * 2 > self->mask + 1 ) {
+    _TOML_deallocWith( table->allocator, self->slots );
+    _TOMLKeyIndex_init( self, table );
+    return;
+  }
+
+  while ( self->count < table->keys->size ) {
+    _TOMLKeyIndex_add( self, table );
+  }
+}
+
+int _TOMLKeyIndex_lookup(
+  struct _TOMLKeyIndex *self, TOMLTable *table, char *key, int size
+) {
+  int slot = _TOML_hashBytes( key, size ) & self->mask;
+  while ( self->slots[ slot ] != -1 ) {
+    TOMLString *tableKey = table->keys->members[ self->slots[ slot ] ];
+    if (
+      tableKey->size == size && memcmp( tableKey->content, key, size ) == 0
+    ) {
+      return self->slots[ slot ];
+    }
+    slot = ( slot + 1 ) & self->mask;
+  }
+  return -1;
+}
+
+int _TOMLKeyIndex_find(
+  struct _TOMLKeyIndex *self, TOMLTable *table, TOMLString *key
+) {
+  return _TOMLKeyIndex_lookup( self, table, key->content, key->size );
+}
+
+// Tables get a key index from TOMLTable_setKey once they hold this many keys.
+#define TOML_INDEXED_TABLE_SIZE 8
+
+void _TOMLTable_dropIndex( TOMLTable *self ) {
+  if ( self->index ) {
+    _TOML_deallocWith( self->allocator, self->index->slots );
+    _TOML_deallocWith( self->allocator, self->index );
+    self->index = NULL;
+  }
+}
+
+void _TOMLTable_updateIndex( TOMLTable *self ) {
+  if ( self->index ) {
+    _TOMLKeyIndex_update( self->index, self );
+  } else if ( self->keys->size >= TOML_INDEXED_TABLE_SIZE ) {
+    self->index =
+      _TOML_mallocWith( self->allocator, sizeof(struct _TOMLKeyIndex) );
+    _TOMLKeyIndex_init( self->index, self );
+  }
+}
+
+void _TOML_freeText( TOMLTable *table ) {
+  if ( table->text ) {
+    _TOML_deallocWith( table->allocator, table->text->content );
+    _TOML_deallocWith( table->allocator, table->text );
+    table->text = NULL;
+  }
+}
+
+// Free the object with the allocator given, unless it is a table or array,
+// which are freed with their own.
+void _TOML_freeIn( TOMLRef self, TOMLAllocator *allocator ) {
   TOMLBasic *basic = (TOMLBasic *) self;
 
+  if ( basic == NULL ) {
+    return;
+  }
+
+  // Other owners keep the object alive.
+  if ( __atomic_sub_fetch( &basic->refCount, 1, __ATOMIC_ACQ_REL ) > 0 ) {
+    return;
+  }
+
   if ( basic->type == TOML_TABLE ) {
     TOMLTable *table = (TOMLTable *) self;
     TOML_free( table->keys );
     TOML_free( table->values );
+    _TOML_freeText( table );
+    _TOMLTable_dropIndex( table );
+    allocator = table->allocator;
   } else if ( basic->type == TOML_ARRAY ) {
     TOMLArray *array = (TOMLArray *) self;
     int i;
     for ( i = 0; i < array->size; ++i ) {
-      TOML_free( array->members[ i ] );
+      _TOML_release( array, array->members[ i ] );
     }
-    free( array->members );
+    _TOML_deallocWith( array->allocator, array->members );
+    allocator = array->allocator;
   } else if ( basic->type == TOML_ERROR ) {
     TOMLError *error = (TOMLError *) self;
-    free( error->line );
-    free( error->message );
-    free( error->fullDescription );
+    _TOML_deallocWith( allocator, error->line );
+    _TOML_deallocWith( allocator, error->message );
+    _TOML_deallocWith( allocator, error->fullDescription );
   }
 
-  free( self );
+  _TOML_deallocWith( allocator, self );
+}
+
+void TOML_free( TOMLRef self ) {
+  _TOML_freeIn( self, _TOML_currentAllocator() );
 }
 
 int TOML_isType( TOMLRef self, TOMLType type ) {
@@ -360,65 +854,236 @@ TOMLRef TOML_find( TOMLRef self, ... ) {
   return self;
 }
 
-TOMLRef TOMLTable_getKey( TOMLTable *self, char *key ) {
-  int keyLength = strlen( key );
-  int i;
-  for ( i = 0; i < self->keys->size; ++i ) {
-    TOMLString *tableKey = TOMLArray_getIndex( self->keys, i );
-    int minSize = keyLength < tableKey->size ? keyLength : tableKey->size;
-    if ( strncmp( tableKey->content, key, minSize + 1 ) == 0 ) {
-      return TOMLArray_getIndex( self->values, i );
+int _TOMLTable_indexOf( TOMLTable *self, char *key, int size ) {
+  // Keys added without TOMLTable_setKey are not indexed yet, so fall back to
+  // a scan until the next setKey catches the index up.
+  if ( self->index && self->index->count == self->keys->size ) {
+    return _TOMLKeyIndex_lookup( self->index, self, key, size );
+  }
+
+  for ( int i = 0; i < self->keys->size; ++i ) {
+    TOMLString *tableKey = self->keys->members[ i ];
+    if (
+      tableKey->size == size &&
+        memcmp( tableKey->content, key, size ) == 0
+    ) {
+      return i;
     }
   }
-  return NULL;
+  return -1;
 }
 
-void TOMLTable_setKey( TOMLTable *self, char *key, TOMLRef value ) {
-  int keyLength = strlen( key );
-  int i;
-  for ( i = 0; i < self->keys->size; ++i ) {
-    TOMLString *tableKey = TOMLArray_getIndex( self->keys, i );
-    int minSize = keyLength < tableKey->size ? keyLength : tableKey->size;
-    if ( strncmp( tableKey->content, key, minSize ) == 0 ) {
-      TOMLArray_setIndex( self->values, i, value );
-      return;
+void _TOML_clearCache( TOMLBasic *basic ) {
+  if ( basic->type == TOML_TABLE ) {
+    ((TOMLTable *) basic)->hash = 0;
+    ((TOMLTable *) basic)->values->hash = 0;
+    _TOML_freeText( (TOMLTable *) basic );
+  } else if ( basic->type == TOML_ARRAY ) {
+    ((TOMLArray *) basic)->hash = 0;
+  }
+}
+
+// Clear the hashes and kept text of the tables and arrays holding a changed
+// object, since both include its content.
+void _TOML_clearAncestors( TOMLBasic *basic ) {
+  basic = _TOML_loadParent( basic );
+  while ( basic && basic != TOML_LOST_PARENT ) {
+    if ( basic->type == TOML_TABLE ) {
+      ((TOMLTable *) basic)->hash = 0;
+      _TOML_freeText( (TOMLTable *) basic );
+    } else {
+      ((TOMLArray *) basic)->hash = 0;
+    }
+    basic = _TOML_loadParent( basic );
+  }
+}
+
+void TOML_touch( TOMLRef self, ... ) {
+  TOMLBasic *basic = self;
+  va_list args;
+  va_start( args, self );
+
+  char *key;
+
+  while ( basic ) {
+    _TOML_clearCache( basic );
+    if ( basic->type != TOML_TABLE && basic->type != TOML_ARRAY ) {
+      break;
+    }
+    key = va_arg( args, char * );
+    if ( key == NULL ) {
+      break;
+    }
+    if ( basic->type == TOML_TABLE ) {
+      basic = TOMLTable_getKey( (TOMLTable *) basic, key );
+    } else {
+      basic = TOMLArray_getIndex( (TOMLArray *) basic, atoi( key ) );
+    }
+  }
+
+  va_end( args );
+}
+
+// Make the object in the slot of the owner private to it, replacing a shared
+// object with a shallow copy. An object with one owner must be held by the
+// slot, so its parent is set back to the owner in case it was lost. A NULL
+// owner is the caller holding a root.
+TOMLBasic * _TOML_unshare( TOMLArray *owner, TOMLRef *slot ) {
+  TOMLBasic *basic = *slot;
+  if ( __atomic_load_n( &basic->refCount, __ATOMIC_ACQUIRE ) > 1 ) {
+    // Values the owner frees are copied with its allocator.
+    TOMLAllocator *previous = _TOML_threadAllocator;
+    if ( owner ) {
+      TOML_useAllocator( owner->allocator );
+    }
+    *slot = _TOML_copyShallow( basic );
+    TOML_useAllocator( previous );
+    _TOML_release( owner, basic );
+    basic = *slot;
+    if ( basic->type == TOML_TABLE ) {
+      _TOMLTable_updateIndex( (TOMLTable *) basic );
+    }
+    _TOML_adopt( owner, basic );
+  } else if ( owner || _TOML_loadParent( basic ) == TOML_LOST_PARENT ) {
+    _TOML_adopt( owner, basic );
+  }
+  _TOML_clearCache( basic );
+  return basic;
+}
+
+TOMLRef TOML_findMutable( TOMLRef *self, ... ) {
+  TOMLBasic *basic = _TOML_unshare( NULL, self );
+  va_list args;
+  va_start( args, self );
+
+  char *key;
+
+  while ( basic->type == TOML_TABLE || basic->type == TOML_ARRAY ) {
+    key = va_arg( args, char * );
+    if ( key == NULL ) {
+      break;
+    }
+
+    TOMLRef *slot = NULL;
+    TOMLArray *owner;
+    if ( basic->type == TOML_TABLE ) {
+      TOMLTable *table = (TOMLTable *) basic;
+      int index = _TOMLTable_indexOf( table, key, strlen( key ) );
+      owner = table->values;
+      if ( index != -1 ) {
+        slot = &table->values->members[ index ];
+      }
+    } else {
+      TOMLArray *array = (TOMLArray *) basic;
+      int index = atoi( key );
+      owner = array;
+      if ( index >= 0 && index < array->size ) {
+        slot = &array->members[ index ];
+      }
+    }
+
+    if ( slot == NULL ) {
+      basic = NULL;
+      break;
+    }
+    basic = _TOML_unshare( owner, slot );
+  }
+
+  va_end( args );
+  return basic;
+}
+
+TOMLRef TOMLTable_getKey( TOMLTable *self, char *key ) {
+  int index = _TOMLTable_indexOf( self, key, strlen( key ) );
+  return index == -1 ? NULL : self->values->members[ index ];
+}
+
+// Whether other owners hold the object or a table or array holding it, so
+// changing it would change theirs.
+int _TOML_isShared( TOMLRef self ) {
+  TOMLBasic *basic = (TOMLBasic *) self;
+  while ( basic ) {
+    if (
+      basic == TOML_LOST_PARENT ||
+        __atomic_load_n( &basic->refCount, __ATOMIC_ACQUIRE ) > 1
+    ) {
+      return 1;
     }
+    basic = _TOML_loadParent( basic );
+  }
+  return 0;
+}
+
+int TOMLTable_setKey( TOMLTable *self, char *key, TOMLRef value ) {
+  if ( _TOML_isShared( self ) ) {
+    TOML_free( value );
+    return TOML_ERROR_SHARED;
+  }
+
+  int index = _TOMLTable_indexOf( self, key, strlen( key ) );
+  if ( index != -1 ) {
+    TOMLArray_setIndex( self->values, index, value );
+    _TOML_clearCache( (TOMLBasic *) self );
+    return TOML_SUCCESS;
   }
 
-  TOMLArray_append( self->keys, TOML_allocString( key ) );
+  _TOML_clearCache( (TOMLBasic *) self );
+  // The key is freed with the table, so it is made with the table's
+  // allocator.
+  TOMLAllocator *previous = TOML_useAllocator( self->allocator );
+  TOMLString *name = TOML_allocString( key );
+  TOML_useAllocator( previous );
+  TOMLArray_append( self->keys, name );
   TOMLArray_append( self->values, value );
+  _TOMLTable_updateIndex( self );
+  return TOML_SUCCESS;
 }
 
 TOMLRef TOMLArray_getIndex( TOMLArray *self, int index ) {
   return self->members && self->size > index ? self->members[ index ] : NULL;
 }
 
-void TOMLArray_setIndex( TOMLArray *self, int index, TOMLRef value ) {
+int TOMLArray_setIndex( TOMLArray *self, int index, TOMLRef value ) {
+  if ( _TOML_isShared( self ) ) {
+    TOML_free( value );
+    return TOML_ERROR_SHARED;
+  }
+
   if ( index < self->size ) {
-    TOML_free( self->members[ index ] );
+    _TOML_release( self, self->members[ index ] );
     self->members[ index ] = value;
+    _TOML_adopt( self, value );
+    self->hash = 0;
+    _TOML_clearAncestors( (TOMLBasic *) self );
+    return TOML_SUCCESS;
   } else {
-    TOMLArray_append( self, value );
+    return TOMLArray_append( self, value );
   }
 }
 
-void TOMLArray_append( TOMLArray *self, TOMLRef value ) {
-  TOMLRef *oldMembers = self->members;
+int TOMLArray_append( TOMLArray *self, TOMLRef value ) {
+  if ( _TOML_isShared( self ) ) {
+    TOML_free( value );
+    return TOML_ERROR_SHARED;
+  }
 
-  self->members = malloc( ( self->size + 1 ) * sizeof(TOMLRef) );
-  int i = 0;
-  for ( ; i < self->size; ++i ) {
-    self->members[ i ] = oldMembers[ i ];
+  if ( self->size == self->capacity ) {
+    self->capacity = self->capacity ? self->capacity * 2 : 4;
+    self->members = _TOML_reallocWith(
+      self->allocator, self->members, self->capacity * sizeof(TOMLRef)
+    );
   }
-  // memcpy( self->members, oldMembers, self->size * sizeof(TOMLRef) );
+
   self->members[ self->size ] = value;
   self->size++;
-
-  free( oldMembers );
+  self->hash = 0;
+  _TOML_clearAncestors( (TOMLBasic *) self );
+  _TOML_adopt( self, value );
+  return TOML_SUCCESS;
 }
 
 char * TOML_toString( TOMLString *self ) {
-  char *string = malloc( self->size + 1 );
+  char *string = _TOML_malloc( self->size + 1 );
   TOML_copyString( self, self->size + 1, string );
   return string;
 }
@@ -451,11 +1116,11 @@ int TOML_toBoolean( TOMLBoolean *self ) {
 }
 
 TOMLToken * TOML_newToken( TOMLToken *token ) {
-  TOMLToken *heapToken = malloc( sizeof(TOMLToken) );
+  TOMLToken *heapToken = _TOML_malloc( sizeof(TOMLToken) );
   memcpy( heapToken, token, sizeof(TOMLToken) );
 
   int size = token->end - token->start;
-  heapToken->tokenStr = malloc( size + 1 );
+  heapToken->tokenStr = _TOML_malloc( size + 1 );
   heapToken->tokenStr[ size ] = 0;
   strncpy( heapToken->tokenStr, token->start, size );
 
@@ -472,15 +1137,16 @@ void TOML_strcpy( char *buffer, TOMLString *self, int size ) {
   }
 }
 
-char * _TOML_increaseBuffer( char *oldBuffer, int *size ) {
-  int newSize = *size + 1024;
-  char *newBuffer = malloc( newSize + 1 );
+// Double the buffer, keeping its first used bytes.
+char * _TOML_increaseBuffer( char *oldBuffer, int *size, int used ) {
+  int newSize = *size ? *size * 2 : 1024;
+  char *newBuffer = _TOML_malloc( newSize + 1 );
   // Always have a null terminator so TOMLScan can exit without segfault.
   newBuffer[ newSize ] = 0;
 
   if ( oldBuffer ) {
-    strncpy( newBuffer, oldBuffer, *size + 1 );
-    free( oldBuffer );
+    memcpy( newBuffer, oldBuffer, used );
+    _TOML_dealloc( oldBuffer );
   }
 
   *size = newSize;
@@ -488,103 +1154,409 @@ char * _TOML_increaseBuffer( char *oldBuffer, int *size ) {
   return newBuffer;
 }
 
-int TOML_load( char *filename, TOMLTable **dest, TOMLError *error ) {
-  assert( *dest == NULL );
-
-  FILE *fd = fopen( filename, "r" );
-  if ( fd == NULL ) {
-    if ( error ) {
-      error->code = TOML_ERROR_FILEIO;
-      error->lineNo = -1;
-      error->line = NULL;
-
-      int messageSize = strlen( TOMLErrorDescription[ error->code ] );
-      error->message =
-        malloc( messageSize + 1 );
-      strcpy( error->message, TOMLErrorDescription[ error->code ] );
-      error->message[ messageSize ] = 0;
-
-      int fullDescSize = messageSize + strlen( filename ) + 8;
-      error->fullDescription = malloc( fullDescSize + 1 );
-      snprintf(
-        error->fullDescription,
-        fullDescSize,
-        "%s File: %s",
-        error->message,
-        filename
-      );
+// The last newline in the buffer, or NULL.
+char * _TOML_lastNewline( char *buffer, int size ) {
+  for ( char *p = buffer + size; p > buffer; --p ) {
+    if ( p[ -1 ] == '\n' ) {
+      return p - 1;
     }
-
-    return TOML_ERROR_FILEIO;
   }
+  return NULL;
+}
 
-  int bufferSize = 0;
-  char * buffer = _TOML_increaseBuffer( NULL, &bufferSize );
-  int copyBufferSize = 0;
-  char * copyBuffer = _TOML_increaseBuffer( NULL, &copyBufferSize );
-  int read = fread( buffer, 1, bufferSize, fd );
-  int incomplete = read == bufferSize;
-
-  int hTokenId;
+void _TOML_fillPlainError( TOMLError *error, int code ) {
+  if ( !error ) {
+    return;
+  }
+
+  error->code = code;
+  error->lineNo = -1;
+  error->line = NULL;
+  error->message = _TOML_cstringCopy( TOMLErrorDescription[ code ] );
+  error->fullDescription = _TOML_cstringCopy( error->message );
+}
+
+void _TOML_fillFileError( TOMLError *error, char *filename ) {
+  if ( !error ) {
+    return;
+  }
+
+  error->code = TOML_ERROR_FILEIO;
+  error->lineNo = -1;
+  error->line = NULL;
+
+  int messageSize = strlen( TOMLErrorDescription[ error->code ] );
+  error->message =
+    _TOML_malloc( messageSize + 1 );
+  strcpy( error->message, TOMLErrorDescription[ error->code ] );
+  error->message[ messageSize ] = 0;
+
+  if ( !filename ) {
+    error->fullDescription = _TOML_cstringCopy( error->message );
+    return;
+  }
+
+  int fullDescSize = messageSize + strlen( filename ) + 8;
+  error->fullDescription = _TOML_malloc( fullDescSize + 1 );
+  snprintf(
+    error->fullDescription,
+    fullDescSize,
+    "%s File: %s",
+    error->message,
+    filename
+  );
+}
+
+long long _TOML_nanoseconds() {
+  struct timespec time;
+  clock_gettime( CLOCK_MONOTONIC, &time );
+  return time.tv_sec * 1000000000LL + time.tv_nsec;
+}
+
+void _TOML_countToken( TOMLParseStats *stats, int tokenId ) {
+  stats->tokens++;
+  switch ( tokenId ) {
+    case ID:
+      stats->keys++;
+      break;
+    case STRING:
+      stats->strings++;
+      break;
+    case NUMBER:
+      stats->numbers++;
+      break;
+    case TRUE:
+    case FALSE:
+      stats->booleans++;
+      break;
+    case DATE:
+      stats->dates++;
+      break;
+    case LEFT_SQUARE:
+    case RIGHT_SQUARE:
+      stats->brackets++;
+      break;
+    case ID_DOT:
+    case EQ:
+    case COMMA:
+      stats->punctuation++;
+      break;
+    case COMMENT:
+      stats->comments++;
+      break;
+  }
+}
+
+// Scan the next token, timing it when stats are kept and the token is
+// sampled.
+int _TOML_scan( char *p, int *tokenId, TOMLToken *token ) {
+  TOMLParseStats *stats = _TOML_parseStats;
+  if ( stats == NULL || stats->tokens % _TOML_STATS_SAMPLE != 0 ) {
+    return TOMLScan( p, tokenId, token );
+  }
+
+  struct _TOMLStatsSample *sample = &_TOML_statsSample;
+  long long start = _TOML_nanoseconds();
+  int more = TOMLScan( p, tokenId, token );
+  sample->lex += _TOML_nanoseconds() - start;
+  sample->timing = 1;
+  return more;
+}
+
+// Hand a token to the parser, counting it by kind when stats are kept and
+// timing it when it is sampled. Time spent converting numbers and dates is
+// left out.
+void _TOML_parseToken(
+  pTOMLParser parser, int tokenId, TOMLToken *token, TOMLParserState *state
+) {
+  TOMLParseStats *stats = _TOML_parseStats;
+  struct _TOMLStatsSample *sample = &_TOML_statsSample;
+  if ( stats ) {
+    _TOML_countToken( stats, tokenId );
+  }
+  if ( stats == NULL || !sample->timing ) {
+    TOMLParser( parser, tokenId, TOML_newToken( token ), state );
+    return;
+  }
+
+  long long convert = sample->convert;
+  long long start = _TOML_nanoseconds();
+  TOMLParser( parser, tokenId, TOML_newToken( token ), state );
+  sample->parse +=
+    _TOML_nanoseconds() - start - ( sample->convert - convert );
+  sample->timing = 0;
+}
+
+// Read a block of a stdio stream, timing it when stats are kept.
+int _TOML_read( void *source, char *buffer, int size ) {
+  FILE *fd = source;
+  TOMLParseStats *stats = _TOML_parseStats;
+  if ( stats == NULL ) {
+    return fread( buffer, 1, size, fd );
+  }
+
+  long long start = _TOML_nanoseconds();
+  int read = fread( buffer, 1, size, fd );
+  stats->ioNanoseconds += _TOML_nanoseconds() - start;
+  stats->bytes += read;
+  return read;
+}
+
+// Read a block of a file descriptor. Reads from pipes and sockets may come
+// back short, so keep reading until the block is full or the input ends.
+int _TOML_readFd( void *source, char *buffer, int size ) {
+  int fd = *(int *) source;
+  int total = 0;
+  while ( total < size ) {
+    ssize_t count = read( fd, buffer + total, size - total );
+    if ( count <= 0 ) {
+      break;
+    }
+    total += count;
+  }
+  return total;
+}
+
+TOMLNumber * _TOML_convertNumber( char *text ) {
+  int timing = _TOML_parseStats && _TOML_statsSample.timing;
+  long long start = timing ? _TOML_nanoseconds() : 0;
+
+  TOMLNumber *number;
+  if ( strchr( text, '.' ) != NULL ) {
+    number = TOML_allocDouble( atof( text ) );
+  } else {
+    number = TOML_allocInt( atoi( text ) );
+  }
+
+  if ( timing ) {
+    _TOML_statsSample.convert += _TOML_nanoseconds() - start;
+  }
+  return number;
+}
+
+TOMLDate * _TOML_convertDate( char *text ) {
+  int timing = _TOML_parseStats && _TOML_statsSample.timing;
+  long long start = timing ? _TOML_nanoseconds() : 0;
+
+  int year;
+  int month;
+  int day;
+  int hour;
+  int minute;
+  int second;
+  sscanf(
+    text,
+    "%d-%d-%dT%d:%d:%dZ",
+    &year, &month, &day, &hour, &minute, &second
+  );
+  TOMLDate *date = TOML_allocDate( year, month, day, hour, minute, second );
+
+  if ( timing ) {
+    _TOML_statsSample.convert += _TOML_nanoseconds() - start;
+  }
+  return date;
+}
+
+// Escapes become the character they name: \b \t \n \f \r \" \/ and \\, and
+// \uxxxx becomes its character encoded as utf8. Text between escapes is
+// copied once so strings with many escapes still unescape in linear time.
+int _TOML_unescape( char *dest, char *source, int size ) {
+  char *end = source + size;
+  char *destCursor = dest;
+
+  for ( ;; ) {
+    char *next = memchr( source, '\\', end - source );
+    if ( next == NULL || next + 1 == end ) {
+      memcpy( destCursor, source, end - source );
+      return destCursor + ( end - source ) - dest;
+    }
+
+    memcpy( destCursor, source, next - source );
+    destCursor += next - source;
+    source = next + 2;
+
+    switch ( next[ 1 ] ) {
+      case 'b': *destCursor++ = '\b'; break;
+      case 't': *destCursor++ = '\t'; break;
+      case 'f': *destCursor++ = '\f'; break;
+      case 'n': *destCursor++ = '\n'; break;
+      case 'r': *destCursor++ = '\r'; break;
+      case '"': *destCursor++ = '"'; break;
+      case '/': *destCursor++ = '/'; break;
+      case '\\': *destCursor++ = '\\'; break;
+      case 'u': {
+        // Convert a copy of the digits. strtol would read past them into the
+        // rest of the string.
+        char digits[ 5 ] = { 0 };
+        int digitCount = end - source < 4 ? end - source : 4;
+        memcpy( digits, source, digitCount );
+        source += digitCount;
+        int num = strtol( digits, NULL, 16 );
+
+        // Number is in normal ascii range.
+        if ( num < 0x80 ) {
+          *destCursor++ = num;
+        // Split the value into 2 or 3 chars as utf8.
+        } else if ( num < 0x800 ) {
+          *destCursor++ = 0xc0 | ( ( num >> 6 ) & 0x1f );
+          *destCursor++ = 0x80 | ( num & 0x3f );
+        } else {
+          *destCursor++ = 0xe0 | ( ( num >> 12 ) & 0x0f );
+          *destCursor++ = 0x80 | ( ( num >> 6 ) & 0x3f );
+          *destCursor++ = 0x80 | ( num & 0x3f );
+        }
+        break;
+      }
+      default:
+        *destCursor++ = '\\';
+        break;
+    }
+  }
+}
+
+// Scans tokens one at a time from a buffer, or from a source read a block at
+// a time keeping the line being scanned buffered. Tokens point into a buffer
+// that moves as more is read, so text kept past the next token is copied.
+struct _TOMLScanner {
+  // Reads up to size bytes, fewer only at the end of the source. NULL when
+  // scanning a buffer.
+  int (*read)( void *source, char *buffer, int size );
+  void *source;
+  // The buffer a source is read into.
+  char *buffer;
+  int bufferSize;
+  int incomplete;
+  char *lastNewline;
+  int tokenId;
+  TOMLToken token;
+  TOMLToken lastToken;
+};
+
+void _TOMLScanner_initBuffer( struct _TOMLScanner *self, char *buffer ) {
+  memset( self, 0, sizeof(struct _TOMLScanner) );
   TOMLToken token = { 0, NULL, NULL, buffer, 0, buffer, NULL };
-  TOMLToken lastToken = token;
+  self->token = token;
+}
 
-  TOMLTable *topTable = *dest = TOML_allocTable( NULL, NULL );
-  TOMLParserState state = { topTable, topTable, 0, error, &token };
+void _TOMLScanner_initRead(
+  struct _TOMLScanner *self,
+  int (*read)( void *source, char *buffer, int size ),
+  void *source
+) {
+  memset( self, 0, sizeof(struct _TOMLScanner) );
+  self->read = read;
+  self->source = source;
+
+  self->buffer = _TOML_increaseBuffer( NULL, &self->bufferSize, 0 );
+  int size = read( source, self->buffer, self->bufferSize );
+  self->incomplete = size == self->bufferSize;
+  if ( !self->incomplete ) {
+    self->buffer[ size ] = 0;
+  }
+  self->lastNewline = _TOML_lastNewline( self->buffer, size );
 
-  pTOMLParser parser = TOMLParserAlloc( malloc );
+  TOMLToken token = { 0, NULL, NULL, self->buffer, 0, self->buffer, NULL };
+  self->token = self->lastToken = token;
+}
 
-  while (
-    state.errorCode == 0 && (
-      TOMLScan( token.end, &hTokenId, &token ) || incomplete
-    )
+// Scan the next token into token and tokenId. Returns 0 once it is the EOF
+// token.
+int _TOMLScanner_next( struct _TOMLScanner *self ) {
+  TOMLToken *token = &self->token;
+  if (
+    !_TOML_scan( token->end, &self->tokenId, token ) && !self->incomplete
   ) {
-    while ( token.end >= buffer + bufferSize && incomplete ) {
-      int lineSize = buffer + bufferSize - lastToken.lineStart;
-
-      if ( lastToken.lineStart == buffer ) {
-        int oldBufferSize = bufferSize;
-        strncpy( copyBuffer, lastToken.lineStart, lineSize );
-        buffer = _TOML_increaseBuffer( buffer, &bufferSize );
-        copyBuffer = _TOML_increaseBuffer( copyBuffer, &copyBufferSize );
-        strncpy( buffer, copyBuffer, lineSize );
-      } else {
-        strncpy( copyBuffer, lastToken.lineStart, lineSize );
-        strncpy( buffer, copyBuffer, lineSize );
-      }
+    return 0;
+  }
 
-      int read = fread( buffer + lineSize, 1, bufferSize - lineSize, fd );
-      incomplete = read == bufferSize - lineSize;
-      if ( !incomplete ) {
-        buffer[ lineSize + read ] = 0;
-      }
+  // A token cut at the end of the buffer may still scan as a shorter token,
+  // so read more while the rest of the line is not buffered.
+  while (
+    self->incomplete && ( !self->lastNewline || token->end > self->lastNewline )
+  ) {
+    char *buffer = self->buffer;
+    int lineSize = buffer + self->bufferSize - self->lastToken.lineStart;
+
+    // Move the line being scanned to the front, and grow the buffer when the
+    // line already fills it. Doubling keeps long lines linear.
+    if ( self->lastToken.lineStart == buffer ) {
+      buffer = self->buffer =
+        _TOML_increaseBuffer( buffer, &self->bufferSize, lineSize );
+    } else {
+      memmove( buffer, self->lastToken.lineStart, lineSize );
+    }
 
-      token = lastToken;
-      token.end = buffer + ( token.end - token.lineStart );
-      token.lineStart = buffer;
-      lastToken = token;
-      TOMLScan( token.end, &hTokenId, &token );
+    int size = self->read(
+      self->source, buffer + lineSize, self->bufferSize - lineSize
+    );
+    self->incomplete = size == self->bufferSize - lineSize;
+    if ( !self->incomplete ) {
+      buffer[ lineSize + size ] = 0;
     }
+    self->lastNewline = _TOML_lastNewline( buffer + lineSize, size );
 
-    lastToken = token;
+    *token = self->lastToken;
+    token->end = buffer + ( token->end - token->lineStart );
+    token->lineStart = buffer;
+    self->lastToken = *token;
+    _TOML_scan( token->end, &self->tokenId, token );
+  }
+
+  self->lastToken = *token;
+  return self->tokenId != EOF;
+}
+
+void _TOMLScanner_free( struct _TOMLScanner *self ) {
+  _TOML_dealloc( self->buffer );
+}
 
-    int tmpSize = token.end - token.start;
-    char *tmp = malloc( tmpSize + 1 );
-    strncpy( tmp, token.start, tmpSize );
-    tmp[ tmpSize ] = 0;
-    free( tmp );
+// Receives each token _TOML_scanTokens scans. Returns non-zero to stop.
+typedef int (*_TOMLTokenHandler)( void *context, int tokenId, TOMLToken * );
 
-    TOMLParser( parser, hTokenId, TOML_newToken( &token ), &state );
+// Hand each token to the handler, ending with the EOF token unless the
+// handler stops first.
+void _TOML_scanTokens(
+  struct _TOMLScanner *scanner, _TOMLTokenHandler handler, void *context
+) {
+  while ( _TOMLScanner_next( scanner ) ) {
+    if ( handler( context, scanner->tokenId, &scanner->token ) ) {
+      return;
+    }
   }
+  handler( context, scanner->tokenId, &scanner->token );
+}
 
-  if ( state.errorCode == 0 ) {
-    TOMLParser( parser, hTokenId, TOML_newToken( &token ), &state );
+struct _TOMLLoad {
+  pTOMLParser parser;
+  TOMLParserState *state;
+};
+
+int _TOML_loadToken( void *context, int tokenId, TOMLToken *token ) {
+  struct _TOMLLoad *self = context;
+  self->state->token = token;
+  _TOML_parseToken( self->parser, tokenId, token, self->state );
+  return self->state->errorCode;
+}
+
+int TOML_load( char *filename, TOMLTable **dest, TOMLError *error ) {
+  assert( *dest == NULL );
+
+  FILE *fd = fopen( filename, "r" );
+  if ( fd == NULL ) {
+    _TOML_fillFileError( error, filename );
+    return TOML_ERROR_FILEIO;
   }
 
-  TOMLParserFree( parser, free );
+  TOMLTable *topTable = *dest = TOML_allocTable( NULL, NULL );
+  TOMLParserState state = { topTable, topTable, 0, error, NULL };
+
+  struct _TOMLLoad load = { TOMLParserAlloc( _TOML_malloc ), &state };
+  struct _TOMLScanner scanner;
+  _TOMLScanner_initRead( &scanner, _TOML_read, fd );
+  _TOML_scanTokens( &scanner, _TOML_loadToken, &load );
 
-  free( copyBuffer );
-  free( buffer );
+  _TOMLScanner_free( &scanner );
+  TOMLParserFree( load.parser, _TOML_dealloc );
   fclose( fd );
 
   if ( state.errorCode != 0 ) {
@@ -596,8 +1568,6 @@ int TOML_load( char *filename, TOMLTable **dest, TOMLError *error ) {
   return 0;
 }
 
-// int TOML_dump( char *filename, TOMLTable * );
-
 int TOML_parse( char *buffer, TOMLTable **dest, TOMLError *error ) {
   assert( *dest == NULL );
 
@@ -607,17 +1577,19 @@ int TOML_parse( char *buffer, TOMLTable **dest, TOMLError *error ) {
   TOMLTable *topTable = *dest = TOML_allocTable( NULL, NULL );
   TOMLParserState state = { topTable, topTable, 0, error, &token };
 
-  pTOMLParser parser = TOMLParserAlloc( malloc );
+  pTOMLParser parser = TOMLParserAlloc( _TOML_malloc );
 
-  while ( state.errorCode == 0 && TOMLScan( token.end, &hTokenId, &token ) ) {
-    TOMLParser( parser, hTokenId, TOML_newToken( &token ), &state );
+  while (
+    state.errorCode == 0 && _TOML_scan( token.end, &hTokenId, &token )
+  ) {
+    _TOML_parseToken( parser, hTokenId, &token, &state );
   }
 
   if ( state.errorCode == 0 ) {
-    TOMLParser( parser, hTokenId, TOML_newToken( &token ), &state );
+    _TOML_parseToken( parser, hTokenId, &token, &state );
   }
 
-  TOMLParserFree( parser, free );
+  TOMLParserFree( parser, _TOML_dealloc );
 
   if ( state.errorCode != 0 ) {
     TOML_free( *dest );
@@ -628,346 +1600,4378 @@ int TOML_parse( char *buffer, TOMLTable **dest, TOMLError *error ) {
   return 0;
 }
 
-TOMLString ** _TOML_increaseNameStack(
-  TOMLString **nameStack, int *nameStackSize
-) {
-  TOMLString **oldStack = nameStack;
-  int oldSize = *nameStackSize;
-  *nameStackSize += 16;
-  nameStack = malloc( *nameStackSize * sizeof(TOMLString *) );
-  if ( oldStack ) {
-    memcpy( nameStack, oldStack, oldSize );
-    free( oldStack );
+// Count the values below a parsed table by type and find how deep they nest.
+void _TOML_countNodes( TOMLParseStats *stats, TOMLBasic *node, int depth ) {
+  stats->nodes[ node->type ]++;
+  if ( depth > stats->maxDepth ) {
+    stats->maxDepth = depth;
+  }
+
+  if ( node->type == TOML_TABLE ) {
+    TOMLArray *values = ((TOMLTable *) node)->values;
+    for ( int i = 0; i < values->size; ++i ) {
+      _TOML_countNodes( stats, values->members[ i ], depth + 1 );
+    }
+  } else if ( node->type == TOML_ARRAY ) {
+    TOMLArray *array = (TOMLArray *) node;
+    for ( int i = 0; i < array->size; ++i ) {
+      _TOML_countNodes( stats, array->members[ i ], depth + 1 );
+    }
   }
-  return nameStack;
 }
 
-void _TOML_stringifyPushName(
-  struct _TOMLStringifyData *self, TOMLRef src
+// Run TOML_parse or TOML_load keeping stats. The parse is timed whole, and
+// the time not spent reading is split in the proportions of the sampled
+// tokens.
+int _TOML_parseTimed(
+  int (*parse)( char *, TOMLTable **, TOMLError * ),
+  char *source, TOMLTable **dest, TOMLParseStats *stats, TOMLError *error
 ) {
-  if ( self->tableNameDepth >= self->tableNameStackSize ) {
-    self->tableNameStack = _TOML_increaseNameStack(
-      self->tableNameStack,
-      &( self->tableNameStackSize )
-    );
+  TOMLParseStats *previous = _TOML_parseStats;
+  struct _TOMLStatsSample previousSample = _TOML_statsSample;
+  struct _TOMLStatsSample *sample = &_TOML_statsSample;
+  memset( sample, 0, sizeof(struct _TOMLStatsSample) );
+  _TOML_parseStats = stats;
+
+  long long start = _TOML_nanoseconds();
+  int errorCode = parse( source, dest, error );
+  double total = _TOML_nanoseconds() - start - stats->ioNanoseconds;
+
+  double sampled = sample->lex + sample->parse + sample->convert;
+  if ( sampled > 0 ) {
+    stats->lexNanoseconds = total * sample->lex / sampled;
+    stats->convertNanoseconds = total * sample->convert / sampled;
   }
-  self->tableNameStack[ self->tableNameDepth ] = src;
-  self->tableNameDepth++;
+  stats->parseNanoseconds =
+    total - stats->lexNanoseconds - stats->convertNanoseconds;
+
+  _TOML_parseStats = previous;
+  _TOML_statsSample = previousSample;
+
+  if ( errorCode == 0 ) {
+    _TOML_countNodes( stats, (TOMLBasic *) *dest, 1 );
+  }
+  return errorCode;
 }
 
-void _TOML_stringifyPopName(
-  struct _TOMLStringifyData *self
+int TOML_parseWithStats(
+  char *buffer, TOMLTable **dest, TOMLParseStats *stats, TOMLError *error
 ) {
-  self->tableNameDepth--;
-  self->tableNameStack[ self->tableNameDepth ] = NULL;
+  memset( stats, 0, sizeof(TOMLParseStats) );
+  stats->bytes = strlen( buffer );
+  return _TOML_parseTimed( TOML_parse, buffer, dest, stats, error );
 }
 
-void _TOML_stringifyText( struct _TOMLStringifyData *self, char *text, int n ) {
-  if ( self->bufferIndex + n + 1 >= self->bufferSize ) {
-    self->buffer = _TOML_increaseBuffer( self->buffer, &self->bufferSize );
-  }
-  strncpy( self->buffer + self->bufferIndex, text, n );
-  self->bufferIndex += n;
-  self->buffer[ self->bufferIndex ] = 0;
+int TOML_loadWithStats(
+  char *filename, TOMLTable **dest, TOMLParseStats *stats, TOMLError *error
+) {
+  memset( stats, 0, sizeof(TOMLParseStats) );
+  return _TOML_parseTimed( TOML_load, filename, dest, stats, error );
 }
 
-void _TOML_stringifyTableHeader(
-  struct _TOMLStringifyData *self, TOMLTable *table
-) {
-  TOMLBasic *first = TOMLArray_getIndex( table->values, 0 );
-  if (
-    !first ||
-      first->type == TOML_TABLE || (
-      first->type == TOML_ARRAY &&
-      ((TOMLArray *) first)->memberType == TOML_TABLE
-    )
-  ) {
-    return;
-  }
+int _TOMLTable_keyIndex( TOMLTable *self, TOMLString *key ) {
+  return _TOMLTable_indexOf( self, key->content, key->size );
+}
 
-  if ( self->bufferIndex != 0 ) {
-    _TOML_stringifyText( self, "\n", 1 );
+// Kinds of paths the duplicate check and TOML_reparse remember. Tables a
+// longer header only passes through are TOML_PATH_PASSED.
+enum {
+  TOML_PATH_TABLE,
+  TOML_PATH_VALUE,
+  TOML_PATH_ARRAY,
+  TOML_PATH_PASSED
+};
+
+struct _TOMLPathEntry {
+  char *path;
+  int size;
+  int kind;
+  // Tables so far in an array of tables.
+  int count;
+};
+
+// An open addressed hash set of paths.
+struct _TOMLPathSet {
+  int mask;
+  int count;
+  struct _TOMLPathEntry *entries;
+};
+
+struct _TOMLPathEntry * _TOMLPathSet_find(
+  struct _TOMLPathSet *self, char *path, int size
+) {
+  if ( self->entries == NULL ) {
+    return NULL;
   }
 
-  _TOML_stringifyText( self, "[", 1 );
-  for ( int i = 0; i < self->tableNameDepth; ++i ) {
-    TOMLString *tableName = self->tableNameStack[ i ];
-    if ( i > 0 ) {
-      _TOML_stringifyText( self, ".", 1 );
+  int slot = _TOML_hashBytes( path, size ) & self->mask;
+  while ( self->entries[ slot ].path ) {
+    struct _TOMLPathEntry *entry = &self->entries[ slot ];
+    if ( entry->size == size && memcmp( entry->path, path, size ) == 0 ) {
+      return entry;
     }
-    _TOML_stringifyText( self, tableName->content, tableName->size );
+    slot = ( slot + 1 ) & self->mask;
   }
-  _TOML_stringifyText( self, "]\n", 2 );
+  return NULL;
 }
 
-void _TOML_stringifyArrayHeader( struct _TOMLStringifyData *self ) {
-  if ( self->bufferIndex != 0 ) {
-    _TOML_stringifyText( self, "\n", 1 );
+void _TOMLPathSet_insert(
+  struct _TOMLPathSet *self, struct _TOMLPathEntry *entry
+) {
+  int slot = _TOML_hashBytes( entry->path, entry->size ) & self->mask;
+  while ( self->entries[ slot ].path ) {
+    slot = ( slot + 1 ) & self->mask;
   }
+  self->entries[ slot ] = *entry;
+}
 
-  _TOML_stringifyText( self, "[[", 2 );
-  for ( int i = 0; i < self->tableNameDepth; ++i ) {
-    TOMLString *tableName = self->tableNameStack[ i ];
-    if ( i > 0 ) {
-      _TOML_stringifyText( self, ".", 1 );
+// Add a path that is not in the set yet. Returns its entry, which moves when
+// the next path is added.
+struct _TOMLPathEntry * _TOMLPathSet_add(
+  struct _TOMLPathSet *self, char *path, int size, int kind
+) {
+  // Grow when half full.
+  if ( self->entries == NULL || ( self->count + 1 ) * 2 > self->mask + 1 ) {
+    struct _TOMLPathSet grown = { self->entries ? self->mask * 2 + 1 : 63 };
+    int slotsSize = ( grown.mask + 1 ) * sizeof(struct _TOMLPathEntry);
+    grown.entries = _TOML_malloc( slotsSize );
+    memset( grown.entries, 0, slotsSize );
+    for ( int i = 0; self->entries && i <= self->mask; ++i ) {
+      if ( self->entries[ i ].path ) {
+        _TOMLPathSet_insert( &grown, &self->entries[ i ] );
+      }
     }
-    _TOML_stringifyText( self, tableName->content, tableName->size );
+    _TOML_dealloc( self->entries );
+    self->mask = grown.mask;
+    self->entries = grown.entries;
   }
-  _TOML_stringifyText( self, "]]\n", 3 );
+
+  struct _TOMLPathEntry entry = { _TOML_malloc( size + 1 ), size, kind, 0 };
+  memcpy( entry.path, path, size );
+  entry.path[ size ] = 0;
+  _TOMLPathSet_insert( self, &entry );
+  self->count++;
+  return _TOMLPathSet_find( self, path, size );
 }
 
-void _TOML_stringifyString(
-  struct _TOMLStringifyData *self, TOMLString *string
-) {
-  char *cursor = string->content;
-  while ( cursor != NULL ) {
-    // Scan for escapable character or unicode.
-    char *next = cursor;
-    unsigned int ch = *next;
-    for ( ;
-      !(
-        ch == 0 ||
-          ch == '\b' ||
-          ch == '\t' ||
-          ch == '\f' ||
-          ch == '\n' ||
-          ch == '\r' ||
-          ch == '"' ||
-          ch == '/' ||
-          ch == '\\' ||
-          ch > 0x7f
-      );
-      next++, ch = *next
-    ) {}
+void _TOMLPathSet_free( struct _TOMLPathSet *self ) {
+  for ( int i = 0; self->entries && i <= self->mask; ++i ) {
+    _TOML_dealloc( self->entries[ i ].path );
+  }
+  _TOML_dealloc( self->entries );
+}
 
-    if ( *next == 0 ) {
-      next = NULL;
-    }
-
-    // Copy text up to character and then insert escaped character.
-    if ( next ) {
-      _TOML_stringifyText( self, cursor, next - cursor );
-
-      #define REPLACE( match, value ) \
-      if ( *next == match ) { \
-        _TOML_stringifyText( self, value, 2 ); \
-      }
-      REPLACE( '\b', "\\b" )
-      else REPLACE( '\t', "\\t" )
-      else REPLACE( '\f', "\\f" )
-      else REPLACE( '\n', "\\n" )
-      else REPLACE( '\r', "\\r" )
-      else REPLACE( '"', "\\\"" )
-      else REPLACE( '/', "\\/" )
-      else REPLACE( '\\', "\\\\" )
-      #undef REPLACE
-      else if ( ((unsigned int) *next ) > 0x7f ) {
-        int num = 0;
-        int chsize;
-
-        // Decode the numeric representation of the utf8 character
-        if ( ( *next & 0xe0 ) == 0xe0 ) {
-          chsize = 3;
-          num =
-            ( ( next[0] & 0x0f ) << 12 ) |
-              ( ( next[1] & 0x3f ) << 6 ) |
-              ( next[2] & 0x3f );
-        } else if ( ( *next & 0xc0 ) == 0xc0 ) {
-          chsize = 2;
-          num =
-            ( ( next[0] & 0x1f ) << 6 ) |
-              ( next[1] & 0x3f );
-        } else {
-          assert( 0 );
-        }
+// A table header found by _TOML_findHeaders.
+struct _TOMLHeader {
+  // Offset of the opening bracket.
+  int start;
+  int kind;
+  // The dotted path, at this offset in the list's paths.
+  int pathStart;
+  int pathSize;
+};
 
-        // Stringify \uxxxx
-        char utf8Buffer[5];
-        snprintf( utf8Buffer, 5, "%04x", num );
-        _TOML_stringifyText( self, "\\u", 2 );
-        _TOML_stringifyText( self, utf8Buffer, 4 );
+// The table headers of a buffer in order. They are found with the scanner,
+// so brackets in strings, comments and array values are not taken for
+// headers.
+struct _TOMLHeaderList {
+  int count;
+  int capacity;
+  struct _TOMLHeader *headers;
+  struct _TOMLStringBuffer paths;
+  // Non-zero if the scanner found text that cannot be valid, like invalid
+  // tokens or a header after a key. Sections parsed alone can miss it.
+  int invalid;
+};
 
-        next += chsize - 1;
+// Find the headers of the buffer from the given offset, which must start a
+// header or the buffer, up to the first header at or after until.
+void _TOML_findHeaders(
+  char *buffer, int from, int until, struct _TOMLHeaderList *self
+) {
+  int hTokenId;
+  TOMLToken token = {
+    0, NULL, NULL, buffer + from, 0, buffer + from, NULL
+  };
+  // Open array brackets, and the last token other than a comment, which
+  // tell an array value from a header.
+  int depth = 0;
+  int last = 0;
+
+  while ( TOMLScan( token.end, &hTokenId, &token ) ) {
+    if ( hTokenId == COMMENT ) {
+      continue;
+    } else if ( hTokenId != LEFT_SQUARE || depth > 0 || last == EQ ) {
+      if ( hTokenId == LEFT_SQUARE ) {
+        depth++;
+      } else if ( hTokenId == RIGHT_SQUARE && depth > 0 ) {
+        depth--;
       }
+      last = hTokenId;
+      continue;
+    }
 
-      next++;
-    // Copy everything up to the end.
-    } else {
-      _TOML_stringifyText( self, cursor, strlen( cursor ) );
+    // A header must follow a value or another header.
+    if ( last == ID || last == ID_DOT || last == COMMA ) {
+      self->invalid = 1;
+    }
+
+    if ( self->count == self->capacity ) {
+      self->capacity = self->capacity ? self->capacity * 2 : 16;
+      self->headers = _TOML_realloc(
+        self->headers, self->capacity * sizeof(struct _TOMLHeader)
+      );
+    }
+    struct _TOMLHeader *header = &self->headers[ self->count++ ];
+    header->start = token.start - buffer;
+    if ( header->start >= until ) {
+      header->kind = TOML_PATH_TABLE;
+      header->pathStart = self->paths.size;
+      header->pathSize = 0;
+      return;
+    }
+    header->kind = TOML_PATH_TABLE;
+    header->pathStart = self->paths.size;
+
+    TOMLScan( token.end, &hTokenId, &token );
+    if ( hTokenId == LEFT_SQUARE ) {
+      header->kind = TOML_PATH_ARRAY;
+      TOMLScan( token.end, &hTokenId, &token );
+    }
+    while ( hTokenId == ID || hTokenId == ID_DOT ) {
+      _TOMLWriter_writeString(
+        &self->paths, token.start, token.end - token.start
+      );
+      TOMLScan( token.end, &hTokenId, &token );
     }
+    header->pathSize = self->paths.size - header->pathStart;
 
-    cursor = next;
+    // The closing brackets end the header.
+    if ( hTokenId != RIGHT_SQUARE ) {
+      self->invalid = 1;
+    }
+    while ( hTokenId == RIGHT_SQUARE ) {
+      TOMLScan( token.end, &hTokenId, &token );
+    }
+    last = RIGHT_SQUARE;
+    if ( hTokenId == EOF ) {
+      break;
+    }
+    // The token after the header is looked at again by the loop.
+    token.end = token.start;
+  }
+
+  if ( *token.start != 0 ) {
+    self->invalid = 1;
   }
 }
 
-void _TOML_stringifyEntry(
-  struct _TOMLStringifyData *self, TOMLString *key, TOMLBasic *value
-) {
-  _TOML_stringifyText( self, key->content, key->size );
-  _TOML_stringifyText( self, " = ", 3 );
+void _TOMLHeaderList_free( struct _TOMLHeaderList *self ) {
+  _TOML_dealloc( self->headers );
+  _TOML_dealloc( self->paths.content );
+}
 
-  if ( value->type == TOML_STRING ) {
-    _TOML_stringifyText( self, "\"", 1 );
-    _TOML_stringifyString( self, (TOMLString *) value );
-    _TOML_stringifyText( self, "\"", 1 );
-  } else {
-    _TOML_stringify( self, value );
+// Index of the first header starting at or after the offset, or count.
+int _TOML_headerAfter( struct _TOMLHeaderList *self, int offset ) {
+  int low = 0;
+  int high = self->count;
+  while ( low < high ) {
+    int middle = ( low + high ) / 2;
+    if ( self->headers[ middle ].start < offset ) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
   }
+  return low;
+}
 
-  _TOML_stringifyText( self, "\n", 1 );
+// Start of the section holding the byte at the given index. Only headers
+// starting before that byte are considered, and the bytes before it decide
+// them, so the answer is the same for both buffers sharing the prefix.
+int _TOML_sectionStart( struct _TOMLHeaderList *self, int at ) {
+  int index = _TOML_headerAfter( self, at );
+  return index > 0 ? self->headers[ index - 1 ].start : 0;
 }
 
-int _TOML_stringify(
-  struct _TOMLStringifyData *self, TOMLRef src
-) {
-  // Cast to TOMLBasic to discover type.
-  TOMLBasic *basic = src;
+// Start of the first header at or after the given index, or size.
+int _TOML_sectionEnd( struct _TOMLHeaderList *self, int from, int size ) {
+  int index = _TOML_headerAfter( self, from );
+  return index < self->count ? self->headers[ index ].start : size;
+}
 
-  // if null
-  if ( src == NULL ) {
-    _TOML_stringifyText( self, "(null)", 6 );
-  // if table
-  } else if ( basic->type == TOML_TABLE ) {
-    TOMLTable *table = src;
+int _TOML_isTableArray( TOMLBasic *value ) {
+  return
+    value->type == TOML_ARRAY &&
+      ((TOMLArray *) value)->memberType == TOML_TABLE;
+}
 
-    // loop keys
-    for ( int i = 0; i < table->keys->size; ++i ) {
-      TOMLRef key = TOMLArray_getIndex( table->keys, i );
-      TOMLRef value = TOMLArray_getIndex( table->values, i  );
-      TOMLBasic *basicValue = value;
+// Remember the path of every header between start and end, and every table
+// the header passes through.
+void _TOML_scanHeaders(
+  struct _TOMLHeaderList *list, int start, int end,
+  struct _TOMLPathSet *headers
+) {
+  for (
+    int i = _TOML_headerAfter( list, start );
+    i < list->count && list->headers[ i ].start < end;
+    ++i
+  ) {
+    struct _TOMLHeader *header = &list->headers[ i ];
+    char *path = list->paths.content + header->pathStart;
+    for ( int j = 0; j < header->pathSize; ++j ) {
+      if ( path[ j ] == '.' && !_TOMLPathSet_find( headers, path, j ) ) {
+        _TOMLPathSet_add( headers, path, j, TOML_PATH_PASSED );
+      }
+    }
 
-      // if value is table, print header, recurse
-      if ( basicValue->type == TOML_TABLE ) {
-        TOMLTable *tableValue = value;
-        _TOML_stringifyPushName( self, key );
-        _TOML_stringifyTableHeader( self, value );
-        _TOML_stringify( self, value );
-        _TOML_stringifyPopName( self );
-      // if value is array
-      } else if ( basicValue->type == TOML_ARRAY ) {
-        TOMLArray *array = value;
+    struct _TOMLPathEntry *entry =
+      _TOMLPathSet_find( headers, path, header->pathSize );
+    if ( !entry ) {
+      _TOMLPathSet_add( headers, path, header->pathSize, header->kind );
+    } else if ( entry->kind == TOML_PATH_PASSED ) {
+      entry->kind = header->kind;
+    }
+  }
+}
 
-        // if value is object array
-        if ( array->memberType == TOML_TABLE ) {
-          // loop indices, print headers, recurse
-          for ( int j = 0; j < array->size; ++j ) {
-            _TOML_stringifyPushName( self, key );
-            _TOML_stringifyArrayHeader( self );
-            _TOML_stringify( self, TOMLArray_getIndex( array, j ) );
-            _TOML_stringifyPopName( self );
-          }
-        } else {
-          // print entry line with dense (no newlines) array
-          _TOML_stringifyEntry( self, key, value );
+// Whether a later header names a table an earlier header already named or
+// passed through, which the parser reports as defined twice.
+int _TOML_headersClash(
+  struct _TOMLPathSet *earlier, struct _TOMLPathSet *later
+) {
+  for ( int i = 0; later->entries && i <= later->mask; ++i ) {
+    struct _TOMLPathEntry *entry = &later->entries[ i ];
+    if (
+      entry->path && entry->kind != TOML_PATH_PASSED &&
+        _TOMLPathSet_find( earlier, entry->path, entry->size )
+    ) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Append a key to a dotted path. Returns the size to cut the path back to.
+int _TOML_pushPath( struct _TOMLStringBuffer *path, TOMLString *key ) {
+  int size = path->size;
+  if ( size > 0 ) {
+    _TOMLWriter_writeString( path, ".", 1 );
+  }
+  _TOMLWriter_writeString( path, key->content, key->size );
+  return size;
+}
+
+// Whether the entry of the table at path was made by text before the
+// section. Tables are made by the first header naming or passing through
+// them and other entries by the header naming their table.
+int _TOML_isBefore(
+  struct _TOMLPathSet *before, struct _TOMLStringBuffer *path,
+  TOMLString *key, TOMLBasic *value
+) {
+  if ( value->type == TOML_TABLE || _TOML_isTableArray( value ) ) {
+    int size = _TOML_pushPath( path, key );
+    int found = _TOMLPathSet_find( before, path->content, path->size ) != NULL;
+    path->size = size;
+    return found;
+  }
+
+  struct _TOMLPathEntry *entry =
+    _TOMLPathSet_find( before, path->content, path->size );
+  return entry && entry->kind == TOML_PATH_TABLE;
+}
+
+int _TOML_parseSection( char *start, int size, TOMLTable **dest ) {
+  char *buffer = _TOML_malloc( size + 1 );
+  memcpy( buffer, start, size );
+  buffer[ size ] = 0;
+  int errorCode = TOML_parse( buffer, dest, NULL );
+  _TOML_dealloc( buffer );
+  return errorCode;
+}
+
+// A table in a parsed section holds entries or is empty only if the section
+// named it in a header. Otherwise it was created for a longer header.
+int _TOML_isNamedTable( TOMLTable *table ) {
+  if ( table->values->size == 0 ) {
+    return 1;
+  }
+  for ( int i = 0; i < table->values->size; ++i ) {
+    if ( ((TOMLBasic *) table->values->members[ i ])->type != TOML_TABLE ) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Count the keys _TOML_spliceSection will remove from doc. Returns -1 if doc
+// does not match the old section or the removal needs a full parse.
+int _TOML_countRemoved(
+  TOMLTable *doc, TOMLTable *oldSection, TOMLTable *newSection,
+  struct _TOMLPathSet *before, struct _TOMLStringBuffer *path
+) {
+  int count = 0;
+  for ( int i = 0; i < oldSection->keys->size; ++i ) {
+    TOMLString *key = oldSection->keys->members[ i ];
+    TOMLBasic *oldValue = oldSection->values->members[ i ];
+    int index = _TOMLTable_keyIndex( doc, key );
+    if ( index == -1 || _TOML_isTableArray( oldValue ) ) {
+      return -1;
+    }
+
+    TOMLBasic *docValue = doc->values->members[ index ];
+    TOMLBasic *newValue =
+      newSection ? TOMLTable_getKey( newSection, key->content ) : NULL;
+    if (
+      ( oldValue->type == TOML_TABLE ) != ( docValue->type == TOML_TABLE )
+    ) {
+      return -1;
+    }
+
+    if ( oldValue->type == TOML_TABLE ) {
+      int size = _TOML_pushPath( path, key );
+      int removed = _TOML_countRemoved(
+        (TOMLTable *) docValue,
+        (TOMLTable *) oldValue,
+        newValue && newValue->type == TOML_TABLE ?
+          (TOMLTable *) newValue :
+          NULL,
+        before,
+        path
+      );
+      path->size = size;
+      if ( removed == -1 ) {
+        return -1;
+      }
+      if ( !newValue && removed == ((TOMLTable *) docValue)->keys->size ) {
+        // A table the section only passed through may be named by an empty
+        // header elsewhere.
+        if ( !_TOML_isNamedTable( (TOMLTable *) oldValue ) ) {
+          return -1;
         }
-      } else {
-        // if value is string or number, print entry
-        _TOML_stringifyEntry( self, key, value );
+        count++;
+      } else if (
+        !newValue && !_TOML_isBefore( before, path, key, docValue )
+      ) {
+        // The table now starts at a later header, which decides its place.
+        return -1;
       }
+    } else if ( !newValue || !TOML_equal( docValue, newValue ) ) {
+      count++;
     }
-  // if array
-  } else if ( basic->type == TOML_ARRAY ) {
-    TOMLArray *array = src;
+  }
+  return count;
+}
 
-    // print array densely
-    _TOML_stringifyText( self, "[", 1 );
-    for ( int i = 0; i < array->size; ++i ) {
-      _TOML_stringifyText( self, " ", 1 );
-      TOMLBasic *arrayValue = TOMLArray_getIndex( array, i );
-      if ( arrayValue->type == TOML_STRING ) {
-        _TOML_stringifyText( self, "\"", 1 );
-        _TOML_stringifyString( self, (TOMLString *) arrayValue );
-        _TOML_stringifyText( self, "\"", 1 );
-      } else {
-        _TOML_stringify( self, arrayValue );
+// The new section may only define tables and entries the old section
+// defined or that doc does not have. Anything else depends on the order of
+// definitions and needs a full parse to report correctly.
+int _TOML_canMergeSection(
+  TOMLTable *doc, TOMLTable *oldSection, TOMLTable *newSection
+) {
+  for ( int i = 0; i < newSection->keys->size; ++i ) {
+    TOMLString *key = newSection->keys->members[ i ];
+    TOMLBasic *newValue = newSection->values->members[ i ];
+    int docIndex = doc ? _TOMLTable_keyIndex( doc, key ) : -1;
+    int oldIndex = oldSection ? _TOMLTable_keyIndex( oldSection, key ) : -1;
+    TOMLBasic *docValue =
+      docIndex != -1 ? doc->values->members[ docIndex ] : NULL;
+    TOMLBasic *oldValue =
+      oldIndex != -1 ? oldSection->values->members[ oldIndex ] : NULL;
+
+    if ( _TOML_isTableArray( newValue ) ) {
+      return 0;
+    }
+
+    if (
+      oldValue &&
+        ( oldValue->type == TOML_TABLE ) != ( newValue->type == TOML_TABLE )
+    ) {
+      return 0;
+    }
+
+    if ( newValue->type != TOML_TABLE ) {
+      if ( docValue && !oldValue ) {
+        return 0;
       }
-      if ( i != array->size - 1 ) {
-        _TOML_stringifyText( self, ",", 1 );
-      } else {
-        _TOML_stringifyText( self, " ", 1 );
+      continue;
+    }
+
+    if ( docValue && docValue->type != TOML_TABLE ) {
+      return 0;
+    }
+
+    // Whether a header may reach a table named elsewhere depends on which
+    // comes first in the file.
+    if (
+      docValue && (
+        !oldValue || (
+          _TOML_isNamedTable( (TOMLTable *) newValue ) &&
+            !_TOML_isNamedTable( (TOMLTable *) oldValue )
+        )
+      )
+    ) {
+      return 0;
+    }
+
+    if (
+      docValue &&
+        !_TOML_canMergeSection(
+          (TOMLTable *) docValue, (TOMLTable *) oldValue, (TOMLTable *) newValue
+        )
+    ) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Marks _TOML_spliceSection keeps for the entries of doc.
+enum {
+  TOML_SPLICE_BEFORE = 1,
+  TOML_SPLICE_OLD = 2,
+  TOML_SPLICE_TAKEN = 4,
+  // A table made before the section that the splice left empty.
+  TOML_SPLICE_EMPTIED = 8
+};
+
+// Replace what the old section defined in doc with what the new section
+// defines, leaving NULL behind in the new section for each value moved into
+// doc. Entries whose value did not change are kept. Keys come out in the
+// order a full parse gives: first those made before the section, then those
+// the new section makes, in its order, then those made after it. Each table
+// is rebuilt in one pass and its key index once.
+void _TOML_spliceSection(
+  TOMLTable *doc, TOMLTable *oldSection, TOMLTable *newSection,
+  struct _TOMLPathSet *before, struct _TOMLStringBuffer *path
+) {
+  int docSize = doc->keys->size;
+  int oldSize = oldSection ? oldSection->keys->size : 0;
+  int newSize = newSection ? newSection->keys->size : 0;
+
+  char *marks = _TOML_malloc( docSize + 1 );
+  for ( int i = 0; i < docSize; ++i ) {
+    marks[ i ] = _TOML_isBefore(
+      before, path, doc->keys->members[ i ], doc->values->members[ i ]
+    ) ? TOML_SPLICE_BEFORE : 0;
+  }
+  for ( int i = 0; i < oldSize; ++i ) {
+    marks[ _TOMLTable_keyIndex( doc, oldSection->keys->members[ i ] ) ] |=
+      TOML_SPLICE_OLD;
+  }
+
+  int capacity = docSize + newSize > 0 ? docSize + newSize : 1;
+  TOMLRef *keys = _TOML_malloc( capacity * sizeof(TOMLRef) );
+  TOMLRef *values = _TOML_malloc( capacity * sizeof(TOMLRef) );
+  int size = 0;
+
+  // Entries made before the section keep their place. Tables among them
+  // that the sections fill are spliced in turn.
+  for ( int i = 0; i < docSize; ++i ) {
+    if ( !( marks[ i ] & TOML_SPLICE_BEFORE ) ) {
+      continue;
+    }
+
+    TOMLString *key = doc->keys->members[ i ];
+    TOMLBasic *value = doc->values->members[ i ];
+    if ( marks[ i ] & TOML_SPLICE_OLD && value->type == TOML_TABLE ) {
+      int pathSize = _TOML_pushPath( path, key );
+      value = _TOML_unshare( doc->values, &doc->values->members[ i ] );
+      _TOML_spliceSection(
+        (TOMLTable *) value,
+        TOMLTable_getKey( oldSection, key->content ),
+        newSection ? TOMLTable_getKey( newSection, key->content ) : NULL,
+        before,
+        path
+      );
+      path->size = pathSize;
+      if ( ((TOMLTable *) value)->keys->size == 0 ) {
+        marks[ i ] |= TOML_SPLICE_EMPTIED;
+        continue;
       }
     }
-    _TOML_stringifyText( self, "]", 1 );
-  // if string
-  } else if ( basic->type == TOML_STRING ) {
-    TOMLString *string = src;
+    keys[ size ] = key;
+    values[ size++ ] = value;
+  }
 
-    // print string
-    _TOML_stringifyText( self, string->content, string->size );
-  // if number
-  } else if ( TOML_isNumber( basic ) ) {
-    TOMLNumber *number = src;
-    char numberBuffer[ 16 ];
-    memset( numberBuffer, 0, 16 );
+  // Then what the new section makes.
+  for ( int j = 0; j < newSize; ++j ) {
+    TOMLString *key = newSection->keys->members[ j ];
+    TOMLBasic *newValue = newSection->values->members[ j ];
+    int index = _TOMLTable_keyIndex( doc, key );
+    if ( index == -1 ) {
+      keys[ size ] = TOML_allocStringN( key->content, key->size );
+      values[ size++ ] = newValue;
+      newSection->values->members[ j ] = NULL;
+      _TOML_adopt( doc->values, newValue );
+      continue;
+    } else if ( marks[ index ] & TOML_SPLICE_BEFORE ) {
+      continue;
+    }
 
-    int size;
-    if ( number->type == TOML_INT ) {
-      size = snprintf( numberBuffer, 15, "%d", number->intValue );
-    } else if ( fmod( number->doubleValue, 1 ) == 0 ) {
-      size = snprintf( numberBuffer, 15, "%.1f", number->doubleValue );
-    } else {
-      size = snprintf( numberBuffer, 15, "%g", number->doubleValue );
+    TOMLBasic *docValue = doc->values->members[ index ];
+    if ( newValue->type == TOML_TABLE ) {
+      int pathSize = _TOML_pushPath( path, key );
+      docValue =
+        _TOML_unshare( doc->values, &doc->values->members[ index ] );
+      _TOML_spliceSection(
+        (TOMLTable *) docValue,
+        TOMLTable_getKey( oldSection, key->content ),
+        (TOMLTable *) newValue,
+        before,
+        path
+      );
+      path->size = pathSize;
+    } else if ( !TOML_equal( docValue, newValue ) ) {
+      _TOML_release( doc->values, docValue );
+      docValue = newValue;
+      newSection->values->members[ j ] = NULL;
+      _TOML_adopt( doc->values, newValue );
     }
+    marks[ index ] |= TOML_SPLICE_TAKEN;
+    keys[ size ] = doc->keys->members[ index ];
+    values[ size++ ] = docValue;
+  }
 
-    // print number
-    _TOML_stringifyText( self, numberBuffer, size );
-  } else if ( basic->type == TOML_BOOLEAN ) {
-    TOMLBoolean *boolean = (TOMLBoolean *) basic;
+  // Then what later sections made. What only the old section made is gone,
+  // as are emptied tables. Both are freed only now, since the lookups above
+  // read the keys of doc.
+  for ( int i = 0; i < docSize; ++i ) {
+    if (
+      marks[ i ] & TOML_SPLICE_EMPTIED || (
+        marks[ i ] & TOML_SPLICE_OLD &&
+          !( marks[ i ] & ( TOML_SPLICE_BEFORE | TOML_SPLICE_TAKEN ) )
+      )
+    ) {
+      TOML_free( doc->keys->members[ i ] );
+      _TOML_release( doc->values, doc->values->members[ i ] );
+      continue;
+    } else if ( marks[ i ] & ( TOML_SPLICE_BEFORE | TOML_SPLICE_TAKEN ) ) {
+      continue;
+    }
+    keys[ size ] = doc->keys->members[ i ];
+    values[ size++ ] = doc->values->members[ i ];
+  }
 
-    if ( boolean->isTrue ) {
-      _TOML_stringifyText( self, "true", 4 );
-    } else {
-      _TOML_stringifyText( self, "false", 5 );
+  _TOML_dealloc( marks );
+  _TOML_dealloc( doc->keys->members );
+  _TOML_dealloc( doc->values->members );
+  doc->keys->members = keys;
+  doc->values->members = values;
+  doc->keys->size = doc->values->size = size;
+  doc->keys->capacity = doc->values->capacity = capacity;
+  doc->keys->hash = 0;
+  _TOML_clearCache( (TOMLBasic *) doc );
+  _TOMLTable_dropIndex( doc );
+  _TOMLTable_updateIndex( doc );
+}
+
+int _TOML_reparse(
+  TOMLTable *doc, char *oldBuffer, char *newBuffer, TOMLError *error
+) {
+  if ( _TOML_isShared( doc ) ) {
+    _TOML_fillPlainError( error, TOML_ERROR_SHARED );
+    return TOML_ERROR_SHARED;
+  }
+
+  int oldSize = strlen( oldBuffer );
+  int newSize = strlen( newBuffer );
+
+  int prefix = 0;
+  while (
+    prefix < oldSize && prefix < newSize &&
+      oldBuffer[ prefix ] == newBuffer[ prefix ]
+  ) {
+    prefix++;
+  }
+
+  if ( prefix == oldSize && prefix == newSize ) {
+    return TOML_SUCCESS;
+  }
+
+  int suffix = 0;
+  while (
+    suffix < oldSize - prefix && suffix < newSize - prefix &&
+      oldBuffer[ oldSize - 1 - suffix ] == newBuffer[ newSize - 1 - suffix ]
+  ) {
+    suffix++;
+  }
+
+  // Widen the changed bytes to whole sections. Both ends lie in bytes the
+  // buffers share. The old buffer is only needed up to the end of its
+  // section, and the new buffer's headers are the old ones up to the start,
+  // so it is scanned from there.
+  struct _TOMLHeaderList oldHeaders = { 0, 0, NULL, { 0, 0, NULL }, 0 };
+  struct _TOMLHeaderList newHeaders = { 0, 0, NULL, { 0, 0, NULL }, 0 };
+  _TOML_findHeaders( oldBuffer, 0, oldSize - suffix, &oldHeaders );
+  int start = _TOML_sectionStart( &oldHeaders, prefix );
+  int oldEnd = _TOML_sectionEnd( &oldHeaders, oldSize - suffix, oldSize );
+  int newEnd = oldEnd - oldSize + newSize;
+  _TOML_findHeaders( newBuffer, start, newSize, &newHeaders );
+
+  TOMLTable *oldSection = NULL;
+  TOMLTable *newSection = NULL;
+  // Headers before, inside and after the new section.
+  struct _TOMLPathSet before = { 0, 0, NULL };
+  struct _TOMLPathSet inside = { 0, 0, NULL };
+  struct _TOMLPathSet after = { 0, 0, NULL };
+  struct _TOMLStringBuffer path = { 0, 0, NULL };
+  int spliced = 0;
+
+  // Splicing parses both sections, so it only pays when they are smaller
+  // than the whole new buffer.
+  // A change opening or closing a string or an array moves the headers after
+  // it, so the old section's end must still start a header. Invalid text is
+  // left for a full parse to report.
+  if (
+    ( oldEnd - start ) + ( newEnd - start ) < newSize &&
+      !oldHeaders.invalid && !newHeaders.invalid &&
+      _TOML_sectionEnd( &newHeaders, newEnd, newSize ) == newEnd &&
+      !_TOML_parseSection( oldBuffer + start, oldEnd - start, &oldSection ) &&
+      !_TOML_parseSection( newBuffer + start, newEnd - start, &newSection )
+  ) {
+    // The root table's entries come first, so it is made before any section
+    // after them.
+    if ( start > 0 ) {
+      _TOMLPathSet_add( &before, "", 0, TOML_PATH_TABLE );
+    }
+    _TOML_scanHeaders( &oldHeaders, 0, start, &before );
+    _TOML_scanHeaders( &newHeaders, start, newEnd, &inside );
+    _TOML_scanHeaders( &newHeaders, newEnd, newSize, &after );
+
+    // A table defined twice is an error only a full parse reports.
+    if (
+      !_TOML_headersClash( &before, &inside ) &&
+        !_TOML_headersClash( &inside, &after ) &&
+        _TOML_countRemoved(
+          doc, oldSection, newSection, &before, &path
+        ) != -1 &&
+        _TOML_canMergeSection( doc, oldSection, newSection )
+    ) {
+      _TOML_spliceSection( doc, oldSection, newSection, &before, &path );
+      spliced = 1;
+    }
+  }
+
+  TOML_free( oldSection );
+  TOML_free( newSection );
+  _TOMLHeaderList_free( &oldHeaders );
+  _TOMLHeaderList_free( &newHeaders );
+  _TOMLPathSet_free( &before );
+  _TOMLPathSet_free( &inside );
+  _TOMLPathSet_free( &after );
+  _TOML_dealloc( path.content );
+
+  if ( spliced ) {
+    return TOML_SUCCESS;
+  }
+
+  // Sections could not be spliced. Parse everything and move the result into
+  // doc so the caller's pointer stays valid.
+  TOMLTable *table = NULL;
+  int errorCode = TOML_parse( newBuffer, &table, error );
+  if ( errorCode != TOML_SUCCESS ) {
+    return errorCode;
+  }
+
+  TOML_free( doc->keys );
+  TOML_free( doc->values );
+  doc->keys = table->keys;
+  doc->values = table->values;
+  doc->keys->parent = doc->values->parent = doc;
+  _TOMLTable_dropIndex( doc );
+  doc->index = table->index;
+  _TOML_clearCache( (TOMLBasic *) doc );
+  _TOML_dealloc( table );
+
+  return TOML_SUCCESS;
+}
+
+// Everything the document keeps is made with its allocator.
+int TOML_reparse(
+  TOMLTable *doc, char *oldBuffer, char *newBuffer, TOMLError *error
+) {
+  TOMLAllocator *previous = TOML_useAllocator( doc->allocator );
+  int errorCode = _TOML_reparse( doc, oldBuffer, newBuffer, error );
+  TOML_useAllocator( previous );
+  return errorCode;
+}
+
+// Finalizer from splitmix64.
+unsigned long long _TOML_mix( unsigned long long value ) {
+  value ^= value >> 30;
+  value *= 0xbf58476d1ce4e5b9ULL;
+  value ^= value >> 27;
+  value *= 0x94d049bb133111ebULL;
+  value ^= value >> 31;
+  return value;
+}
+
+unsigned long long _TOML_loadHash( unsigned long long *cache ) {
+  return __atomic_load_n( cache, __ATOMIC_RELAXED );
+}
+
+// Store a computed hash, keeping 0 free to mean not computed.
+unsigned long long _TOML_storeHash(
+  unsigned long long *cache, unsigned long long hash
+) {
+  if ( hash == 0 ) {
+    hash = 1;
+  }
+  __atomic_store_n( cache, hash, __ATOMIC_RELAXED );
+  return hash;
+}
+
+unsigned long long TOML_hash( TOMLRef self ) {
+  TOMLBasic *basic = (TOMLBasic *) self;
+  unsigned long long hash = _TOML_mix( basic->type );
+
+  if ( basic->type == TOML_TABLE ) {
+    TOMLTable *table = (TOMLTable *) self;
+    unsigned long long cached = _TOML_loadHash( &table->hash );
+    if ( cached ) {
+      return cached;
+    }
+
+    // Entries are summed so key order does not matter.
+    unsigned long long sum = 0;
+    for ( int i = 0; i < table->keys->size; ++i ) {
+      sum += _TOML_mix(
+        TOML_hash( table->keys->members[ i ] ) * 31 +
+          TOML_hash( table->values->members[ i ] )
+      );
+    }
+    return _TOML_storeHash( &table->hash, _TOML_mix( hash + sum ) );
+  } else if ( basic->type == TOML_ARRAY ) {
+    TOMLArray *array = (TOMLArray *) self;
+    unsigned long long cached = _TOML_loadHash( &array->hash );
+    if ( cached ) {
+      return cached;
+    }
+
+    for ( int i = 0; i < array->size; ++i ) {
+      hash = _TOML_mix( hash + TOML_hash( array->members[ i ] ) );
+    }
+    return _TOML_storeHash( &array->hash, hash );
+  } else if ( basic->type == TOML_STRING ) {
+    TOMLString *string = (TOMLString *) self;
+    unsigned long long cached = _TOML_loadHash( &string->hash );
+    if ( cached ) {
+      return cached;
     }
+
+    return _TOML_storeHash(
+      &string->hash,
+      _TOML_mix( hash ^ _TOML_hashBytes( string->content, string->size ) )
+    );
+  } else if ( basic->type == TOML_INT ) {
+    return _TOML_mix( hash ^ (unsigned int) ((TOMLNumber *) self)->intValue );
+  } else if ( basic->type == TOML_DOUBLE ) {
+    // -0.0 and 0.0 are equal and must hash the same.
+    double value = ((TOMLNumber *) self)->doubleValue;
+    unsigned long long bits = 0;
+    if ( value != 0 ) {
+      memcpy( &bits, &value, sizeof(double) );
+    }
+    return _TOML_mix( hash ^ bits );
+  } else if ( basic->type == TOML_BOOLEAN ) {
+    return _TOML_mix( hash ^ ( ((TOMLBoolean *) self)->isTrue != 0 ) );
   } else if ( basic->type == TOML_DATE ) {
-    TOMLDate *date = (TOMLDate *) basic;
-    char numberBuffer[ 16 ];
-    int size;
+    return _TOML_mix( hash ^ ((TOMLDate *) self)->sinceEpoch );
+  } else if ( basic->type == TOML_ERROR ) {
+    return _TOML_mix( hash ^ ((TOMLError *) self)->code );
+  }
 
-    #define STRINGIFY_DATE_SECTION( format, part, spacer ) \
-      size = snprintf( numberBuffer, 15, format, date->part ); \
-      _TOML_stringifyText( self, numberBuffer, size ); \
-      _TOML_stringifyText( self, spacer, 1 )
+  return hash;
+}
 
-    STRINGIFY_DATE_SECTION( "%d", year, "-" );
-    STRINGIFY_DATE_SECTION( "%0.2d", month, "-" );
-    STRINGIFY_DATE_SECTION( "%0.2d", day, "T" );
-    STRINGIFY_DATE_SECTION( "%0.2d", hour, ":" );
-    STRINGIFY_DATE_SECTION( "%0.2d", minute, ":" );
-    STRINGIFY_DATE_SECTION( "%0.2d", second, "Z" );
+// Compare two objects. Cached hashes of tables and arrays are stale when a
+// nested object changed without the path to it being touched, so they are only
+// used to reject unequal objects when trustHash is set.
+int _TOML_equal( TOMLRef a, TOMLRef b, int trustHash ) {
+  TOMLBasic *basicA = (TOMLBasic *) a;
+  TOMLBasic *basicB = (TOMLBasic *) b;
 
-    #undef STRINGIFY_DATE_SECTION
-  } else {
-    assert( 0 );
+  if ( a == b ) {
+    return 1;
+  }
+  if ( basicA->type != basicB->type ) {
+    return 0;
   }
-  // if error
-    // print error
 
-  return 0;
+  switch ( basicA->type ) {
+    case TOML_TABLE: {
+      TOMLTable *tableA = (TOMLTable *) a;
+      TOMLTable *tableB = (TOMLTable *) b;
+      if (
+        tableA->keys->size != tableB->keys->size ||
+          ( trustHash && TOML_hash( a ) != TOML_hash( b ) )
+      ) {
+        return 0;
+      }
+
+      struct _TOMLKeyIndex index;
+      _TOMLKeyIndex_init( &index, tableB );
+      int equal = 1;
+      for ( int i = 0; i < tableA->keys->size && equal; ++i ) {
+        int j =
+          _TOMLKeyIndex_find( &index, tableB, tableA->keys->members[ i ] );
+        equal = j != -1 && _TOML_equal(
+          tableA->values->members[ i ], tableB->values->members[ j ], trustHash
+        );
+      }
+      _TOML_deallocWith( tableB->allocator, index.slots );
+      return equal;
+    }
+    case TOML_ARRAY: {
+      TOMLArray *arrayA = (TOMLArray *) a;
+      TOMLArray *arrayB = (TOMLArray *) b;
+      if (
+        arrayA->size != arrayB->size ||
+          ( trustHash && TOML_hash( a ) != TOML_hash( b ) )
+      ) {
+        return 0;
+      }
+      for ( int i = 0; i < arrayA->size; ++i ) {
+        if (
+          !_TOML_equal( arrayA->members[ i ], arrayB->members[ i ], trustHash )
+        ) {
+          return 0;
+        }
+      }
+      return 1;
+    }
+    case TOML_STRING: {
+      TOMLString *stringA = (TOMLString *) a;
+      TOMLString *stringB = (TOMLString *) b;
+      return
+        stringA->size == stringB->size &&
+          TOML_hash( a ) == TOML_hash( b ) &&
+          memcmp( stringA->content, stringB->content, stringA->size ) == 0;
+    }
+    case TOML_INT:
+      return ((TOMLNumber *) a)->intValue == ((TOMLNumber *) b)->intValue;
+    case TOML_DOUBLE:
+      return
+        ((TOMLNumber *) a)->doubleValue == ((TOMLNumber *) b)->doubleValue;
+    case TOML_BOOLEAN:
+      return
+        ( ((TOMLBoolean *) a)->isTrue != 0 ) ==
+          ( ((TOMLBoolean *) b)->isTrue != 0 );
+    case TOML_DATE:
+      return ((TOMLDate *) a)->sinceEpoch == ((TOMLDate *) b)->sinceEpoch;
+    case TOML_ERROR:
+      return ((TOMLError *) a)->code == ((TOMLError *) b)->code;
+    default:
+      return 0;
+  }
 }
 
-int TOML_stringify( char **buffer, TOMLRef src, TOMLError *error ) {
-  int bufferSize = 0;
-  char *output = _TOML_increaseBuffer( NULL, &bufferSize );
+int TOML_equal( TOMLRef a, TOMLRef b ) {
+  return _TOML_equal( a, b, 1 );
+}
 
-  int stackSize = 0;
-  TOMLString **tableNameStack = _TOML_increaseNameStack( NULL, &stackSize );
+struct _TOMLDiffData {
+  TOMLDiffCallback callback;
+  void *context;
+  int count;
+  int stopped;
 
-  struct _TOMLStringifyData stringifyData = {
-    error,
+  int pathSize;
+  int pathCapacity;
+  char *path;
+};
 
-    bufferSize,
-    0,
-    output,
-    0,
-    stackSize,
-    tableNameStack
-  };
+// Append a key or index to the path and return the old path size so the
+// caller can restore it.
+int _TOML_diffPushPath(
+  struct _TOMLDiffData *self, TOMLString *key, int index
+) {
+  int oldSize = self->pathSize;
+  int needed = oldSize + ( key ? key->size + 1 : 16 ) + 1;
+  if ( needed > self->pathCapacity ) {
+    while ( needed > self->pathCapacity ) {
+      self->pathCapacity *= 2;
+    }
+    self->path = _TOML_realloc( self->path, self->pathCapacity );
+  }
 
-  int errorCode = _TOML_stringify( &stringifyData, src );
+  if ( key ) {
+    if ( oldSize > 0 ) {
+      self->path[ self->pathSize++ ] = '.';
+    }
+    memcpy( self->path + self->pathSize, key->content, key->size );
+    self->pathSize += key->size;
+  } else {
+    self->pathSize += sprintf( self->path + self->pathSize, "[%d]", index );
+  }
+  self->path[ self->pathSize ] = 0;
 
-  free( tableNameStack );
-  *buffer = stringifyData.buffer;
+  return oldSize;
+}
 
-  return errorCode;
+void _TOML_diffPopPath( struct _TOMLDiffData *self, int oldSize ) {
+  self->pathSize = oldSize;
+  self->path[ oldSize ] = 0;
+}
+
+void _TOML_diffReport(
+  struct _TOMLDiffData *self, TOMLDiffType type, TOMLRef a, TOMLRef b
+) {
+  self->count++;
+  if ( self->callback( self->context, type, self->path, a, b ) ) {
+    self->stopped = 1;
+  }
+}
+
+void _TOML_diff( struct _TOMLDiffData *self, TOMLBasic *a, TOMLBasic *b ) {
+  // Shared nodes are identical, and tables and arrays hashing the same are
+  // taken to be. The setters clear the hashes above a change, so cached
+  // hashes are current.
+  if ( a == b ) {
+    return;
+  }
+  if (
+    a->type == b->type &&
+      ( a->type == TOML_TABLE || a->type == TOML_ARRAY ) &&
+      TOML_hash( a ) == TOML_hash( b )
+  ) {
+    return;
+  }
+
+  if ( a->type == TOML_TABLE && b->type == TOML_TABLE ) {
+    TOMLTable *tableA = (TOMLTable *) a;
+    TOMLTable *tableB = (TOMLTable *) b;
+
+    struct _TOMLKeyIndex index;
+    _TOMLKeyIndex_init( &index, tableB );
+    char *matched = _TOML_malloc( tableB->keys->size + 1 );
+    memset( matched, 0, tableB->keys->size + 1 );
+
+    for ( int i = 0; i < tableA->keys->size && !self->stopped; ++i ) {
+      TOMLString *key = tableA->keys->members[ i ];
+      int j = _TOMLKeyIndex_find( &index, tableB, key );
+      int oldSize = _TOML_diffPushPath( self, key, 0 );
+      if ( j == -1 ) {
+        _TOML_diffReport(
+          self, TOML_DIFF_REMOVED, tableA->values->members[ i ], NULL
+        );
+      } else {
+        matched[ j ] = 1;
+        _TOML_diff(
+          self, tableA->values->members[ i ], tableB->values->members[ j ]
+        );
+      }
+      _TOML_diffPopPath( self, oldSize );
+    }
+
+    for ( int j = 0; j < tableB->keys->size && !self->stopped; ++j ) {
+      if ( !matched[ j ] ) {
+        int oldSize = _TOML_diffPushPath( self, tableB->keys->members[ j ], 0 );
+        _TOML_diffReport(
+          self, TOML_DIFF_ADDED, NULL, tableB->values->members[ j ]
+        );
+        _TOML_diffPopPath( self, oldSize );
+      }
+    }
+
+    _TOML_dealloc( matched );
+    _TOML_deallocWith( tableB->allocator, index.slots );
+  } else if ( _TOML_isTableArray( a ) && _TOML_isTableArray( b ) ) {
+    // Arrays of tables are matched by position.
+    TOMLArray *arrayA = (TOMLArray *) a;
+    TOMLArray *arrayB = (TOMLArray *) b;
+    int size = arrayA->size > arrayB->size ? arrayA->size : arrayB->size;
+
+    for ( int i = 0; i < size && !self->stopped; ++i ) {
+      int oldSize = _TOML_diffPushPath( self, NULL, i );
+      if ( i >= arrayB->size ) {
+        _TOML_diffReport( self, TOML_DIFF_REMOVED, arrayA->members[ i ], NULL );
+      } else if ( i >= arrayA->size ) {
+        _TOML_diffReport( self, TOML_DIFF_ADDED, NULL, arrayB->members[ i ] );
+      } else {
+        _TOML_diff( self, arrayA->members[ i ], arrayB->members[ i ] );
+      }
+      _TOML_diffPopPath( self, oldSize );
+    }
+  } else if ( !_TOML_equal( a, b, 0 ) ) {
+    _TOML_diffReport( self, TOML_DIFF_CHANGED, a, b );
+  }
+}
+
+int TOML_diff(
+  TOMLRef a, TOMLRef b, TOMLDiffCallback callback, void *context
+) {
+  struct _TOMLDiffData diffData = {
+    callback,
+    context,
+    0,
+    0,
+
+    0,
+    64,
+    _TOML_malloc( 64 )
+  };
+  diffData.path[ 0 ] = 0;
+
+  _TOML_diff( &diffData, a, b );
+
+  _TOML_dealloc( diffData.path );
+
+  return diffData.count;
+}
+
+TOMLString ** _TOML_increaseNameStack(
+  TOMLString **nameStack, int *nameStackSize
+) {
+  TOMLString **oldStack = nameStack;
+  int oldSize = *nameStackSize;
+  *nameStackSize *= 2;
+  nameStack = _TOML_malloc( *nameStackSize * sizeof(TOMLString *) );
+  if ( oldStack ) {
+    memcpy( nameStack, oldStack, oldSize * sizeof(TOMLString *) );
+    _TOML_dealloc( oldStack );
+  }
+  return nameStack;
+}
+
+void _TOML_stringifyPushName(
+  struct _TOMLStringifyData *self, TOMLRef src
+) {
+  if ( self->tableNameDepth >= self->tableNameStackSize ) {
+    TOMLString **oldStack = self->tableNameStack;
+    self->tableNameStack = _TOML_increaseNameStack(
+      oldStack == self->inlineNameStack ? NULL : oldStack,
+      &( self->tableNameStackSize )
+    );
+    if ( oldStack == self->inlineNameStack ) {
+      memcpy( self->tableNameStack, oldStack, sizeof(self->inlineNameStack) );
+    }
+  }
+  self->tableNameStack[ self->tableNameDepth ] = src;
+  self->tableNameDepth++;
+}
+
+void _TOML_stringifyPopName(
+  struct _TOMLStringifyData *self
+) {
+  self->tableNameDepth--;
+  self->tableNameStack[ self->tableNameDepth ] = NULL;
+}
+
+// Writes text that lives as long as the object being stringified.
+void _TOML_stringifyText( struct _TOMLStringifyData *self, char *text, int n ) {
+  if ( self->capture ) {
+    _TOMLWriter_writeString( self->capture, text, n );
+  } else if ( self->transient ) {
+    TOMLWriter_write( self->writer, text, n );
+  } else {
+    TOMLWriter_writeStable( self->writer, text, n );
+  }
+}
+
+// Writes text from a temporary buffer.
+void _TOML_stringifyCopy( struct _TOMLStringifyData *self, char *text, int n ) {
+  if ( self->capture ) {
+    _TOMLWriter_writeString( self->capture, text, n );
+  } else {
+    TOMLWriter_write( self->writer, text, n );
+  }
+}
+
+void _TOML_stringifyTableHeader(
+  struct _TOMLStringifyData *self, TOMLTable *table
+) {
+  TOMLBasic *first = TOMLArray_getIndex( table->values, 0 );
+  if (
+    !first ||
+      first->type == TOML_TABLE || (
+      first->type == TOML_ARRAY &&
+      ((TOMLArray *) first)->memberType == TOML_TABLE
+    )
+  ) {
+    return;
+  }
+
+  if ( self->writer->total != 0 || self->hasOutput ) {
+    _TOML_stringifyText( self, "\n", 1 );
+  }
+
+  _TOML_stringifyText( self, "[", 1 );
+  for ( int i = 0; i < self->tableNameDepth; ++i ) {
+    TOMLString *tableName = self->tableNameStack[ i ];
+    if ( i > 0 ) {
+      _TOML_stringifyText( self, ".", 1 );
+    }
+    _TOML_stringifyText( self, tableName->content, tableName->size );
+  }
+  _TOML_stringifyText( self, "]\n", 2 );
+}
+
+void _TOML_stringifyArrayHeader( struct _TOMLStringifyData *self ) {
+  if ( self->writer->total != 0 || self->hasOutput ) {
+    _TOML_stringifyText( self, "\n", 1 );
+  }
+
+  _TOML_stringifyText( self, "[[", 2 );
+  for ( int i = 0; i < self->tableNameDepth; ++i ) {
+    TOMLString *tableName = self->tableNameStack[ i ];
+    if ( i > 0 ) {
+      _TOML_stringifyText( self, ".", 1 );
+    }
+    _TOML_stringifyText( self, tableName->content, tableName->size );
+  }
+  _TOML_stringifyText( self, "]]\n", 3 );
+}
+
+// The letter written after a backslash for ASCII bytes that are escaped that
+// way, or 0.
+static const char _TOML_escapeLetters[ 128 ] = {
+  [ '\b' ] = 'b',
+  [ '\t' ] = 't',
+  [ '\f' ] = 'f',
+  [ '\n' ] = 'n',
+  [ '\r' ] = 'r',
+  [ '"' ] = '"',
+  [ '/' ] = '/',
+  [ '\\' ] = '\\'
+};
+
+// The size of the well formed UTF-8 sequence starting at bytes[ at ], or 0 if
+// it is cut short, overlong, a surrogate, past U+10FFFF or not a lead byte.
+int _TOML_utf8Size( unsigned char *bytes, int at, int size ) {
+  unsigned char ch = bytes[ at ];
+  int chsize = ch < 0x80 ? 1 : ch < 0xc2 ? 0 : ch < 0xe0 ? 2 :
+    ch < 0xf0 ? 3 : ch < 0xf5 ? 4 : 0;
+  if ( chsize == 0 || at + chsize > size ) {
+    return 0;
+  }
+
+  for ( int i = 1; i < chsize; ++i ) {
+    if ( ( bytes[ at + i ] & 0xc0 ) != 0x80 ) {
+      return 0;
+    }
+  }
+
+  // The second byte bounds what the lead byte may start.
+  unsigned char second = bytes[ at + 1 ];
+  if (
+    ( ch == 0xe0 && second < 0xa0 ) || ( ch == 0xed && second > 0x9f ) ||
+      ( ch == 0xf0 && second < 0x90 ) || ( ch == 0xf4 && second > 0x8f )
+  ) {
+    return 0;
+  }
+  return chsize;
+}
+
+static const char _TOML_hexDigits[] = "0123456789abcdef";
+
+int _TOML_needsEscape( unsigned char ch, int escapeControls ) {
+  return
+    ch == 0 || ch > 0x7f || _TOML_escapeLetters[ ch ] ||
+      ( escapeControls && ch < 0x20 );
+}
+
+// Returns the index of the first byte from start on that needs escaping, or
+// size if there is none.
+int _TOML_findEscape(
+  unsigned char *bytes, int start, int size, int escapeControls
+) {
+  int i = start;
+
+#ifdef __SSE2__
+  __m128i quote = _mm_set1_epi8( '"' );
+  __m128i slash = _mm_set1_epi8( '/' );
+  __m128i backslash = _mm_set1_epi8( '\\' );
+  __m128i space = _mm_set1_epi8( ' ' );
+
+  for ( ; i + 16 <= size; i += 16 ) {
+    __m128i chunk = _mm_loadu_si128( (__m128i *) ( bytes + i ) );
+    // The signed compare against space also catches every byte above 0x7f.
+    __m128i hits = _mm_or_si128(
+      _mm_or_si128(
+        _mm_cmpeq_epi8( chunk, quote ), _mm_cmpeq_epi8( chunk, slash )
+      ),
+      _mm_or_si128(
+        _mm_cmpeq_epi8( chunk, backslash ), _mm_cmplt_epi8( chunk, space )
+      )
+    );
+
+    // Control bytes without an escape letter are candidates but stay as
+    // they are unless escapeControls is set.
+    for (
+      int mask = _mm_movemask_epi8( hits ); mask != 0; mask &= mask - 1
+    ) {
+      int candidate = i + __builtin_ctz( mask );
+      if ( _TOML_needsEscape( bytes[ candidate ], escapeControls ) ) {
+        return candidate;
+      }
+    }
+  }
+#endif
+
+  while ( i < size && !_TOML_needsEscape( bytes[ i ], escapeControls ) ) {
+    i++;
+  }
+  return i;
+}
+
+void _TOML_stringifyBytes(
+  struct _TOMLStringifyData *self, unsigned char *bytes, int size
+) {
+  int cursor = 0;
+
+  while ( cursor < size ) {
+    // Copy clean text up to the next escapable character in one piece.
+    int next = _TOML_findEscape( bytes, cursor, size, self->json );
+    if ( next > cursor ) {
+      _TOML_stringifyText( self, (char *) bytes + cursor, next - cursor );
+    }
+    if ( next == size ) {
+      break;
+    }
+
+    unsigned char ch = bytes[ next ];
+    if ( ch <= 0x7f && _TOML_escapeLetters[ ch ] ) {
+      char escaped[ 2 ] = { '\\', _TOML_escapeLetters[ ch ] };
+      _TOML_stringifyCopy( self, escaped, 2 );
+      cursor = next + 1;
+      continue;
+    }
+
+    int chsize = _TOML_utf8Size( bytes, next, size );
+
+    // A byte that does not start a well formed sequence is copied alone, so
+    // the bytes after it are looked at again. The lexer takes it as it is,
+    // but JSON must be UTF-8 and gets a replacement character instead.
+    if ( chsize == 0 ) {
+      if ( self->json ) {
+        _TOML_stringifyCopy( self, "\\ufffd", 6 );
+      } else {
+        _TOML_stringifyText( self, (char *) bytes + next, 1 );
+      }
+      cursor = next + 1;
+      continue;
+    }
+
+    // \uxxxx cannot hold four byte sequences and the lexer takes them as
+    // they are.
+    if ( chsize == 4 ) {
+      _TOML_stringifyText( self, (char *) bytes + next, 4 );
+      cursor = next + 4;
+      continue;
+    }
+
+    // Decode the numeric representation of the utf8 character.
+    int num = ch & ( 0xff >> ( chsize + 1 ) );
+    for ( int i = 1; i < chsize; ++i ) {
+      num = ( num << 6 ) | ( bytes[ next + i ] & 0x3f );
+    }
+
+    // Stringify \uxxxx
+    char escaped[ 6 ] = {
+      '\\', 'u',
+      _TOML_hexDigits[ ( num >> 12 ) & 0xf ],
+      _TOML_hexDigits[ ( num >> 8 ) & 0xf ],
+      _TOML_hexDigits[ ( num >> 4 ) & 0xf ],
+      _TOML_hexDigits[ num & 0xf ]
+    };
+    _TOML_stringifyCopy( self, escaped, 6 );
+    cursor = next + chsize;
+  }
+}
+
+void _TOML_stringifyString(
+  struct _TOMLStringifyData *self, TOMLString *string
+) {
+  _TOML_stringifyBytes(
+    self, (unsigned char *) string->content, string->size
+  );
+}
+
+// Write a value the way it appears on the right of an entry.
+void _TOML_stringifyValue( struct _TOMLStringifyData *self, TOMLBasic *value ) {
+  if ( value->type == TOML_STRING ) {
+    _TOML_stringifyText( self, "\"", 1 );
+    _TOML_stringifyString( self, (TOMLString *) value );
+    _TOML_stringifyText( self, "\"", 1 );
+  } else {
+    _TOML_stringify( self, value );
+  }
+}
+
+void _TOML_stringifyEntry(
+  struct _TOMLStringifyData *self, TOMLString *key, TOMLBasic *value
+) {
+  _TOML_stringifyText( self, key->content, key->size );
+  _TOML_stringifyText( self, " = ", 3 );
+  _TOML_stringifyValue( self, value );
+  _TOML_stringifyText( self, "\n", 1 );
+}
+
+// Two digit strings for 0 through 99 so integers convert two digits at a time.
+static const char _TOML_digitPairs[] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+// Writes the decimal digits of value to buffer. Returns the number of bytes
+// written, at most 10.
+int _TOML_formatUnsigned( char *buffer, unsigned int value ) {
+  char digits[ 10 ];
+  int index = 10;
+  while ( value >= 100 ) {
+    const char *pair = _TOML_digitPairs + ( value % 100 ) * 2;
+    value /= 100;
+    digits[ --index ] = pair[ 1 ];
+    digits[ --index ] = pair[ 0 ];
+  }
+  if ( value >= 10 ) {
+    digits[ --index ] = _TOML_digitPairs[ value * 2 + 1 ];
+    digits[ --index ] = _TOML_digitPairs[ value * 2 ];
+  } else {
+    digits[ --index ] = '0' + value;
+  }
+  memcpy( buffer, digits + index, 10 - index );
+  return 10 - index;
+}
+
+// Writes value like "%d". Returns the number of bytes written, at most 11.
+int _TOML_formatInt( char *buffer, int value ) {
+  if ( value < 0 ) {
+    buffer[ 0 ] = '-';
+    return 1 + _TOML_formatUnsigned( buffer + 1, 0u - (unsigned int) value );
+  }
+  return _TOML_formatUnsigned( buffer, value );
+}
+
+// Shortest round trip doubles use Grisu2 (Loitsch, "Printing Floating-Point
+// Numbers Quickly and Accurately with Integers"). A _TOMLDiyFp is f * 2^e.
+typedef struct _TOMLDiyFp {
+  unsigned long long f;
+  int e;
+} _TOMLDiyFp;
+
+// Normalized 64 bit approximations of 10^k for every eighth k from -300 to
+// 324, rounded to nearest.
+static const struct {
+  unsigned long long f;
+  int e;
+  int k;
+} _TOML_cachedPowers[] = {
+  { 0xAB70FE17C79AC6CAULL, -1060, -300 },
+  { 0xFF77B1FCBEBCDC4FULL, -1034, -292 },
+  { 0xBE5691EF416BD60CULL, -1007, -284 },
+  { 0x8DD01FAD907FFC3CULL, -980, -276 },
+  { 0xD3515C2831559A83ULL, -954, -268 },
+  { 0x9D71AC8FADA6C9B5ULL, -927, -260 },
+  { 0xEA9C227723EE8BCBULL, -901, -252 },
+  { 0xAECC49914078536DULL, -874, -244 },
+  { 0x823C12795DB6CE57ULL, -847, -236 },
+  { 0xC21094364DFB5637ULL, -821, -228 },
+  { 0x9096EA6F3848984FULL, -794, -220 },
+  { 0xD77485CB25823AC7ULL, -768, -212 },
+  { 0xA086CFCD97BF97F4ULL, -741, -204 },
+  { 0xEF340A98172AACE5ULL, -715, -196 },
+  { 0xB23867FB2A35B28EULL, -688, -188 },
+  { 0x84C8D4DFD2C63F3BULL, -661, -180 },
+  { 0xC5DD44271AD3CDBAULL, -635, -172 },
+  { 0x936B9FCEBB25C996ULL, -608, -164 },
+  { 0xDBAC6C247D62A584ULL, -582, -156 },
+  { 0xA3AB66580D5FDAF6ULL, -555, -148 },
+  { 0xF3E2F893DEC3F126ULL, -529, -140 },
+  { 0xB5B5ADA8AAFF80B8ULL, -502, -132 },
+  { 0x87625F056C7C4A8BULL, -475, -124 },
+  { 0xC9BCFF6034C13053ULL, -449, -116 },
+  { 0x964E858C91BA2655ULL, -422, -108 },
+  { 0xDFF9772470297EBDULL, -396, -100 },
+  { 0xA6DFBD9FB8E5B88FULL, -369, -92 },
+  { 0xF8A95FCF88747D94ULL, -343, -84 },
+  { 0xB94470938FA89BCFULL, -316, -76 },
+  { 0x8A08F0F8BF0F156BULL, -289, -68 },
+  { 0xCDB02555653131B6ULL, -263, -60 },
+  { 0x993FE2C6D07B7FACULL, -236, -52 },
+  { 0xE45C10C42A2B3B06ULL, -210, -44 },
+  { 0xAA242499697392D3ULL, -183, -36 },
+  { 0xFD87B5F28300CA0EULL, -157, -28 },
+  { 0xBCE5086492111AEBULL, -130, -20 },
+  { 0x8CBCCC096F5088CCULL, -103, -12 },
+  { 0xD1B71758E219652CULL, -77, -4 },
+  { 0x9C40000000000000ULL, -50, 4 },
+  { 0xE8D4A51000000000ULL, -24, 12 },
+  { 0xAD78EBC5AC620000ULL, 3, 20 },
+  { 0x813F3978F8940984ULL, 30, 28 },
+  { 0xC097CE7BC90715B3ULL, 56, 36 },
+  { 0x8F7E32CE7BEA5C70ULL, 83, 44 },
+  { 0xD5D238A4ABE98068ULL, 109, 52 },
+  { 0x9F4F2726179A2245ULL, 136, 60 },
+  { 0xED63A231D4C4FB27ULL, 162, 68 },
+  { 0xB0DE65388CC8ADA8ULL, 189, 76 },
+  { 0x83C7088E1AAB65DBULL, 216, 84 },
+  { 0xC45D1DF942711D9AULL, 242, 92 },
+  { 0x924D692CA61BE758ULL, 269, 100 },
+  { 0xDA01EE641A708DEAULL, 295, 108 },
+  { 0xA26DA3999AEF774AULL, 322, 116 },
+  { 0xF209787BB47D6B85ULL, 348, 124 },
+  { 0xB454E4A179DD1877ULL, 375, 132 },
+  { 0x865B86925B9BC5C2ULL, 402, 140 },
+  { 0xC83553C5C8965D3DULL, 428, 148 },
+  { 0x952AB45CFA97A0B3ULL, 455, 156 },
+  { 0xDE469FBD99A05FE3ULL, 481, 164 },
+  { 0xA59BC234DB398C25ULL, 508, 172 },
+  { 0xF6C69A72A3989F5CULL, 534, 180 },
+  { 0xB7DCBF5354E9BECEULL, 561, 188 },
+  { 0x88FCF317F22241E2ULL, 588, 196 },
+  { 0xCC20CE9BD35C78A5ULL, 614, 204 },
+  { 0x98165AF37B2153DFULL, 641, 212 },
+  { 0xE2A0B5DC971F303AULL, 667, 220 },
+  { 0xA8D9D1535CE3B396ULL, 694, 228 },
+  { 0xFB9B7CD9A4A7443CULL, 720, 236 },
+  { 0xBB764C4CA7A44410ULL, 747, 244 },
+  { 0x8BAB8EEFB6409C1AULL, 774, 252 },
+  { 0xD01FEF10A657842CULL, 800, 260 },
+  { 0x9B10A4E5E9913129ULL, 827, 268 },
+  { 0xE7109BFBA19C0C9DULL, 853, 276 },
+  { 0xAC2820D9623BF429ULL, 880, 284 },
+  { 0x80444B5E7AA7CF85ULL, 907, 292 },
+  { 0xBF21E44003ACDD2DULL, 933, 300 },
+  { 0x8E679C2F5E44FF8FULL, 960, 308 },
+  { 0xD433179D9C8CB841ULL, 986, 316 },
+  { 0x9E19DB92B4E31BA9ULL, 1013, 324 },
+};
+
+_TOMLDiyFp _TOMLDiyFp_make( unsigned long long f, int e ) {
+  _TOMLDiyFp self = { f, e };
+  return self;
+}
+
+// Multiplies and rounds to the upper 64 bits of the product.
+_TOMLDiyFp _TOMLDiyFp_mul( _TOMLDiyFp x, _TOMLDiyFp y ) {
+  unsigned long long xLo = x.f & 0xFFFFFFFFu, xHi = x.f >> 32;
+  unsigned long long yLo = y.f & 0xFFFFFFFFu, yHi = y.f >> 32;
+
+  unsigned long long p0 = xLo * yLo;
+  unsigned long long p1 = xLo * yHi;
+  unsigned long long p2 = xHi * yLo;
+  unsigned long long p3 = xHi * yHi;
+
+  unsigned long long middle =
+    ( p0 >> 32 ) + ( p1 & 0xFFFFFFFFu ) + ( p2 & 0xFFFFFFFFu ) +
+      ( 1ull << 31 );
+
+  return _TOMLDiyFp_make(
+    p3 + ( p1 >> 32 ) + ( p2 >> 32 ) + ( middle >> 32 ), x.e + y.e + 64
+  );
+}
+
+_TOMLDiyFp _TOMLDiyFp_normalize( _TOMLDiyFp x ) {
+  while ( ( x.f >> 63 ) == 0 ) {
+    x.f <<= 1;
+    x.e--;
+  }
+  return x;
+}
+
+// Rounds the last digit down toward w while it stays inside the boundaries.
+void _TOML_grisuRound(
+  char *digits, int size, unsigned long long distance,
+  unsigned long long delta, unsigned long long rest, unsigned long long tenK
+) {
+  while (
+    rest < distance && delta - rest >= tenK && (
+      rest + tenK < distance || distance - rest > rest + tenK - distance
+    )
+  ) {
+    digits[ size - 1 ]--;
+    rest += tenK;
+  }
+}
+
+// Writes the shortest digits for a positive, finite value so value equals
+// digits * 10^exponent once read back with correct rounding. Returns the
+// number of digits, at most 17.
+int _TOML_grisu2( char *digits, int *exponent, double value ) {
+  unsigned long long bits;
+  memcpy( &bits, &value, sizeof(bits) );
+  unsigned long long fraction = bits & ( ( 1ull << 52 ) - 1 );
+  int biasedExponent = (int) ( bits >> 52 ) & 0x7FF;
+
+  _TOMLDiyFp v = biasedExponent == 0 ?
+    _TOMLDiyFp_make( fraction, 1 - 1075 ) :
+    _TOMLDiyFp_make( fraction + ( 1ull << 52 ), biasedExponent - 1075 );
+
+  // The boundaries halfway to the neighbouring doubles. The lower one is
+  // closer when the value is a power of two.
+  _TOMLDiyFp plus = _TOMLDiyFp_normalize(
+    _TOMLDiyFp_make( ( v.f << 1 ) + 1, v.e - 1 )
+  );
+  _TOMLDiyFp minus = fraction == 0 && biasedExponent > 1 ?
+    _TOMLDiyFp_make( ( v.f << 2 ) - 1, v.e - 2 ) :
+    _TOMLDiyFp_make( ( v.f << 1 ) - 1, v.e - 1 );
+  minus.f <<= minus.e - plus.e;
+  minus.e = plus.e;
+  v = _TOMLDiyFp_normalize( v );
+
+  // Pick a cached power that brings the upper boundary's exponent into
+  // [-60, -32].
+  int f = -60 - plus.e - 1;
+  int k = ( f * 78913 ) / ( 1 << 18 ) + ( f > 0 );
+  int index = ( 300 + k + 7 ) / 8;
+  _TOMLDiyFp cached = _TOMLDiyFp_make(
+    _TOML_cachedPowers[ index ].f, _TOML_cachedPowers[ index ].e
+  );
+  *exponent = -_TOML_cachedPowers[ index ].k;
+
+  _TOMLDiyFp w = _TOMLDiyFp_mul( v, cached );
+  _TOMLDiyFp low = _TOMLDiyFp_mul( minus, cached );
+  _TOMLDiyFp high = _TOMLDiyFp_mul( plus, cached );
+  low.f++;
+  high.f--;
+
+  unsigned long long delta = high.f - low.f;
+  unsigned long long distance = high.f - w.f;
+
+  int shift = -high.e;
+  unsigned long long one = 1ull << shift;
+  unsigned int integral = (unsigned int) ( high.f >> shift );
+  unsigned long long rest = high.f & ( one - 1 );
+
+  unsigned int power = 1000000000;
+  int remaining = 10;
+  while ( power > integral && remaining > 1 ) {
+    power /= 10;
+    remaining--;
+  }
+
+  int size = 0;
+  while ( remaining > 0 ) {
+    digits[ size++ ] = '0' + integral / power;
+    integral %= power;
+    remaining--;
+
+    unsigned long long total =
+      ( (unsigned long long) integral << shift ) + rest;
+    if ( total <= delta ) {
+      *exponent += remaining;
+      _TOML_grisuRound(
+        digits, size, distance, delta, total,
+        (unsigned long long) power << shift
+      );
+      return size;
+    }
+
+    power /= 10;
+  }
+
+  for (;;) {
+    rest *= 10;
+    delta *= 10;
+    distance *= 10;
+    digits[ size++ ] = '0' + ( rest >> shift );
+    rest &= one - 1;
+    ( *exponent )--;
+    if ( rest <= delta ) {
+      break;
+    }
+  }
+
+  _TOML_grisuRound( digits, size, distance, delta, rest, one );
+  return size;
+}
+
+// Writes value in plain decimal notation with at least one digit after the
+// point, since TOML numbers have no exponent and the point marks a double.
+// The value must be finite, since TOML has no nan or infinity.
+// Returns the number of bytes written, less than TOML_DOUBLE_BUFFER_SIZE.
+int _TOML_formatDouble( char *buffer, double value ) {
+  int size = 0;
+  if ( signbit( value ) ) {
+    buffer[ size++ ] = '-';
+    value = -value;
+  }
+
+  if ( value == 0 ) {
+    memcpy( buffer + size, "0.0", 3 );
+    return size + 3;
+  }
+
+  char digits[ 18 ];
+  int exponent;
+  int digitCount = _TOML_grisu2( digits, &exponent, value );
+  // Digits before the decimal point.
+  int point = digitCount + exponent;
+
+  if ( exponent >= 0 ) {
+    memcpy( buffer + size, digits, digitCount );
+    size += digitCount;
+    memset( buffer + size, '0', exponent );
+    size += exponent;
+    memcpy( buffer + size, ".0", 2 );
+    size += 2;
+  } else if ( point > 0 ) {
+    memcpy( buffer + size, digits, point );
+    size += point;
+    buffer[ size++ ] = '.';
+    memcpy( buffer + size, digits + point, digitCount - point );
+    size += digitCount - point;
+  } else {
+    memcpy( buffer + size, "0.", 2 );
+    size += 2;
+    memset( buffer + size, '0', -point );
+    size += -point;
+    memcpy( buffer + size, digits, digitCount );
+    size += digitCount;
+  }
+
+  return size;
+}
+
+// Writes the two digits of a value from 0 to 99.
+void _TOML_formatPair( char *buffer, int value ) {
+  memcpy( buffer, _TOML_digitPairs + value * 2, 2 );
+}
+
+// Writes the date as YYYY-MM-DDTHH:MM:SSZ. Years outside 0 to 9999 are written
+// in full. Returns the number of bytes written, at most 27.
+int _TOML_formatDate( char *buffer, TOMLDate *date ) {
+  int size;
+  if ( date->year >= 0 && date->year <= 9999 ) {
+    _TOML_formatPair( buffer, date->year / 100 );
+    _TOML_formatPair( buffer + 2, date->year % 100 );
+    size = 4;
+  } else {
+    size = _TOML_formatInt( buffer, date->year );
+  }
+
+  char *rest = buffer + size;
+  rest[ 0 ] = '-';
+  _TOML_formatPair( rest + 1, date->month % 100 );
+  rest[ 3 ] = '-';
+  _TOML_formatPair( rest + 4, date->day % 100 );
+  rest[ 6 ] = 'T';
+  _TOML_formatPair( rest + 7, date->hour % 100 );
+  rest[ 9 ] = ':';
+  _TOML_formatPair( rest + 10, date->minute % 100 );
+  rest[ 12 ] = ':';
+  _TOML_formatPair( rest + 13, date->second % 100 );
+  rest[ 15 ] = 'Z';
+
+  return size + 16;
+}
+
+// Non-zero if the value is written under its own header rather than as an
+// entry line.
+int _TOML_isSection( TOMLBasic *value ) {
+  return value->type == TOML_TABLE || (
+    value->type == TOML_ARRAY &&
+      ((TOMLArray *) value)->memberType == TOML_TABLE
+  );
+}
+
+// Returns the table's kept entry lines, writing them first if the table has
+// changed since they were kept. Threads writing the same table race to store
+// their copy and the losers free theirs.
+struct _TOMLTableText * _TOML_stringifyTableText(
+  struct _TOMLStringifyData *self, TOMLTable *table
+) {
+  struct _TOMLTableText *text =
+    __atomic_load_n( &table->text, __ATOMIC_ACQUIRE );
+  if ( text ) {
+    return text;
+  }
+
+  int runCount = 1;
+  for ( int i = 0; i < table->values->size; ++i ) {
+    runCount += _TOML_isSection( table->values->members[ i ] );
+  }
+
+  text = _TOML_mallocWith(
+    table->allocator, sizeof(struct _TOMLTableText) + runCount * sizeof(int)
+  );
+  struct _TOMLStringBuffer buffer = { 0, 0, NULL };
+  self->capture = &buffer;
+
+  int run = 0;
+  for ( int i = 0; i < table->keys->size; ++i ) {
+    TOMLBasic *value = table->values->members[ i ];
+    if ( _TOML_isSection( value ) ) {
+      text->runEnds[ run++ ] = buffer.size;
+    } else {
+      _TOML_stringifyEntry( self, table->keys->members[ i ], value );
+    }
+  }
+  text->runEnds[ run ] = buffer.size;
+
+  self->capture = NULL;
+  // Text missing a value is never kept. The caller falls back to writing the
+  // table directly.
+  if ( self->errorCode != TOML_SUCCESS ) {
+    _TOML_dealloc( buffer.content );
+    _TOML_deallocWith( table->allocator, text );
+    return NULL;
+  }
+  // The text is freed with the table, so it moves to the table's allocator.
+  text->size = buffer.size;
+  text->content = _TOML_mallocWith( table->allocator, buffer.size + 1 );
+  if ( buffer.content ) {
+    memcpy( text->content, buffer.content, buffer.size );
+    _TOML_dealloc( buffer.content );
+  }
+
+  struct _TOMLTableText *expected = NULL;
+  if (
+    !__atomic_compare_exchange_n(
+      &table->text, &expected, text, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE
+    )
+  ) {
+    _TOML_deallocWith( table->allocator, text->content );
+    _TOML_deallocWith( table->allocator, text );
+    text = expected;
+  }
+
+  return text;
+}
+
+// Writes one run of kept entry lines.
+void _TOML_stringifyRun(
+  struct _TOMLStringifyData *self, struct _TOMLTableText *text, int run
+) {
+  int start = run > 0 ? text->runEnds[ run - 1 ] : 0;
+  if ( text->runEnds[ run ] > start ) {
+    _TOML_stringifyText(
+      self, text->content + start, text->runEnds[ run ] - start
+    );
+  }
+}
+
+// Numbers and dates are formatted outside _TOML_stringify so their buffers
+// stay off the stack of every level of nested tables.
+void _TOML_stringifyNumber(
+  struct _TOMLStringifyData *self, TOMLNumber *number
+) {
+  char numberBuffer[ TOML_DOUBLE_BUFFER_SIZE ];
+
+  int size;
+  if ( number->type == TOML_INT ) {
+    size = _TOML_formatInt( numberBuffer, number->intValue );
+  } else if ( isfinite( number->doubleValue ) ) {
+    size = _TOML_formatDouble( numberBuffer, number->doubleValue );
+  } else {
+    if ( self->errorCode == TOML_SUCCESS ) {
+      self->errorCode = TOML_ERROR_NOT_FINITE;
+    }
+    return;
+  }
+
+  _TOML_stringifyCopy( self, numberBuffer, size );
+}
+
+void _TOML_stringifyDate( struct _TOMLStringifyData *self, TOMLDate *date ) {
+  char dateBuffer[ 32 ];
+  int size = _TOML_formatDate( dateBuffer, date );
+
+  _TOML_stringifyCopy( self, dateBuffer, size );
+}
+
+int _TOML_stringify(
+  struct _TOMLStringifyData *self, TOMLRef src
+) {
+  // Cast to TOMLBasic to discover type.
+  TOMLBasic *basic = src;
+
+  // if null
+  if ( src == NULL ) {
+    _TOML_stringifyText( self, "(null)", 6 );
+  // if table
+  } else if ( basic->type == TOML_TABLE ) {
+    TOMLTable *table = src;
+    struct _TOMLTableText *text =
+      self->cached ? _TOML_stringifyTableText( self, table ) : NULL;
+    int run = 0;
+
+    // loop keys
+    for ( int i = 0; i < table->keys->size; ++i ) {
+      TOMLRef key = TOMLArray_getIndex( table->keys, i );
+      TOMLRef value = TOMLArray_getIndex( table->values, i  );
+      TOMLBasic *basicValue = value;
+
+      if ( text && _TOML_isSection( basicValue ) ) {
+        _TOML_stringifyRun( self, text, run++ );
+      }
+
+      // if value is table, print header, recurse
+      if ( basicValue->type == TOML_TABLE ) {
+        TOMLTable *tableValue = value;
+        _TOML_stringifyPushName( self, key );
+        _TOML_stringifyTableHeader( self, value );
+        _TOML_stringify( self, value );
+        _TOML_stringifyPopName( self );
+      // if value is array
+      } else if ( basicValue->type == TOML_ARRAY ) {
+        TOMLArray *array = value;
+
+        // if value is object array
+        if ( array->memberType == TOML_TABLE ) {
+          // loop indices, print headers, recurse
+          for ( int j = 0; j < array->size; ++j ) {
+            _TOML_stringifyPushName( self, key );
+            _TOML_stringifyArrayHeader( self );
+            _TOML_stringify( self, TOMLArray_getIndex( array, j ) );
+            _TOML_stringifyPopName( self );
+          }
+        } else if ( !text ) {
+          // print entry line with dense (no newlines) array
+          _TOML_stringifyEntry( self, key, value );
+        }
+      } else if ( !text ) {
+        // if value is string or number, print entry
+        _TOML_stringifyEntry( self, key, value );
+      }
+    }
+
+    if ( text ) {
+      _TOML_stringifyRun( self, text, run );
+    }
+  // if array
+  } else if ( basic->type == TOML_ARRAY ) {
+    TOMLArray *array = src;
+
+    // print array densely
+    _TOML_stringifyText( self, "[", 1 );
+    for ( int i = 0; i < array->size; ++i ) {
+      _TOML_stringifyText( self, " ", 1 );
+      TOMLBasic *arrayValue = TOMLArray_getIndex( array, i );
+      if ( arrayValue->type == TOML_STRING ) {
+        _TOML_stringifyText( self, "\"", 1 );
+        _TOML_stringifyString( self, (TOMLString *) arrayValue );
+        _TOML_stringifyText( self, "\"", 1 );
+      } else {
+        _TOML_stringify( self, arrayValue );
+      }
+      if ( i != array->size - 1 ) {
+        _TOML_stringifyText( self, ",", 1 );
+      } else {
+        _TOML_stringifyText( self, " ", 1 );
+      }
+    }
+    _TOML_stringifyText( self, "]", 1 );
+  // if string
+  } else if ( basic->type == TOML_STRING ) {
+    TOMLString *string = src;
+
+    // print string
+    _TOML_stringifyText( self, string->content, string->size );
+  // if number
+  } else if ( TOML_isNumber( basic ) ) {
+    // print number
+    _TOML_stringifyNumber( self, src );
+  } else if ( basic->type == TOML_BOOLEAN ) {
+    TOMLBoolean *boolean = (TOMLBoolean *) basic;
+
+    if ( boolean->isTrue ) {
+      _TOML_stringifyText( self, "true", 4 );
+    } else {
+      _TOML_stringifyText( self, "false", 5 );
+    }
+  } else if ( basic->type == TOML_DATE ) {
+    _TOML_stringifyDate( self, (TOMLDate *) basic );
+  } else {
+    assert( 0 );
+  }
+  // if error
+    // print error
+
+  return self->errorCode;
+}
+
+void TOMLWriter_initCallback(
+  TOMLWriter *self, TOMLWriteCallback write, void *context
+) {
+  self->write = write;
+  self->writev = NULL;
+  self->context = context;
+  self->errorCode = TOML_SUCCESS;
+  self->total = 0;
+  self->index = 0;
+  self->iovCount = 0;
+}
+
+void TOMLWriter_initIov(
+  TOMLWriter *self, TOMLWritevCallback writev, void *context
+) {
+  TOMLWriter_initCallback( self, NULL, context );
+  self->writev = writev;
+}
+
+int _TOMLWriter_writeFile( void *context, char *bytes, int size ) {
+  return fwrite( bytes, 1, size, (FILE *) context ) != (size_t) size;
+}
+
+void TOMLWriter_initFile( TOMLWriter *self, FILE *file ) {
+  TOMLWriter_initCallback( self, _TOMLWriter_writeFile, file );
+}
+
+int _TOMLWriter_writevFd( void *context, struct iovec *iov, int count ) {
+  int fd = (int) (long int) context;
+  while ( count > 0 ) {
+    ssize_t written = writev( fd, iov, count );
+    if ( written < 0 ) {
+      return 1;
+    }
+
+    // Skip the pieces that went out and trim a partly written one.
+    for ( ; count > 0 && (size_t) written >= iov->iov_len; iov++, count-- ) {
+      written -= iov->iov_len;
+    }
+    if ( count > 0 ) {
+      iov->iov_base = (char *) iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return 0;
+}
+
+void TOMLWriter_initFd( TOMLWriter *self, int fd ) {
+  TOMLWriter_initIov( self, _TOMLWriter_writevFd, (void *) (long int) fd );
+}
+
+int TOMLWriter_flush( TOMLWriter *self ) {
+  if ( self->writev ) {
+    if ( self->iovCount > 0 && self->errorCode == TOML_SUCCESS ) {
+      if ( self->writev( self->context, self->iov, self->iovCount ) ) {
+        self->errorCode = TOML_ERROR_FILEIO;
+      }
+    }
+    self->iovCount = 0;
+  } else if ( self->index > 0 && self->errorCode == TOML_SUCCESS ) {
+    if ( self->write( self->context, self->buffer, self->index ) ) {
+      self->errorCode = TOML_ERROR_FILEIO;
+    }
+  }
+  self->index = 0;
+  return self->errorCode;
+}
+
+// Adds a piece, extending the last one if the bytes follow it in memory. The
+// caller makes sure a free slot is left.
+void _TOMLWriter_addIov( TOMLWriter *self, char *bytes, int size ) {
+  if ( self->iovCount > 0 ) {
+    struct iovec *last = self->iov + self->iovCount - 1;
+    if ( (char *) last->iov_base + last->iov_len == bytes ) {
+      last->iov_len += size;
+      return;
+    }
+  }
+
+  self->iov[ self->iovCount ].iov_base = bytes;
+  self->iov[ self->iovCount ].iov_len = size;
+  self->iovCount++;
+}
+
+void _TOMLWriter_copyIov( TOMLWriter *self, char *bytes, int size ) {
+  if (
+    self->index + size > TOML_WRITER_BUFFER_SIZE ||
+      self->iovCount == TOML_WRITER_IOV_SIZE
+  ) {
+    TOMLWriter_flush( self );
+  }
+
+  // Pieces larger than the buffer go out before the caller can change them.
+  if ( size >= TOML_WRITER_BUFFER_SIZE ) {
+    _TOMLWriter_addIov( self, bytes, size );
+    TOMLWriter_flush( self );
+    return;
+  }
+
+  memcpy( self->buffer + self->index, bytes, size );
+  _TOMLWriter_addIov( self, self->buffer + self->index, size );
+  self->index += size;
+}
+
+void TOMLWriter_write( TOMLWriter *self, char *bytes, int size ) {
+  self->total += size;
+
+  if ( self->writev ) {
+    _TOMLWriter_copyIov( self, bytes, size );
+    return;
+  }
+
+  if ( self->index + size <= TOML_WRITER_BUFFER_SIZE ) {
+    memcpy( self->buffer + self->index, bytes, size );
+    self->index += size;
+    return;
+  }
+
+  TOMLWriter_flush( self );
+
+  // Pieces larger than the buffer go straight to the sink.
+  if ( size >= TOML_WRITER_BUFFER_SIZE ) {
+    if (
+      self->errorCode == TOML_SUCCESS &&
+        self->write( self->context, bytes, size )
+    ) {
+      self->errorCode = TOML_ERROR_FILEIO;
+    }
+  } else {
+    memcpy( self->buffer, bytes, size );
+    self->index = size;
+  }
+}
+
+void TOMLWriter_writeStable( TOMLWriter *self, char *bytes, int size ) {
+  if ( !self->writev || size < TOML_WRITER_STABLE_MIN ) {
+    TOMLWriter_write( self, bytes, size );
+    return;
+  }
+
+  self->total += size;
+  if ( self->iovCount == TOML_WRITER_IOV_SIZE ) {
+    TOMLWriter_flush( self );
+  }
+  _TOMLWriter_addIov( self, bytes, size );
+}
+
+int _TOML_write(
+  TOMLWriter *writer, TOMLRef src, int cached, TOMLError *error
+) {
+  struct _TOMLStringifyData stringifyData;
+  stringifyData.error = error;
+  stringifyData.writer = writer;
+  stringifyData.tableNameDepth = 0;
+  stringifyData.tableNameStackSize = 16;
+  stringifyData.tableNameStack = stringifyData.inlineNameStack;
+  stringifyData.hasOutput = 0;
+  stringifyData.json = 0;
+  stringifyData.cached = cached;
+  stringifyData.capture = NULL;
+  stringifyData.transient = 0;
+  stringifyData.errorCode = TOML_SUCCESS;
+
+  int errorCode = _TOML_stringify( &stringifyData, src );
+
+  if ( stringifyData.tableNameStack != stringifyData.inlineNameStack ) {
+    _TOML_dealloc( stringifyData.tableNameStack );
+  }
+
+  if ( errorCode != TOML_SUCCESS ) {
+    // Keep the unfinished output in the buffer from reaching the sink.
+    if ( writer->errorCode == TOML_SUCCESS ) {
+      writer->errorCode = errorCode;
+    }
+    _TOML_fillPlainError( error, errorCode );
+  } else {
+    errorCode = TOMLWriter_flush( writer );
+    if ( errorCode != TOML_SUCCESS ) {
+      _TOML_fillFileError( error, NULL );
+    }
+  }
+
+  return errorCode;
+}
+
+int TOML_write( TOMLWriter *writer, TOMLRef src, TOMLError *error ) {
+  return _TOML_write( writer, src, 0, error );
+}
+
+int TOML_writeCached( TOMLWriter *writer, TOMLRef src, TOMLError *error ) {
+  return _TOML_write( writer, src, 1, error );
+}
+
+int TOML_dump( char *filename, TOMLTable *src, TOMLError *error ) {
+  FILE *file = fopen( filename, "w" );
+  if ( file == NULL ) {
+    _TOML_fillFileError( error, filename );
+    return TOML_ERROR_FILEIO;
+  }
+
+  TOMLWriter *writer = _TOML_malloc( sizeof(TOMLWriter) );
+  TOMLWriter_initFile( writer, file );
+  int errorCode = TOML_write( writer, src, NULL );
+  _TOML_dealloc( writer );
+
+  if ( fclose( file ) != 0 ) {
+    errorCode = TOML_ERROR_FILEIO;
+  }
+
+  if ( errorCode != TOML_SUCCESS ) {
+    _TOML_fillFileError( error, filename );
+  }
+
+  return errorCode;
+}
+
+struct _TOMLFixedBuffer {
+  char *content;
+  int capacity;
+  int size;
+};
+
+// Copies what fits and drops the rest. TOMLWriter still counts the dropped
+// bytes in its total.
+int _TOMLWriter_writeFixed( void *context, char *bytes, int size ) {
+  struct _TOMLFixedBuffer *self = context;
+  int room = self->capacity - self->size;
+  if ( size > room ) {
+    size = room;
+  }
+  if ( size > 0 ) {
+    memcpy( self->content + self->size, bytes, size );
+    self->size += size;
+  }
+  return 0;
+}
+
+int TOML_stringifyTo( char *buffer, int capacity, TOMLRef src ) {
+  // Leave room for the null terminator.
+  struct _TOMLFixedBuffer fixed = {
+    buffer, capacity > 0 ? capacity - 1 : 0, 0
+  };
+
+  TOMLWriter writer;
+  TOMLWriter_initCallback( &writer, _TOMLWriter_writeFixed, &fixed );
+  int errorCode = TOML_write( &writer, src, NULL );
+
+  if ( capacity > 0 ) {
+    buffer[ fixed.size ] = 0;
+  }
+
+  return errorCode == TOML_SUCCESS ? writer.total : -1;
+}
+
+int TOML_stringifySize( TOMLRef src ) {
+  return TOML_stringifyTo( NULL, 0, src );
+}
+
+int TOML_stringify( char **buffer, TOMLRef src, TOMLError *error ) {
+  struct _TOMLStringBuffer string = { 0, 0, NULL };
+  TOMLWriter writer;
+  TOMLWriter_initCallback( &writer, _TOMLWriter_writeString, &string );
+  int errorCode = TOML_write( &writer, src, error );
+
+  if ( errorCode != TOML_SUCCESS ) {
+    _TOML_dealloc( string.content );
+    *buffer = NULL;
+    return errorCode;
+  }
+
+  _TOMLWriter_writeString( &string, "", 1 );
+  *buffer = string.content;
+  return TOML_SUCCESS;
+}
+
+int TOML_stringifyIov(
+  TOMLRef src, TOMLWritevCallback writev, void *context, TOMLError *error
+) {
+  TOMLWriter writer;
+  TOMLWriter_initIov( &writer, writev, context );
+  return TOML_write( &writer, src, error );
+}
+
+// Spaces for indenting pretty JSON, written in pieces for deep nesting.
+static char _TOML_jsonIndent[] = "                                ";
+
+void _TOML_jsonNewline( struct _TOMLStringifyData *self, int depth ) {
+  if ( !self->pretty ) {
+    return;
+  }
+
+  _TOML_stringifyText( self, "\n", 1 );
+  int spaces = depth * 2;
+  while ( spaces > 0 ) {
+    int size = spaces < 32 ? spaces : 32;
+    _TOML_stringifyText( self, _TOML_jsonIndent, size );
+    spaces -= size;
+  }
+}
+
+void _TOML_jsonString( struct _TOMLStringifyData *self, TOMLString *string ) {
+  _TOML_stringifyText( self, "\"", 1 );
+  _TOML_stringifyString( self, string );
+  _TOML_stringifyText( self, "\"", 1 );
+}
+
+void _TOML_toJSON(
+  struct _TOMLStringifyData *self, TOMLRef src, int depth
+) {
+  TOMLBasic *basic = src;
+
+  if ( src == NULL ) {
+    _TOML_stringifyText( self, "null", 4 );
+  } else if ( basic->type == TOML_TABLE ) {
+    TOMLTable *table = src;
+
+    _TOML_stringifyText( self, "{", 1 );
+    for ( int i = 0; i < table->keys->size; ++i ) {
+      if ( i > 0 ) {
+        _TOML_stringifyText( self, ",", 1 );
+      }
+      _TOML_jsonNewline( self, depth + 1 );
+      _TOML_jsonString( self, TOMLArray_getIndex( table->keys, i ) );
+      _TOML_stringifyText( self, self->pretty ? ": " : ":", self->pretty + 1 );
+      _TOML_toJSON( self, TOMLArray_getIndex( table->values, i ), depth + 1 );
+    }
+    if ( table->keys->size > 0 ) {
+      _TOML_jsonNewline( self, depth );
+    }
+    _TOML_stringifyText( self, "}", 1 );
+  } else if ( basic->type == TOML_ARRAY ) {
+    TOMLArray *array = src;
+
+    _TOML_stringifyText( self, "[", 1 );
+    for ( int i = 0; i < array->size; ++i ) {
+      if ( i > 0 ) {
+        _TOML_stringifyText( self, ",", 1 );
+      }
+      _TOML_jsonNewline( self, depth + 1 );
+      _TOML_toJSON( self, TOMLArray_getIndex( array, i ), depth + 1 );
+    }
+    if ( array->size > 0 ) {
+      _TOML_jsonNewline( self, depth );
+    }
+    _TOML_stringifyText( self, "]", 1 );
+  } else if ( basic->type == TOML_STRING ) {
+    _TOML_jsonString( self, src );
+  } else if ( TOML_isNumber( basic ) ) {
+    TOMLNumber *number = src;
+    char numberBuffer[ TOML_DOUBLE_BUFFER_SIZE ];
+
+    int size;
+    if ( number->type == TOML_INT ) {
+      size = _TOML_formatInt( numberBuffer, number->intValue );
+    } else if ( isfinite( number->doubleValue ) ) {
+      size = _TOML_formatDouble( numberBuffer, number->doubleValue );
+    } else {
+      // JSON has no nan or infinity.
+      memcpy( numberBuffer, "null", 4 );
+      size = 4;
+    }
+
+    _TOML_stringifyCopy( self, numberBuffer, size );
+  } else if ( basic->type == TOML_BOOLEAN ) {
+    if ( ( (TOMLBoolean *) basic )->isTrue ) {
+      _TOML_stringifyText( self, "true", 4 );
+    } else {
+      _TOML_stringifyText( self, "false", 5 );
+    }
+  } else if ( basic->type == TOML_DATE ) {
+    char dateBuffer[ 34 ];
+    dateBuffer[ 0 ] = '"';
+    int size = _TOML_formatDate( dateBuffer + 1, (TOMLDate *) basic );
+    dateBuffer[ size + 1 ] = '"';
+
+    _TOML_stringifyCopy( self, dateBuffer, size + 2 );
+  } else {
+    assert( 0 );
+  }
+}
+
+int TOML_toJSON(
+  TOMLWriter *writer, TOMLRef src, int pretty, TOMLError *error
+) {
+  struct _TOMLStringifyData stringifyData;
+  memset( &stringifyData, 0, sizeof(stringifyData) );
+  stringifyData.error = error;
+  stringifyData.writer = writer;
+  stringifyData.json = 1;
+  stringifyData.pretty = pretty != 0;
+
+  _TOML_toJSON( &stringifyData, src, 0 );
+
+  int errorCode = TOMLWriter_flush( writer );
+  if ( errorCode != TOML_SUCCESS ) {
+    _TOML_fillFileError( error, NULL );
+  }
+
+  return errorCode;
+}
+
+void _TOMLEmitter_fail( TOMLEmitter *self, TOMLErrorType errorCode ) {
+  if ( self->errorCode == TOML_SUCCESS ) {
+    self->errorCode = errorCode;
+  }
+}
+
+void _TOMLEmitter_data(
+  TOMLEmitter *self, struct _TOMLStringifyData *data
+) {
+  data->error = NULL;
+  data->writer = self->writer;
+  data->tableNameDepth = 0;
+  data->tableNameStackSize = 16;
+  data->tableNameStack = data->inlineNameStack;
+  data->hasOutput = 0;
+  data->json = 0;
+  data->cached = 0;
+  data->capture = NULL;
+  // The caller's strings may change as soon as the call returns.
+  data->transient = 1;
+  data->errorCode = TOML_SUCCESS;
+}
+
+void TOMLEmitter_init( TOMLEmitter *self, TOMLWriter *writer ) {
+  self->writer = writer;
+  self->errorCode = TOML_SUCCESS;
+  self->path = NULL;
+  self->pathCapacity = 0;
+  self->hasKey = 0;
+  self->arrayDepth = 0;
+}
+
+int TOMLEmitter_finish( TOMLEmitter *self ) {
+  if ( self->hasKey || self->arrayDepth > 0 ) {
+    _TOMLEmitter_fail( self, TOML_ERROR_NO_VALUE );
+  }
+
+  _TOML_dealloc( self->path );
+  self->path = NULL;
+  self->pathCapacity = 0;
+
+  if ( TOMLWriter_flush( self->writer ) != TOML_SUCCESS ) {
+    _TOMLEmitter_fail( self, TOML_ERROR_FILEIO );
+  }
+  return self->errorCode;
+}
+
+// Returns non-zero if the size bytes at name are a key the parser reads back.
+int _TOML_isKey( char *name, int size ) {
+  if (
+    size == 0 || ( name[ 0 ] >= '0' && name[ 0 ] <= '9' ) ||
+      ( size == 4 && strncmp( name, "true", 4 ) == 0 ) ||
+      ( size == 5 && strncmp( name, "false", 5 ) == 0 )
+  ) {
+    return 0;
+  }
+  for ( int i = 0; i < size; ++i ) {
+    char c = name[ i ];
+    if (
+      !( c >= 'a' && c <= 'z' ) && !( c >= 'A' && c <= 'Z' ) &&
+        !( c >= '0' && c <= '9' ) && c != '_'
+    ) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Returns non-zero if every dotted part of the path is a key.
+int _TOML_isKeyPath( char *path ) {
+  char *dot;
+  while ( ( dot = strchr( path, '.' ) ) != NULL ) {
+    if ( !_TOML_isKey( path, dot - path ) ) {
+      return 0;
+    }
+    path = dot + 1;
+  }
+  return _TOML_isKey( path, strlen( path ) );
+}
+
+void _TOMLEmitter_header(
+  TOMLEmitter *self, char *path, char *open, char *close, int isArray
+) {
+  if ( self->errorCode != TOML_SUCCESS ) {
+    return;
+  }
+
+  int size = path ? strlen( path ) : 0;
+  if ( size == 0 || self->hasKey || self->arrayDepth > 0 ) {
+    _TOMLEmitter_fail( self, TOML_ERROR_INVALID_HEADER );
+    return;
+  }
+  if ( !_TOML_isKeyPath( path ) ) {
+    _TOMLEmitter_fail( self, TOML_ERROR_INVALID_KEY );
+    return;
+  }
+
+  // Only the current header is remembered, so only a table repeated right
+  // after itself is caught.
+  if ( !isArray && self->path && strcmp( self->path, path ) == 0 ) {
+    _TOMLEmitter_fail( self, TOML_ERROR_TABLE_DEFINED );
+    return;
+  }
+
+  if ( size + 1 > self->pathCapacity ) {
+    _TOML_dealloc( self->path );
+    self->pathCapacity = size + 1;
+    self->path = _TOML_malloc( self->pathCapacity );
+  }
+  memcpy( self->path, path, size + 1 );
+
+  if ( self->writer->total != 0 ) {
+    TOMLWriter_write( self->writer, "\n", 1 );
+  }
+  TOMLWriter_write( self->writer, open, strlen( open ) );
+  TOMLWriter_write( self->writer, path, size );
+  TOMLWriter_write( self->writer, close, strlen( close ) );
+}
+
+void TOMLEmitter_beginTable( TOMLEmitter *self, char *path ) {
+  _TOMLEmitter_header( self, path, "[", "]\n", 0 );
+}
+
+void TOMLEmitter_beginArrayTable( TOMLEmitter *self, char *path ) {
+  _TOMLEmitter_header( self, path, "[[", "]]\n", 1 );
+}
+
+void TOMLEmitter_key( TOMLEmitter *self, char *name ) {
+  if ( self->errorCode != TOML_SUCCESS ) {
+    return;
+  }
+
+  if ( self->hasKey || self->arrayDepth > 0 ) {
+    _TOMLEmitter_fail( self, TOML_ERROR_NO_VALUE );
+    return;
+  }
+  if ( !name || !_TOML_isKey( name, strlen( name ) ) ) {
+    _TOMLEmitter_fail( self, TOML_ERROR_INVALID_KEY );
+    return;
+  }
+
+  self->hasKey = 1;
+  TOMLWriter_write( self->writer, name, strlen( name ) );
+  TOMLWriter_write( self->writer, " = ", 3 );
+}
+
+// Checks a value may be written here and writes what goes before it.
+// Returns non-zero if it may.
+int _TOMLEmitter_beginValue( TOMLEmitter *self, TOMLType type ) {
+  if ( self->errorCode != TOML_SUCCESS ) {
+    return 0;
+  }
+
+  if ( self->arrayDepth == 0 ) {
+    if ( !self->hasKey ) {
+      _TOMLEmitter_fail( self, TOML_ERROR_NO_EQ );
+      return 0;
+    }
+    return 1;
+  }
+
+  int level = self->arrayDepth - 1;
+  if ( self->memberTypes[ level ] == TOML_NOTYPE ) {
+    self->memberTypes[ level ] = type;
+  } else if ( self->memberTypes[ level ] != type ) {
+    _TOMLEmitter_fail( self, TOML_ERROR_ARRAY_MEMBER_MISMATCH );
+    return 0;
+  }
+
+  if ( self->memberCounts[ level ]++ > 0 ) {
+    TOMLWriter_write( self->writer, ",", 1 );
+  }
+  TOMLWriter_write( self->writer, " ", 1 );
+  return 1;
+}
+
+// Ends the entry line once a value outside of any array is written.
+void _TOMLEmitter_endValue( TOMLEmitter *self ) {
+  if ( self->arrayDepth == 0 ) {
+    TOMLWriter_write( self->writer, "\n", 1 );
+    self->hasKey = 0;
+  }
+}
+
+void TOMLEmitter_string( TOMLEmitter *self, char *value ) {
+  if ( _TOMLEmitter_beginValue( self, TOML_STRING ) ) {
+    struct _TOMLStringifyData data;
+    _TOMLEmitter_data( self, &data );
+    TOMLWriter_write( self->writer, "\"", 1 );
+    _TOML_stringifyBytes( &data, (unsigned char *) value, strlen( value ) );
+    TOMLWriter_write( self->writer, "\"", 1 );
+    _TOMLEmitter_endValue( self );
+  }
+}
+
+void TOMLEmitter_int( TOMLEmitter *self, int value ) {
+  if ( _TOMLEmitter_beginValue( self, TOML_INT ) ) {
+    char numberBuffer[ 16 ];
+    int size = _TOML_formatInt( numberBuffer, value );
+    TOMLWriter_write( self->writer, numberBuffer, size );
+    _TOMLEmitter_endValue( self );
+  }
+}
+
+void TOMLEmitter_double( TOMLEmitter *self, double value ) {
+  if ( !isfinite( value ) ) {
+    _TOMLEmitter_fail( self, TOML_ERROR_NOT_FINITE );
+    return;
+  }
+  if ( _TOMLEmitter_beginValue( self, TOML_DOUBLE ) ) {
+    char numberBuffer[ TOML_DOUBLE_BUFFER_SIZE ];
+    int size = _TOML_formatDouble( numberBuffer, value );
+    TOMLWriter_write( self->writer, numberBuffer, size );
+    _TOMLEmitter_endValue( self );
+  }
+}
+
+void TOMLEmitter_boolean( TOMLEmitter *self, int truth ) {
+  if ( _TOMLEmitter_beginValue( self, TOML_BOOLEAN ) ) {
+    if ( truth ) {
+      TOMLWriter_write( self->writer, "true", 4 );
+    } else {
+      TOMLWriter_write( self->writer, "false", 5 );
+    }
+    _TOMLEmitter_endValue( self );
+  }
+}
+
+void TOMLEmitter_value( TOMLEmitter *self, TOMLRef value ) {
+  TOMLBasic *basic = value;
+  if ( basic == NULL || basic->type == TOML_TABLE ) {
+    _TOMLEmitter_fail( self, TOML_ERROR_NO_VALUE );
+    return;
+  }
+
+  if ( _TOMLEmitter_beginValue( self, basic->type ) ) {
+    struct _TOMLStringifyData data;
+    _TOMLEmitter_data( self, &data );
+    if ( basic->type == TOML_STRING ) {
+      TOMLWriter_write( self->writer, "\"", 1 );
+      _TOML_stringifyString( &data, value );
+      TOMLWriter_write( self->writer, "\"", 1 );
+    } else if ( _TOML_stringify( &data, value ) != TOML_SUCCESS ) {
+      _TOMLEmitter_fail( self, data.errorCode );
+      return;
+    }
+    _TOMLEmitter_endValue( self );
+  }
+}
+
+void TOMLEmitter_beginArray( TOMLEmitter *self ) {
+  if ( self->arrayDepth == TOML_EMITTER_MAX_DEPTH ) {
+    _TOMLEmitter_fail( self, TOML_ERROR_FATAL );
+    return;
+  }
+
+  if ( _TOMLEmitter_beginValue( self, TOML_ARRAY ) ) {
+    self->memberTypes[ self->arrayDepth ] = TOML_NOTYPE;
+    self->memberCounts[ self->arrayDepth ] = 0;
+    self->arrayDepth++;
+    TOMLWriter_write( self->writer, "[", 1 );
+  }
+}
+
+void TOMLEmitter_endArray( TOMLEmitter *self ) {
+  if ( self->errorCode != TOML_SUCCESS ) {
+    return;
+  }
+
+  if ( self->arrayDepth == 0 ) {
+    _TOMLEmitter_fail( self, TOML_ERROR_FATAL );
+    return;
+  }
+
+  self->arrayDepth--;
+  if ( self->memberCounts[ self->arrayDepth ] > 0 ) {
+    TOMLWriter_write( self->writer, " ]", 2 );
+  } else {
+    TOMLWriter_write( self->writer, "]", 1 );
+  }
+  _TOMLEmitter_endValue( self );
+}
+
+// What the event parser expects next.
+enum {
+  TOML_EVENTS_LINE,
+  // An id, or a second [ for an array of tables.
+  TOML_EVENTS_HEADER,
+  TOML_EVENTS_HEADER_ID,
+  // A dot or the ] closing the header.
+  TOML_EVENTS_HEADER_DOT,
+  // The second ] of an array of tables header.
+  TOML_EVENTS_HEADER_CLOSE,
+  TOML_EVENTS_EQ,
+  TOML_EVENTS_VALUE,
+  // A value or ] right after [.
+  TOML_EVENTS_FIRST_MEMBER,
+  // A comma or ] after a member.
+  TOML_EVENTS_COMMA,
+  // A value, comma or ] after a comma.
+  TOML_EVENTS_MEMBER
+};
+
+// Follows the grammar one token at a time, so it can be fed from a buffer or
+// from a file read in blocks. Tokens are dropped once handled.
+struct _TOMLEventParser {
+  TOMLEvents *events;
+  void *context;
+  // Holds the error object, so errors are filled the way the grammar does.
+  TOMLParserState state;
+  // The non-zero value a callback stopped the parse with.
+  int stopped;
+  int step;
+  int isArrayTable;
+  // The header path as written or the key of the current entry.
+  struct _TOMLStringBuffer name;
+  // Open arrays and, when checking types, the member type of each.
+  int depth;
+  int typesCapacity;
+  TOMLType *memberTypes;
+  // When checking for duplicates, the path of the current table, with tables
+  // of arrays of tables named by index like "host.0", and every path defined
+  // so far.
+  struct _TOMLStringBuffer table;
+  struct _TOMLPathSet defined;
+  // Values handed to the value callback, reused for every value.
+  struct _TOMLStringBuffer text;
+  TOMLString *string;
+  int stringCapacity;
+  TOMLNumber number;
+  TOMLBoolean boolean;
+  TOMLDate date;
+};
+
+void _TOMLEventParser_init(
+  struct _TOMLEventParser *self, TOMLEvents *events, void *context,
+  TOMLError *error
+) {
+  memset( self, 0, sizeof(struct _TOMLEventParser) );
+  self->events = events;
+  self->context = context;
+  self->state.errorObj = error;
+  self->number.refCount = 1;
+  self->boolean.type = TOML_BOOLEAN;
+  self->boolean.refCount = 1;
+}
+
+void _TOMLEventParser_fail(
+  struct _TOMLEventParser *self, TOMLToken *token, int errorCode
+) {
+  self->state.token = token;
+  _TOML_fillError( token, &self->state, errorCode );
+}
+
+// Copy the text of a token into a buffer, null terminated.
+char * _TOMLEventParser_copy(
+  struct _TOMLStringBuffer *buffer, char *start, int size
+) {
+  buffer->size = 0;
+  _TOMLWriter_writeString( buffer, start, size );
+  _TOMLWriter_writeString( buffer, "", 1 );
+  buffer->size--;
+  return buffer->content;
+}
+
+// Append ".index" to the path of the current table.
+void _TOMLEventParser_appendIndex( struct _TOMLEventParser *self, int index ) {
+  char text[ 16 ];
+  text[ 0 ] = '.';
+  int size = _TOML_formatInt( text + 1, index ) + 1;
+  _TOMLWriter_writeString( &self->table, text, size );
+}
+
+// Find the table a header names, remembering it and any tables it implies.
+// Mirrors how the tree parser creates tables: a header may not name anything
+// already defined, and names going through an array of tables mean its last
+// table.
+int _TOMLEventParser_defineTable(
+  struct _TOMLEventParser *self, TOMLToken *token
+) {
+  struct _TOMLStringBuffer *table = &self->table;
+  table->size = 0;
+
+  char *part = self->name.content;
+  for ( ;; ) {
+    char *dot = strchr( part, '.' );
+    if ( table->size > 0 ) {
+      _TOMLWriter_writeString( table, ".", 1 );
+    }
+    _TOMLWriter_writeString( table, part, dot ? dot - part : strlen( part ) );
+
+    struct _TOMLPathEntry *entry =
+      _TOMLPathSet_find( &self->defined, table->content, table->size );
+    if ( dot ) {
+      if ( entry == NULL ) {
+        _TOMLPathSet_add(
+          &self->defined, table->content, table->size, TOML_PATH_TABLE
+        );
+      } else if ( entry->kind == TOML_PATH_VALUE ) {
+        _TOMLEventParser_fail( self, token, TOML_ERROR_TABLE_DEFINED );
+        return 1;
+      } else if ( entry->kind == TOML_PATH_ARRAY ) {
+        _TOMLEventParser_appendIndex( self, entry->count - 1 );
+      }
+      part = dot + 1;
+      continue;
+    }
+
+    if ( self->isArrayTable ) {
+      if ( entry == NULL ) {
+        entry = _TOMLPathSet_add(
+          &self->defined, table->content, table->size, TOML_PATH_ARRAY
+        );
+      } else if ( entry->kind != TOML_PATH_ARRAY ) {
+        _TOMLEventParser_fail( self, token, TOML_ERROR_TABLE_DEFINED );
+        return 1;
+      }
+      _TOMLEventParser_appendIndex( self, entry->count++ );
+    } else if ( entry ) {
+      _TOMLEventParser_fail( self, token, TOML_ERROR_TABLE_DEFINED );
+      return 1;
+    }
+
+    _TOMLPathSet_add(
+      &self->defined, table->content, table->size, TOML_PATH_TABLE
+    );
+    return 0;
+  }
+}
+
+// Remember the key of the current entry in the current table.
+int _TOMLEventParser_defineKey(
+  struct _TOMLEventParser *self, TOMLToken *token
+) {
+  struct _TOMLStringBuffer *table = &self->table;
+  int tableSize = table->size;
+  if ( tableSize > 0 ) {
+    _TOMLWriter_writeString( table, ".", 1 );
+  }
+  _TOMLWriter_writeString( table, self->name.content, self->name.size );
+
+  int defined =
+    _TOMLPathSet_find( &self->defined, table->content, table->size ) != NULL;
+  if ( defined ) {
+    _TOMLEventParser_fail( self, token, TOML_ERROR_ENTRY_DEFINED );
+  } else {
+    _TOMLPathSet_add(
+      &self->defined, table->content, table->size, TOML_PATH_VALUE
+    );
+  }
+
+  table->size = tableSize;
+  return defined;
+}
+
+// Check a member against the type of the array it is in.
+int _TOMLEventParser_checkMember(
+  struct _TOMLEventParser *self, TOMLToken *token, TOMLType type
+) {
+  if ( !( self->events->checks & TOML_CHECK_ARRAY_TYPES ) || !self->depth ) {
+    return 0;
+  }
+
+  TOMLType *memberType = &self->memberTypes[ self->depth - 1 ];
+  if ( *memberType == TOML_NOTYPE ) {
+    *memberType = type;
+  } else if ( *memberType != type ) {
+    _TOMLEventParser_fail( self, token, TOML_ERROR_ARRAY_MEMBER_MISMATCH );
+    return 1;
+  }
+  return 0;
+}
+
+// Decode a scalar token into the reused value of its type. Returns NULL for
+// tokens that are not values.
+TOMLRef _TOMLEventParser_decode(
+  struct _TOMLEventParser *self, int tokenId, TOMLToken *token
+) {
+  int size = token->end - token->start;
+
+  if ( tokenId == STRING ) {
+    if ( self->stringCapacity < size ) {
+      self->stringCapacity = size;
+      self->string = _TOML_realloc(
+        self->string, sizeof(TOMLString) + self->stringCapacity + 1
+      );
+      self->string->type = TOML_STRING;
+      self->string->refCount = 1;
+    }
+    self->string->size =
+      _TOML_unescape( self->string->content, token->start + 1, size - 2 );
+    self->string->content[ self->string->size ] = 0;
+    self->string->hash = 0;
+    return self->string;
+  } else if ( tokenId == NUMBER ) {
+    char *text = _TOMLEventParser_copy( &self->text, token->start, size );
+    if ( strchr( text, '.' ) != NULL ) {
+      self->number.type = TOML_DOUBLE;
+      self->number.doubleValue = atof( text );
+    } else {
+      self->number.type = TOML_INT;
+      self->number.intValue = atoi( text );
+    }
+    return &self->number;
+  } else if ( tokenId == TRUE || tokenId == FALSE ) {
+    self->boolean.isTrue = tokenId == TRUE;
+    return &self->boolean;
+  } else if ( tokenId == DATE ) {
+    char *text = _TOMLEventParser_copy( &self->text, token->start, size );
+    int year, month, day, hour, minute, second;
+    sscanf(
+      text,
+      "%d-%d-%dT%d:%d:%dZ",
+      &year, &month, &day, &hour, &minute, &second
+    );
+    _TOMLDate_set( &self->date, year, month, day, hour, minute, second );
+    return &self->date;
+  }
+  return NULL;
+}
+
+// After a value, expect the next member or the next line.
+void _TOMLEventParser_endValue( struct _TOMLEventParser *self ) {
+  self->step = self->depth > 0 ? TOML_EVENTS_COMMA : TOML_EVENTS_LINE;
+}
+
+// Handle one token. Returns non-zero once the parse fails or is stopped.
+int _TOMLEventParser_token( void *context, int tokenId, TOMLToken *token ) {
+  struct _TOMLEventParser *self = context;
+  TOMLEvents *events = self->events;
+  int checkDuplicates = events->checks & TOML_CHECK_DUPLICATES;
+
+  switch ( self->step ) {
+    case TOML_EVENTS_LINE:
+      if ( tokenId == LEFT_SQUARE ) {
+        self->isArrayTable = 0;
+        self->name.size = 0;
+        self->step = TOML_EVENTS_HEADER;
+      } else if ( tokenId == ID ) {
+        _TOMLEventParser_copy(
+          &self->name, token->start, token->end - token->start
+        );
+        self->step = TOML_EVENTS_EQ;
+      } else if ( tokenId != COMMENT && tokenId != EOF ) {
+        _TOMLEventParser_fail( self, token, TOML_ERROR_FATAL );
+      }
+      break;
+
+    case TOML_EVENTS_HEADER:
+      if ( tokenId == LEFT_SQUARE && !self->isArrayTable ) {
+        self->isArrayTable = 1;
+        break;
+      }
+      // A header starts with an id like any part after a dot.
+    case TOML_EVENTS_HEADER_ID:
+      if ( tokenId == ID ) {
+        _TOMLWriter_writeString(
+          &self->name, token->start, token->end - token->start
+        );
+        self->step = TOML_EVENTS_HEADER_DOT;
+      } else {
+        _TOMLEventParser_fail( self, token, TOML_ERROR_INVALID_HEADER );
+      }
+      break;
+
+    case TOML_EVENTS_HEADER_DOT:
+      if ( tokenId == ID_DOT ) {
+        _TOMLWriter_writeString( &self->name, ".", 1 );
+        self->step = TOML_EVENTS_HEADER_ID;
+        break;
+      } else if ( tokenId == RIGHT_SQUARE && self->isArrayTable ) {
+        self->step = TOML_EVENTS_HEADER_CLOSE;
+        break;
+      } else if ( tokenId != RIGHT_SQUARE ) {
+        _TOMLEventParser_fail( self, token, TOML_ERROR_INVALID_HEADER );
+        break;
+      }
+      // A ] ends a table header.
+    case TOML_EVENTS_HEADER_CLOSE:
+      if ( tokenId != RIGHT_SQUARE ) {
+        _TOMLEventParser_fail( self, token, TOML_ERROR_INVALID_HEADER );
+        break;
+      }
+
+      _TOMLEventParser_copy( &self->name, self->name.content, self->name.size );
+      if ( checkDuplicates && _TOMLEventParser_defineTable( self, token ) ) {
+        break;
+      }
+      if ( self->isArrayTable && events->arrayTable ) {
+        self->stopped = events->arrayTable( self->context, self->name.content );
+      } else if ( !self->isArrayTable && events->table ) {
+        self->stopped = events->table( self->context, self->name.content );
+      }
+      self->step = TOML_EVENTS_LINE;
+      break;
+
+    case TOML_EVENTS_EQ:
+      if ( tokenId != EQ ) {
+        _TOMLEventParser_fail( self, token, TOML_ERROR_NO_EQ );
+        break;
+      }
+
+      if ( checkDuplicates && _TOMLEventParser_defineKey( self, token ) ) {
+        break;
+      }
+      if ( events->key ) {
+        self->stopped = events->key( self->context, self->name.content );
+      }
+      self->step = TOML_EVENTS_VALUE;
+      break;
+
+    case TOML_EVENTS_FIRST_MEMBER:
+    case TOML_EVENTS_MEMBER:
+      if ( tokenId == RIGHT_SQUARE ) {
+        goto endArray;
+      } else if ( tokenId == COMMA && self->step == TOML_EVENTS_MEMBER ) {
+        break;
+      }
+      // Otherwise a member is a value like any other.
+    case TOML_EVENTS_VALUE:
+      if ( tokenId == LEFT_SQUARE ) {
+        if ( _TOMLEventParser_checkMember( self, token, TOML_ARRAY ) ) {
+          break;
+        }
+
+        if ( events->checks & TOML_CHECK_ARRAY_TYPES ) {
+          if ( self->depth == self->typesCapacity ) {
+            self->typesCapacity =
+              self->typesCapacity ? self->typesCapacity * 2 : 8;
+            self->memberTypes = _TOML_realloc(
+              self->memberTypes, self->typesCapacity * sizeof(TOMLType)
+            );
+          }
+          self->memberTypes[ self->depth ] = TOML_NOTYPE;
+        }
+        self->depth++;
+
+        if ( events->beginArray ) {
+          self->stopped = events->beginArray( self->context );
+        }
+        self->step = TOML_EVENTS_FIRST_MEMBER;
+        break;
+      }
+
+      TOMLBasic *value = _TOMLEventParser_decode( self, tokenId, token );
+      if ( value == NULL ) {
+        _TOMLEventParser_fail( self, token, TOML_ERROR_NO_VALUE );
+        break;
+      } else if ( _TOMLEventParser_checkMember( self, token, value->type ) ) {
+        break;
+      }
+
+      if ( events->value ) {
+        self->stopped = events->value( self->context, value );
+      }
+      _TOMLEventParser_endValue( self );
+      break;
+
+    case TOML_EVENTS_COMMA:
+      if ( tokenId == COMMA ) {
+        self->step = TOML_EVENTS_MEMBER;
+        break;
+      } else if ( tokenId != RIGHT_SQUARE ) {
+        _TOMLEventParser_fail( self, token, TOML_ERROR_NO_VALUE );
+        break;
+      }
+
+    endArray:
+      self->depth--;
+      if ( events->endArray ) {
+        self->stopped = events->endArray( self->context );
+      }
+      _TOMLEventParser_endValue( self );
+      break;
+  }
+
+  return self->state.errorCode || self->stopped;
+}
+
+// Free what the parser holds and return the parse's result.
+int _TOMLEventParser_finish( struct _TOMLEventParser *self ) {
+  _TOML_dealloc( self->name.content );
+  _TOML_dealloc( self->memberTypes );
+  _TOML_dealloc( self->table.content );
+  _TOMLPathSet_free( &self->defined );
+  _TOML_dealloc( self->text.content );
+  _TOML_dealloc( self->string );
+
+  return self->stopped ? self->stopped : self->state.errorCode;
+}
+
+int TOML_parseEvents(
+  char *buffer, TOMLEvents *events, void *context, TOMLError *error
+) {
+  struct _TOMLEventParser parser;
+  _TOMLEventParser_init( &parser, events, context, error );
+  struct _TOMLScanner scanner;
+  _TOMLScanner_initBuffer( &scanner, buffer );
+  _TOML_scanTokens( &scanner, _TOMLEventParser_token, &parser );
+
+  return _TOMLEventParser_finish( &parser );
+}
+
+int TOML_loadEvents(
+  char *filename, TOMLEvents *events, void *context, TOMLError *error
+) {
+  FILE *fd = fopen( filename, "r" );
+  if ( fd == NULL ) {
+    _TOML_fillFileError( error, filename );
+    return TOML_ERROR_FILEIO;
+  }
+
+  struct _TOMLEventParser parser;
+  _TOMLEventParser_init( &parser, events, context, error );
+  struct _TOMLScanner scanner;
+  _TOMLScanner_initRead( &scanner, _TOML_read, fd );
+  _TOML_scanTokens( &scanner, _TOMLEventParser_token, &parser );
+  _TOMLScanner_free( &scanner );
+  fclose( fd );
+
+  return _TOMLEventParser_finish( &parser );
+}
+
+struct _TOMLReaderState {
+  struct _TOMLScanner scanner;
+  struct _TOMLEventParser parser;
+  TOMLEvents events;
+  // The descriptor TOMLReader_initFd reads.
+  int fd;
+  // Set once the EOF token was scanned.
+  int ended;
+  // Where the parser's callbacks put the event made from the last token.
+  TOMLReadEvent *event;
+  int ready;
+};
+
+int _TOMLReader_event(
+  struct _TOMLReaderState *self, TOMLReadType type, char *name,
+  TOMLRef value
+) {
+  self->event->type = type;
+  self->event->name = name;
+  self->event->value = value;
+  self->event->line = self->scanner.token.line;
+  self->ready = 1;
+  return 0;
+}
+
+int _TOMLReader_table( void *context, char *path ) {
+  return _TOMLReader_event( context, TOML_READ_TABLE, path, NULL );
+}
+
+int _TOMLReader_arrayTable( void *context, char *path ) {
+  return _TOMLReader_event( context, TOML_READ_ARRAY_TABLE, path, NULL );
+}
+
+int _TOMLReader_key( void *context, char *name ) {
+  return _TOMLReader_event( context, TOML_READ_KEY, name, NULL );
+}
+
+int _TOMLReader_value( void *context, TOMLRef value ) {
+  return _TOMLReader_event( context, TOML_READ_VALUE, NULL, value );
+}
+
+int _TOMLReader_beginArray( void *context ) {
+  return _TOMLReader_event( context, TOML_READ_BEGIN_ARRAY, NULL, NULL );
+}
+
+int _TOMLReader_endArray( void *context ) {
+  return _TOMLReader_event( context, TOML_READ_END_ARRAY, NULL, NULL );
+}
+
+struct _TOMLReaderState * _TOMLReader_alloc( int checks, TOMLError *error ) {
+  struct _TOMLReaderState *self =
+    _TOML_malloc( sizeof(struct _TOMLReaderState) );
+  TOMLEvents events = {
+    _TOMLReader_table,
+    _TOMLReader_arrayTable,
+    _TOMLReader_key,
+    _TOMLReader_value,
+    _TOMLReader_beginArray,
+    _TOMLReader_endArray,
+    checks
+  };
+  self->events = events;
+  _TOMLEventParser_init( &self->parser, &self->events, self, error );
+  self->ended = 0;
+  return self;
+}
+
+void TOMLReader_initBuffer(
+  TOMLReader *reader, char *buffer, int checks, TOMLError *error
+) {
+  reader->state = _TOMLReader_alloc( checks, error );
+  _TOMLScanner_initBuffer( &reader->state->scanner, buffer );
+}
+
+void TOMLReader_initFile(
+  TOMLReader *reader, FILE *file, int checks, TOMLError *error
+) {
+  reader->state = _TOMLReader_alloc( checks, error );
+  _TOMLScanner_initRead( &reader->state->scanner, _TOML_read, file );
+}
+
+void TOMLReader_initFd(
+  TOMLReader *reader, int fd, int checks, TOMLError *error
+) {
+  struct _TOMLReaderState *self = reader->state =
+    _TOMLReader_alloc( checks, error );
+  self->fd = fd;
+  _TOMLScanner_initRead( &self->scanner, _TOML_readFd, &self->fd );
+}
+
+// Scan the next token. Returns 0 once it is the EOF token.
+int _TOMLReader_scan( struct _TOMLReaderState *self ) {
+  self->ended = !_TOMLScanner_next( &self->scanner );
+  return !self->ended;
+}
+
+// Hand the last token to the parser. Returns non-zero on error.
+int _TOMLReader_parse( struct _TOMLReaderState *self ) {
+  return _TOMLEventParser_token(
+    &self->parser, self->scanner.tokenId, &self->scanner.token
+  );
+}
+
+int TOMLReader_next( TOMLReader *reader, TOMLReadEvent *event ) {
+  struct _TOMLReaderState *self = reader->state;
+  self->event = event;
+  self->ready = 0;
+
+  while ( !self->ended && !self->parser.state.errorCode ) {
+    _TOMLReader_scan( self );
+    if ( _TOMLReader_parse( self ) ) {
+      return 0;
+    } else if ( self->ready ) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Skip tokens up to the ] closing an array already started. Only brackets
+// are looked at. Returns non-zero if the input ends first.
+int _TOMLReader_skipArray( struct _TOMLReaderState *self ) {
+  int depth = 1;
+  while ( depth > 0 ) {
+    if ( !_TOMLReader_scan( self ) ) {
+      _TOMLEventParser_fail(
+        &self->parser, &self->scanner.token, TOML_ERROR_NO_VALUE
+      );
+      return 1;
+    }
+
+    if ( self->scanner.tokenId == LEFT_SQUARE ) {
+      depth++;
+    } else if ( self->scanner.tokenId == RIGHT_SQUARE ) {
+      depth--;
+    }
+  }
+  return 0;
+}
+
+// Skip the next value without decoding it. Returns non-zero if it is not a
+// value.
+int _TOMLReader_skipOne( struct _TOMLReaderState *self ) {
+  _TOMLReader_scan( self );
+  switch ( self->scanner.tokenId ) {
+    case LEFT_SQUARE:
+      return _TOMLReader_skipArray( self );
+    case STRING:
+    case NUMBER:
+    case TRUE:
+    case FALSE:
+    case DATE:
+      return 0;
+    default:
+      _TOMLEventParser_fail(
+        &self->parser, &self->scanner.token, TOML_ERROR_NO_VALUE
+      );
+      return 1;
+  }
+}
+
+void TOMLReader_skipValue( TOMLReader *reader ) {
+  struct _TOMLReaderState *self = reader->state;
+  struct _TOMLEventParser *parser = &self->parser;
+  if ( self->ended || parser->state.errorCode ) {
+    return;
+  }
+
+  switch ( parser->step ) {
+    case TOML_EVENTS_VALUE:
+      if ( _TOMLReader_skipOne( self ) ) {
+        return;
+      }
+      break;
+    case TOML_EVENTS_FIRST_MEMBER:
+    case TOML_EVENTS_COMMA:
+    case TOML_EVENTS_MEMBER:
+      if ( _TOMLReader_skipArray( self ) ) {
+        return;
+      }
+      parser->depth--;
+      break;
+    default:
+      return;
+  }
+  _TOMLEventParser_endValue( parser );
+}
+
+void TOMLReader_skipTable( TOMLReader *reader ) {
+  struct _TOMLReaderState *self = reader->state;
+  struct _TOMLEventParser *parser = &self->parser;
+
+  // Finish the value being read.
+  while (
+    !self->ended && !parser->state.errorCode &&
+      parser->step != TOML_EVENTS_LINE
+  ) {
+    TOMLReader_skipValue( reader );
+  }
+
+  // Skip entries until a header starts. Values are skipped whole, so the [
+  // of an array is not mistaken for a header.
+  while ( !self->ended && !parser->state.errorCode ) {
+    if ( !_TOMLReader_scan( self ) ) {
+      _TOMLReader_parse( self );
+    } else if ( self->scanner.tokenId == LEFT_SQUARE ) {
+      _TOMLReader_parse( self );
+      return;
+    } else if ( self->scanner.tokenId == EQ ) {
+      _TOMLReader_skipOne( self );
+    }
+  }
+}
+
+int TOMLReader_finish( TOMLReader *reader ) {
+  struct _TOMLReaderState *self = reader->state;
+  _TOMLScanner_free( &self->scanner );
+  int errorCode = _TOMLEventParser_finish( &self->parser );
+  _TOML_dealloc( self );
+  reader->state = NULL;
+  return errorCode;
+}
+
+// Fill an error that has no source line to point at.
+TOMLBindSpec * TOML_allocBindSpec( TOMLBinding *bindings ) {
+  TOMLBindSpec *self = _TOML_malloc( sizeof(TOMLBindSpec) );
+  self->count = 0;
+  while ( bindings[ self->count ].path ) {
+    self->count++;
+  }
+  self->bindings = _TOML_malloc( ( self->count + 1 ) * sizeof(TOMLBinding) );
+  self->paths = _TOML_malloc( sizeof(struct _TOMLPathSet) );
+  memset( self->paths, 0, sizeof(struct _TOMLPathSet) );
+
+  // Entries are added with the index of their binding as their kind.
+  for ( int i = 0; i < self->count; ++i ) {
+    self->bindings[ i ] = bindings[ i ];
+    self->bindings[ i ].path = _TOML_cstringCopy( bindings[ i ].path );
+    int size = strlen( bindings[ i ].path );
+    if ( !_TOMLPathSet_find( self->paths, bindings[ i ].path, size ) ) {
+      _TOMLPathSet_add( self->paths, bindings[ i ].path, size, i );
+    }
+  }
+  self->bindings[ self->count ].path = NULL;
+  return self;
+}
+
+void TOML_freeBindSpec( TOMLBindSpec *self ) {
+  for ( int i = 0; i < self->count; ++i ) {
+    _TOML_dealloc( self->bindings[ i ].path );
+  }
+  _TOMLPathSet_free( self->paths );
+  _TOML_dealloc( self->paths );
+  _TOML_dealloc( self->bindings );
+  _TOML_dealloc( self );
+}
+
+// Store a value in its field. Returns 0 if the value does not match the
+// binding.
+int _TOML_bindValue(
+  TOMLBinding *binding, void *object, TOMLReadEvent *event
+) {
+  char *field = (char *) object + binding->offset;
+  TOMLBasic *value = event->value;
+  if ( event->type != TOML_READ_VALUE ) {
+    return 0;
+  }
+
+  switch ( binding->type ) {
+    case TOML_BIND_INT:
+      if ( value->type != TOML_INT ) {
+        return 0;
+      }
+      *(int *) field = TOML_toInt( event->value );
+      return 1;
+    case TOML_BIND_DOUBLE:
+      if ( !TOML_isNumber( value ) ) {
+        return 0;
+      }
+      *(double *) field = TOML_toDouble( event->value );
+      return 1;
+    case TOML_BIND_BOOLEAN:
+      if ( value->type != TOML_BOOLEAN ) {
+        return 0;
+      }
+      *(int *) field = TOML_toBoolean( event->value );
+      return 1;
+    case TOML_BIND_STRING: {
+      if ( value->type != TOML_STRING || binding->size < 1 ) {
+        return 0;
+      }
+      TOMLString *string = event->value;
+      int size = string->size < binding->size ?
+        string->size : binding->size - 1;
+      memcpy( field, string->content, size );
+      field[ size ] = 0;
+      return 1;
+    }
+    case TOML_BIND_DATE:
+      if ( value->type != TOML_DATE ) {
+        return 0;
+      }
+      *(time_t *) field = ( (TOMLDate *) value )->sinceEpoch;
+      return 1;
+  }
+  return 0;
+}
+
+int TOML_bind(
+  char *buffer, TOMLBindSpec *spec, void *object, TOMLError *error
+) {
+  TOMLReader reader;
+  TOMLReadEvent event;
+  // The path of the current key and how much of it is the table's.
+  struct _TOMLStringBuffer path = { 0, 0, NULL };
+  int prefix = 0;
+  char *bound = _TOML_malloc( spec->count + 1 );
+  memset( bound, 0, spec->count + 1 );
+
+  TOMLReader_initBuffer( &reader, buffer, 0, error );
+  struct _TOMLReaderState *state = reader.state;
+  while ( TOMLReader_next( &reader, &event ) ) {
+    if ( event.type == TOML_READ_TABLE ) {
+      path.size = 0;
+      _TOMLWriter_writeString( &path, event.name, strlen( event.name ) );
+      _TOMLWriter_writeString( &path, ".", 1 );
+      prefix = path.size;
+    } else if ( event.type == TOML_READ_ARRAY_TABLE ) {
+      TOMLReader_skipTable( &reader );
+    } else if ( event.type == TOML_READ_KEY ) {
+      path.size = prefix;
+      _TOMLWriter_writeString( &path, event.name, strlen( event.name ) );
+      struct _TOMLPathEntry *entry =
+        _TOMLPathSet_find( spec->paths, path.content, path.size );
+      if ( !entry ) {
+        TOMLReader_skipValue( &reader );
+      } else if ( TOMLReader_next( &reader, &event ) ) {
+        TOMLBinding *binding = &spec->bindings[ entry->kind ];
+        if ( !_TOML_bindValue( binding, object, &event ) ) {
+          _TOMLEventParser_fail(
+            &state->parser, &state->scanner.token, TOML_ERROR_BIND_TYPE
+          );
+          break;
+        }
+        bound[ entry->kind ] = 1;
+      }
+    }
+  }
+
+  int errorCode = state->parser.state.errorCode;
+  for ( int i = 0; !errorCode && i < spec->count; ++i ) {
+    TOMLBinding *binding = &spec->bindings[ i ];
+    struct _TOMLPathEntry *entry = _TOMLPathSet_find(
+      spec->paths, binding->path, strlen( binding->path )
+    );
+    if ( binding->flags & TOML_BIND_REQUIRED && !bound[ entry->kind ] ) {
+      errorCode = TOML_ERROR_BIND_MISSING;
+      _TOML_fillPlainError( error, errorCode );
+      if ( error ) {
+        _TOML_dealloc( error->fullDescription );
+        error->fullDescription = _TOML_malloc(
+          strlen( error->message ) + strlen( binding->path ) + 3
+        );
+        sprintf(
+          error->fullDescription, "%s: %s", error->message, binding->path
+        );
+      }
+    }
+  }
+
+  TOMLReader_finish( &reader );
+  _TOML_dealloc( path.content );
+  _TOML_dealloc( bound );
+  return errorCode;
+}
+
+// Count of tables seen so far in an array of tables, named by its path.
+struct _TOMLArrayCount {
+  char *path;
+  int count;
+};
+
+int _TOMLDocument_addSpan(
+  TOMLDocument *self, char *path, int size, int start, int end, int isTable
+) {
+  if ( self->spanCount == self->spanCapacity ) {
+    self->spanCapacity = self->spanCapacity ? self->spanCapacity * 2 : 16;
+    self->spans =
+      _TOML_realloc( self->spans, self->spanCapacity * sizeof(TOMLSpan) );
+  }
+
+  TOMLSpan *span = &self->spans[ self->spanCount ];
+  span->path = _TOML_malloc( size + 1 );
+  memcpy( span->path, path, size );
+  span->path[ size ] = 0;
+  span->start = start;
+  span->end = end;
+  span->isTable = isTable;
+  return self->spanCount++;
+}
+
+// Offset just past the end of the line holding the given offset.
+int _TOMLDocument_lineEnd( TOMLDocument *self, int at ) {
+  char *newline = memchr( self->source + at, '\n', self->size - at );
+  return newline ? newline - self->source + 1 : self->size;
+}
+
+// Append ".index" naming the current table of the array of tables at path.
+// A new table is counted first when next is set.
+void _TOMLDocument_indexPath(
+  struct _TOMLStringBuffer *path,
+  struct _TOMLArrayCount **arrays,
+  int *arrayCount,
+  int next
+) {
+  struct _TOMLArrayCount *array = NULL;
+  for ( int i = 0; i < *arrayCount; ++i ) {
+    if (
+      strlen( (*arrays)[ i ].path ) == path->size &&
+        memcmp( (*arrays)[ i ].path, path->content, path->size ) == 0
+    ) {
+      array = &(*arrays)[ i ];
+      break;
+    }
+  }
+
+  if ( array == NULL ) {
+    if ( !next ) {
+      return;
+    }
+    *arrays = _TOML_realloc( *arrays, ( *arrayCount + 1 ) * sizeof(**arrays) );
+    array = &(*arrays)[ (*arrayCount)++ ];
+    array->path = _TOML_malloc( path->size + 1 );
+    memcpy( array->path, path->content, path->size );
+    array->path[ path->size ] = 0;
+    array->count = 0;
+  }
+
+  if ( next ) {
+    array->count++;
+  }
+
+  char index[ 16 ];
+  index[ 0 ] = '.';
+  int size = _TOML_formatInt( index + 1, array->count - 1 ) + 1;
+  _TOMLWriter_writeString( path, index, size );
+}
+
+// Walk the tokens of the parsed source, recording the span of every entry's
+// value and of every table. The source already parsed, so the walk only needs
+// to follow headers, keys and brackets.
+void _TOMLDocument_scan( TOMLDocument *self ) {
+  struct _TOMLStringBuffer path = { 0, 0, NULL };
+  struct _TOMLArrayCount *arrays = NULL;
+  int arrayCount = 0;
+  int table = _TOMLDocument_addSpan( self, "", 0, 0, 0, 1 );
+
+  int hTokenId;
+  TOMLToken token = { 0, NULL, NULL, self->source, 0, self->source, NULL };
+
+  while ( TOMLScan( token.end, &hTokenId, &token ) ) {
+    if ( hTokenId == LEFT_SQUARE ) {
+      int start = token.start - self->source;
+      TOMLScan( token.end, &hTokenId, &token );
+      int isArray = hTokenId == LEFT_SQUARE;
+      if ( isArray ) {
+        TOMLScan( token.end, &hTokenId, &token );
+      }
+
+      path.size = 0;
+      while ( hTokenId == ID ) {
+        if ( path.size > 0 ) {
+          _TOMLWriter_writeString( &path, ".", 1 );
+        }
+        _TOMLWriter_writeString( &path, token.start, token.end - token.start );
+        TOMLScan( token.end, &hTokenId, &token );
+        if ( hTokenId == ID_DOT ) {
+          _TOMLDocument_indexPath( &path, &arrays, &arrayCount, 0 );
+          TOMLScan( token.end, &hTokenId, &token );
+        }
+      }
+
+      if ( isArray ) {
+        _TOMLDocument_indexPath( &path, &arrays, &arrayCount, 1 );
+        TOMLScan( token.end, &hTokenId, &token );
+      }
+
+      table = _TOMLDocument_addSpan(
+        self,
+        path.content,
+        path.size,
+        start,
+        _TOMLDocument_lineEnd( self, token.end - self->source ),
+        1
+      );
+    } else if ( hTokenId == ID ) {
+      int pathSize = path.size;
+      if ( pathSize > 0 ) {
+        _TOMLWriter_writeString( &path, ".", 1 );
+      }
+      _TOMLWriter_writeString( &path, token.start, token.end - token.start );
+
+      // Skip the equals sign.
+      TOMLScan( token.end, &hTokenId, &token );
+      TOMLScan( token.end, &hTokenId, &token );
+      int start = token.start - self->source;
+      int depth = 0;
+      do {
+        if ( hTokenId == LEFT_SQUARE ) {
+          depth++;
+        } else if ( hTokenId == RIGHT_SQUARE ) {
+          depth--;
+        }
+      } while ( depth > 0 && TOMLScan( token.end, &hTokenId, &token ) );
+      int end = token.end - self->source;
+
+      _TOMLDocument_addSpan( self, path.content, path.size, start, end, 0 );
+      self->spans[ table ].end = _TOMLDocument_lineEnd( self, end );
+      path.size = pathSize;
+    }
+  }
+
+  for ( int i = 0; i < arrayCount; ++i ) {
+    _TOML_dealloc( arrays[ i ].path );
+  }
+  _TOML_dealloc( arrays );
+  _TOML_dealloc( path.content );
+}
+
+int TOML_parseDocument(
+  char *buffer, TOMLDocument **dest, TOMLError *error
+) {
+  TOMLTable *table = NULL;
+  int errorCode = TOML_parse( buffer, &table, error );
+  if ( errorCode != 0 ) {
+    *dest = NULL;
+    return errorCode;
+  }
+
+  TOMLDocument *self = *dest = _TOML_malloc( sizeof(TOMLDocument) );
+  self->table = table;
+  self->size = strlen( buffer );
+  self->capacity = self->size;
+  self->source = _TOML_malloc( self->capacity + 1 );
+  memcpy( self->source, buffer, self->size + 1 );
+  self->spanCount = 0;
+  self->spanCapacity = 0;
+  self->spans = NULL;
+
+  _TOMLDocument_scan( self );
+  return 0;
+}
+
+void TOML_freeDocument( TOMLDocument *self ) {
+  if ( self == NULL ) {
+    return;
+  }
+
+  for ( int i = 0; i < self->spanCount; ++i ) {
+    _TOML_dealloc( self->spans[ i ].path );
+  }
+  _TOML_dealloc( self->spans );
+  _TOML_dealloc( self->source );
+  TOML_free( self->table );
+  _TOML_dealloc( self );
+}
+
+TOMLSpan * TOML_findSpan( TOMLDocument *self, char *path ) {
+  for ( int i = 0; i < self->spanCount; ++i ) {
+    if ( strcmp( self->spans[ i ].path, path ) == 0 ) {
+      return &self->spans[ i ];
+    }
+  }
+  return NULL;
+}
+
+// Non-zero if any part of the dotted path is an array index.
+int _TOML_hasIndex( char *path, int size ) {
+  for ( int i = 0; i < size; ++i ) {
+    int segmentStart = i == 0 || path[ i - 1 ] == '.';
+    if ( segmentStart && path[ i ] >= '0' && path[ i ] <= '9' ) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int TOML_editSet(
+  TOMLDocument *self, char *path, TOMLRef value, TOMLError *error
+) {
+  TOMLBasic *basic = value;
+  TOMLSpan *span = TOML_findSpan( self, path );
+  char *key = strrchr( path, '.' );
+  int parentSize = key ? key - path : 0;
+  key = key ? key + 1 : path;
+
+  int errorCode = TOML_SUCCESS;
+  if (
+    basic == NULL || basic->type == TOML_TABLE || _TOML_isTableArray( basic )
+  ) {
+    errorCode = TOML_ERROR_NO_VALUE;
+  } else if ( span && span->isTable ) {
+    errorCode = TOML_ERROR_TABLE_DEFINED;
+  }
+  if ( errorCode != TOML_SUCCESS ) {
+    TOML_free( value );
+    _TOML_fillPlainError( error, errorCode );
+    return errorCode;
+  }
+
+  struct _TOMLStringifyData data;
+  memset( &data, 0, sizeof(data) );
+  data.tableNameStackSize = 16;
+  data.tableNameStack = data.inlineNameStack;
+  struct _TOMLStringBuffer text = { 0, 0, NULL };
+  data.capture = &text;
+
+  TOMLSpan *table = NULL;
+  int at, end;
+  int headerStart = -1;
+  if ( span ) {
+    at = span->start;
+    end = span->end;
+  } else {
+    char *parent = _TOML_cstringCopy( path );
+    parent[ parentSize ] = 0;
+    table = TOML_findSpan( self, parent );
+    _TOML_dealloc( parent );
+
+    if ( table ) {
+      at = end = table->end;
+    } else if ( _TOML_hasIndex( path, parentSize ) ) {
+      TOML_free( value );
+      _TOML_fillPlainError( error, TOML_ERROR_INVALID_HEADER );
+      return TOML_ERROR_INVALID_HEADER;
+    } else {
+      at = end = self->size;
+    }
+
+    if ( at > 0 && self->source[ at - 1 ] != '\n' ) {
+      _TOML_stringifyText( &data, "\n", 1 );
+    }
+    if ( !table ) {
+      if ( at > 0 ) {
+        _TOML_stringifyText( &data, "\n", 1 );
+      }
+      headerStart = at + text.size;
+      _TOML_stringifyText( &data, "[", 1 );
+      _TOML_stringifyText( &data, path, parentSize );
+      _TOML_stringifyText( &data, "]\n", 2 );
+    }
+    _TOML_stringifyText( &data, key, strlen( key ) );
+    _TOML_stringifyText( &data, " = ", 3 );
+  }
+
+  int valueStart = at + text.size;
+  _TOML_stringifyValue( &data, basic );
+  if ( data.errorCode != TOML_SUCCESS ) {
+    _TOML_dealloc( text.content );
+    TOML_free( value );
+    _TOML_fillPlainError( error, data.errorCode );
+    return data.errorCode;
+  }
+  int valueEnd = at + text.size;
+  if ( !span ) {
+    _TOML_stringifyText( &data, "\n", 1 );
+  }
+  TOML_free( value );
+
+  int delta = text.size - ( end - at );
+  int size = self->size + delta;
+  int capacity = size > self->capacity ? size * 2 : self->capacity;
+  char *source = _TOML_malloc( capacity + 1 );
+  memcpy( source, self->source, at );
+  memcpy( source + at, text.content, text.size );
+  memcpy( source + at + text.size, self->source + end, self->size - end + 1 );
+  _TOML_dealloc( text.content );
+
+  errorCode = TOML_reparse( self->table, self->source, source, error );
+  if ( errorCode != 0 ) {
+    _TOML_dealloc( source );
+    return errorCode;
+  }
+
+  _TOML_dealloc( self->source );
+  self->source = source;
+  self->size = size;
+  self->capacity = capacity;
+
+  // Move the spans after the change. A replaced value moves everything from
+  // its end on. An inserted line moves what starts at the insertion point
+  // but not what ends there. The root table always starts at 0.
+  int tableIndex = table ? table - self->spans : -1;
+  for ( int i = 0; i < self->spanCount; ++i ) {
+    TOMLSpan *moved = &self->spans[ i ];
+    if ( i > 0 && moved->start >= end && moved != span ) {
+      moved->start += delta;
+    }
+    if ( moved->end > end || ( span && moved->end == end ) ) {
+      moved->end += delta;
+    }
+  }
+
+  if ( !span ) {
+    if ( tableIndex == -1 ) {
+      tableIndex =
+        _TOMLDocument_addSpan( self, path, parentSize, headerStart, 0, 1 );
+    }
+    self->spans[ tableIndex ].end = at + delta;
+    _TOMLDocument_addSpan(
+      self, path, strlen( path ), valueStart, valueEnd, 0
+    );
+  }
+
+  return 0;
+}
+
+// Parallel stringify splits the document into units, each one an entry line,
+// a table header or a whole table in an array of tables, in the order the
+// sequential pass writes them. Ranges of units are written by a pool of
+// threads into their own buffers, then copied to the writer in order.
+
+// The names above a unit, shared by the units of one table.
+struct _TOMLNamePath {
+  struct _TOMLNamePath *parent;
+  TOMLString *name;
+};
+
+typedef enum {
+  _TOML_UNIT_ENTRY,
+  _TOML_UNIT_TABLE_HEADER,
+  _TOML_UNIT_ARRAY_TABLE
+} _TOMLUnitType;
+
+struct _TOMLUnit {
+  _TOMLUnitType type;
+  struct _TOMLNamePath *parent;
+  TOMLString *key;
+  TOMLRef value;
+};
+
+struct _TOMLParallelChunk {
+  int start;
+  int end;
+  struct _TOMLStringBuffer output;
+};
+
+struct _TOMLParallelJob {
+  int unitCount;
+  int unitCapacity;
+  struct _TOMLUnit *units;
+
+  int pathCount;
+  int pathCapacity;
+  struct _TOMLNamePath **paths;
+
+  int chunkCount;
+  struct _TOMLParallelChunk *chunks;
+  // The next chunk for a thread to take.
+  int nextChunk;
+  // Whether anything was written before the first chunk.
+  int hasOutput;
+  // The calling thread's allocator, used by every worker.
+  TOMLAllocator *allocator;
+  // The first error any worker ran into.
+  int errorCode;
+};
+
+// Fewer units than this are written on the calling thread.
+#define TOML_PARALLEL_MIN_UNITS 256
+
+void _TOML_addUnit(
+  struct _TOMLParallelJob *self, _TOMLUnitType type,
+  struct _TOMLNamePath *parent, TOMLString *key, TOMLRef value
+) {
+  if ( self->unitCount == self->unitCapacity ) {
+    self->unitCapacity = self->unitCapacity ? self->unitCapacity * 2 : 64;
+    self->units = _TOML_realloc(
+      self->units, self->unitCapacity * sizeof(struct _TOMLUnit)
+    );
+  }
+  struct _TOMLUnit unit = { type, parent, key, value };
+  self->units[ self->unitCount++ ] = unit;
+}
+
+struct _TOMLNamePath * _TOML_addPath(
+  struct _TOMLParallelJob *self, struct _TOMLNamePath *parent, TOMLString *name
+) {
+  if ( self->pathCount == self->pathCapacity ) {
+    self->pathCapacity = self->pathCapacity ? self->pathCapacity * 2 : 16;
+    self->paths = _TOML_realloc(
+      self->paths, self->pathCapacity * sizeof(struct _TOMLNamePath *)
+    );
+  }
+  struct _TOMLNamePath *path = _TOML_malloc( sizeof(struct _TOMLNamePath) );
+  path->parent = parent;
+  path->name = name;
+  self->paths[ self->pathCount++ ] = path;
+  return path;
+}
+
+// Mirrors the table loop in _TOML_stringify.
+void _TOML_planUnits(
+  struct _TOMLParallelJob *self, struct _TOMLNamePath *parent,
+  TOMLTable *table
+) {
+  for ( int i = 0; i < table->keys->size; ++i ) {
+    TOMLString *key = TOMLArray_getIndex( table->keys, i );
+    TOMLBasic *value = TOMLArray_getIndex( table->values, i );
+
+    if ( value->type == TOML_TABLE ) {
+      _TOML_addUnit( self, _TOML_UNIT_TABLE_HEADER, parent, key, value );
+      _TOML_planUnits(
+        self, _TOML_addPath( self, parent, key ), (TOMLTable *) value
+      );
+    } else if (
+      value->type == TOML_ARRAY &&
+        ((TOMLArray *) value)->memberType == TOML_TABLE
+    ) {
+      TOMLArray *array = (TOMLArray *) value;
+      for ( int j = 0; j < array->size; ++j ) {
+        _TOML_addUnit(
+          self, _TOML_UNIT_ARRAY_TABLE, parent, key,
+          TOMLArray_getIndex( array, j )
+        );
+      }
+    } else {
+      _TOML_addUnit( self, _TOML_UNIT_ENTRY, parent, key, value );
+    }
+  }
+}
+
+void _TOML_stringifyPushPath(
+  struct _TOMLStringifyData *self, struct _TOMLNamePath *path
+) {
+  if ( path ) {
+    _TOML_stringifyPushPath( self, path->parent );
+    _TOML_stringifyPushName( self, path->name );
+  }
+}
+
+void _TOML_stringifyUnit(
+  struct _TOMLStringifyData *self, struct _TOMLUnit *unit
+) {
+  if ( unit->type == _TOML_UNIT_ENTRY ) {
+    _TOML_stringifyEntry( self, unit->key, unit->value );
+    return;
+  }
+
+  self->tableNameDepth = 0;
+  _TOML_stringifyPushPath( self, unit->parent );
+  _TOML_stringifyPushName( self, unit->key );
+
+  if ( unit->type == _TOML_UNIT_TABLE_HEADER ) {
+    _TOML_stringifyTableHeader( self, unit->value );
+  } else {
+    _TOML_stringifyArrayHeader( self );
+    _TOML_stringify( self, unit->value );
+  }
+}
+
+void * _TOML_parallelWorker( void *context ) {
+  struct _TOMLParallelJob *job = context;
+  TOML_useAllocator( job->allocator );
+
+  TOMLWriter *writer = _TOML_malloc( sizeof(TOMLWriter) );
+  struct _TOMLStringifyData data;
+  data.error = NULL;
+  data.writer = writer;
+  data.tableNameStackSize = 16;
+  data.tableNameStack = data.inlineNameStack;
+  data.json = 0;
+  data.cached = 0;
+  data.capture = NULL;
+  data.transient = 0;
+  data.errorCode = TOML_SUCCESS;
+
+  for (;;) {
+    int index = __atomic_fetch_add( &job->nextChunk, 1, __ATOMIC_RELAXED );
+    if ( index >= job->chunkCount ) {
+      break;
+    }
+
+    struct _TOMLParallelChunk *chunk = job->chunks + index;
+    TOMLWriter_initCallback( writer, _TOMLWriter_writeString, &chunk->output );
+    // Chunks after the first assume something came before them. The copy
+    // drops the header's leading newline if nothing did.
+    data.hasOutput = index > 0 || job->hasOutput;
+    data.tableNameDepth = 0;
+
+    for ( int i = chunk->start; i < chunk->end; ++i ) {
+      _TOML_stringifyUnit( &data, job->units + i );
+    }
+    TOMLWriter_flush( writer );
+  }
+
+  if ( data.errorCode != TOML_SUCCESS ) {
+    __atomic_store_n( &job->errorCode, data.errorCode, __ATOMIC_RELAXED );
+  }
+  if ( data.tableNameStack != data.inlineNameStack ) {
+    _TOML_dealloc( data.tableNameStack );
+  }
+  _TOML_dealloc( writer );
+
+  return NULL;
+}
+
+int TOML_writeParallel(
+  TOMLWriter *writer, TOMLRef src, int threadCount, TOMLError *error
+) {
+  if ( threadCount <= 0 ) {
+    threadCount = sysconf( _SC_NPROCESSORS_ONLN );
+  }
+
+  TOMLBasic *basic = src;
+  if ( threadCount <= 1 || basic == NULL || basic->type != TOML_TABLE ) {
+    return TOML_write( writer, src, error );
+  }
+
+  struct _TOMLParallelJob job;
+  memset( &job, 0, sizeof(job) );
+  job.allocator = _TOML_currentAllocator();
+  _TOML_planUnits( &job, NULL, src );
+
+  int errorCode;
+  if ( job.unitCount < TOML_PARALLEL_MIN_UNITS ) {
+    errorCode = TOML_write( writer, src, error );
+  } else {
+    // Several chunks per thread even out subtrees of different sizes.
+    job.chunkCount = threadCount * 8;
+    if ( job.chunkCount > job.unitCount ) {
+      job.chunkCount = job.unitCount;
+    }
+    int chunksSize = job.chunkCount * sizeof(struct _TOMLParallelChunk);
+    job.chunks = _TOML_malloc( chunksSize );
+    memset( job.chunks, 0, chunksSize );
+    for ( int i = 0; i < job.chunkCount; ++i ) {
+      job.chunks[ i ].start =
+        (long int) job.unitCount * i / job.chunkCount;
+      job.chunks[ i ].end =
+        (long int) job.unitCount * ( i + 1 ) / job.chunkCount;
+    }
+    job.hasOutput = writer->total != 0;
+
+    pthread_t *threads =
+      _TOML_malloc( ( threadCount - 1 ) * sizeof(pthread_t) );
+    int started = 0;
+    for ( ; started < threadCount - 1; ++started ) {
+      if (
+        pthread_create( threads + started, NULL, _TOML_parallelWorker, &job )
+      ) {
+        break;
+      }
+    }
+    _TOML_parallelWorker( &job );
+    for ( int i = 0; i < started; ++i ) {
+      pthread_join( threads[ i ], NULL );
+    }
+    _TOML_dealloc( threads );
+
+    for ( int i = 0; !job.errorCode && i < job.chunkCount; ++i ) {
+      struct _TOMLStringBuffer *output = &job.chunks[ i ].output;
+      char *bytes = output->content;
+      int size = output->size;
+      if ( i > 0 && writer->total == 0 && size > 0 && bytes[ 0 ] == '\n' ) {
+        bytes++;
+        size--;
+      }
+      TOMLWriter_writeStable( writer, bytes, size );
+    }
+
+    if ( job.errorCode != TOML_SUCCESS ) {
+      errorCode = job.errorCode;
+      if ( writer->errorCode == TOML_SUCCESS ) {
+        writer->errorCode = errorCode;
+      }
+      _TOML_fillPlainError( error, errorCode );
+    } else {
+      errorCode = TOMLWriter_flush( writer );
+      if ( errorCode != TOML_SUCCESS ) {
+        _TOML_fillFileError( error, NULL );
+      }
+    }
+
+    for ( int i = 0; i < job.chunkCount; ++i ) {
+      _TOML_dealloc( job.chunks[ i ].output.content );
+    }
+    _TOML_dealloc( job.chunks );
+  }
+
+  for ( int i = 0; i < job.pathCount; ++i ) {
+    _TOML_dealloc( job.paths[ i ] );
+  }
+  _TOML_dealloc( job.paths );
+  _TOML_dealloc( job.units );
+
+  return errorCode;
+}
+
+// A reader slot. Each thread that acquires a snapshot owns one.
+struct _TOMLConfigSlot {
+  // Generation of the oldest table the thread holds, or 0 outside a snapshot.
+  unsigned long generation;
+  // Snapshots the thread has open.
+  int depth;
+  // Non-zero while a thread owns the slot. Slots of exited threads are reused.
+  int owned;
+  struct _TOMLConfigSlot *next;
+};
+
+struct _TOMLConfigRetired {
+  TOMLTable *table;
+  unsigned long generation;
+};
+
+struct _TOMLConfigState {
+  // Maps each thread to its slot.
+  pthread_key_t slotKey;
+  struct _TOMLConfigSlot *slots;
+  // Held by reloads and collection, never by readers.
+  pthread_mutex_t lock;
+  int retiredSize;
+  int retiredCapacity;
+  struct _TOMLConfigRetired *retired;
+};
+
+// Called when a thread exits, so the slot can be given to another thread.
+void _TOMLConfig_dropSlot( void *value ) {
+  struct _TOMLConfigSlot *slot = value;
+  slot->depth = 0;
+  __atomic_store_n( &slot->generation, 0, __ATOMIC_SEQ_CST );
+  __atomic_store_n( &slot->owned, 0, __ATOMIC_RELEASE );
+}
+
+// The calling thread's slot, claimed or added the first time the thread reads.
+struct _TOMLConfigSlot * _TOMLConfig_slot( TOMLConfigHandle *self ) {
+  struct _TOMLConfigState *state = self->state;
+  struct _TOMLConfigSlot *slot = pthread_getspecific( state->slotKey );
+  if ( slot ) {
+    return slot;
+  }
+
+  slot = __atomic_load_n( &state->slots, __ATOMIC_ACQUIRE );
+  for ( ; slot; slot = slot->next ) {
+    int owned = 0;
+    if (
+      __atomic_compare_exchange_n(
+        &slot->owned, &owned, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED
+      )
+    ) {
+      break;
+    }
+  }
+
+  if ( !slot ) {
+    slot = _TOML_malloc( sizeof(struct _TOMLConfigSlot) );
+    slot->generation = 0;
+    slot->depth = 0;
+    slot->owned = 1;
+    slot->next = __atomic_load_n( &state->slots, __ATOMIC_ACQUIRE );
+    while (
+      !__atomic_compare_exchange_n(
+        &state->slots, &slot->next, slot, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE
+      )
+    ) {}
+  }
+
+  pthread_setspecific( state->slotKey, slot );
+  return slot;
+}
+
+// Returns non-zero if the file differs from the stat recorded at the last
+// successful load, or cannot be read.
+int _TOMLConfig_changed( TOMLConfigHandle *self ) {
+  struct stat fileStat;
+  if ( stat( self->filename, &fileStat ) != 0 ) {
+    return 1;
+  }
+
+  return
+    self->modified != (long int) fileStat.st_mtim.tv_sec ||
+      self->modifiedNanoseconds != (long int) fileStat.st_mtim.tv_nsec ||
+      self->fileSize != (long int) fileStat.st_size ||
+      self->inode != (long int) fileStat.st_ino;
+}
+
+// Load the file into the table, recording its stat if the load succeeds. The
+// stat is taken first, so a change made while the file is read is seen by
+// the next check.
+int _TOMLConfig_load(
+  TOMLConfigHandle *self, TOMLTable **table, TOMLError *error
+) {
+  struct stat fileStat;
+  int statted = stat( self->filename, &fileStat ) == 0;
+
+  int errorCode = TOML_load( self->filename, table, error );
+  if ( errorCode == TOML_SUCCESS && statted ) {
+    self->modified = fileStat.st_mtim.tv_sec;
+    self->modifiedNanoseconds = fileStat.st_mtim.tv_nsec;
+    self->fileSize = fileStat.st_size;
+    self->inode = fileStat.st_ino;
+  }
+  return errorCode;
+}
+
+TOMLConfigHandle * TOML_allocConfig( char *filename, TOMLError *error ) {
+  TOMLConfigHandle *self = _TOML_malloc( sizeof(TOMLConfigHandle) );
+  self->filename = _TOML_cstringCopy( filename );
+  self->current = NULL;
+  self->generation = 1;
+  self->modified = 0;
+  self->modifiedNanoseconds = 0;
+  self->fileSize = 0;
+  self->inode = 0;
+
+  if ( _TOMLConfig_load( self, &self->current, error ) != TOML_SUCCESS ) {
+    _TOML_dealloc( self->filename );
+    _TOML_dealloc( self );
+    return NULL;
+  }
+
+  struct _TOMLConfigState *state = _TOML_malloc( sizeof(*state) );
+  pthread_key_create( &state->slotKey, _TOMLConfig_dropSlot );
+  state->slots = NULL;
+  pthread_mutex_init( &state->lock, NULL );
+  state->retiredSize = 0;
+  state->retiredCapacity = 0;
+  state->retired = NULL;
+  self->state = state;
+
+  return self;
+}
+
+void TOML_freeConfig( TOMLConfigHandle *self ) {
+  struct _TOMLConfigState *state = self->state;
+  pthread_key_delete( state->slotKey );
+  while ( state->slots ) {
+    struct _TOMLConfigSlot *next = state->slots->next;
+    _TOML_dealloc( state->slots );
+    state->slots = next;
+  }
+  pthread_mutex_destroy( &state->lock );
+  for ( int i = 0; i < state->retiredSize; ++i ) {
+    TOML_free( state->retired[ i ].table );
+  }
+  _TOML_dealloc( state->retired );
+  _TOML_dealloc( state );
+
+  TOML_free( self->current );
+  _TOML_dealloc( self->filename );
+  _TOML_dealloc( self );
+}
+
+TOMLTable * TOMLConfig_acquire( TOMLConfigHandle *self ) {
+  struct _TOMLConfigSlot *slot = _TOMLConfig_slot( self );
+  if ( slot->depth++ == 0 ) {
+    // The slot must hold the generation before current is read. A reload
+    // publishes a table before raising the generation, so the table read is
+    // never older than the slot says, and a collection that missed the slot
+    // retired its table before this read and cannot be handing it out.
+    __atomic_store_n(
+      &slot->generation,
+      __atomic_load_n( &self->generation, __ATOMIC_SEQ_CST ),
+      __ATOMIC_SEQ_CST
+    );
+  }
+  return __atomic_load_n( &self->current, __ATOMIC_SEQ_CST );
+}
+
+void TOMLConfig_release( TOMLConfigHandle *self ) {
+  struct _TOMLConfigSlot *slot = _TOMLConfig_slot( self );
+  if ( --slot->depth == 0 ) {
+    __atomic_store_n( &slot->generation, 0, __ATOMIC_SEQ_CST );
+  }
+}
+
+// Free the retired tables older than every snapshot still open. Called with
+// the lock held.
+int _TOMLConfig_collect( TOMLConfigHandle *self ) {
+  struct _TOMLConfigState *state = self->state;
+  unsigned long oldest = __atomic_load_n( &self->generation, __ATOMIC_SEQ_CST );
+  struct _TOMLConfigSlot *slot =
+    __atomic_load_n( &state->slots, __ATOMIC_ACQUIRE );
+  for ( ; slot; slot = slot->next ) {
+    unsigned long generation =
+      __atomic_load_n( &slot->generation, __ATOMIC_SEQ_CST );
+    if ( generation != 0 && generation < oldest ) {
+      oldest = generation;
+    }
+  }
+
+  int kept = 0;
+  for ( int i = 0; i < state->retiredSize; ++i ) {
+    if ( state->retired[ i ].generation < oldest ) {
+      TOML_free( state->retired[ i ].table );
+    } else {
+      state->retired[ kept++ ] = state->retired[ i ];
+    }
+  }
+  state->retiredSize = kept;
+
+  return kept;
+}
+
+// Parse the file and publish the result. Called with the lock held, so
+// generations are published in order.
+int _TOMLConfig_reload( TOMLConfigHandle *self, TOMLError *error ) {
+  struct _TOMLConfigState *state = self->state;
+  TOMLTable *table = NULL;
+  int errorCode = _TOMLConfig_load( self, &table, error );
+  if ( errorCode != TOML_SUCCESS ) {
+    return errorCode;
+  }
+
+  unsigned long generation = self->generation;
+  TOMLTable *old =
+    __atomic_exchange_n( &self->current, table, __ATOMIC_SEQ_CST );
+  __atomic_store_n( &self->generation, generation + 1, __ATOMIC_SEQ_CST );
+
+  if ( state->retiredSize == state->retiredCapacity ) {
+    state->retiredCapacity =
+      state->retiredCapacity ? state->retiredCapacity * 2 : 4;
+    state->retired = _TOML_realloc(
+      state->retired,
+      state->retiredCapacity * sizeof(struct _TOMLConfigRetired)
+    );
+  }
+  state->retired[ state->retiredSize ].table = old;
+  state->retired[ state->retiredSize ].generation = generation;
+  state->retiredSize++;
+
+  _TOMLConfig_collect( self );
+
+  return TOML_SUCCESS;
+}
+
+int TOMLConfig_reload( TOMLConfigHandle *self, TOMLError *error ) {
+  // Readers never take the lock, so a slow parse holds up only other reloads.
+  pthread_mutex_lock( &self->state->lock );
+  int errorCode = _TOMLConfig_reload( self, error );
+  pthread_mutex_unlock( &self->state->lock );
+  return errorCode;
+}
+
+int TOMLConfig_reloadIfChanged( TOMLConfigHandle *self, TOMLError *error ) {
+  int errorCode = TOML_SUCCESS;
+  pthread_mutex_lock( &self->state->lock );
+  if ( _TOMLConfig_changed( self ) ) {
+    errorCode = _TOMLConfig_reload( self, error );
+  }
+  pthread_mutex_unlock( &self->state->lock );
+  return errorCode;
+}
+
+int TOMLConfig_collect( TOMLConfigHandle *self ) {
+  pthread_mutex_lock( &self->state->lock );
+  int pending = _TOMLConfig_collect( self );
+  pthread_mutex_unlock( &self->state->lock );
+  return pending;
 }
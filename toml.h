@@ -5,9 +5,12 @@
 extern "C" {
 #endif
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 
+#include <sys/uio.h>
+
 // Values identifying what the TOML object is.
 typedef enum {
   TOML_NOTYPE,
@@ -36,7 +39,13 @@ typedef enum {
   TOML_ERROR_NO_VALUE,
   TOML_ERROR_NO_EQ,
   TOML_ERROR_INVALID_HEADER,
-  TOML_ERROR_ARRAY_MEMBER_MISMATCH
+  TOML_ERROR_ARRAY_MEMBER_MISMATCH,
+  TOML_ERROR_BIND_MISSING,
+  TOML_ERROR_BIND_TYPE,
+  TOML_ERROR_SHARED,
+  TOML_ERROR_TOO_DEEP,
+  TOML_ERROR_INVALID_KEY,
+  TOML_ERROR_NOT_FINITE
 } TOMLErrorType;
 
 static char *TOMLErrorStrings[] = {
@@ -48,7 +57,13 @@ static char *TOMLErrorStrings[] = {
   "TOML_ERROR_NO_VALUE",
   "TOML_ERROR_NO_EQ",
   "TOML_ERROR_INVALID_HEADER",
-  "TOML_ERROR_ARRAY_MEMBER_MISMATCH"
+  "TOML_ERROR_ARRAY_MEMBER_MISMATCH",
+  "TOML_ERROR_BIND_MISSING",
+  "TOML_ERROR_BIND_TYPE",
+  "TOML_ERROR_SHARED",
+  "TOML_ERROR_TOO_DEEP",
+  "TOML_ERROR_INVALID_KEY",
+  "TOML_ERROR_NOT_FINITE"
 };
 
 static char *TOMLErrorDescription[] = {
@@ -60,43 +75,78 @@ static char *TOMLErrorDescription[] = {
   "Missing valid value.",
   "Missing equal sign in table entry.",
   "Incomplete table header.",
-  "Array member must be the same type as other members."
+  "Array member must be the same type as other members.",
+  "Missing required value.",
+  "Value does not match the type it is bound to.",
+  "Object is shared and cannot be changed.",
+  "Table header has too many keys.",
+  "Key is not a valid name.",
+  "Double is nan or infinite, which TOML cannot write."
 };
 
 // Arbitrary pointer to a TOML object.
 typedef void * TOMLRef;
 
 // Struct defining the common part of all TOML objects, giving access to
-// the type.
+// the type and the number of owners sharing the object.
 typedef struct TOMLBasic {
   TOMLType type;
+  int refCount;
 } TOMLBasic;
 
 // A TOML array.
 typedef struct TOMLArray {
   TOMLType type;
+  int refCount;
   TOMLType memberType;
   int size;
+  // Room allocated in members. Grows by doubling.
+  int capacity;
   TOMLRef *members;
+  // Cached TOML_hash, 0 until computed.
+  unsigned long long hash;
+  // The array or table holding this one, NULL for a root. Kept by the
+  // functions that add and remove members.
+  TOMLRef parent;
+  // The allocator the array was made with, which grows and frees it.
+  struct TOMLAllocator *allocator;
 } TOMLArray;
 
 // A TOML table.
 typedef struct TOMLTable {
   TOMLType type;
+  int refCount;
   TOMLArray *keys;
   TOMLArray *values;
+  // Cached TOML_hash, 0 until computed.
+  unsigned long long hash;
+  // Entry lines kept by TOML_writeCached, NULL until written.
+  struct _TOMLTableText *text;
+  // Hash index of keys kept by TOMLTable_setKey once the table is big enough,
+  // otherwise NULL.
+  struct _TOMLKeyIndex *index;
+  // The array holding this table, NULL for a root. Kept by the functions that
+  // add and remove members.
+  TOMLRef parent;
+  // The allocator the table was made with, which holds its caches and frees
+  // it.
+  struct TOMLAllocator *allocator;
 } TOMLTable;
 
 // A TOML string.
 typedef struct TOMLString {
   TOMLType type;
+  int refCount;
   int size;
+  // Cached TOML_hash, 0 until computed.
+  unsigned long long hash;
   char content[];
 } TOMLString;
 
 // A TOML number.
 typedef struct TOMLNumber {
   TOMLType type;
+  int refCount;
   union {
     int intValue;
     double doubleValue;
@@ -107,12 +157,14 @@ typedef struct TOMLNumber {
 // A TOML boolean.
 typedef struct TOMLBoolean {
   TOMLType type;
+  int refCount;
   int isTrue;
 } TOMLBoolean;
 
 // A TOML date.
 typedef struct TOMLDate {
   TOMLType type;
+  int refCount;
   long int sinceEpoch;
   int year;
   int month;
@@ -124,6 +176,7 @@ typedef struct TOMLDate {
 
 typedef struct TOMLError {
   TOMLType type;
+  int refCount;
   TOMLErrorType code;
   int lineNo;
   char * line;
@@ -131,6 +184,77 @@ typedef struct TOMLError {
   char * fullDescription;
 } TOMLError;
 
+/****************
+ ** Allocators **
+ ****************/
+
+// A set of functions tomlc allocates and frees memory with, including the
+// buffers it returns, like those of TOML_stringify. Memory must be freed by
+// the allocator that allocated it. Tables and arrays keep the allocator they
+// were made with, use it for what they allocate later, like kept text and
+// grown members, and free themselves and their members with it. Values added
+// to a table or array must be made with its allocator.
+typedef struct TOMLAllocator {
+  void * (*malloc)( void *context, size_t size );
+  void * (*realloc)( void *context, void *ptr, size_t size );
+  void (*free)( void *context, void *ptr );
+  void *context;
+} TOMLAllocator;
+
+// Use the allocator on every thread that has none of its own. Pass NULL to go
+// back to malloc, realloc and free. Change it only while no objects made
+// with the previous one remain.
+void TOML_setAllocator( TOMLAllocator * );
+
+// Use the allocator on the calling thread until it is replaced, and return
+// the one used before. NULL falls back to the allocator of TOML_setAllocator.
+//
+// Example:
+// TOMLAllocator *previous = TOML_useAllocator( &arena );
+// TOML_parse( buffer, &table, NULL );
+// TOML_free( table );
+// TOML_useAllocator( previous );
+TOMLAllocator * TOML_useAllocator( TOMLAllocator * );
+
+// Parse, load and free with the allocator used for the calling thread during
+// the call. Tables and arrays free with their own allocator either way.
+int TOML_parseWith( char *buffer, TOMLTable **, TOMLAllocator *, TOMLError * );
+int TOML_loadWith( char *filename, TOMLTable **, TOMLAllocator *, TOMLError * );
+void TOML_freeWith( TOMLRef, TOMLAllocator * );
+
+typedef struct TOMLAllocationStats {
+  long long mallocs;
+  long long reallocs;
+  long long frees;
+  // Bytes requested by mallocs and by reallocs growing a block.
+  long long bytes;
+  long long liveBytes;
+  long long peakBytes;
+} TOMLAllocationStats;
+
+// An allocator counting the calls and bytes going to its parent. Its
+// allocator member is what is passed to TOML_setAllocator and the like.
+//
+// Example:
+// TOMLCountingAllocator counter;
+// TOMLCountingAllocator_init( &counter, NULL );
+// TOML_parseWith( buffer, &table, &counter.allocator, NULL );
+// printf( "%lld peak bytes\n", counter.stats.peakBytes );
+typedef struct TOMLCountingAllocator {
+  TOMLAllocator allocator;
+  TOMLAllocator *parent;
+  TOMLAllocationStats stats;
+} TOMLCountingAllocator;
+
+// Sets up a counting allocator. A NULL parent uses malloc, realloc and free.
+void TOMLCountingAllocator_init(
+  TOMLCountingAllocator *, TOMLAllocator *parent
+);
+
+// Zeroes the counts and starts the peak from the current live bytes, to
+// measure the next operation alone.
+void TOMLCountingAllocator_reset( TOMLCountingAllocator * );
+
 /**********************
  ** Memory Functions **
  **********************/
@@ -176,10 +300,14 @@ TOMLDate * TOML_allocEpochDate( time_t stamp );
 // Allocate an error to be filled by TOML_parse or TOML_stringify.
 TOMLError * TOML_allocError( int code );
 
-// Copy any TOML object.
+// Share any TOML object. The copy is the same object with one more owner, so
+// copying is O(1) at any size. Shared objects must not be changed; setKey,
+// setIndex and append refuse them with TOML_ERROR_SHARED, along with every
+// table and array inside them. Get a private path to the part to change with
+// TOML_findMutable.
 TOMLRef TOML_copy( TOMLRef );
 
-// Free a TOML object.
+// Release one owner of a TOML object, freeing it when none remain.
 void TOML_free( TOMLRef );
 
 /*****************
@@ -199,12 +327,54 @@ int TOML_isNumber( TOMLRef );
 // TOMLRef ref = TOML_find( table, "child", "nextchild", "0", NULL );
 TOMLRef TOML_find( TOMLRef, ... );
 
+// Clear the cached state of the object and of every table and array along the
+// path below it, given the same way as TOML_find. setKey, setIndex and append
+// clear the object they change and every table and array holding it, so
+// touching is only needed after changing a value in place.
+//
+// Example:
+// ((TOMLNumber *) TOML_find( table, "server", "port", NULL ))->intValue = 81;
+// TOML_touch( table, "server", "port", NULL );
+void TOML_touch( TOMLRef, ... );
+
+// Return a 64 bit hash of the content of a TOML object. Equal objects hash the
+// same, independent of table key order, and the value is stable across
+// processes. Tables, arrays and strings cache their hash. setKey, setIndex and
+// append clear the cached hashes above the object they change, so hashes stay
+// current without touching.
+unsigned long long TOML_hash( TOMLRef );
+
+// Return non-zero if the two objects have the same content. Objects with
+// different hashes are rejected without comparing their members.
+int TOML_equal( TOMLRef, TOMLRef );
+
+// Find a value like TOML_find and make it and every object on the path to it
+// safe to change. Shared objects on the path are replaced by shallow copies,
+// so only the path is copied and everything beside it stays shared. The root
+// may be replaced too, which is why its address is given, and must be owned
+// by the caller. Cached state along the path is cleared as with TOML_touch.
+//
+// A table or array that was shared with a table since freed may not know its
+// owner anymore and is refused by setKey, setIndex and append like a shared
+// one. Finding it with TOML_findMutable makes it changeable again.
+//
+// Example:
+// TOMLTable *variant = TOML_copy( base );
+// TOMLTable_setKey(
+//   TOML_findMutable( (TOMLRef *) &variant, "server", NULL ),
+//   "port",
+//   TOML_allocInt( 8080 )
+// );
+TOMLRef TOML_findMutable( TOMLRef *, ... );
+
 // Get the value at the given key.
 TOMLRef TOMLTable_getKey( TOMLTable *, char * );
 
 // Set the value at the given key. If the key is already set, the replaced
 // value will be freed.
-void TOMLTable_setKey( TOMLTable *, char *, TOMLRef );
+// Returns TOML_ERROR_SHARED and frees the value if the table or anything
+// holding it is shared.
+int TOMLTable_setKey( TOMLTable *, char *, TOMLRef );
 
 // Return the value stored at the index or NULL.
 TOMLRef TOMLArray_getIndex( TOMLArray *, int index );
@@ -213,10 +383,38 @@ TOMLRef TOMLArray_getIndex( TOMLArray *, int index );
 // to the current size of the array, the value will be appended to the end.
 //
 // If a value is replaced, the replaced value will be freed.
-void TOMLArray_setIndex( TOMLArray *, int index, TOMLRef );
+// Returns TOML_ERROR_SHARED and frees the value if the array or anything
+// holding it is shared.
+int TOMLArray_setIndex( TOMLArray *, int index, TOMLRef );
 
 // Append the given TOML object to the array.
-void TOMLArray_append( TOMLArray *, TOMLRef );
+// Returns TOML_ERROR_SHARED and frees the value if the array or anything
+// holding it is shared.
+int TOMLArray_append( TOMLArray *, TOMLRef );
+
+// Kinds of difference reported by TOML_diff.
+typedef enum {
+  TOML_DIFF_ADDED,
+  TOML_DIFF_REMOVED,
+  TOML_DIFF_CHANGED
+} TOMLDiffType;
+
+// Called by TOML_diff for each difference. The path is written the way
+// toml-lookup takes it, for example "servers.alpha.ip" or "fruit[1].name".
+// The old value is NULL for added paths and the new value is NULL for removed
+// ones. Return non-zero to stop the diff.
+typedef int (*TOMLDiffCallback)(
+  void *context, TOMLDiffType, char *path, TOMLRef oldValue, TOMLRef newValue
+);
+
+// Report every path that differs between two TOML objects. Table keys are
+// matched through a hash index and arrays of tables by position. Other values
+// are compared whole. Shared subtrees, like those TOML_copy and
+// TOML_findMutable leave beside a change, and tables and arrays with equal
+// hashes are skipped without visiting their members. Touch the path to a value
+// changed in place, as for TOML_hash. Returns the number of differences
+// reported.
+int TOML_diff( TOMLRef, TOMLRef, TOMLDiffCallback, void *context );
 
 /****************
  ** Raw Values **
@@ -247,23 +445,577 @@ int TOML_toBoolean( TOMLBoolean * );
  ** Loading and Saving **
  ************************/
 
+// Table headers with more keys than this fail to parse with
+// TOML_ERROR_TOO_DEEP. Freeing, hashing, comparing and writing tables recurse
+// once per level of nesting, so the limit keeps any parsed table within the
+// stack.
+#define TOML_MAX_DEPTH 256
+
 // Allocates a table filled with the parsed content of the file.
 // Returns non-zero if there was an error.
 int TOML_load( char *filename, TOMLTable **, TOMLError * );
 
 // Writes a stringified table to the indicated file.
 // Returns non-zero if there was an error.
-// TODO: Implement TOML_dump.
-// int TOML_dump( char *filename, TOMLTable *, TOMLError * );
+int TOML_dump( char *filename, TOMLTable *, TOMLError * );
 
 // Allocates a table filled with the parsed content of the buffer.
 // Returns non-zero if there was an error.
 int TOML_parse( char *buffer, TOMLTable **, TOMLError * );
 
-// Allocates a string filled a string version of the table.
+// What a parse read, made and spent time on. Keeping stats costs counting
+// every token and a few clock reads on one token in 64.
+typedef struct TOMLParseStats {
+  long long bytes;
+  // Tokens handed to the parser, in total and by kind. Brackets count both [
+  // and ], punctuation counts dots, equals signs and commas.
+  long long tokens;
+  long long keys;
+  long long strings;
+  long long numbers;
+  long long booleans;
+  long long dates;
+  long long brackets;
+  long long punctuation;
+  long long comments;
+  // Values in the parsed table, indexed by TOMLType.
+  long long nodes[ TOML_ERROR ];
+  // How deeply tables and arrays nest. A root table with only plain values
+  // is 2 deep.
+  int maxDepth;
+  // Calls to the allocator and the bytes asked for.
+  long long allocations;
+  long long allocatedBytes;
+  // Time spent reading the file, scanning tokens, in the parser and
+  // converting numbers and dates. Conversion time is not part of the parser
+  // time. Reading is timed per block. The rest is the time of the whole parse,
+  // split in the proportions measured on one token in 64.
+  long long ioNanoseconds;
+  long long lexNanoseconds;
+  long long parseNanoseconds;
+  long long convertNanoseconds;
+} TOMLParseStats;
+
+// Parse and load like TOML_parse and TOML_load and fill the stats.
+// Returns non-zero if there was an error.
+int TOML_parseWithStats(
+  char *buffer, TOMLTable **, TOMLParseStats *, TOMLError *
+);
+int TOML_loadWithStats(
+  char *filename, TOMLTable **, TOMLParseStats *, TOMLError *
+);
+
+// Updates a table parsed from oldBuffer to match newBuffer. Only the table
+// sections holding changed bytes are parsed again. Tables and entries outside
+// them, and unchanged entries inside them, keep their nodes, and keys end up
+// in the order a full parse gives. Sections are found with the scanner, so
+// brackets in strings and arrays do not start one. Falls back to a full parse
+// when a change cannot be spliced, for example one touching an array of
+// tables or opening a string that runs into the next section, or when the
+// changed sections make up most of the buffer. On error the table is left as
+// it was. Shared tables below it are copied before they are changed, but a
+// shared table itself is refused with TOML_ERROR_SHARED. Runs with the
+// table's allocator, which also makes the error's strings.
+// Returns non-zero if there was an error.
+int TOML_reparse(
+  TOMLTable *, char *oldBuffer, char *newBuffer, TOMLError *
+);
+
+// Allocates a string filled a string version of the table. The object is
+// formatted once into a string that grows as needed. On an error *buffer is
+// set to NULL and error is filled.
 // Returns non-zero if there was an error.
 int TOML_stringify( char **buffer, TOMLRef, TOMLError * );
 
+// Writes a string version of the object into buffer, truncating it to
+// capacity - 1 bytes and null terminating it when capacity is positive. Like
+// snprintf, it returns the size of the whole string, not counting the null
+// terminator, so a return value of capacity or more means it was truncated.
+// Returns -1 if the object holds a double that is nan or infinite.
+// Does not allocate unless tables nest more than 16 levels deep.
+int TOML_stringifyTo( char *buffer, int capacity, TOMLRef );
+
+// Returns the size of the string TOML_stringify would make, not counting the
+// null terminator, or -1 if it would fail.
+int TOML_stringifySize( TOMLRef );
+
+/*************
+ ** Writers **
+ *************/
+
+#define TOML_WRITER_BUFFER_SIZE 4096
+#define TOML_WRITER_IOV_SIZE 64
+// Stable pieces shorter than this are copied, since an iovec for them costs
+// more than the copy.
+#define TOML_WRITER_STABLE_MIN 16
+
+// Receives output from a TOMLWriter. Returns non-zero if the bytes could not
+// be written.
+typedef int (*TOMLWriteCallback)( void *context, char *bytes, int size );
+
+// Receives output from a TOMLWriter as a list of pieces. The pieces are only
+// valid during the call. Returns non-zero if the bytes could not be written.
+typedef int (*TOMLWritevCallback)(
+  void *context, struct iovec *iov, int count
+);
+
+// Collects output in a fixed size buffer and hands it to a sink when the
+// buffer fills, so output of any size needs constant memory. A writer is
+// usually declared on the stack and set up with one of the init functions.
+//
+// A writer set up with an iovec callback copies only transient bytes into its
+// buffer. Stable bytes, like string contents and literals, are handed to the
+// sink where they are.
+typedef struct TOMLWriter {
+  TOMLWriteCallback write;
+  TOMLWritevCallback writev;
+  void *context;
+  TOMLErrorType errorCode;
+  // Bytes given to the writer so far, buffered or not.
+  long int total;
+  int index;
+  int iovCount;
+  struct iovec iov[ TOML_WRITER_IOV_SIZE ];
+  char buffer[ TOML_WRITER_BUFFER_SIZE ];
+} TOMLWriter;
+
+// Sets up a writer calling the callback with each full buffer.
+void TOMLWriter_initCallback( TOMLWriter *, TOMLWriteCallback, void *context );
+
+// Sets up a writer calling the callback with each full list of pieces.
+void TOMLWriter_initIov( TOMLWriter *, TOMLWritevCallback, void *context );
+
+// Sets up a writer for a stdio stream.
+void TOMLWriter_initFile( TOMLWriter *, FILE * );
+
+// Sets up a writer for a file descriptor. Output goes out with writev.
+void TOMLWriter_initFd( TOMLWriter *, int fd );
+
+// Adds bytes to the writer. The bytes are copied if the writer needs them
+// after returning.
+void TOMLWriter_write( TOMLWriter *, char *bytes, int size );
+
+// Adds bytes that stay valid and unchanged until the writer is flushed.
+// Iovec writers point at them instead of copying them.
+void TOMLWriter_writeStable( TOMLWriter *, char *bytes, int size );
+
+// Hands any buffered bytes to the sink.
+// Returns non-zero if any write failed.
+int TOMLWriter_flush( TOMLWriter * );
+
+// Stringifies a TOML object into the writer and flushes it. A double that is
+// nan or infinite has no TOML form and fails with TOML_ERROR_NOT_FINITE,
+// leaving the writer failed so no more of the output reaches its sink.
+// Returns non-zero if there was an error.
+int TOML_write( TOMLWriter *, TOMLRef, TOMLError * );
+
+// Stringifies a TOML object into the writer like TOML_write and keeps the
+// entry lines of each table. Later calls copy the kept lines of unchanged
+// tables instead of formatting them again, so rewriting a large document after
+// a small change costs little more than copying it. Changes are tracked the
+// same way as for TOML_hash. Kept lines take about as much memory as the
+// output and are freed with their tables.
+// Returns non-zero if there was an error.
+int TOML_writeCached( TOMLWriter *, TOMLRef, TOMLError * );
+
+// Stringifies a TOML object into the writer like TOML_write, splitting the
+// work across threadCount threads. Entries, table headers and each table of an
+// array of tables are written in parallel into separate buffers and copied to
+// the writer in order, so the output is the same as TOML_write's. Small
+// documents are written on the calling thread. A threadCount of 0 or less
+// uses one thread per online processor.
+// Returns non-zero if there was an error.
+int TOML_writeParallel(
+  TOMLWriter *, TOMLRef, int threadCount, TOMLError *
+);
+
+// Stringifies a TOML object as lists of pieces handed to the callback. Pieces
+// point into the object's strings and static literals where they can, so the
+// object must not change during the call.
+// Returns non-zero if there was an error.
+int TOML_stringifyIov(
+  TOMLRef, TOMLWritevCallback, void *context, TOMLError *
+);
+
+// Writes a TOML object to the writer as JSON and flushes it. Tables become
+// objects, dates become RFC 3339 strings and a NULL object becomes null. Pretty
+// output puts each member on its own line indented by two spaces.
+// Returns non-zero if there was an error.
+int TOML_toJSON( TOMLWriter *, TOMLRef, int pretty, TOMLError * );
+
+/**************
+ ** Emitters **
+ **************/
+
+#define TOML_EMITTER_MAX_DEPTH 32
+
+// Writes a TOML document to a writer one header, key and value at a time,
+// without building a tree. Values use the same escaping and number formats
+// as TOML_stringify. The emitter remembers only the current header path and
+// its place in nested arrays, so it catches values without keys, mixed array
+// members and a table repeated right after itself, but not tables defined
+// twice further apart. Keys and each part of a header path must be names the
+// parser reads back, matching [a-zA-Z_][a-zA-Z0-9_]* and not true or false,
+// or the call fails with TOML_ERROR_INVALID_KEY. The first error sticks and
+// later calls do nothing.
+//
+// Example:
+// TOMLEmitter emitter;
+// TOMLEmitter_init( &emitter, &writer );
+// TOMLEmitter_beginArrayTable( &emitter, "host" );
+// TOMLEmitter_key( &emitter, "name" );
+// TOMLEmitter_string( &emitter, "alpha" );
+// TOMLEmitter_finish( &emitter );
+typedef struct TOMLEmitter {
+  TOMLWriter *writer;
+  TOMLErrorType errorCode;
+  // The current header path, NULL under the root table.
+  char *path;
+  int pathCapacity;
+  // Set between a key and its value.
+  int hasKey;
+  int arrayDepth;
+  TOMLType memberTypes[ TOML_EMITTER_MAX_DEPTH ];
+  int memberCounts[ TOML_EMITTER_MAX_DEPTH ];
+} TOMLEmitter;
+
+// Sets up an emitter writing to the writer.
+void TOMLEmitter_init( TOMLEmitter *, TOMLWriter * );
+
+// Flushes the writer and frees what the emitter holds.
+// Returns non-zero if any call failed or a key was left without a value.
+int TOMLEmitter_finish( TOMLEmitter * );
+
+// Writes a [path] header. The path is written as given, like "a.b".
+void TOMLEmitter_beginTable( TOMLEmitter *, char *path );
+
+// Writes a [[path]] header starting the next table of an array of tables.
+void TOMLEmitter_beginArrayTable( TOMLEmitter *, char *path );
+
+// Starts an entry in the current table. The next value completes it.
+void TOMLEmitter_key( TOMLEmitter *, char *name );
+
+// Write a value for the current key or array. A double that is nan or
+// infinite fails with TOML_ERROR_NOT_FINITE.
+void TOMLEmitter_string( TOMLEmitter *, char *value );
+void TOMLEmitter_int( TOMLEmitter *, int value );
+void TOMLEmitter_double( TOMLEmitter *, double value );
+void TOMLEmitter_boolean( TOMLEmitter *, int truth );
+
+// Writes any TOML object other than a table as a value.
+void TOMLEmitter_value( TOMLEmitter *, TOMLRef );
+
+// Start and end an array value. Arrays may nest.
+void TOMLEmitter_beginArray( TOMLEmitter * );
+void TOMLEmitter_endArray( TOMLEmitter * );
+
+/************
+ ** Events **
+ ************/
+
+// Checks TOML_parseEvents can make beyond the syntax. Checking for keys and
+// tables defined twice remembers the path of every key and table, so its
+// memory grows with the document. Checking that array members share a type
+// remembers one type per open array.
+#define TOML_CHECK_DUPLICATES 1
+#define TOML_CHECK_ARRAY_TYPES 2
+#define TOML_CHECK_ALL 3
+
+// Callbacks TOML_parseEvents makes while reading a document, in the order of
+// the TOMLEmitter calls that would write it back. Any callback may be NULL.
+// Names and values belong to the parser and are only valid during the call.
+// A callback returning non-zero stops the parse.
+typedef struct TOMLEvents {
+  // A [path] header. The path is dotted as written, like "a.b".
+  int (*table)( void *context, char *path );
+  // A [[path]] header starting the next table of an array of tables.
+  int (*arrayTable)( void *context, char *path );
+  // The key of the next entry in the current table.
+  int (*key)( void *context, char *name );
+  // A string, number, boolean or date for the current key or array. The
+  // value is reused for the next one, so it must not be freed or kept.
+  int (*value)( void *context, TOMLRef value );
+  // Start and end an array value. Arrays may nest.
+  int (*beginArray)( void *context );
+  int (*endArray)( void *context );
+  // TOML_CHECK_ flags for the checks to make. 0 only checks the syntax.
+  int checks;
+} TOMLEvents;
+
+// Parse the buffer and report each header, key and value as it is read,
+// without building a tree. Strings are unescaped into one reused buffer, so
+// without TOML_CHECK_DUPLICATES memory stays constant in the size of the
+// document apart from its longest string.
+// Returns non-zero if there was an error, or the non-zero value a callback
+// returned.
+//
+// Example:
+// int printKey( void *context, char *name ) {
+//   printf( "%s\n", name );
+//   return 0;
+// }
+// TOMLEvents events = { NULL, NULL, printKey };
+// TOML_parseEvents( buffer, &events, NULL, NULL );
+int TOML_parseEvents(
+  char *buffer, TOMLEvents *, void *context, TOMLError *
+);
+
+// Reads the file a block at a time and reports it like TOML_parseEvents,
+// keeping only the line being read in memory.
+// Returns non-zero if there was an error, or the non-zero value a callback
+// returned.
+int TOML_loadEvents(
+  char *filename, TOMLEvents *, void *context, TOMLError *
+);
+
+/*************
+ ** Readers **
+ *************/
+
+// What TOMLReader_next read.
+typedef enum {
+  TOML_READ_TABLE,
+  TOML_READ_ARRAY_TABLE,
+  TOML_READ_KEY,
+  TOML_READ_VALUE,
+  TOML_READ_BEGIN_ARRAY,
+  TOML_READ_END_ARRAY
+} TOMLReadType;
+
+// One header, key, value or array bound, valid until the reader moves on.
+typedef struct TOMLReadEvent {
+  TOMLReadType type;
+  // The dotted path of a header or the name of a key, otherwise NULL.
+  char *name;
+  // A string, number, boolean or date, otherwise NULL. Strings are
+  // unescaped. The value belongs to the reader and must not be freed.
+  TOMLRef value;
+  // The line the event was read on, counted from 0 like TOMLError's lineNo.
+  int line;
+} TOMLReadEvent;
+
+// Reads a document one event at a time, in the order TOML_parseEvents calls
+// back with them. The caller decides when to read on, so it can interleave
+// reading with its own work or stop as soon as it has what it needs.
+//
+// Example:
+// TOMLReader reader;
+// TOMLReadEvent event;
+// TOMLReader_initBuffer( &reader, buffer, 0, NULL );
+// while ( TOMLReader_next( &reader, &event ) ) {
+//   if ( event.type == TOML_READ_KEY && strcmp( event.name, "port" ) ) {
+//     TOMLReader_skipValue( &reader );
+//   }
+// }
+// TOMLReader_finish( &reader );
+typedef struct TOMLReader {
+  // The scanner and event parser, allocated by the init functions.
+  struct _TOMLReaderState *state;
+} TOMLReader;
+
+// Sets up a reader for a null terminated buffer. Checks are TOML_CHECK_
+// flags like those of TOMLEvents. The error is filled if reading fails.
+void TOMLReader_initBuffer(
+  TOMLReader *, char *buffer, int checks, TOMLError *
+);
+
+// Sets up a reader for a stdio stream or a file descriptor. Either is read a
+// block at a time, keeping only the line being read in memory, and is left
+// open by TOMLReader_finish.
+void TOMLReader_initFile( TOMLReader *, FILE *, int checks, TOMLError * );
+void TOMLReader_initFd( TOMLReader *, int fd, int checks, TOMLError * );
+
+// Reads the next event.
+// Returns 0 at the end of the document or once there was an error.
+int TOMLReader_next( TOMLReader *, TOMLReadEvent * );
+
+// After a key, skips its value. Inside an array, skips the rest of it along
+// with its end. Skipped text is scanned for brackets but not decoded or
+// checked.
+void TOMLReader_skipValue( TOMLReader * );
+
+// Skips the rest of the current table up to the next header, scanning it
+// like TOMLReader_skipValue.
+void TOMLReader_skipTable( TOMLReader * );
+
+// Frees what the reader holds.
+// Returns non-zero if there was an error.
+int TOMLReader_finish( TOMLReader * );
+
+/*************
+ ** Binding **
+ *************/
+
+// How TOML_bind stores a value and the C type of the field it goes in.
+typedef enum {
+  // int. Only integers match.
+  TOML_BIND_INT,
+  // double. Integers match too.
+  TOML_BIND_DOUBLE,
+  // int, 1 for true and 0 for false.
+  TOML_BIND_BOOLEAN,
+  // char[ size ], null terminated. Longer strings are cut short to fit.
+  TOML_BIND_STRING,
+  // time_t, seconds since the epoch.
+  TOML_BIND_DATE
+} TOMLBindType;
+
+// TOML_bind fails if the value is not in the document.
+#define TOML_BIND_REQUIRED 1
+
+// Where one value of a document goes in a struct.
+typedef struct TOMLBinding {
+  // The dotted path of the value, like "server.port".
+  char *path;
+  TOMLBindType type;
+  // The offset of the field, from offsetof.
+  size_t offset;
+  // TOML_BIND_ flags.
+  int flags;
+  // The size of a TOML_BIND_STRING field, its null byte included.
+  int size;
+} TOMLBinding;
+
+// Bindings indexed by path. A spec is built once and can be shared by any
+// number of TOML_bind calls, on any number of threads.
+typedef struct TOMLBindSpec {
+  int count;
+  TOMLBinding *bindings;
+  struct _TOMLPathSet *paths;
+} TOMLBindSpec;
+
+// Allocates a spec from bindings ending with one whose path is NULL. The
+// bindings and their paths are copied. When a path is bound twice, the first
+// binding is used.
+//
+// Example:
+// struct server { int port; char host[ 64 ]; };
+// TOMLBinding bindings[] = {
+//   { "server.port", TOML_BIND_INT, offsetof( struct server, port ),
+//     TOML_BIND_REQUIRED },
+//   { "server.host", TOML_BIND_STRING, offsetof( struct server, host ), 0,
+//     64 },
+//   { NULL }
+// };
+// TOMLBindSpec *spec = TOML_allocBindSpec( bindings );
+TOMLBindSpec * TOML_allocBindSpec( TOMLBinding * );
+
+void TOML_freeBindSpec( TOMLBindSpec * );
+
+// Reads the buffer with a TOMLReader, storing each bound value in the object
+// as it is read. No tree is built and nothing is allocated per value. Values
+// that are not bound are skipped without being decoded, as are arrays of
+// tables, so those can not be bound. Fields whose values are missing are left
+// as they were.
+// Returns non-zero if there was an error, TOML_ERROR_BIND_TYPE for a bound
+// value of another type and TOML_ERROR_BIND_MISSING for a missing required
+// value.
+int TOML_bind( char *buffer, TOMLBindSpec *, void *object, TOMLError * );
+
+/***************
+ ** Documents **
+ ***************/
+
+// Where a value or a table of a TOMLDocument is in its source.
+typedef struct TOMLSpan {
+  // The path given to TOML_editSet. Tables of an array of tables are named
+  // by their index, like "host.1", and the root table is "".
+  char *path;
+  // For entries, the bytes of the value. For tables, start is where the
+  // header starts and end is where the next new entry goes.
+  int start;
+  int end;
+  int isTable;
+} TOMLSpan;
+
+// A parsed table kept with the source it was parsed from. Edits change only
+// the bytes of the values they set, so comments, whitespace and everything
+// else keep their original text.
+typedef struct TOMLDocument {
+  TOMLTable *table;
+  // The current source, null terminated.
+  char *source;
+  int size;
+  int capacity;
+  int spanCount;
+  int spanCapacity;
+  TOMLSpan *spans;
+} TOMLDocument;
+
+// Allocates a document holding a copy of the buffer and its parsed table.
+// Returns non-zero if there was an error.
+int TOML_parseDocument( char *buffer, TOMLDocument **, TOMLError * );
+
+// Frees the document, its source and its table.
+void TOML_freeDocument( TOMLDocument * );
+
+// Returns the span of the value or table at the path or NULL.
+TOMLSpan * TOML_findSpan( TOMLDocument *, char *path );
+
+// Sets the value at a dotted path like "server.port" or "host.1.name". An
+// existing value has its text replaced. A new key is added on the line after
+// the last entry of its table, and a missing table is added at the end of the
+// source. The table is updated with TOML_reparse. Takes ownership of the
+// value, which may be anything but a table or an array of tables. On error
+// the document is left as it was.
+// Returns non-zero if there was an error.
+int TOML_editSet( TOMLDocument *, char *path, TOMLRef value, TOMLError * );
+
+/*******************
+ ** Config Handle **
+ *******************/
+
+// Owns the current parse of a file and replaces it on reload. Readers acquire
+// the current table without taking a lock. A reload parses the file, publishes
+// the new table with an atomic swap and retires the old one. Reloads run one at
+// a time, so tables are published in the order their files were read. Each
+// thread that reads has a slot holding the generation of the oldest table it
+// uses, and a retired table is freed once no slot holds its generation or an
+// older one.
+typedef struct TOMLConfigHandle {
+  char *filename;
+  TOMLTable *current;
+  // Generation of the current table, raised each time a table is published.
+  unsigned long generation;
+  // Stat of the file at the last successful load.
+  long int modified;
+  long int modifiedNanoseconds;
+  long int fileSize;
+  long int inode;
+  // Reader slots, retired tables and the reload lock.
+  struct _TOMLConfigState *state;
+} TOMLConfigHandle;
+
+// Allocates a handle holding the parsed content of the file.
+// Returns NULL and fills the error if the first load fails.
+TOMLConfigHandle * TOML_allocConfig( char *filename, TOMLError * );
+
+// Frees the handle and every table it still owns. No reader may be holding a
+// snapshot.
+void TOML_freeConfig( TOMLConfigHandle * );
+
+// Returns the current table. The table stays valid until the matching
+// TOMLConfig_release on the same thread. Snapshots may nest. Never blocks, even
+// during a reload.
+TOMLTable * TOMLConfig_acquire( TOMLConfigHandle * );
+
+// Ends the latest snapshot started by TOMLConfig_acquire on this thread.
+void TOMLConfig_release( TOMLConfigHandle * );
+
+// Parses the file again and publishes the result. Waits for a reload already
+// running on another thread. If parsing fails the current table stays
+// published and the error code is returned.
+int TOMLConfig_reload( TOMLConfigHandle *, TOMLError * );
+
+// Reloads only if the file's modification time, size or inode changed since
+// the last successful load, so a failed reload is tried again on the next
+// call. Intended to be polled or called from a file watcher.
+int TOMLConfig_reloadIfChanged( TOMLConfigHandle *, TOMLError * );
+
+// Frees retired tables no reader can still hold. Returns the number of retired
+// tables still waiting to be freed.
+int TOMLConfig_collect( TOMLConfigHandle * );
+
 #ifdef __cplusplus
 };
 #endif